@@ -0,0 +1,251 @@
+/*
+ * Copyright (c) 2016 University of Michigan, Ann Arbor.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms are permitted
+ * provided that the above copyright notice and this paragraph are
+ * duplicated in all such forms and that any documentation,
+ * advertising materials, and other materials related to such
+ * distribution and use acknowledge that the software was developed
+ * by the University of Michigan, Ann Arbor. The name of the University
+ * may not be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * Author: Sugih Jamin (jamin@eecs.umich.edu)
+ *
+*/
+#include <string.h>
+#include <math.h>
+
+#include "bc1.h"
+
+/*
+ * BC1, a.k.a. DXT1 or S3TC, the fixed rate GPU texture format: each
+ * 4x4 pixel block, in raster order of blocks, takes 8 bytes, two
+ * RGB565 end points, little endian, followed by a 2-bit palette index
+ * per pixel, pixel 0 in the low bits of the first byte.  If the first
+ * end point is larger, the palette is the two end points and 1/3 and
+ * 2/3 of the way between them, else it is the end points, their
+ * midpoint and transparent black.  RGB is 6:1, RGBA 8:1, with 1-bit
+ * alpha.
+ */
+
+static unsigned short
+bc1_565(const float *c)
+{
+  int r, g, b;
+
+  r = (int) (c[0]*31/255 + 0.5f);
+  g = (int) (c[1]*63/255 + 0.5f);
+  b = (int) (c[2]*31/255 + 0.5f);
+  r = r < 0 ? 0 : r > 31 ? 31 : r;
+  g = g < 0 ? 0 : g > 63 ? 63 : g;
+  b = b < 0 ? 0 : b > 31 ? 31 : b;
+
+  return((unsigned short) ((r << 11) | (g << 5) | b));
+}
+
+static void
+bc1_888(unsigned short c, int *rgb)
+{
+  rgb[0] = ((c >> 11) & 31) << 3 | ((c >> 13) & 7);
+  rgb[1] = ((c >> 5) & 63) << 2 | ((c >> 9) & 3);
+  rgb[2] = (c & 31) << 3 | ((c >> 2) & 7);
+}
+
+/*
+ * bc1_palette(): the four colours of a block with end points "c0"
+ * and "c1", alpha in [3] 0 for transparent.
+ */
+static void
+bc1_palette(unsigned short c0, unsigned short c1, int pal[4][4])
+{
+  int i;
+
+  bc1_888(c0, pal[0]);
+  bc1_888(c1, pal[1]);
+  for (i = 0; i < 3; i++) {
+    if (c0 > c1) {
+      pal[2][i] = (2*pal[0][i] + pal[1][i])/3;
+      pal[3][i] = (pal[0][i] + 2*pal[1][i])/3;
+    } else {
+      pal[2][i] = (pal[0][i] + pal[1][i])/2;
+      pal[3][i] = 0;
+    }
+  }
+  pal[0][3] = pal[1][3] = pal[2][3] = 255;
+  pal[3][3] = c0 > c1 ? 255 : 0;
+}
+
+/*
+ * bc1_block(): code the 16 pixels "px" into the 8 bytes at "blk".
+ * End points are the extremes of the opaque pixels along their
+ * principal axis.
+ */
+static void
+bc1_block(unsigned char *blk, float px[16][4], int depth)
+{
+  float mean[3], cov[6], axis[3], v[3], t, tmin, tmax, lo[3], hi[3];
+  int pal[4][4], i, j, k, n, alpha, best, d, bestd;
+  unsigned short c0, c1, tmp;
+  unsigned int idx;
+
+  memset(mean, 0, sizeof(mean));
+  for (n = 0, alpha = 0, i = 0; i < 16; i++) {
+    if (depth == 4 && px[i][3] < 128) {
+      alpha = 1;
+      continue;
+    }
+    for (j = 0; j < 3; j++) {
+      mean[j] += px[i][j];
+    }
+    n++;
+  }
+
+  if (!n) {                      // all transparent
+    memset(blk, 0, 4);
+    memset(blk+4, 0xff, 4);
+    return;
+  }
+  for (j = 0; j < 3; j++) {
+    mean[j] /= n;
+  }
+
+  memset(cov, 0, sizeof(cov));
+  for (i = 0; i < 16; i++) {
+    if (depth == 4 && px[i][3] < 128) {
+      continue;
+    }
+    for (j = 0; j < 3; j++) {
+      v[j] = px[i][j] - mean[j];
+    }
+    cov[0] += v[0]*v[0]; cov[1] += v[0]*v[1]; cov[2] += v[0]*v[2];
+    cov[3] += v[1]*v[1]; cov[4] += v[1]*v[2]; cov[5] += v[2]*v[2];
+  }
+  axis[0] = axis[1] = axis[2] = 1.0f;
+  for (k = 0; k < 4; k++) {      // power iteration
+    v[0] = cov[0]*axis[0] + cov[1]*axis[1] + cov[2]*axis[2];
+    v[1] = cov[1]*axis[0] + cov[3]*axis[1] + cov[4]*axis[2];
+    v[2] = cov[2]*axis[0] + cov[4]*axis[1] + cov[5]*axis[2];
+    t = sqrtf(v[0]*v[0] + v[1]*v[1] + v[2]*v[2]);
+    if (t < 1e-6f) {
+      break;
+    }
+    for (j = 0; j < 3; j++) {
+      axis[j] = v[j]/t;
+    }
+  }
+
+  tmin = tmax = 0;
+  for (i = 0; i < 16; i++) {
+    if (depth == 4 && px[i][3] < 128) {
+      continue;
+    }
+    t = (px[i][0]-mean[0])*axis[0] + (px[i][1]-mean[1])*axis[1] + (px[i][2]-mean[2])*axis[2];
+    tmin = t < tmin ? t : tmin;
+    tmax = t > tmax ? t : tmax;
+  }
+  for (j = 0; j < 3; j++) {
+    lo[j] = mean[j] + tmin*axis[j];
+    hi[j] = mean[j] + tmax*axis[j];
+  }
+  c0 = bc1_565(hi);
+  c1 = bc1_565(lo);
+
+  // 4-colour blocks need c0 > c1, 3-colour ones with transparency c0 <= c1
+  if (alpha ? c0 > c1 : c0 < c1) {
+    tmp = c0; c0 = c1; c1 = tmp;
+  }
+  bc1_palette(c0, c1, pal);
+
+  idx = 0;
+  for (i = 0; i < 16; i++) {
+    if (depth == 4 && px[i][3] < 128) {
+      best = 3;
+    } else {
+      for (best = 0, bestd = -1, k = 0; k < (alpha || c0 == c1 ? 3 : 4); k++) {
+        for (d = 0, j = 0; j < 3; j++) {
+          d += (int) ((px[i][j] - pal[k][j])*(px[i][j] - pal[k][j]));
+        }
+        if (bestd < 0 || d < bestd) {
+          bestd = d;
+          best = k;
+        }
+      }
+    }
+    idx |= (unsigned int) best << (2*i);
+  }
+
+  blk[0] = (unsigned char) c0; blk[1] = (unsigned char) (c0 >> 8);
+  blk[2] = (unsigned char) c1; blk[3] = (unsigned char) (c1 >> 8);
+  for (i = 0; i < 4; i++) {
+    blk[4+i] = (unsigned char) (idx >> (8*i));
+  }
+}
+
+/*
+ * bc1_encode(): code the "width" x "height" RGB or RGBA raster
+ * "image", of "depth" 3 or 4, into the BC1_SIZE() bytes at "blocks".
+ * Pixels beyond the image's edges are replicated from the edges.
+ */
+void
+bc1_encode(unsigned char *blocks, unsigned char *image, int width, int height,
+           int depth)
+{
+  float px[16][4];
+  unsigned char *p;
+  int bx, by, x, y, j;
+
+  for (by = 0; by < height; by += 4) {
+    for (bx = 0; bx < width; bx += 4) {
+      for (y = 0; y < 4; y++) {
+        for (x = 0; x < 4; x++) {
+          p = image + ((long) (by+y < height ? by+y : height-1)*width
+                       + (bx+x < width ? bx+x : width-1))*depth;
+          for (j = 0; j < depth; j++) {
+            px[y*4+x][j] = p[j];
+          }
+        }
+      }
+      bc1_block(blocks, px, depth);
+      blocks += BC1_BLKSZ;
+    }
+  }
+}
+
+/*
+ * bc1_render(): decode the blocks of the BC1 coded "blocks" that
+ * overlap the "size" bytes at "offset" into the raster "image".
+ * Pixels beyond the image's edges are dropped.
+ */
+void
+bc1_render(unsigned char *image, int width, int height, int depth,
+           unsigned char *blocks, long offset, long size)
+{
+  int pal[4][4], bw, x, y, j, i;
+  long b, last;
+  unsigned char *blk, *p;
+  unsigned int idx;
+
+  bw = (width+3)/4;
+  last = BC1_SIZE(width, height)/BC1_BLKSZ - 1;
+  for (b = offset/BC1_BLKSZ; b <= (offset+size-1)/BC1_BLKSZ && b <= last; b++) {
+    blk = blocks + b*BC1_BLKSZ;
+    bc1_palette(blk[0] | (blk[1] << 8), blk[2] | (blk[3] << 8), pal);
+    idx = blk[4] | (blk[5] << 8) | (blk[6] << 16) | ((unsigned int) blk[7] << 24);
+    for (i = 0; i < 16; i++, idx >>= 2) {
+      x = (int) (b % bw)*4 + (i & 3);
+      y = (int) (b / bw)*4 + (i >> 2);
+      if (x >= width || y >= height) {
+        continue;
+      }
+      p = image + ((long) y*width + x)*depth;
+      for (j = 0; j < depth; j++) {
+        p[j] = (unsigned char) pal[idx & 3][j];
+      }
+    }
+  }
+}
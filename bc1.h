@@ -0,0 +1,33 @@
+/*
+ * Copyright (c) 2016 University of Michigan, Ann Arbor.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms are permitted
+ * provided that the above copyright notice and this paragraph are
+ * duplicated in all such forms and that any documentation,
+ * advertising materials, and other materials related to such
+ * distribution and use acknowledge that the software was developed
+ * by the University of Michigan, Ann Arbor. The name of the University
+ * may not be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * Author: Sugih Jamin (jamin@eecs.umich.edu)
+ *
+*/
+#ifndef __BC1_H__
+#define __BC1_H__
+
+#define BC1_BLKSZ  8     // bytes per 4x4 pixel block
+
+#define BC1_SIZE(width, height) \
+  ((long) (((width)+3)/4)*(((height)+3)/4)*BC1_BLKSZ)
+
+extern void bc1_encode(unsigned char *blocks, unsigned char *image, int width, int height,
+                       int depth);
+extern void bc1_render(unsigned char *image, int width, int height, int depth,
+                       unsigned char *blocks, long offset, long size);
+
+#endif // __BC1_H__
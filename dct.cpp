@@ -0,0 +1,539 @@
+/*
+ * Copyright (c) 2016 University of Michigan, Ann Arbor.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms are permitted
+ * provided that the above copyright notice and this paragraph are
+ * duplicated in all such forms and that any documentation,
+ * advertising materials, and other materials related to such
+ * distribution and use acknowledge that the software was developed
+ * by the University of Michigan, Ann Arbor. The name of the University
+ * may not be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * Author: Sugih Jamin (jamin@eecs.umich.edu)
+ *
+*/
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <arpa/inet.h>     // htonl(), ntohl()
+
+#include "netimg.h"
+#include "dct.h"
+
+/*
+ * Lossy transform coding, after baseline JPEG.  The image is cut into
+ * DCT_MCU x DCT_MCU coding units (MCUs), in raster order.  Colour is
+ * converted to YCbCr with Cb and Cr subsampled 2x2; greyscale is
+ * coded as Y only, and alpha, if any, as a full resolution channel.
+ * Each 8x8 block is DCT transformed and quantized with the JPEG
+ * example tables scaled to the quality asked for.  A block is coded
+ * as its DC difference from the previous block of the same channel,
+ * the number of non-zero AC coefficients, and a (zero run, level)
+ * pair for each, all in Exp-Golomb codes.
+ *
+ * MCUs are packed into slots (see islot_t), with is_unit the first
+ * MCU of the slot.  The content of a slot is a 16-bit count of the
+ * MCUs in it followed by their codes.  DC prediction restarts with
+ * each slot, so every slot decodes on its own.
+ */
+
+#define DCT_NCH 4        // channels at most: Y, Cb, Cr, alpha
+
+static const unsigned char dct_zigzag[64] = {
+   0,  1,  8, 16,  9,  2,  3, 10, 17, 24, 32, 25, 18, 11,  4,  5,
+  12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13,  6,  7, 14, 21, 28,
+  35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+  58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63,
+};
+
+static const unsigned char dct_lumq[64] = {
+  16, 11, 10, 16,  24,  40,  51,  61,
+  12, 12, 14, 19,  26,  58,  60,  55,
+  14, 13, 16, 24,  40,  57,  69,  56,
+  14, 17, 22, 29,  51,  87,  80,  62,
+  18, 22, 37, 56,  68, 109, 103,  77,
+  24, 35, 55, 64,  81, 104, 113,  92,
+  49, 64, 78, 87, 103, 121, 120, 101,
+  72, 92, 95, 98, 112, 100, 103,  99,
+};
+
+static const unsigned char dct_chrq[64] = {
+  17, 18, 24, 47, 99, 99, 99, 99,
+  18, 21, 26, 66, 99, 99, 99, 99,
+  24, 26, 56, 99, 99, 99, 99, 99,
+  47, 66, 99, 99, 99, 99, 99, 99,
+  99, 99, 99, 99, 99, 99, 99, 99,
+  99, 99, 99, 99, 99, 99, 99, 99,
+  99, 99, 99, 99, 99, 99, 99, 99,
+  99, 99, 99, 99, 99, 99, 99, 99,
+};
+
+typedef struct {
+  int depth;                   // bytes per pixel of the image
+  int nch;                     // channels coded
+  float q[DCT_NCH][64];        // quantizer step of each coefficient
+  float cosine[8][8];          // DCT basis
+} dct_t;
+
+typedef struct {
+  unsigned char *buf;
+  long nbits;                  // written or read so far
+  long maxbits;
+  int overflow;                // wrote or read past maxbits
+} dct_bits_t;
+
+static int
+dct_sub(dct_t *dc, int ch)
+{
+  return(dc->depth >= 3 && (ch == 1 || ch == 2));  // Cb, Cr subsampled
+}
+
+static void
+dct_setup(dct_t *dc, int depth, int quality)
+{
+  int i, u, x, ch, scale;
+  const unsigned char *base;
+
+  if (quality < 1 || quality > 100) {
+    quality = DCT_QUALITY;
+  }
+  scale = quality < 50 ? 5000/quality : 200 - 2*quality;   // as libjpeg
+
+  dc->depth = depth;
+  dc->nch = depth;
+  for (ch = 0; ch < dc->nch; ch++) {
+    base = dct_sub(dc, ch) ? dct_chrq : dct_lumq;
+    for (i = 0; i < 64; i++) {
+      int step = (base[i]*scale + 50)/100;
+      dc->q[ch][i] = (float) (step < 1 ? 1 : step > 255 ? 255 : step);
+    }
+  }
+  for (u = 0; u < 8; u++) {
+    for (x = 0; x < 8; x++) {
+      dc->cosine[u][x] = (float) ((u ? 0.5 : 0.5/sqrt(2.0))*cos((2*x+1)*u*M_PI/16));
+    }
+  }
+
+  return;
+}
+
+static inline void
+dct_putbit(dct_bits_t *bw, int bit)
+{
+  unsigned char mask;
+
+  if (bw->nbits >= bw->maxbits) {
+    bw->overflow = 1;
+    return;
+  }
+  mask = 0x80 >> (bw->nbits & 7);
+  bw->buf[bw->nbits >> 3] = bit ? bw->buf[bw->nbits >> 3] | mask
+                                 : bw->buf[bw->nbits >> 3] & ~mask;
+  bw->nbits++;
+}
+
+static inline int
+dct_getbit(dct_bits_t *br)
+{
+  if (br->nbits >= br->maxbits) {
+    br->overflow = 1;
+    return(0);
+  }
+  br->nbits++;
+  return((br->buf[(br->nbits-1) >> 3] >> (7 - ((br->nbits-1) & 7))) & 1);
+}
+
+static void
+dct_putbits(dct_bits_t *bw, unsigned v, int n)
+{
+  while (n--) {
+    dct_putbit(bw, (v >> n) & 1);
+  }
+}
+
+static unsigned
+dct_getbits(dct_bits_t *br, int n)
+{
+  unsigned v = 0;
+
+  while (n--) {
+    v = (v << 1) | dct_getbit(br);
+  }
+  return(v);
+}
+
+// Exp-Golomb codes, unsigned and signed
+static void
+dct_putue(dct_bits_t *bw, unsigned v)
+{
+  int n = 0;
+
+  while ((v+1) >> (n+1)) {
+    n++;
+  }
+  dct_putbits(bw, 0, n);
+  dct_putbits(bw, v+1, n+1);
+}
+
+static unsigned
+dct_getue(dct_bits_t *br)
+{
+  int n = 0;
+
+  while (!dct_getbit(br) && !br->overflow) {
+    if (++n > 24) {
+      br->overflow = 1;
+      return(0);
+    }
+  }
+  return(((1U << n) | dct_getbits(br, n)) - 1);
+}
+
+static void
+dct_putse(dct_bits_t *bw, int v)
+{
+  dct_putue(bw, v > 0 ? 2*v-1 : -2*v);
+}
+
+static int
+dct_getse(dct_bits_t *br)
+{
+  unsigned v = dct_getue(br);
+
+  return(v & 1 ? (int) (v+1)/2 : -(int) (v/2));
+}
+
+/*
+ * Separable 8x8 forward and inverse DCT of "blk" in place.
+ */
+static void
+dct_fwd(dct_t *dc, float *blk)
+{
+  float tmp[64];
+  int u, v, x, y;
+
+  for (y = 0; y < 8; y++) {
+    for (u = 0; u < 8; u++) {
+      float s = 0;
+      for (x = 0; x < 8; x++) {
+        s += dc->cosine[u][x]*blk[y*8+x];
+      }
+      tmp[y*8+u] = s;
+    }
+  }
+  for (u = 0; u < 8; u++) {
+    for (v = 0; v < 8; v++) {
+      float s = 0;
+      for (y = 0; y < 8; y++) {
+        s += dc->cosine[v][y]*tmp[y*8+u];
+      }
+      blk[v*8+u] = s;
+    }
+  }
+}
+
+static void
+dct_inv(dct_t *dc, float *blk)
+{
+  float tmp[64];
+  int u, v, x, y;
+
+  for (v = 0; v < 8; v++) {
+    for (x = 0; x < 8; x++) {
+      float s = 0;
+      for (u = 0; u < 8; u++) {
+        s += dc->cosine[u][x]*blk[v*8+u];
+      }
+      tmp[v*8+x] = s;
+    }
+  }
+  for (x = 0; x < 8; x++) {
+    for (y = 0; y < 8; y++) {
+      float s = 0;
+      for (v = 0; v < 8; v++) {
+        s += dc->cosine[v][y]*tmp[v*8+x];
+      }
+      blk[y*8+x] = s;
+    }
+  }
+}
+
+/*
+ * dct_mcuin(): the channels of the MCU whose top-left pixel is at
+ * (x0, y0) into "plane", replicating edge pixels beyond the image.
+ */
+static void
+dct_mcuin(dct_t *dc, float plane[DCT_NCH][DCT_MCU][DCT_MCU], unsigned char *image,
+          int width, int height, int x0, int y0)
+{
+  int x, y;
+  unsigned char *p;
+
+  for (y = 0; y < DCT_MCU; y++) {
+    for (x = 0; x < DCT_MCU; x++) {
+      p = image + ((long) (y0+y < height ? y0+y : height-1)*width
+                   + (x0+x < width ? x0+x : width-1))*dc->depth;
+      if (dc->depth >= 3) {
+        plane[0][y][x] = 0.299f*p[0] + 0.587f*p[1] + 0.114f*p[2];
+        plane[1][y][x] = -0.168736f*p[0] - 0.331264f*p[1] + 0.5f*p[2] + 128;
+        plane[2][y][x] = 0.5f*p[0] - 0.418688f*p[1] - 0.081312f*p[2] + 128;
+        if (dc->depth == 4) {
+          plane[3][y][x] = p[3];
+        }
+      } else {
+        plane[0][y][x] = p[0];
+        if (dc->depth == 2) {
+          plane[1][y][x] = p[1];
+        }
+      }
+    }
+  }
+}
+
+/*
+ * dct_mcuout(): inverse of dct_mcuin(), pixels beyond the image are
+ * dropped.
+ */
+static void
+dct_mcuout(dct_t *dc, float plane[DCT_NCH][DCT_MCU][DCT_MCU], unsigned char *image,
+           int width, int height, int x0, int y0)
+{
+  int x, y, ch;
+  float v[DCT_NCH];
+  unsigned char *p;
+
+  for (y = 0; y < DCT_MCU && y0+y < height; y++) {
+    for (x = 0; x < DCT_MCU && x0+x < width; x++) {
+      p = image + ((long) (y0+y)*width + x0+x)*dc->depth;
+      for (ch = 0; ch < dc->nch; ch++) {
+        v[ch] = plane[ch][y][x];
+      }
+      if (dc->depth >= 3) {
+        float yy = v[0], cb = v[1]-128, cr = v[2]-128;
+        v[0] = yy + 1.402f*cr;
+        v[1] = yy - 0.344136f*cb - 0.714136f*cr;
+        v[2] = yy + 1.772f*cb;
+      }
+      for (ch = 0; ch < dc->nch; ch++) {
+        p[ch] = (unsigned char) (v[ch] < 0 ? 0 : v[ch] > 255 ? 255 : v[ch] + 0.5f);
+      }
+    }
+  }
+}
+
+/*
+ * dct_mcuenc(), dct_mcudec(): code the MCU in "plane" into "bw", or
+ * decode it from "br", "pred" holding the DC of the last block of
+ * each channel.
+ */
+static void
+dct_mcuenc(dct_t *dc, float plane[DCT_NCH][DCT_MCU][DCT_MCU], int *pred, dct_bits_t *bw)
+{
+  float blk[64];
+  int coef[64];
+  int ch, b, nb, x, y, i, n, run;
+
+  for (ch = 0; ch < dc->nch; ch++) {
+    nb = dct_sub(dc, ch) ? 1 : 4;
+    for (b = 0; b < nb; b++) {
+      for (y = 0; y < 8; y++) {
+        for (x = 0; x < 8; x++) {
+          if (nb == 1) {
+            blk[y*8+x] = (plane[ch][2*y][2*x] + plane[ch][2*y][2*x+1]
+                          + plane[ch][2*y+1][2*x] + plane[ch][2*y+1][2*x+1])/4 - 128;
+          } else {
+            blk[y*8+x] = plane[ch][(b>>1)*8+y][(b&1)*8+x] - 128;
+          }
+        }
+      }
+      dct_fwd(dc, blk);
+
+      for (n = 0, i = 0; i < 64; i++) {
+        coef[i] = (int) lrintf(blk[dct_zigzag[i]]/dc->q[ch][dct_zigzag[i]]);
+        n += i && coef[i];
+      }
+      dct_putse(bw, coef[0] - pred[ch]);
+      pred[ch] = coef[0];
+      dct_putue(bw, n);
+      for (run = 0, i = 1; i < 64; i++) {
+        if (!coef[i]) {
+          run++;
+          continue;
+        }
+        dct_putue(bw, run);
+        dct_putse(bw, coef[i]);
+        run = 0;
+      }
+    }
+  }
+}
+
+static void
+dct_mcudec(dct_t *dc, float plane[DCT_NCH][DCT_MCU][DCT_MCU], int *pred, dct_bits_t *br)
+{
+  float blk[64];
+  int ch, b, nb, x, y, i, n;
+
+  for (ch = 0; ch < dc->nch; ch++) {
+    nb = dct_sub(dc, ch) ? 1 : 4;
+    for (b = 0; b < nb; b++) {
+      memset(blk, 0, sizeof(blk));
+      pred[ch] += dct_getse(br);
+      blk[0] = pred[ch]*dc->q[ch][0];
+      n = dct_getue(br);
+      for (i = 1; n > 0 && i < 64 && !br->overflow; n--) {
+        i += dct_getue(br);
+        if (i < 64) {
+          blk[dct_zigzag[i]] = dct_getse(br)*dc->q[ch][dct_zigzag[i]];
+          i++;
+        }
+      }
+      dct_inv(dc, blk);
+
+      for (y = 0; y < 8; y++) {
+        for (x = 0; x < 8; x++) {
+          if (nb == 1) {
+            plane[ch][2*y][2*x] = plane[ch][2*y][2*x+1] = plane[ch][2*y+1][2*x]
+              = plane[ch][2*y+1][2*x+1] = blk[y*8+x] + 128;
+          } else {
+            plane[ch][(b>>1)*8+y][(b&1)*8+x] = blk[y*8+x] + 128;
+          }
+        }
+      }
+    }
+  }
+}
+
+/*
+ * dct_slots(): code the "width" x "height" raster "image" of "depth"
+ * bytes per pixel at "quality" into slots of "datasize" bytes, as
+ * described above.  "*slots" is realloc()'ed to hold the result,
+ * zero padded.
+ *
+ * Returns the number of bytes of slots, or -1 if an MCU doesn't fit
+ * in a slot.
+ */
+long
+dct_slots(unsigned char **slots, unsigned char *image, int width, int height,
+          int depth, int quality, int datasize)
+{
+  dct_t dc;
+  dct_bits_t bw;
+  float plane[DCT_NCH][DCT_MCU][DCT_MCU];
+  int pred[DCT_NCH], savepred[DCT_NCH];
+  long mcu, nmcus, first, size, alloced, save;
+  int mw, count, used;
+  islot_t slot;
+
+  if (datasize < (int) sizeof(islot_t) + 2 || depth < 1 || depth > DCT_NCH) {
+    return(-1);
+  }
+  dct_setup(&dc, depth, quality);
+  mw = (width+DCT_MCU-1)/DCT_MCU;
+  nmcus = DCT_NMCUS(width, height);
+
+  alloced = size = 0;
+  mcu = 0;
+  while (mcu < nmcus) {
+    if (size + datasize > alloced) {
+      alloced = alloced ? 2*alloced : 16L*datasize;
+      *slots = (unsigned char *) realloc(*slots, alloced);
+      if (!*slots) {
+        return(-1);
+      }
+    }
+    memset(*slots + size, 0, datasize);
+    bw.buf = *slots + size + sizeof(islot_t);
+    bw.nbits = 16;         // MCU count, filled in below
+    bw.maxbits = 8L*(datasize - sizeof(islot_t));
+    bw.overflow = 0;
+    memset(pred, 0, sizeof(pred));
+    first = mcu;
+
+    for (count = 0; mcu < nmcus && count < 0xffff; count++, mcu++) {
+      save = bw.nbits;
+      memcpy(savepred, pred, sizeof(pred));
+      dct_mcuin(&dc, plane, image, width, height,
+                (int) (mcu % mw)*DCT_MCU, (int) (mcu / mw)*DCT_MCU);
+      dct_mcuenc(&dc, plane, pred, &bw);
+      if (bw.overflow) {
+        bw.nbits = save;   // doesn't fit, goes in the next slot
+        memcpy(pred, savepred, sizeof(pred));
+        break;
+      }
+    }
+    if (!count) {
+      return(-1);
+    }
+
+    used = (int) ((bw.nbits+7)/8);
+    if (bw.nbits & 7) {    // clear what the MCU that didn't fit left
+      bw.buf[used-1] &= 0xff << (8 - (bw.nbits & 7));
+    }
+    memset(bw.buf + used, 0, datasize - sizeof(islot_t) - used);
+    bw.buf[0] = (unsigned char) (count >> 8);
+    bw.buf[1] = (unsigned char) count;
+    slot.is_unit = htonl((unsigned int) first);
+    slot.is_size = htonl(used);
+    memcpy(*slots + size, &slot, sizeof(islot_t));
+    size += datasize;
+  }
+
+  return(size);
+}
+
+/*
+ * dct_render(): decode the slot at "slot", of "datasize" bytes,
+ * coded by dct_slots() with the same "width", "height", "depth" and
+ * "quality", into the raster "image".
+ *
+ * Returns the number of MCUs decoded, 0 for a slot that hasn't
+ * arrived, or -1 if the slot is malformed.
+ */
+long
+dct_render(unsigned char *image, int width, int height, int depth,
+           int quality, unsigned char *slot, int datasize)
+{
+  dct_t dc;
+  dct_bits_t br;
+  float plane[DCT_NCH][DCT_MCU][DCT_MCU];
+  int pred[DCT_NCH];
+  long mcu, first, nmcus;
+  int mw, count, i;
+  islot_t is;
+
+  memcpy(&is, slot, sizeof(islot_t));
+  if (!is.is_size) {
+    return(0);
+  }
+  if (ntohl(is.is_size) > datasize - sizeof(islot_t) || depth < 1 || depth > DCT_NCH) {
+    return(-1);
+  }
+  dct_setup(&dc, depth, quality);
+  mw = (width+DCT_MCU-1)/DCT_MCU;
+  nmcus = DCT_NMCUS(width, height);
+
+  br.buf = slot + sizeof(islot_t);
+  br.nbits = 0;
+  br.maxbits = 8L*ntohl(is.is_size);
+  br.overflow = 0;
+  count = (int) dct_getbits(&br, 16);
+  first = ntohl(is.is_unit);
+  memset(pred, 0, sizeof(pred));
+
+  for (i = 0, mcu = first; i < count && mcu < nmcus; i++, mcu++) {
+    dct_mcudec(&dc, plane, pred, &br);
+    if (br.overflow) {
+      return(-1);
+    }
+    dct_mcuout(&dc, plane, image, width, height,
+               (int) (mcu % mw)*DCT_MCU, (int) (mcu / mw)*DCT_MCU);
+  }
+
+  return(mcu - first);
+}
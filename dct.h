@@ -0,0 +1,34 @@
+/*
+ * Copyright (c) 2016 University of Michigan, Ann Arbor.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms are permitted
+ * provided that the above copyright notice and this paragraph are
+ * duplicated in all such forms and that any documentation,
+ * advertising materials, and other materials related to such
+ * distribution and use acknowledge that the software was developed
+ * by the University of Michigan, Ann Arbor. The name of the University
+ * may not be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * Author: Sugih Jamin (jamin@eecs.umich.edu)
+ *
+*/
+#ifndef __DCT_H__
+#define __DCT_H__
+
+#define DCT_MCU     16   // pixels, width and height of a coding unit
+#define DCT_QUALITY 50   // default quality, 1 (worst) to 100 (best)
+
+#define DCT_NMCUS(width, height) \
+  ((long) (((width)+DCT_MCU-1)/DCT_MCU)*(((height)+DCT_MCU-1)/DCT_MCU))
+
+extern long dct_slots(unsigned char **slots, unsigned char *image, int width, int height,
+                      int depth, int quality, int datasize);
+extern long dct_render(unsigned char *image, int width, int height, int depth,
+                       int quality, unsigned char *slot, int datasize);
+
+#endif // __DCT_H__
@@ -37,6 +37,7 @@ using namespace std;
 #include <sys/types.h>     // u_short
 #include <sys/socket.h>    // socket API, setsockopt(), getsockname()
 #include <sys/ioctl.h>     // ioctl(), FIONBIO
+#include <sys/time.h>      // gettimeofday()
 #endif
 #ifdef __APPLE__
 #include <OpenGL/gl.h>
@@ -52,26 +53,62 @@ using namespace std;
 #include <algorithm>    // std::max
 #include <errno.h>
 #include "fec.h"
+#include "prog.h"
+#include "pyr.h"
+#include "zseg.h"
+#include "rle.h"
+#include "dct.h"
+#include "bc1.h"
+#include "pixfmt.h"
+#include "seghash.h"
+#include <poll.h>          // poll()
+#include <pthread.h>       // pthread_create()
+#ifdef __linux__
+#include <sys/mman.h>      // memfd_create()
+#include <fcntl.h>         // fcntl(), F_ADD_SEALS
+#include <netinet/tcp.h>   // TCP_CORK
+#include <sys/sendfile.h>  // sendfile()
+#include <linux/errqueue.h> // struct sock_extended_err
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+#endif // __linux__
 
 /*
  * args: parses command line args.
  *
  * Returns 0 on success or 1 on failure.  On successful return,
- * the provided drop probability is stored in imgdb::pdrop.
+ * the provided drop probability is stored in imgdb::pdrop.  With -u
+ * "path", clients on the same host are also served at that Unix
+ * domain socket, see handlelocal().  With -t, clients are also served
+ * over TCP, see handletcp().  With -z, image segments are sent
+ * MSG_ZEROCOPY, see zcreap().  With -U, segments are sent and ACKs
+ * received on an io_uring, see urwait(), if one can be set up.
+ * Images are TGA files in the current directory, or in "folder"
+ * given with -f, or with -k "pack", the images of that pack file,
+ * see imgsrc.h.  With -M "group:port", clients asking for it may be
+ * sent their image over multicast to that group, see sendmcast().
  *
  * Nothing else is modified.
  */
 int imgdb::
 args(int argc, char *argv[])
 {
-  char c;
+  char c, *p;
   extern char *optarg;
+#ifdef __linux__
+  int on;
+#endif // __linux__
 
   if (argc < 1) {
     return (1);
   }
   
-  while ((c = getopt(argc, argv, "d:")) != EOF) {
+  while ((c = getopt(argc, argv, "d:u:tzUf:k:M:")) != EOF) {
     switch (c) {
     case 'd':
       pdrop = atof(optarg);
@@ -80,6 +117,57 @@ args(int argc, char *argv[])
                 NETIMG_MINPROB, NETIMG_MAXPROB);
       }
       break;
+#ifdef __linux__
+    case 'u':
+      lsd = socks_localservinit((char *) "imgdb", optarg);
+      break;
+    case 't':
+      tsd = socks_tcpservinit((char *) "imgdb", &self, sname);
+      break;
+#else
+    case 'u':
+    case 't':
+      fprintf(stderr, "%s: -%c: no memfd nor sendfile() here, UDP only\n", argv[0], c);
+      break;
+#endif // __linux__
+    case 'z':
+#ifdef __linux__
+      on = 1;
+      if (setsockopt(sd, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(int)) < 0) {
+        perror("imgdb::args: SO_ZEROCOPY");  // segments copied as usual
+      } else {
+        zerocopy = true;
+      }
+#else
+      fprintf(stderr, "%s: -z: no MSG_ZEROCOPY here, segments are copied\n", argv[0]);
+#endif // __linux__
+      break;
+    case 'U':
+#ifdef __linux__
+      useuring = !urinit();  // else select() and sendmsg() as usual
+#else
+      fprintf(stderr, "%s: -U: no io_uring here, using select()\n", argv[0]);
+#endif // __linux__
+      break;
+    case 'f':
+      setsrc(new fsimgsrc(optarg));
+      break;
+    case 'k':
+      setsrc(new packimgsrc(optarg));
+      break;
+    case 'M':
+      p = strrchr(optarg, NETIMG_PORTSEP);
+      if (!p || atoi(p+1) <= 0 || atoi(p+1) > 65536-IMGDB_MCPORTS) {
+        return(1);
+      }
+      *p++ = '\0';
+      mcgroup.sin_family = AF_INET;
+      mcgroup.sin_port = htons((u_short) atoi(p));
+      if (!inet_aton(optarg, &mcgroup.sin_addr) || !IN_MULTICAST(ntohl(mcgroup.sin_addr.s_addr))
+          || socks_mcastservinit(sd, &self.sin_addr)) {
+        return(1);
+      }
+      break;
     default:
       return(1);
       break;
@@ -92,41 +180,448 @@ args(int argc, char *argv[])
 }
 
 /*
- * readimg: load TGA image from file "imgname" to curimg.
+ * clearent: release everything held by cache entry "ent" and mark
+ * it unused.
+ */
+void imgdb::
+clearent(imgent_t *ent)
+{
+  int i;
+
+  for (i = 1; i < ent->nlvls; i++) {
+    free(ent->lvl[i]);
+  }
+  delete ent->img;
+  free(ent->zc.zsegs);
+  free(ent->zc.zlen);
+  free(ent->rle.stream);
+  free(ent->rle.slots);
+  free(ent->dc.slots);
+  free(ent->bc.blocks);
+  for (i = 0; i <= NETIMG_PAL8; i++) {
+    free(ent->fc[i].pixels);
+  }
+  if (ent->shm.size) {
+    close(ent->shm.fd);
+  }
+  memset(ent, 0, sizeof(imgent_t));
+
+  return;
+}
+
+/*
+ * setsrc: serve the images of "_src" from now on, in place of those
+ * of the current image source, which are dropped from the cache.
+ * "_src" stays the caller's and must outlive its use.
+ */
+void imgdb::
+setsrc(imgsrc *_src)
+{
+  int i;
+
+  for (i = 0; i < IMGDB_CACHESZ; i++) {
+    clearent(&cache[i]);
+  }
+  curent = NULL;
+  curimg = NULL;
+  src = _src;
+
+  return;
+}
+
+/*
+ * zprepare: get "zc" ready to hand out NETIMG_DATA_Z segments of
+ * "payload", of "size" bytes, cut into segments of the current
+ * client's datasize.  Compressed segments already in "zc" are kept
+ * if they were cut from the same payload the same way, so a payload
+ * held in the image cache is only compressed once.
+ */
+void imgdb::
+zprepare(zcache_t *zc, unsigned char *payload, long size, int depth, int rowsize)
+{
+  int datasize, nsegs;
+
+  datasize = mss - sizeof(ihdr_t) - NETIMG_UDPIP;
+  if (zc->payload == payload && zc->size == size && zc->datasize == datasize
+      && zc->depth == depth && zc->rowsize == rowsize) {
+    return;
+  }
+
+  nsegs = (int) ((size + datasize - 1)/datasize);
+  free(zc->zsegs);
+  free(zc->zlen);
+  zc->zsegs = (unsigned char *) malloc((long) nsegs*datasize);
+  zc->zlen = (int *) calloc(nsegs, sizeof(int));
+  net_assert((!zc->zsegs || !zc->zlen), "imgdb::zprepare: malloc");
+  zc->payload = payload;
+  zc->size = size;
+  zc->datasize = datasize;
+  zc->depth = depth;
+  zc->rowsize = rowsize;
+
+  return;
+}
+
+/*
+ * zsegment: compress, if not already done, the segment of "segsize"
+ * bytes at "offset" into the payload of "zc" and point "*zdata" at
+ * the result.
+ *
+ * Returns the compressed size, or 0 if the segment should be sent
+ * uncompressed.
+ */
+int imgdb::
+zsegment(zcache_t *zc, long offset, int segsize, unsigned char **zdata)
+{
+  int i, len;
+
+  if (offset % zc->datasize) {
+    return(0);
+  }
+  i = (int) (offset/zc->datasize);
+  if (!zc->zlen[i]) {
+    len = zseg_encode(zc->zsegs + (long) i*zc->datasize, zc->payload + offset,
+                      segsize, zc->depth, zc->rowsize);
+    zc->zlen[i] = len ? len : -1;
+  }
+  *zdata = zc->zsegs + (long) i*zc->datasize;
+
+  return(zc->zlen[i] > 0 ? zc->zlen[i] : 0);
+}
+
+/*
+ * findent: point curent at the cache entry of "imgname".  An entry
+ * whose image has changed at imgdb::src since it was loaded is
+ * cleared.  If there is no entry, the least recently used one is
+ * cleared and given to "imgname", with nothing loaded yet.
+ *
+ * Returns NETIMG_FOUND if the image source has "imgname", else
+ * NETIMG_NFOUND, or NETIMG_ENAME if "imgname" is empty.
+ */
+char imgdb::
+findent(char *imgname)
+{
+  long version;
+  imgent_t *ent, *victim;
+  int i;
+
+  if (!imgname || !imgname[0]) {
+    return(NETIMG_ENAME);
+  }
+  
+  if (src->stamp(imgname, &version)) {
+    return(NETIMG_NFOUND);
+  }
+
+  ent = victim = NULL;
+  for (i = 0; i < IMGDB_CACHESZ; i++) {
+    if (!strcmp(cache[i].name, imgname)) {
+      ent = &cache[i];
+      break;
+    }
+    if (!victim || cache[i].used < victim->used) {
+      victim = &cache[i];
+    }
+  }
+
+  if (ent && ent->version != version) {
+    clearent(ent);       // stale, changed since loaded
+    victim = ent;
+    ent = NULL;
+  }
+
+  if (!ent) {
+    if (victim->name[0]) {
+      clearent(victim);
+    }
+    ent = victim;
+    strcpy(ent->name, imgname);
+    ent->version = version;
+    ent->since = clock+1;
+  }
+
+  ent->used = ++clock;
+  curent = ent;
+  
+  return(NETIMG_FOUND);
+}
+
+/*
+ * readimg: load image "imgname" from imgdb::src into curimg.
  * "imgname" must point to valid memory allocated by caller.
+ * Decoded images are kept in imgdb::cache, so an image that hasn't
+ * changed since it was last loaded is not loaded again.
+ * When the cache is full, the least recently used image is evicted.
+ * On success, curent points to the image's cache entry and curimg
+ * to its decoded LTGA.
  * Terminate process on encountering any error.
  * Returns NETIMG_FOUND if "imgname" found, else returns NETIMG_NFOUND.
  */
 char imgdb::
 readimg(char *imgname, int verbose)
 {
-  string pathname=IMGDB_FOLDER;
+  imgent_t *ent;
+  char err;
 
-  if (!imgname || !imgname[0]) {
-    return(NETIMG_ENAME);
+  err = findent(imgname);
+  if (err != NETIMG_FOUND) {
+    return(err);
+  }
+  ent = curent;
+
+  if (!ent->img) {
+    ent->img = src->load(imgname);
+    if (!ent->img || !ent->img->IsLoaded()) {
+      clearent(ent);
+      return(NETIMG_NFOUND);
+    }
+
+    if (verbose) {
+      cerr << "Image: " << endl;
+      cerr << "       Type = " << LImageTypeString[ent->img->GetImageType()] 
+           << " (" << ent->img->GetImageType() << ")" << endl;
+      cerr << "      Width = " << ent->img->GetImageWidth() << endl;
+      cerr << "     Height = " << ent->img->GetImageHeight() << endl;
+      cerr << "Pixel depth = " << ent->img->GetPixelDepth() << endl;
+      cerr << "Alpha depth = " << ent->img->GetAlphaDepth() << endl;
+      cerr << "RL encoding = " << (((int) ent->img->GetImageType()) > 8) << endl;
+      /* use curimg->GetPixels()  to obtain the pixel array */
+    }
   }
+
+  curimg = ent->img;
   
-  curimg.LoadFromFile(pathname+IMGDB_DIRSEP+imgname);
+  return(NETIMG_FOUND);
+}
 
-  if (!curimg.IsLoaded()) {
-    return(NETIMG_NFOUND);
+/*
+ * readrle: read the RLE packets of TGA image "imgname", if
+ * imgdb::src holds it that way, into the rlecache_t of its cache
+ * entry, without decoding them, if not already there.  Only the
+ * 18-byte TGA header is interpreted, as LTGA::LoadFromFile() would:
+ * true color or greyscale, RLE encoded (image types 10 and 11), 8,
+ * 24 or 32 bits per pixel.
+ *
+ * Returns NETIMG_FOUND if the packets are in curent->rle, 0 if the
+ * image is not RLE encoded or can't be served this way, in which
+ * case it should be served decoded, or the error of findent().
+ */
+char imgdb::
+readrle(char *imgname)
+{
+  unsigned char tgahdr[IMGSRC_TGAHDR];
+  unsigned char *stream = NULL;
+  rlecache_t *rle;
+  long size;
+  char err;
+
+  err = findent(imgname);
+  if (err != NETIMG_FOUND) {
+    return(err);
+  }
+  rle = &curent->rle;
+  if (rle->stream) {
+    return(NETIMG_FOUND);
+  } else if (rle->streamsize < 0) {
+    return(0);
   }
 
-  if (verbose) {
-    cerr << "Image: " << endl;
-    cerr << "       Type = " << LImageTypeString[curimg.GetImageType()] 
-         << " (" << curimg.GetImageType() << ")" << endl;
-    cerr << "      Width = " << curimg.GetImageWidth() << endl;
-    cerr << "     Height = " << curimg.GetImageHeight() << endl;
-    cerr << "Pixel depth = " << curimg.GetPixelDepth() << endl;
-    cerr << "Alpha depth = " << curimg.GetAlphaDepth() << endl;
-    cerr << "RL encoding = " << (((int) curimg.GetImageType()) > 8) << endl;
-    /* use curimg.GetPixels()  to obtain the pixel array */
+  rle->streamsize = -1;
+  size = src->rle(imgname, tgahdr, &stream);
+  if (size <= 0) {
+    return(0);
   }
-  
+  if (tgahdr[1] != 0 || (tgahdr[2] != 10 && tgahdr[2] != 11)
+      || (tgahdr[16] != 8 && tgahdr[16] != 24 && tgahdr[16] != 32)
+      || ((tgahdr[17] & 0xf) != 0 && (tgahdr[17] & 0xf) != 8)) {
+    free(stream);
+    return(0);
+  }
+
+  rle->stream = stream;
+  rle->streamsize = size;
+  rle->width = tgahdr[12] | (tgahdr[13] << 8);
+  rle->height = tgahdr[14] | (tgahdr[15] << 8);
+  rle->depth = tgahdr[16]/8;
+  if (tgahdr[2] == 11) {
+    rle->format = (tgahdr[17] & 0xf) ? NETIMG_GSA : NETIMG_GS;
+  } else {
+    rle->format = (tgahdr[17] & 0xf) ? NETIMG_RGBA : NETIMG_RGB;
+  }
+
   return(NETIMG_FOUND);
 }
 
+/*
+ * rleslots: cut the RLE packets of curent into slots of "datasize",
+ * unless already cut that way.
+ *
+ * Returns the size of the slots, or -1 if they can't be cut into
+ * slots that small.
+ */
+long imgdb::
+rleslots(int datasize)
+{
+  rlecache_t *rle = &curent->rle;
+
+  if (rle->datasize != datasize) {
+    rle->size = rle_slots(&rle->slots, rle->stream, rle->streamsize,
+                          (long) rle->width*rle->height, rle->depth, datasize);
+    rle->datasize = datasize;
+  }
+
+  return(rle->size);
+}
+
+/*
+ * dctslots: code the raster "payload", of the size and depth given
+ * in "imsg", at "quality" into slots of the current client's
+ * datasize, see dct_slots(), unless "dc" already holds them.  The
+ * slots are kept in "dc", so a payload held in the image cache is
+ * only coded once per quality and datasize.
+ *
+ * Returns the size of the slots, or -1 if they can't be cut that
+ * small.
+ */
+long imgdb::
+dctslots(dctcache_t *dc, unsigned char *payload, imsg_t *imsg, int quality)
+{
+  int datasize;
+
+  datasize = mss - sizeof(ihdr_t) - NETIMG_UDPIP;
+  if (quality < 1 || quality > 100) {
+    quality = DCT_QUALITY;
+  }
+  if (dc->payload == payload && dc->width == imsg->im_width && dc->height == imsg->im_height
+      && dc->depth == imsg->im_depth && dc->quality == quality && dc->datasize == datasize) {
+    return(dc->size);
+  }
+
+  dc->size = dct_slots(&dc->slots, payload, imsg->im_width, imsg->im_height,
+                       imsg->im_depth, quality, datasize);
+  dc->payload = payload;
+  dc->width = imsg->im_width;
+  dc->height = imsg->im_height;
+  dc->depth = imsg->im_depth;
+  dc->quality = quality;
+  dc->datasize = datasize;
+
+  return(dc->size);
+}
+
+/*
+ * bc1blocks: BC1 code the raster "payload", of the size and depth
+ * given in "imsg", unless "bc" already holds it coded.  The blocks
+ * are kept in "bc", so a payload held in the image cache is only
+ * coded once.
+ *
+ * Returns the blocks.
+ */
+unsigned char *imgdb::
+bc1blocks(bccache_t *bc, unsigned char *payload, imsg_t *imsg)
+{
+  if (bc->payload == payload && bc->width == imsg->im_width
+      && bc->height == imsg->im_height && bc->depth == imsg->im_depth) {
+    return(bc->blocks);
+  }
+
+  bc->size = BC1_SIZE(imsg->im_width, imsg->im_height);
+  bc->blocks = (unsigned char *) realloc(bc->blocks, bc->size);
+  net_assert((bc->blocks == NULL), "imgdb::bc1blocks: realloc");
+  bc1_encode(bc->blocks, payload, imsg->im_width, imsg->im_height, imsg->im_depth);
+  bc->payload = payload;
+  bc->width = imsg->im_width;
+  bc->height = imsg->im_height;
+  bc->depth = imsg->im_depth;
+
+  return(bc->blocks);
+}
+
+/*
+ * reduce: convert the raster "payload", of the size, depth and
+ * format given in "imsg", to "format", unless "fc" already holds
+ * it so converted.  The result is kept in "fc", so a payload held in
+ * the image cache is only converted once per format.  The depth and
+ * format of "imsg" are updated to those of the result.
+ *
+ * Returns the converted pixels.
+ */
+unsigned char *imgdb::
+reduce(fmtcache_t *fc, unsigned char *payload, imsg_t *imsg, int format)
+{
+  long npixels = (long) imsg->im_width*imsg->im_height;
+
+  if (fc->payload != payload || fc->width != imsg->im_width
+      || fc->height != imsg->im_height) {
+    fc->size = pixfmt_size(format, npixels);
+    fc->pixels = (unsigned char *) realloc(fc->pixels, fc->size);
+    net_assert((fc->pixels == NULL), "imgdb::reduce: realloc");
+    pixfmt_reduce(fc->pixels, format, payload, npixels, imsg->im_depth);
+    fc->payload = payload;
+    fc->width = imsg->im_width;
+    fc->height = imsg->im_height;
+  }
+  imsg->im_format = format;
+  imsg->im_depth = pixfmt_depth(format);
+
+  return(fc->pixels);
+}
+
+/*
+ * buildpyr: build the pyramid of curent with 2x2 box filtering, the
+ * first time it is needed.  The levels are kept in the cache entry
+ * alongside the full resolution pixels, halving each dimension down
+ * to 1x1 or NETIMG_MAXLVL levels, whichever comes first.
+ */
+void imgdb::
+buildpyr()
+{
+  int l, depth;
+  imgent_t *ent = curent;
+
+  if (ent->nlvls) {
+    return;
+  }
+
+  depth = ent->img->GetPixelDepth()/8;
+  ent->lvl[0] = ent->img->GetPixels();
+  ent->lvlw[0] = ent->img->GetImageWidth();
+  ent->lvlh[0] = ent->img->GetImageHeight();
+  for (l = 1; l < NETIMG_MAXLVL && (ent->lvlw[l-1] > 1 || ent->lvlh[l-1] > 1); l++) {
+    ent->lvlw[l] = PYR_HALF(ent->lvlw[l-1]);
+    ent->lvlh[l] = PYR_HALF(ent->lvlh[l-1]);
+    ent->lvl[l] = (unsigned char *) malloc((long) ent->lvlw[l]*ent->lvlh[l]*depth);
+    net_assert((ent->lvl[l] == NULL), "imgdb::buildpyr: malloc");
+    pyr_halve(ent->lvl[l], ent->lvl[l-1], ent->lvlw[l-1], ent->lvlh[l-1], depth);
+  }
+  ent->nlvls = l;
+
+  return;
+}
+
+/*
+ * pyrlevel: pick the pyramid level of curent to serve to a client
+ * whose display is "dispw" x "disph" pixels: the smallest level that
+ * still covers the display, or level 0 if none is smaller than the
+ * full resolution image.
+ *
+ * Returns the level picked.
+ */
+int imgdb::
+pyrlevel(unsigned short dispw, unsigned short disph)
+{
+  int l;
+
+  buildpyr();
+  for (l = curent->nlvls-1; l > 0; l--) {
+    if (curent->lvlw[l] >= dispw && curent->lvlh[l] >= disph) {
+      break;
+    }
+  }
+
+  return(l);
+}
+
 /*
  * marshall_imsg: Initialize *imsg with image's specifics.
  * Upon return, the *imsg fields are in host-byte order.
@@ -137,21 +632,88 @@ readimg(char *imgname, int verbose)
 double imgdb::
 marshall_imsg(imsg_t *imsg)
 {
-  imsg->im_depth = (unsigned char)(curimg.GetPixelDepth()/8);
-  if (((int) curimg.GetImageType()) == 3 ||
-      ((int) curimg.GetImageType()) == 11) {
-    imsg->im_format = ((int) curimg.GetAlphaDepth()) ?
+  imsg->im_depth = (unsigned char)(curimg->GetPixelDepth()/8);
+  if (((int) curimg->GetImageType()) == 3 ||
+      ((int) curimg->GetImageType()) == 11) {
+    imsg->im_format = ((int) curimg->GetAlphaDepth()) ?
       NETIMG_GSA : NETIMG_GS;
   } else {
-    imsg->im_format = ((int) curimg.GetAlphaDepth()) ?
+    imsg->im_format = ((int) curimg->GetAlphaDepth()) ?
       NETIMG_RGBA : NETIMG_RGB;
   }
-  imsg->im_width = curimg.GetImageWidth();
-  imsg->im_height = curimg.GetImageHeight();
+  imsg->im_width = curimg->GetImageWidth();
+  imsg->im_height = curimg->GetImageHeight();
+  imsg->im_mode = 0;
+  imsg->im_level = 0;
+  imsg->im_lvlw = imsg->im_width;
+  imsg->im_lvlh = imsg->im_height;
+  imsg->im_quality = 0;
+  imsg->im_nflows = 0;
+  imsg->im_group = 0;
+  imsg->im_gport = 0;
+  imsg->im_gfwnd = 0;
 
   return((double) (imsg->im_width*imsg->im_height*imsg->im_depth));
 }
 
+/*
+ * cropimg: restrict the reply to the region of interest carried in
+ * "iqry", whose fields are still in network byte order.  The region
+ * is clipped to the image.  Rows of the region are sliced out of
+ * curimg into imgdb::roibuf, unless the region spans whole rows, in
+ * which case they are already contiguous and "*image" simply points
+ * into curimg's pixel array.  On return, "*image" points to the first
+ * byte to send and the width and height of "*imsg" are those of the
+ * region.
+ *
+ * Returns NETIMG_EROI if the region lies outside the image,
+ * else NETIMG_FOUND.
+ */
+char imgdb::
+cropimg(iqry_t *iqry, imsg_t *imsg, unsigned char **image)
+{
+  int x, y, w, h, i, bpp, rowsize;
+  long size;
+  unsigned char *pixels;
+
+  x = ntohs(iqry->iq_x);
+  y = ntohs(iqry->iq_y);
+  w = ntohs(iqry->iq_w);
+  h = ntohs(iqry->iq_h);
+  if (x >= imsg->im_width || y >= imsg->im_height) {
+    return(NETIMG_EROI);
+  }
+  if (x+w > imsg->im_width) {
+    w = imsg->im_width - x;
+  }
+  if (y+h > imsg->im_height) {
+    h = imsg->im_height - y;
+  }
+
+  bpp = imsg->im_depth;
+  rowsize = imsg->im_width*bpp;
+  pixels = *image;
+  if (w == imsg->im_width) {
+    *image = pixels + (long) y*rowsize;
+  } else {
+    size = (long) w*h*bpp;
+    if (size > roisize) {
+      roibuf = (unsigned char *) realloc(roibuf, size);
+      net_assert((roibuf == NULL), "imgdb::cropimg: realloc");
+      roisize = size;
+    }
+    for (i = 0; i < h; i++) {
+      memcpy(roibuf + (long) i*w*bpp, pixels + (long) (y+i)*rowsize + x*bpp, w*bpp);
+    }
+    *image = roibuf;
+  }
+
+  imsg->im_width = w;
+  imsg->im_height = h;
+
+  return(NETIMG_FOUND);
+}
+
 /* 
  * recvqry: receives an iqry_t packet and stores the client's address
  * and port number in the imgdb::client member variable.  Checks that
@@ -160,7 +722,8 @@ marshall_imsg(imsg_t *imsg)
  *
  * If error encountered when receiving packet, or if packet is of the
  * wrong version or type, returns appropriate NETIMG error code.
- * Otherwise returns 0.
+ * Returns NETIMG_ACK if the packet is a stray ACK of a previous
+ * transfer.  Otherwise returns 0.
  *
  * Nothing else is modified.
 */
@@ -178,10 +741,23 @@ recvqry(iqry_t *iqry)
   /* Lab5: YOUR CODE HERE */
   socklen_t client_size = sizeof(client);
 
-  bytes = recvfrom(sd, iqry, sizeof(iqry_t), 0, (struct sockaddr *) &client, &client_size);
+  if (npending) {  // set aside by recvack() while serving another
+    memcpy(&client, &pending[0].from, sizeof(struct sockaddr_in));
+    memcpy(iqry, &pending[0].iqry, sizeof(iqry_t));
+    memmove(pending, pending+1, --npending*sizeof(pendqry_t));
+    bytes = sizeof(iqry_t);
+  } else {
+    bytes = recvfrom(sd, iqry, sizeof(iqry_t), 0, (struct sockaddr *) &client, &client_size);
+  }
   
   fprintf(stderr, "%s\n", "finish recived");
 
+  if (bytes == sizeof(ihdr_t) && ((ihdr_t *) iqry)->ih_type == NETIMG_ACK) {
+    return(NETIMG_ACK);  // late ACK of a transfer already completed
+  }
+  if (bytes >= (int) sizeof(ihdr_t) && ((ihdr_t *) iqry)->ih_type == NETIMG_NACK) {
+    return(NETIMG_ACK);  // late NACK of a multicast, likewise
+  }
   if (bytes != sizeof(iqry_t)) {
     return (NETIMG_ESIZE);
   }
@@ -201,71 +777,286 @@ recvqry(iqry_t *iqry)
 }
 
 
-/* 
- * Lab5 Task 1:
- * sendpkt: sends the provided "pkt" of size "size"
- * to imgdb::client using sendto().
- *
- * PA3 Task 2.1:
- * If send is successful, wait for an ACK. When an ACK is received,
- * check that its sequence number is the expected "ackseqn".  If the
- * ACK packet is not received, or if the sequence number doesn't
- * match, repeat NETIMG_MAXTRIES times.  The "all" flag tells
- * sendpkt() whether to wait for only one ACK packet (0) or to
- * "opportunistically" grab all ACKs that have returned to the server
- * (1).  If "all" is 1, "ackseqn" must match the sequence number of
- * the last ACK received.
- *
- * Returns 0 if send success (and ack-ed correctly for PA3), else -1.
+/*
+ * recvack: while serving the client of "snd", receive the next packet
+ * on its socket, waiting for one unless "flags" has MSG_DONTWAIT, into
+ * "ack".  A packet from anyone else is not for this transfer: if it
+ * is a query, it is set aside in imgdb::pending, for recvqry() to
+ * take once done with this client, else it is dropped, as are
+ * queries beyond IMGDB_PENDING, or arriving on a flow.  So are
+ * queries from the client itself, e.g., for its next tile.
  *
- * Nothing else is modified.
-*/
+ * Returns the size of the packet received for this transfer, 0 if
+ * it wasn't one, or -1 if there is none or on error.
+ */
 int imgdb::
-sendpkt(char *pkt, int size, unsigned int ackseqn, int all)
+recvack(sender_t *snd, ihdr_t *ack, int flags)
 {
+  struct sockaddr_in from;
+  socklen_t fromlen = sizeof(from);
+  iqry_t pkt;
+  int bytes;
 
+  bytes = recvfrom(snd->sd, &pkt, sizeof(iqry_t), flags, (struct sockaddr *) &from, &fromlen);
+  if (bytes < 0) {
+    return(-1);
+  }
+  if (bytes == sizeof(iqry_t) && pkt.iq_type == NETIMG_SYNQRY) {
+    if (!snd->flow) {  // flows run on threads of their own
+      setaside(&from, &pkt);
+    }
+    return(0);
+  }
+  if (from.sin_addr.s_addr != snd->client.sin_addr.s_addr
+      || from.sin_port != snd->client.sin_port) {
+    return(0);
+  }
+  memcpy(ack, &pkt, sizeof(ihdr_t));
 
-  /* Lab5 and PA3 Task 2.1: YOUR CODE HERE */
-    socklen_t client_size = sizeof(client);
-    fd_set imgdb_sendpkt_set;
-    FD_ZERO(&imgdb_sendpkt_set);
-    FD_SET(sd, &imgdb_sendpkt_set);
-    int count =0;
-    ihdr_t ihdr_ack;
-    unsigned int recived_ih_seq;
-    while(count < NETIMG_MAXTRIES){
-    //send packet  
-    ssize_t judge = sendto(sd, pkt, size, 0, (struct sockaddr *) &client, client_size);
-    assert(judge>0&&"failed sent to client");
+  return(bytes);
+}
 
-    int err = select(sd+1, &imgdb_sendpkt_set, 0, 0, &timeout);
-    bool recived_right_ack_seq = false;
+/*
+ * setaside: keep query "iqry" from "from" in imgdb::pending, unless
+ * already full.
+ */
+void imgdb::
+setaside(struct sockaddr_in *from, iqry_t *iqry)
+{
+  if (npending < IMGDB_PENDING) {
+    memcpy(&pending[npending].from, from, sizeof(struct sockaddr_in));
+    memcpy(&pending[npending].iqry, iqry, sizeof(iqry_t));
+    npending++;
+  }
 
-    if(!err){// timeout
-      
-      if((recived_right_ack_seq)&all) {return 0;}
-      count++;
-      fprintf(stderr, "time out recive ack,tried %d times\n", count);
-      continue;
-    }else  if(FD_ISSET(sd, &imgdb_sendpkt_set)){
-            if(all==0){
-              int bytes = recvfrom(sd, &ihdr_ack, sizeof(ihdr_t), 0, (struct sockaddr *) &client, &client_size);
-              net_assert((bytes<0),"recv error when all ==0");
-              recived_ih_seq = ntohl(ihdr_ack.ih_seqn);
-              if(recived_ih_seq == ackseqn) return 0;
-              else return (-1);
+  return;
+}
 
-            }else{
-                while(1){
-                  fprintf(stderr, "recive ack num is 0x%x\n", recived_ih_seq);
-                  int bytes = recvfrom(sd, &ihdr_ack, sizeof(ihdr_t), MSG_DONTWAIT, (struct sockaddr *) &client, &client_size);
-                  if(bytes<0){
-                    fprintf(stderr, " before break recive ack num is 0x%x\n", recived_ih_seq);
-                    if(recived_ih_seq==ackseqn) return 0;
-                    else return (-1);
+/*
+ * recvhash: if query "iqry" asks for NETIMG_DELTA, receive the
+ * segment hashes following it into imgdb::hashes, marking those
+ * that arrived in imgdb::same.  Stray ACKs in between are dropped.
+ * Gives up on hashes not in within imgdb::timeout, or as soon as a
+ * packet of another type is waiting, e.g., the next query.
+ *
+ * Returns the number of hashes received, imgdb::nhash is the
+ * number expected.
+ */
+unsigned int imgdb::
+recvhash(iqry_t *iqry)
+{
+  ihdr_t hdr;
+  struct iovec iov[NETIMG_NUMIOV];
+  struct msghdr mh;
+  struct timeval tv;
+  fd_set rset;
+  unsigned int got = 0, first, n, i;
+  int bytes;
+
+  nhash = (iqry->iq_mode & NETIMG_DELTA) ? ntohl(iqry->iq_nhash) : 0;
+  if (nhash > IMGDB_MAXHASH) {
+    nhash = IMGDB_MAXHASH;  // the rest are not taken, nor will match
+  }
+  if (!nhash) {
+    return(0);
+  }
+  hashes = (unsigned char *) realloc(hashes, nhash*SEGHASH_LEN);
+  same = (unsigned char *) realloc(same, nhash);
+  net_assert((!hashes || !same), "imgdb::recvhash: realloc");
+  memset(same, 0, nhash);
+
+  memset(&mh, 0, sizeof(struct msghdr));
+  mh.msg_iov = iov;
+  mh.msg_iovlen = NETIMG_NUMIOV;
+  iov[0].iov_base = &hdr;
+  iov[0].iov_len = sizeof(ihdr_t);
+
+  while (got < nhash) {
+    FD_ZERO(&rset);
+    FD_SET(sd, &rset);
+    tv = timeout;
+    if (select(sd+1, &rset, 0, 0, &tv) <= 0) {
+      break;
+    }
+    bytes = recv(sd, &hdr, sizeof(ihdr_t), MSG_PEEK);
+    if (bytes == sizeof(ihdr_t) && hdr.ih_type == NETIMG_ACK) {
+      recv(sd, &hdr, sizeof(ihdr_t), 0);
+      continue;
+    }
+    if (bytes != sizeof(ihdr_t) || hdr.ih_type != NETIMG_HASH) {
+      break;
+    }
+    first = ntohl(hdr.ih_seqn);
+    n = ntohs(hdr.ih_size)/SEGHASH_LEN;
+    if (first >= nhash) {
+      first = n = 0;  // consumed below, but not taken
+    } else if (n > nhash - first) {
+      n = nhash - first;
+    }
+    iov[1].iov_base = hashes + first*SEGHASH_LEN;
+    iov[1].iov_len = n*SEGHASH_LEN;
+    bytes = recvmsg(sd, &mh, 0);
+    n = bytes > (int) sizeof(ihdr_t) ? (bytes - sizeof(ihdr_t))/SEGHASH_LEN : 0;
+    for (i = first; i < first+n; i++) {
+      got += !same[i];
+      same[i] = 1;
+    }
+  }
+  fprintf(stderr, "imgdb::recvhash: %u of %u segment hashes received\n", got, nhash);
+
+  return(got);
+}
+
+/*
+ * deltasegs: NETIMG_DELTA for the "size" bytes of raster "payload",
+ * described by "imsg".  Compare the hash of each of its segments
+ * against those received from the client by recvhash().  The
+ * client's copy must be cut into as many segments and, through the
+ * hash seed, be of the same dimensions and format.
+ *
+ * Returns imgdb::same, with a non-zero entry for each segment the
+ * client already has, or NULL if the client's copy doesn't match.
+ */
+unsigned char *imgdb::
+deltasegs(unsigned char *payload, long size, imsg_t *imsg)
+{
+  unsigned char hash[SEGHASH_LEN];
+  unsigned int seed, i, nsame = 0;
+  int datasize;
+  long offset;
+
+  datasize = mss - sizeof(ihdr_t) - NETIMG_UDPIP;
+  if (!nhash || (size + datasize-1)/datasize != (long) nhash) {
+    return(NULL);
+  }
+
+  seed = SEGHASH_SEED(imsg->im_width, imsg->im_height, imsg->im_depth, imsg->im_format);
+  for (i = 0, offset = 0; i < nhash; i++, offset += datasize) {
+    if (same[i]) {
+      seghash(hash, payload + offset, size - offset < datasize ? size - offset : datasize, seed);
+      same[i] = !memcmp(hash, hashes + i*SEGHASH_LEN, SEGHASH_LEN);
+      nsame += same[i];
+    }
+  }
+  fprintf(stderr, "imgdb::deltasegs: %u of %u segments unchanged\n", nsame, nhash);
+
+  return(nsame ? same : NULL);
+}
+
+/*
+ * etag: tag the "size" bytes of "payload" to be sent as described by
+ * "imsg", for the client to cache them under.  It is a hash of the
+ * payload, the image shape and the modes it was coded in, less
+ * NETIMG_DELTA, which doesn't change what the client ends up with.
+ *
+ * Returns the tag, never 0.
+ */
+unsigned int imgdb::
+etag(unsigned char *payload, long size, imsg_t *imsg)
+{
+  unsigned char hash[SEGHASH_LEN];
+  unsigned int tag;
+  bool held = prepheld(payload, size);
+
+  if (held && prep.tag && prep.tagmode == (imsg->im_mode & ~NETIMG_DELTA)) {
+    return(prep.tag);  // hashed for an earlier client already
+  }
+  seghash(hash, payload, size,
+          SEGHASH_SEED(imsg->im_width, imsg->im_height, imsg->im_depth, imsg->im_format));
+  tag = (unsigned int) hash[0] << 24 | hash[1] << 16 | hash[2] << 8 | hash[3];
+  tag ^= (imsg->im_mode & ~NETIMG_DELTA) | imsg->im_level << 8 | imsg->im_quality << 16;
+  tag = tag ? tag : 1;
+  if (held) {
+    prep.tag = tag;
+    prep.tagmode = imsg->im_mode & ~NETIMG_DELTA;
+  }
+
+  return(tag);
+}
+
+/* 
+ * Lab5 Task 1:
+ * sendpkt: sends the provided "pkt" of size "size"
+ * to the client of "snd" using sendto().
+ *
+ * PA3 Task 2.1:
+ * If send is successful, wait for an ACK. When an ACK is received,
+ * check that its sequence number is the expected "ackseqn".  If the
+ * ACK packet is not received, or if the sequence number doesn't
+ * match, repeat NETIMG_MAXTRIES times.  The "all" flag tells
+ * sendpkt() whether to wait for only one ACK packet (0) or to
+ * "opportunistically" grab all ACKs that have returned to the server
+ * (1).  If "all" is 1, "ackseqn" must match the sequence number of
+ * the last ACK received.
+ *
+ * Returns 0 if send success (and ack-ed correctly for PA3), else -1.
+ *
+ * Nothing else is modified.
+*/
+int imgdb::
+sendpkt(sender_t *snd, char *pkt, int size, unsigned int ackseqn, int all)
+{
+
+
+  /* Lab5 and PA3 Task 2.1: YOUR CODE HERE */
+    socklen_t client_size = sizeof(snd->client);
+    fd_set imgdb_sendpkt_set;
+    struct timeval tv;
+    int count =0;
+    ihdr_t ihdr_ack;
+    unsigned int recived_ih_seq = 0;
+    bool resend = true;
+    while(count < NETIMG_MAXTRIES){
+    //send packet  
+    if (resend) {
+      ssize_t judge = sendto(snd->sd, pkt, size, 0, (struct sockaddr *) &snd->client, client_size);
+      assert(judge>0&&"failed sent to client");
+    }
+    resend = true;
+
+    // select() may modify both, re-arm them on every try
+    FD_ZERO(&imgdb_sendpkt_set);
+    FD_SET(snd->sd, &imgdb_sendpkt_set);
+    tv = snd->timeout;
+    int err = select(snd->sd+1, &imgdb_sendpkt_set, 0, 0, &tv);
+    bool recived_right_ack_seq = false;
+
+    if(!err){// timeout
+      
+      if((recived_right_ack_seq)&all) {return 0;}
+      count++;
+      fprintf(stderr, "time out recive ack,tried %d times\n", count);
+      continue;
+    }else  if(FD_ISSET(snd->sd, &imgdb_sendpkt_set)){
+            if(all==0){
+              int bytes = recvack(snd, &ihdr_ack, 0);
+              net_assert((bytes<0),"recv error when all ==0");
+              if (!bytes) {
+                resend = false;  // not from our client, wait on
+                continue;
+              }
+              recived_ih_seq = ntohl(ihdr_ack.ih_seqn);
+              if(recived_ih_seq == ackseqn) return 0;
+              else return (-1);
+
+            }else{
+                while(1){
+                  fprintf(stderr, "recive ack num is 0x%x\n", recived_ih_seq);
+                  // a query for the next image arriving right behind
+                  // our last ACK is set aside for handleqry()
+                  int bytes = recvack(snd, &ihdr_ack, MSG_DONTWAIT);
+                  if (!bytes) {
+                    continue;
+                  }
+                  if(bytes<0){
+                    fprintf(stderr, " before break recive ack num is 0x%x\n", recived_ih_seq);
+                    break;
                   }
                   recived_ih_seq = ntohl(ihdr_ack.ih_seqn);
                 }
+                if(recived_ih_seq==ackseqn) return 0;
+                // only stale ACKs so far, send again and keep waiting
+                count++;
             }
     }
 
@@ -287,59 +1078,491 @@ sendpkt(char *pkt, int size, unsigned int ackseqn, int all)
  * Upon successful sent, return 0, else return -1. 
  * Nothing else is modified.
 */
-int imgdb::
-sendimsg(imsg_t *imsg)
+static void
+imgdb_htonimsg(imsg_t *imsg)
 {
   imsg->im_vers = NETIMG_VERS;
   imsg->im_width = htons(imsg->im_width);
   imsg->im_height = htons(imsg->im_height);
+  imsg->im_lvlw = htons(imsg->im_lvlw);
+  imsg->im_lvlh = htons(imsg->im_lvlh);
+  imsg->im_size = htonl(imsg->im_size);
+  imsg->im_etag = htonl(imsg->im_etag);
+
+  return;
+}
+
+/*
+ * sendinit: set up "snd" to send to imgdb::client, as it asked, on
+ * socket "s", imgdb::sd or a flow's.
+ */
+void imgdb::
+sendinit(sender_t *snd, int s)
+{
+  snd->sd = s;
+  memcpy(&snd->client, &client, sizeof(struct sockaddr_in));
+  snd->mss = mss;
+  snd->rwnd = rwnd;
+  snd->fwnd = fwnd;
+  snd->timeout = timeout;
+  snd->pdrop = pdrop;
+  snd->flow = s != sd;
+
+  return;
+}
+
+int imgdb::
+sendimsg(imsg_t *imsg)
+{
+  sender_t snd;
+
+  imgdb_htonimsg(imsg);
+  sendinit(&snd, sd);
+
+  return(sendpkt(&snd, (char *) imsg, sizeof(imsg_t), NETIMG_SYNSEQ, 0));
+}
+
+#ifdef __linux__
+/*
+ * zcreap: segments sent MSG_ZEROCOPY are read by the kernel straight
+ * out of the payload, after sendmsg() has returned.  The payload must
+ * stay as it is until the kernel says it is done with each of them,
+ * on the socket's error queue.  Collect these completions.  If
+ * "wait", keep at it until all segments sent so far have completed,
+ * giving up after imgdb::timeout without any.
+ *
+ * Nothing else is modified.
+ */
+void imgdb::
+zcreap(int wait)
+{
+  struct msghdr mh;
+  union {                      // aligned for struct cmsghdr
+    struct cmsghdr cm;
+    char buf[CMSG_SPACE(sizeof(struct sock_extended_err) + sizeof(struct sockaddr_in))];
+  } ctl;
+  struct cmsghdr *cmsg;
+  struct sock_extended_err *ee;
+  struct pollfd pfd;
+
+  while ((int) (zcsent - zcdone) > 0) {
+    memset(&mh, 0, sizeof(struct msghdr));
+    mh.msg_control = ctl.buf;
+    mh.msg_controllen = sizeof(ctl.buf);
+    if (recvmsg(sd, &mh, MSG_ERRQUEUE|MSG_DONTWAIT) < 0) {
+      if (!wait || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+        break;
+      }
+      pfd.fd = sd;
+      pfd.events = 0;          // POLLERR is always reported
+      if (poll(&pfd, 1, timeout.tv_sec*1000 + timeout.tv_usec/1000) <= 0) {
+        fprintf(stderr, "imgdb::zcreap: %u sends not completed\n", zcsent - zcdone);
+        break;
+      }
+      continue;
+    }
+    for (cmsg = CMSG_FIRSTHDR(&mh); cmsg; cmsg = CMSG_NXTHDR(&mh, cmsg)) {
+      ee = (struct sock_extended_err *) CMSG_DATA(cmsg);
+      if (cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR
+          && ee->ee_origin == SO_EE_ORIGIN_ZEROCOPY) {
+        // completions come as ranges of send counts
+        zcdone += ee->ee_data - ee->ee_info + 1;
+        if (ee->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+          zccopied += ee->ee_data - ee->ee_info + 1;
+        }
+      }
+    }
+  }
+
+  return;
+}
+
+/*
+ * urinit: set up imgdb::ur for sendimg(), with IMGDB_URSLOTS slots
+ * for sends in flight and IMGDB_URBUFS buffers for the kernel to
+ * receive ACKs into.
+ *
+ * Returns 0 on success, else -1, with nothing set up.
+ */
+int imgdb::
+urinit()
+{
+  int i, err;
+
+  if ((err = uring_init(&ur, IMGDB_URSLOTS)) < 0) {
+    errno = -err;
+    perror("imgdb::urinit: io_uring_setup");
+    return(-1);
+  }
+  urbr = uring_bufring(&ur, 0, IMGDB_URBUFS);
+  if (!urbr) {
+    perror("imgdb::urinit: IORING_REGISTER_PBUF_RING");
+    uring_exit(&ur);
+    return(-1);
+  }
+  urbufs = new unsigned char[IMGDB_URBUFS*IMGDB_URBUFSZ];
+  for (i = 0; i < IMGDB_URBUFS; i++) {
+    uring_bufadd(urbr, IMGDB_URBUFS, urbufs+i*IMGDB_URBUFSZ, IMGDB_URBUFSZ, i);
+  }
+  urslots = new urslot_t[IMGDB_URSLOTS];
+  memset(urslots, 0, IMGDB_URSLOTS*sizeof(urslot_t));
+  urnext = urbusy = 0;
+  urlink = NULL;
+
+  // the sender's address is asked for, see recvack(), no control data
+  memset(&urmh, 0, sizeof(struct msghdr));
+  urmh.msg_namelen = sizeof(struct sockaddr_in);
+  urrecv = urtimer = uracked = urfired = false;
+  urts.tv_sec = NETIMG_SLEEP;
+  urts.tv_nsec = NETIMG_USLEEP*1000;
+
+  return(0);
+}
+
+/*
+ * ursqe: Returns a free submission queue entry of imgdb::ur,
+ * submitting those queued so far if there is none.
+ */
+struct io_uring_sqe *imgdb::
+ursqe()
+{
+  struct io_uring_sqe *sqe;
+
+  while (!(sqe = uring_sqe(&ur))) {
+    urflush(0);
+  }
+
+  return(sqe);
+}
+
+/*
+ * urflush: submit everything queued on imgdb::ur and wait for at
+ * least "wait" completions.
+ *
+ * Returns the number of entries submitted, or -1 on error.
+ */
+int imgdb::
+urflush(unsigned wait)
+{
+  int err;
+
+  urlink = NULL;  // what's submitted is the kernel's now
+  if ((err = uring_enter(&ur, wait)) < 0) {
+    errno = -err;
+    perror("imgdb::urflush: io_uring_enter");
+    return(-1);
+  }
+
+  return(err);
+}
+
+/*
+ * ursend: queue the sendmsg() of "slot" on imgdb::ur.  Sends queued
+ * back to back are linked, so the kernel sends them in order even if
+ * the socket buffer fills up in between.
+ */
+void imgdb::
+ursend(urslot_t *slot)
+{
+  struct io_uring_sqe *sqe;
+
+  sqe = ursqe();
+  sqe->opcode = IORING_OP_SENDMSG;
+  sqe->fd = sd;
+  sqe->addr = (unsigned long) &slot->mh;
+  sqe->msg_flags = slot->zcflag;
+  sqe->user_data = slot - urslots;
+  if (urlink) {
+    urlink->flags |= IOSQE_IO_LINK;
+  }
+  urlink = sqe;
+
+  return;
+}
+
+/*
+ * urqueue: queue the segment described by "mh", as sendmsg() would
+ * take it, for urwait() to send.  The ihdr_t in its first iovec is
+ * copied and, if "copy" is set, so is the data in the second, else
+ * the data must stay as it is until the send completes.  "zcflag" is
+ * as with sendmsg().  If all IMGDB_URSLOTS slots are in flight, wait
+ * for one to complete.
+ */
+void imgdb::
+urqueue(struct msghdr *mh, int copy, int zcflag)
+{
+  urslot_t *slot;
+  int i;
+
+  while (1) {
+    for (i = 0; i < IMGDB_URSLOTS && urslots[(urnext+i) % IMGDB_URSLOTS].busy; i++);
+    if (i < IMGDB_URSLOTS) {
+      break;
+    }
+    if (urflush(1) < 0) {
+      return;  // as if dropped
+    }
+    urreap();
+  }
+  slot = &urslots[(urnext+i) % IMGDB_URSLOTS];
+  urnext = (slot - urslots + 1) % IMGDB_URSLOTS;
+
+  memcpy(&slot->hdr, mh->msg_iov[0].iov_base, sizeof(ihdr_t));
+  slot->iov[0].iov_base = &slot->hdr;
+  slot->iov[0].iov_len = sizeof(ihdr_t);
+  slot->iov[1] = mh->msg_iov[1];
+  if (copy) {
+    delete[] slot->copy;
+    slot->copy = new unsigned char[mh->msg_iov[1].iov_len];
+    memcpy(slot->copy, mh->msg_iov[1].iov_base, mh->msg_iov[1].iov_len);
+    slot->iov[1].iov_base = slot->copy;
+  }
+  slot->mh = *mh;
+  slot->mh.msg_iov = slot->iov;
+  slot->zcflag = zcflag;
+  slot->busy = true;
+  urbusy++;
+  ursend(slot);
+
+  return;
+}
+
+/*
+ * urreap: process all completions on imgdb::ur.  A completed send
+ * frees its slot; one that ran out of pinned memory for MSG_ZEROCOPY
+ * is sent again without, any other failure is left to Go-Back-N.
+ * Packets received are sorted as recvack() does: queries are set
+ * aside, anything else not from imgdb::client dropped.  The client's
+ * ACKs, but those of the imsg_t, are counted in imgdb::uracks, the
+ * largest kept in imgdb::urack.  The timer expiring with no ACK
+ * since it was armed sets imgdb::urfired.
+ */
+void imgdb::
+urreap()
+{
+  struct io_uring_cqe *cqe;
+  struct io_uring_recvmsg_out *out;
+  struct sockaddr_in *from;
+  urslot_t *slot;
+  unsigned char *pkt;
+  ihdr_t ihdr_ack;
+  iqry_t iqry;
+  unsigned short bid;
+
+  while ((cqe = uring_cqe(&ur))) {
+    if (cqe->user_data < IMGDB_URSLOTS) {
+      slot = &urslots[cqe->user_data];
+      if (cqe->res == -ENOBUFS && slot->zcflag) {
+        slot->zcflag = 0;
+        ursend(slot);
+      } else {
+        if (cqe->res >= 0 && slot->zcflag) {
+          zcsent++;
+        } else if (cqe->res < 0 && cqe->res != -ECANCELED) {
+          fprintf(stderr, "imgdb::urreap: sendmsg: %s\n", strerror(-cqe->res));
+        }
+        slot->busy = false;
+        urbusy--;
+      }
+
+    } else if (cqe->user_data == IMGDB_URRECV) {
+      if (cqe->flags & IORING_CQE_F_BUFFER) {
+        bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        out = (struct io_uring_recvmsg_out *) (urbufs + bid*IMGDB_URBUFSZ);
+        // the sender follows, then the payload, no control data
+        from = (struct sockaddr_in *) (out+1);
+        pkt = (unsigned char *) (out+1) + urmh.msg_namelen;
+        if (cqe->res < (int) (sizeof(struct io_uring_recvmsg_out) + urmh.msg_namelen)
+            || out->namelen < sizeof(struct sockaddr_in) || (out->flags & MSG_TRUNC)) {
+          ;  // dropped, no room for it
+        } else if (out->payloadlen == sizeof(iqry_t)
+                   && ((iqry_t *) pkt)->iq_type == NETIMG_SYNQRY) {
+          memcpy(&iqry, pkt, sizeof(iqry_t));
+          setaside(from, &iqry);
+        } else if (from->sin_addr.s_addr == client.sin_addr.s_addr
+                   && from->sin_port == client.sin_port
+                   && out->payloadlen >= sizeof(ihdr_t)) {
+          memcpy(&ihdr_ack, pkt, sizeof(ihdr_t));
+          if (ihdr_ack.ih_type == NETIMG_ACK
+              && ntohl(ihdr_ack.ih_seqn) != NETIMG_SYNSEQ) {
+            urack = max(urack, (unsigned int) ntohl(ihdr_ack.ih_seqn));
+            uracks++;
+            uracked = true;
+          }
+        }
+        uring_bufadd(urbr, IMGDB_URBUFS, out, IMGDB_URBUFSZ, bid);
+      }
+      if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        urrecv = false;  // out of buffers or cancelled
+      }
+
+    } else if (cqe->user_data == IMGDB_URTIMER) {
+      urtimer = false;
+      if (cqe->res == -ETIME && !uracked) {
+        urfired = true;
+      }
+    }
+    uring_cqseen(&ur);
+  }
+
+  return;
+}
+
+/*
+ * urwait: send what urqueue() has queued and wait for ACKs, all in
+ * as few io_uring_enter() calls as possible.  ACKs are received by
+ * one multishot recvmsg() into the buffers provided, and the RTO is
+ * an IORING_OP_TIMEOUT, both kept armed across calls.  The timer
+ * isn't restarted on every window: if ACKs did arrive by the time it
+ * expires, it is merely armed again, so an RTO is detected within
+ * two imgdb::timeout.
+ *
+ * Returns the number of ACKs received, the largest in imgdb::urack,
+ * or 0 on RTO.
+ */
+int imgdb::
+urwait()
+{
+  struct io_uring_sqe *sqe;
+  int acks;
+
+  do {
+    if (!urrecv) {
+      sqe = ursqe();
+      sqe->opcode = IORING_OP_RECVMSG;
+      sqe->fd = sd;
+      sqe->addr = (unsigned long) &urmh;
+      sqe->ioprio = IORING_RECV_MULTISHOT;
+      sqe->flags = IOSQE_BUFFER_SELECT;
+      sqe->buf_group = 0;
+      sqe->user_data = IMGDB_URRECV;
+      urlink = NULL;
+      urrecv = true;
+    }
+    if (!urtimer) {
+      sqe = ursqe();
+      sqe->opcode = IORING_OP_TIMEOUT;
+      sqe->addr = (unsigned long) &urts;
+      sqe->len = 1;
+      sqe->user_data = IMGDB_URTIMER;
+      urlink = NULL;
+      urtimer = true;
+      uracked = false;
+    }
+    if (urflush(uracks || urfired ? 0 : 1) < 0) {
+      break;
+    }
+    urreap();
+  } while (!uracks && !urfired);
+
+  acks = uracks;
+  uracks = 0;
+  urfired = false;
+
+  return(acks);
+}
+
+/*
+ * urdrain: cancel the ACK receive and the timer and wait for all
+ * sends in flight to complete, leaving sd to select() and
+ * recvfrom() again and the payload to the caller.
+ */
+void imgdb::
+urdrain()
+{
+  struct io_uring_sqe *sqe;
+
+  if (urrecv) {
+    sqe = ursqe();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = IMGDB_URRECV;
+    sqe->user_data = IMGDB_URCANCEL;
+    urlink = NULL;
+  }
+  if (urtimer) {
+    sqe = ursqe();
+    sqe->opcode = IORING_OP_TIMEOUT_REMOVE;
+    sqe->addr = IMGDB_URTIMER;
+    sqe->user_data = IMGDB_URCANCEL;
+    urlink = NULL;
+  }
+  while (urbusy || urrecv || urtimer) {
+    if (urflush(1) < 0) {
+      break;
+    }
+    urreap();
+  }
 
-  return(sendpkt((char *) imsg, sizeof(imsg_t), NETIMG_SYNSEQ, 0));
+  return;
 }
+#endif // __linux__
 
 /*
  * sendimg:
- * Send the image contained in *image to the client.  Send the image
- * in chunks of segsize, not to exceed mss, instead of as one single
- * image. With probability pdrop, drop a segment instead of sending
- * it.
+ * Send the image contained in *image to the client of "snd", on its
+ * socket.  Send the image in chunks of segsize, not to exceed its mss,
+ * instead of as one single image. With probability of its pdrop, drop
+ * a segment instead of sending it.  If "zc" is not NULL, segments that compress are sent as
+ * NETIMG_DATA_Z, taken from, or added to, "zc".  If "slotted" is
+ * set, "image" is made of slots as described with islot_t and each
+ * segment is sent as NETIMG_DATA_S.  If "same" is not NULL, segments
+ * with a non-zero entry in it are sent as NETIMG_DATA_H.  With
+ * imgdb::zerocopy, segments of at least IMGDB_ZCMIN bytes are sent
+ * MSG_ZEROCOPY, and all of them have completed on return.  With
+ * imgdb::useuring, segments are sent and ACKs awaited with urwait().
+ * Neither applies to flows, see sendflows().
  *
  * Terminate process upon encountering any error.
  * Doesn't otherwise modify anything.
 */
 void imgdb::
-sendimg(char *image, long imgsize)
+sendimg(sender_t *snd, char *image, long imgsize, zcache_t *zc, int slotted,
+        unsigned char *same)
 {
-  int bytes, segsize, datasize;
+  int bytes, segsize, datasize, zsize, zcflag;
+  unsigned char *zdata;
+  islot_t slot;
+  long wirebytes = 0;
   char *ip;
   long left;
   unsigned int snd_next=0;
+  fd_set rset;
+  // flows are sent on threads of their own, with neither
+  bool uring = useuring && !snd->flow;
+#ifdef __linux__
+  bool zcopy = zerocopy && !snd->flow;
+#endif // __linux__
   if (!image) {
     return;
   }
   
   ip = image; /* ip points to the start of image byte buffer */
-  datasize = mss - sizeof(ihdr_t) - NETIMG_UDPIP;
+  datasize = snd->mss - sizeof(ihdr_t) - NETIMG_UDPIP;
   
   //researve fec data
   unsigned char* fecdata = new  unsigned char[datasize];
+  unsigned char *fecblk = NULL;  // or the window's, see parity()
   int packet_count = 0;
   unsigned int current_start_window  = 0;
+#ifdef __linux__
+  urack = 0;
+  uracks = 0;
+#endif // __linux__
 
 
 
   /* Lab5 Task 1:
    * make sure that the send buffer is of size at least mss.
    */
-  int mss_in = (int) mss;
-  int err_SO_SNDBUF = setsockopt(sd, SOL_SOCKET, SO_SNDBUF, &mss_in , sizeof(int));
+  int mss_in = (int) snd->mss;
+  int err_SO_SNDBUF = setsockopt(snd->sd, SOL_SOCKET, SO_SNDBUF, &mss_in , sizeof(int));
   if(err_SO_SNDBUF==-1) perror("setsockopt SO_SNDBUF failed");
 
 
   int recive_buffer_sized;
   socklen_t len_int = sizeof(int);
 
-  int error = getsockopt(sd, SOL_SOCKET, SO_RCVBUF, &recive_buffer_sized, &len_int);
+  int error = getsockopt(snd->sd, SOL_SOCKET, SO_RCVBUF, &recive_buffer_sized, &len_int);
   fprintf(stderr, "the recive buffer is %d\n", recive_buffer_sized);
   /* Lab5 Task 1:
    *
@@ -352,7 +1575,7 @@ sendimg(char *image, long imgsize)
   /* Lab5: YOUR CODE HERE */
     struct iovec iov[NETIMG_NUMIOV];
 
-    struct msghdr mh ={&client, sizeof(struct sockaddr_in), iov, NETIMG_NUMIOV, NULL, 0, 0};
+    struct msghdr mh ={&snd->client, sizeof(struct sockaddr_in), iov, NETIMG_NUMIOV, NULL, 0, 0};
 
     ihdr_t io_header;
     io_header.ih_vers = NETIMG_VERS;
@@ -368,9 +1591,10 @@ sendimg(char *image, long imgsize)
    */
   /* PA3: YOUR CODE HERE */
     unsigned int snd_una = 0;
-    unsigned int rwnd_short = rwnd*datasize;
+    int rtos = 0;  // consecutive timeouts without an ACK
+    unsigned int rwnd_short = snd->rwnd*datasize;
     unsigned int useable_window = rwnd_short - (snd_next - snd_una);
-    fprintf(stderr, "useable_window%hu mss is%hu\n", useable_window, mss );
+    fprintf(stderr, "useable_window%hu mss is%hu\n", useable_window, snd->mss );
 
   do {
     /* PA3 Task 2.2: estimate the receiver's receive buffer based on packets
@@ -403,16 +1627,20 @@ sendimg(char *image, long imgsize)
        * window should be XOR-ed with the content of your FEC data.
        */      
       if(packet_count == 0){
-        fec_init(fecdata, reinterpret_cast<unsigned char*> (ip + snd_next), datasize, segsize);
+        // the window's FEC may be at hand already, see parity()
+        fecblk = parity((unsigned char *) ip, imgsize, snd_next, snd->fwnd);
+        if (!fecblk) {
+          fec_init(fecdata, reinterpret_cast<unsigned char*> (ip + snd_next), datasize, segsize);
+        }
         current_start_window = snd_next;
-      }else{
+      }else if (!fecblk) {
         fec_accum(fecdata,reinterpret_cast<unsigned char*> (ip + snd_next), datasize, segsize);
       }
       
 
 
       /* probabilistically drop a segment */
-      if (((float) random())/INT_MAX < pdrop) {
+      if (((float) random())/INT_MAX < snd->pdrop) {
         fprintf(stderr, "imgdb::sendimg: DROPPED offset 0x%x, %d bytes\n",
                 snd_next, segsize);
       } else { 
@@ -432,11 +1660,53 @@ sendimg(char *image, long imgsize)
         io_header.ih_type = NETIMG_DATA;
         io_header.ih_size = htons(segsize); 
         io_header.ih_seqn = htonl(snd_next);
+        if (same && same[snd_next/datasize]) {
+          // client has it, FEC above still covers it
+          iov[1].iov_len = 0;
+          io_header.ih_type = NETIMG_DATA_H;
+          io_header.ih_size = 0;
+        } else if (zc && (zsize = zsegment(zc, snd_next, segsize, &zdata))) {
+          // compressed size in ih_size, offset stays in ih_seqn
+          iov[1].iov_base = zdata;
+          iov[1].iov_len = zsize;
+          io_header.ih_type = NETIMG_DATA_Z;
+          io_header.ih_size = htons(zsize);
+        } else if (slotted) {
+          // slot padding is not sent
+          memcpy(&slot, ip + snd_next, sizeof(islot_t));
+          iov[1].iov_len = sizeof(islot_t) + ntohl(slot.is_size);
+          io_header.ih_type = NETIMG_DATA_S;
+          io_header.ih_size = htons(iov[1].iov_len);
+        }
+        wirebytes += iov[1].iov_len;
 
-        int rc = sendmsg(sd, &mh, 0);  
-        if (rc == -1) {
-          perror("sendmsg xxx failed");
-          return;
+        // FEC data is reused at once, so only the payload qualifies
+        zcflag = 0;
+#ifdef __linux__
+        if (zcopy && iov[1].iov_len >= IMGDB_ZCMIN) {
+          zcflag = MSG_ZEROCOPY;
+        }
+#endif // __linux__
+        if (uring) {
+#ifdef __linux__
+          urqueue(&mh, 0, zcflag);
+#endif // __linux__
+        } else {
+          int rc = sendmsg(snd->sd, &mh, zcflag);  
+          if (rc == -1 && zcflag && errno == ENOBUFS) {
+            rc = sendmsg(snd->sd, &mh, 0);  // out of pinned memory
+          } else if (rc >= 0 && zcflag) {
+            zcsent++;
+          }
+          if (rc == -1) {
+            perror("sendmsg xxx failed");
+#ifdef __linux__
+            if (zcopy) {
+              zcreap(1);
+            }
+#endif // __linux__
+            return;
+          }
         }
 
 
@@ -472,20 +1742,27 @@ sendimg(char *image, long imgsize)
     /* Lab6 Task 1: YOUR CODE HERE */
         packet_count = (packet_count+1);
 
-      if(( packet_count == fwnd)||(imgsize - snd_next<=0)){
-        if (((float) random())/INT_MAX < pdrop) {
+      if(( packet_count == snd->fwnd)||(imgsize - snd_next<=0)){
+        if (((float) random())/INT_MAX < snd->pdrop) {
           fprintf(stderr, "imgdb::sendimg: DROPPED FEC 0x%x, %d bytes\n",
                   current_start_window, datasize);
             packet_count = 0;
 
         } 
         else{         
-          iov[1].iov_base = fecdata;
+          iov[1].iov_base = fecblk ? fecblk : fecdata;
           iov[1].iov_len = datasize;
           io_header.ih_type = NETIMG_FEC;
           io_header.ih_size = htons(datasize); 
           io_header.ih_seqn = htonl(current_start_window);
-          int fk = sendmsg(sd, &mh, 0);  
+          int fk = 0;
+          if (uring) {
+#ifdef __linux__
+            urqueue(&mh, 1, 0);  // fecdata is reused at once
+#endif // __linux__
+          } else {
+            fk = sendmsg(snd->sd, &mh, 0);  
+          }
   
           fprintf(stderr, "imgdb::sendimg: sent FEC 0x%x, %d bytes\n",
                   current_start_window, datasize);
@@ -509,30 +1786,69 @@ sendimg(char *image, long imgsize)
      * segment.
      */
     /* PA3: YOUR CODE HERE */
-    FD_ZERO(&imgdb_fd_set);
-    FD_SET(sd, &imgdb_fd_set);
+    FD_ZERO(&rset);
+    FD_SET(snd->sd, &rset);
     struct timeval timeout_1;
     timeout_1.tv_sec = NETIMG_SLEEP;
     timeout_1.tv_usec = NETIMG_USLEEP;
 
-      int err = select(sd+1, &imgdb_fd_set, 0, 0, &timeout_1);
+#ifdef __linux__
+      int err = uring ? urwait() : select(snd->sd+1, &rset, 0, 0, &timeout_1);
+#else
+      int err = select(snd->sd+1, &rset, 0, 0, &timeout_1);
+#endif // __linux__
       while(1){
         if(!err){// start go back n
-          snd_next = snd_una;
+          if (++rtos > NETIMG_MAXTRIES) {
+            // client has gone away or cancelled the transfer
+            fprintf(stderr, "imgdb::sendimg: no ACK after %d RTOs, abort at 0x%x\n",
+                    NETIMG_MAXTRIES, snd_una);
+            delete[] fecdata;
+#ifdef __linux__
+            if (uring) {
+              urdrain();
+            }
+            if (zcopy) {
+              zcreap(1);
+            }
+#endif // __linux__
+            return;
+          }
+          snd_next = snd_una;
           //reset the fec datapatch
           packet_count = 0;
           fprintf(stderr, " RTO current unacked is: 0x%x\n", snd_una);
           break;
         }
         else{
-          if(FD_ISSET(sd, &imgdb_fd_set)){
+#ifdef __linux__
+          if (uring) {
+            snd_una = max(snd_una, urack);
+            rtos = 0;
+            break;
+          }
+#endif // __linux__
+          if(FD_ISSET(snd->sd, &rset)){
               ihdr_t ihdr_ack;
-              socklen_t client_size = sizeof(client);
-                int byte_r = recvfrom(sd, &ihdr_ack, sizeof(ihdr_t), MSG_DONTWAIT, (struct sockaddr *) &client, &client_size);
-                if(byte_r<0) break;
+                int byte_r = recvack(snd, &ihdr_ack, MSG_DONTWAIT);
+                if (!byte_r) {
+                  continue;  // another client's, see recvack()
+                }
+                if(byte_r<0) {
+#ifdef __linux__
+                  if (zcopy) {
+                    zcreap(0);  // else select() keeps waking up for them
+                  }
+#endif // __linux__
+                  break;
+                }
+                if(ihdr_ack.ih_type == NETIMG_ACK && ntohl(ihdr_ack.ih_seqn) == NETIMG_SYNSEQ){
+                  continue;  // of the imsg_t, or a flow's hello, again
+                }
                 if(ihdr_ack.ih_type == NETIMG_ACK){
                   unsigned int seq_short =  ntohl(ihdr_ack.ih_seqn);
                   snd_una = max(snd_una, seq_short);
+                  rtos = 0;
                   fprintf(stderr, " server finish recive ack 0x%x current unacked is: 0x%x\n", seq_short, snd_una);
                 }else{
                   fprintf(stderr, "!!! recived type is not net ack");
@@ -541,6 +1857,12 @@ sendimg(char *image, long imgsize)
           }
         }
     }
+    if (snd_next < snd_una) {
+      // ACKed beyond what was sent: after an RTO, or the client got
+      // the rest elsewhere, see NETIMG_RANGE
+      snd_next = snd_una;
+      packet_count = 0;
+    }
     //fprintf(stderr, "current snd_next is  %d, and imgsize is %li\n", snd_next, imgsize);
 
   } while (((int)snd_next < imgsize)||(snd_una<imgsize)); // PA3 Task 2.2: replace the '1' with your condition for detecting 
@@ -549,6 +1871,16 @@ sendimg(char *image, long imgsize)
   /* PA3 Task 2.2: after the image is sent send a NETIMG_FIN packet
    * and wait for ACK, using imgdb::recvack().
    */ 
+#ifdef __linux__
+  if (uring) {
+    urdrain();  // the FIN handshake is select()'s
+  }
+  if (zcopy) {
+    zcreap(1);
+    fprintf(stderr, "imgdb::sendimg: %u zerocopy sends so far, %u of them copied\n",
+            zcsent, zccopied);
+  }
+#endif // __linux__
   ihdr_t hdr;
   hdr.ih_vers = NETIMG_VERS;
   hdr.ih_type = NETIMG_FIN;
@@ -556,13 +1888,706 @@ sendimg(char *image, long imgsize)
   hdr.ih_seqn = htonl(NETIMG_FINSEQ);
 
   fprintf(stderr, "imgdb::sendimg: send FIN, unacked: 0x%x\n", snd_una);
-  if (!sendpkt((char *) &hdr, sizeof(ihdr_t), NETIMG_FINSEQ, 1)) {
+  if (zc || slotted || same) {
+    fprintf(stderr, "imgdb::sendimg: %ld image bytes sent as %ld bytes\n",
+            (long) snd_next, wirebytes);
+  }
+  if (!sendpkt(snd, (char *) &hdr, sizeof(ihdr_t), NETIMG_FINSEQ, 1)) {
     fprintf(stderr, "imgdb::sendimg: FIN acked.\n");
   }
   fprintf(stderr, "finally returned gugugugugu\n");
   return;
 }
 
+/*
+ * sendimg: send, as above, to imgdb::client on imgdb::sd.
+ */
+void imgdb::
+sendimg(char *image, long imgsize, zcache_t *zc, int slotted,
+        unsigned char *same)
+{
+  sender_t snd;
+
+  sendinit(&snd, sd);
+  sendimg(&snd, image, imgsize, zc, slotted, same);
+
+  return;
+}
+
+/*
+ * flowinit: split the transfer about to be announced in "imsg" across
+ * "n" flows, at most one per segment, see imsg_t::im_nflows.  A
+ * socket on a port of its own is set up for each.
+ *
+ * Returns the number of flows, 0 if not split after all.
+ */
+int imgdb::
+flowinit(imsg_t *imsg, int n)
+{
+  int datasize = mss - sizeof(ihdr_t) - NETIMG_UDPIP;
+  long nsegs = ((long) imsg->im_size + datasize-1)/datasize;
+
+  n = n > NETIMG_MAXFLOWS ? NETIMG_MAXFLOWS : n;
+  n = n > nsegs ? (int) nsegs : n;
+  if (n < 2) {
+    return(0);
+  }
+  for (nflows = 0; nflows < n; nflows++) {
+    sendinit(&flows[nflows].snd, socks_dgraminit(&imsg->im_fports[nflows]));
+    if (flows[nflows].snd.sd < 0) {
+      flowclose();
+      return(0);
+    }
+  }
+  imsg->im_nflows = (unsigned char) nflows;
+
+  return(nflows);
+}
+
+/*
+ * flowclose: done with the flows' sockets, if any.
+ */
+void imgdb::
+flowclose()
+{
+  while (nflows > 0) {
+    socks_close(flows[--nflows].snd.sd);
+  }
+
+  return;
+}
+
+/*
+ * sendflow: thread sending flow "arg", a flow_t, see sendflows().
+ * Wait for the client's hello on it to know where to send to, then
+ * send its segments as any transfer.
+ */
+void *imgdb::
+sendflow(void *arg)
+{
+  flow_t *flow = (flow_t *) arg;
+  struct sockaddr_in from;
+  socklen_t fromlen;
+  struct timeval tv;
+  fd_set rset;
+  ihdr_t hello;
+  int tries;
+
+  for (tries = 0; tries <= NETIMG_MAXTRIES; tries++) {
+    FD_ZERO(&rset);
+    FD_SET(flow->snd.sd, &rset);
+    tv = flow->snd.timeout;
+    if (select(flow->snd.sd+1, &rset, NULL, NULL, &tv) <= 0) {
+      continue;
+    }
+    fromlen = sizeof(from);
+    if (recvfrom(flow->snd.sd, &hello, sizeof(ihdr_t), 0, (struct sockaddr *) &from, &fromlen)
+        == sizeof(ihdr_t) && hello.ih_vers == NETIMG_VERS && hello.ih_type == NETIMG_ACK
+        && ntohl(hello.ih_seqn) == NETIMG_SYNSEQ) {
+      memcpy(&flow->snd.client, &from, sizeof(struct sockaddr_in));
+      flow->db->sendimg(&flow->snd, flow->buf, flow->size, NULL, flow->slotted, NULL);
+      return(NULL);
+    }
+  }
+  fromlen = sizeof(from);
+  getsockname(flow->snd.sd, (struct sockaddr *) &from, &fromlen);
+  fprintf(stderr, "imgdb::sendflow: no hello on flow port %d\n", ntohs(from.sin_port));
+
+  return(NULL);
+}
+
+/*
+ * sendflows: send the "imgsize" bytes at "image" over the flows set
+ * up by flowinit(), each on a thread of its own.  Flow f carries
+ * segments f, f+nflows, ... copied back to back, as its own transfer
+ * with its own window and FEC.  The flows send as sendimg(), using
+ * neither MSG_ZEROCOPY nor io_uring, and return once all are done.
+ */
+void imgdb::
+sendflows(char *image, long imgsize, int slotted)
+{
+  pthread_t threads[NETIMG_MAXFLOWS];
+  bool started[NETIMG_MAXFLOWS];
+  flow_t *flow;
+  char *buf;
+  long offset, seg, segsize;
+  int f, datasize;
+
+  datasize = mss - sizeof(ihdr_t) - NETIMG_UDPIP;
+  buf = new char[imgsize];
+
+  for (offset = f = 0; f < nflows; f++) {
+    flow = &flows[f];
+    flow->db = this;
+    flow->buf = buf + offset;
+    flow->slotted = slotted;
+    for (seg = f*datasize; seg < imgsize; seg += nflows*datasize) {
+      segsize = imgsize - seg < datasize ? imgsize - seg : datasize;
+      memcpy(buf + offset, image + seg, segsize);
+      offset += segsize;
+    }
+    flow->size = buf + offset - flow->buf;
+  }
+
+  for (f = 0; f < nflows; f++) {
+    started[f] = !pthread_create(&threads[f], NULL, sendflow, &flows[f]);
+    if (!started[f]) {
+      sendflow(&flows[f]);  // no thread, send it on ours
+    }
+  }
+  for (f = 0; f < nflows; f++) {
+    if (started[f]) {
+      pthread_join(threads[f], NULL);
+    }
+  }
+  fprintf(stderr, "imgdb::sendflows: %ld bytes sent over %d flows\n", imgsize, nflows);
+
+  delete[] buf;
+  return;
+}
+
+/*
+ * mcastqry: whether query "iqry" is to be served over multicast, see
+ * imsg_t::im_group: it asks for it, this server has a group, and it
+ * asks for none of the modes not applied over it.  If so, NETIMG_Z
+ * and NETIMG_RLE are dropped from it: the payload goes as it is, the
+ * same for all who ask for it.
+ *
+ * Returns 1 if so, else 0.
+ */
+int imgdb::
+mcastqry(iqry_t *iqry)
+{
+  if (!mcgroup.sin_port || !iqry->iq_mcast
+      || (iqry->iq_mode & (NETIMG_TILE|NETIMG_DELTA|NETIMG_RANGE))) {
+    return(0);
+  }
+  iqry->iq_mode &= ~(NETIMG_Z|NETIMG_RLE);
+
+  return(1);
+}
+
+/*
+ * imgdb_samekey: whether queries "a" and "b" ask prepare() for the
+ * same payload of the same image, cut into segments of the same size.
+ */
+static int
+imgdb_samekey(iqry_t *a, iqry_t *b)
+{
+  int modes = NETIMG_PROG|NETIMG_TILE|NETIMG_DCT|NETIMG_BC1;
+
+  return((a->iq_mode & modes) == (b->iq_mode & modes) && a->iq_mss == b->iq_mss
+         && a->iq_x == b->iq_x && a->iq_y == b->iq_y && a->iq_w == b->iq_w && a->iq_h == b->iq_h
+         && a->iq_dispw == b->iq_dispw && a->iq_disph == b->iq_disph
+         && a->iq_level == b->iq_level && a->iq_quality == b->iq_quality
+         && a->iq_format == b->iq_format && !strncmp(a->iq_name, b->iq_name, NETIMG_MAXFNAME));
+}
+
+/*
+ * imgdb_samepayload: whether query "iqry", as received, asks to be
+ * sent over multicast for the same payload as query "first", as
+ * passed by mcastqry().
+ */
+static int
+imgdb_samepayload(iqry_t *iqry, iqry_t *first)
+{
+  return(iqry->iq_vers == NETIMG_VERS && iqry->iq_type == NETIMG_SYNQRY && iqry->iq_mcast
+         && !(iqry->iq_mode & (NETIMG_TILE|NETIMG_DELTA|NETIMG_RANGE))
+         && (iqry->iq_mode & ~(NETIMG_Z|NETIMG_RLE)) == first->iq_mode
+         && imgdb_samekey(iqry, first));
+}
+
+/*
+ * imgdb_elapsed: microseconds since "since".
+ */
+static long
+imgdb_elapsed(struct timeval *since)
+{
+  struct timeval now;
+
+  gettimeofday(&now, NULL);
+  return((now.tv_sec - since->tv_sec)*1000000L + (now.tv_usec - since->tv_usec));
+}
+
+/*
+ * mcastgather: send reply "imsg" to query "iqry", from
+ * imgdb::client, then to every other client asking for the same
+ * payload: those set aside in imgdb::pending and those whose queries
+ * arrive within IMGDB_MCGATHER ms of the last one.  Each joins the
+ * group before ACKing it.  Other queries are set aside as usual.
+ *
+ * Returns the number of clients that ACKed the reply.
+ */
+int imgdb::
+mcastgather(iqry_t *iqry, imsg_t *imsg)
+{
+  struct timeval last, tv;
+  imsg_t reply;
+  ihdr_t ack;
+  sender_t snd;
+  long wait;
+  int i, members;
+
+  reply = *imsg;  // sendimsg() puts it in network byte order
+  members = !sendimsg(&reply);
+  gettimeofday(&last, NULL);
+  while (1) {
+    for (i = 0; i < npending && !imgdb_samepayload(&pending[i].iqry, iqry); i++);
+    if (i < npending) {
+      memcpy(&client, &pending[i].from, sizeof(struct sockaddr_in));
+      memmove(pending+i, pending+i+1, (--npending - i)*sizeof(pendqry_t));
+      reply = *imsg;
+      members += !sendimsg(&reply);
+      gettimeofday(&last, NULL);
+      continue;
+    }
+    wait = IMGDB_MCGATHER*1000L - imgdb_elapsed(&last);
+    if (wait <= 0) {
+      break;
+    }
+    FD_ZERO(&imgdb_fd_set);
+    FD_SET(sd, &imgdb_fd_set);
+    tv.tv_sec = wait/1000000;
+    tv.tv_usec = wait%1000000;
+    if (select(sd+1, &imgdb_fd_set, NULL, NULL, &tv) > 0) {
+      sendinit(&snd, sd);
+      recvack(&snd, &ack, MSG_DONTWAIT);  // queries are set aside
+    }
+  }
+
+  return(members);
+}
+
+/*
+ * mcastseg: send the segment at "offset" of the "imgsize" bytes at
+ * "image" on "mh", as sendimg() would, but for the FEC, slot padding
+ * not sent.  Dropped with probability imgdb::pdrop.
+ *
+ * Returns the bytes of payload sent, 0 if dropped.
+ */
+long imgdb::
+mcastseg(struct msghdr *mh, char *image, long imgsize, long offset, int slotted)
+{
+  ihdr_t *hdr = (ihdr_t *) mh->msg_iov[0].iov_base;
+  islot_t slot;
+  long segsize;
+
+  segsize = mss - sizeof(ihdr_t) - NETIMG_UDPIP;
+  segsize = imgsize - offset < segsize ? imgsize - offset : segsize;
+  mh->msg_iov[1].iov_base = image + offset;
+  mh->msg_iov[1].iov_len = segsize;
+  hdr->ih_type = NETIMG_DATA;
+  if (slotted) {
+    memcpy(&slot, image + offset, sizeof(islot_t));
+    mh->msg_iov[1].iov_len = sizeof(islot_t) + ntohl(slot.is_size);
+    hdr->ih_type = NETIMG_DATA_S;
+  }
+  hdr->ih_size = htons(mh->msg_iov[1].iov_len);
+  hdr->ih_seqn = htonl((unsigned int) offset);
+
+  if (((float) random())/INT_MAX < pdrop) {
+    fprintf(stderr, "imgdb::mcastseg: DROPPED offset 0x%lx, %ld bytes\n", offset, segsize);
+    return(0);
+  }
+  if (sendmsg(sd, mh, 0) < 0) {
+    perror("imgdb::mcastseg: sendmsg");
+    return(0);
+  }
+
+  return(mh->msg_iov[1].iov_len);
+}
+
+/*
+ * sendmcast: send the "imgsize" bytes at "image", described by
+ * "imsg", in reply to query "iqry", once, to the next port of
+ * imgdb::mcgroup, see imsg_t::im_group, for all the clients
+ * mcastgather() finds asking for it.  Every IMGDB_MCFWND segments
+ * are followed by their FEC, and every rwnd of them by a pause of
+ * IMGDB_MCGAP us, as there are no ACKs to pace them.  Then send a FIN
+ * every IMGDB_MCRTO ms, resending the segments NACKed in between,
+ * until none have been for IMGDB_MCQUIET of them.  Queries arriving
+ * meanwhile are set aside.
+ */
+void imgdb::
+sendmcast(char *image, long imgsize, int slotted, iqry_t *iqry, imsg_t *imsg)
+{
+  struct sockaddr_in group, from;
+  socklen_t fromlen;
+  struct iovec iov[NETIMG_NUMIOV];
+  struct msghdr mh;
+  struct timeval start, tv;
+  ihdr_t hdr, *nack;
+  unsigned char *fecdata, *fecblk = NULL, *resent, *pkt;
+  unsigned int *offsets;
+  long datasize, nsegs, seg, offset, segsize, wait, wirebytes = 0, repairs = 0;
+  int members, round, quiet, nacked, pktsize, bytes, i, n;
+
+  datasize = mss - sizeof(ihdr_t) - NETIMG_UDPIP;
+  nsegs = (imgsize + datasize-1)/datasize;
+  memcpy(&group, &mcgroup, sizeof(struct sockaddr_in));
+  group.sin_port = htons(ntohs(mcgroup.sin_port) + mcsent++ % IMGDB_MCPORTS);
+  imsg->im_group = group.sin_addr.s_addr;
+  imsg->im_gport = group.sin_port;
+  imsg->im_gfwnd = IMGDB_MCFWND;
+  members = mcastgather(iqry, imsg);
+  if (!members) {
+    return;
+  }
+
+  memset(&mh, 0, sizeof(struct msghdr));
+  mh.msg_name = &group;
+  mh.msg_namelen = sizeof(struct sockaddr_in);
+  mh.msg_iov = iov;
+  mh.msg_iovlen = NETIMG_NUMIOV;
+  iov[0].iov_base = &hdr;
+  iov[0].iov_len = sizeof(ihdr_t);
+  hdr.ih_vers = NETIMG_VERS;
+  fecdata = new unsigned char[datasize];
+
+  for (seg = 0; seg < nsegs; seg++) {
+    offset = seg*datasize;
+    segsize = imgsize - offset < datasize ? imgsize - offset : datasize;
+    if (!(seg % IMGDB_MCFWND)) {
+      fecblk = parity((unsigned char *) image, imgsize, offset, IMGDB_MCFWND);
+      if (!fecblk) {
+        fec_init(fecdata, (unsigned char *) image + offset, datasize, segsize);
+      }
+    } else if (!fecblk) {
+      fec_accum(fecdata, (unsigned char *) image + offset, datasize, segsize);
+    }
+    wirebytes += mcastseg(&mh, image, imgsize, offset, slotted);
+    if (seg % IMGDB_MCFWND == IMGDB_MCFWND-1 || seg == nsegs-1) {
+      iov[1].iov_base = fecblk ? fecblk : fecdata;
+      iov[1].iov_len = datasize;
+      hdr.ih_type = NETIMG_FEC;
+      hdr.ih_size = htons(datasize);
+      hdr.ih_seqn = htonl((unsigned int) ((seg - seg % IMGDB_MCFWND)*datasize));
+      if (((float) random())/INT_MAX < pdrop) {
+        fprintf(stderr, "imgdb::sendmcast: DROPPED FEC 0x%x\n", ntohl(hdr.ih_seqn));
+      } else if (sendmsg(sd, &mh, 0) > 0) {
+        wirebytes += datasize;
+      }
+    }
+    if (seg % rwnd == rwnd-1) {
+      usleep(IMGDB_MCGAP);
+    }
+  }
+  delete[] fecdata;
+
+  pktsize = mss > sizeof(iqry_t) ? mss : sizeof(iqry_t);
+  pkt = new unsigned char[pktsize];
+  resent = new unsigned char[nsegs ? nsegs : 1];
+  nack = (ihdr_t *) pkt;
+  offsets = (unsigned int *) (pkt + sizeof(ihdr_t));
+  for (round = quiet = 0; quiet < IMGDB_MCQUIET && round < IMGDB_MCROUNDS; round++) {
+    hdr.ih_type = NETIMG_FIN;
+    hdr.ih_size = 0;
+    hdr.ih_seqn = htonl(NETIMG_FINSEQ);
+    sendto(sd, &hdr, sizeof(ihdr_t), 0, (struct sockaddr *) &group, sizeof(struct sockaddr_in));
+    memset(resent, 0, nsegs);  // each at most once per round
+    nacked = 0;
+    gettimeofday(&start, NULL);
+    while ((wait = IMGDB_MCRTO*1000L - imgdb_elapsed(&start)) > 0) {
+      FD_ZERO(&imgdb_fd_set);
+      FD_SET(sd, &imgdb_fd_set);
+      tv.tv_sec = wait/1000000;
+      tv.tv_usec = wait%1000000;
+      if (select(sd+1, &imgdb_fd_set, NULL, NULL, &tv) <= 0) {
+        break;
+      }
+      fromlen = sizeof(struct sockaddr_in);
+      bytes = recvfrom(sd, pkt, pktsize, 0, (struct sockaddr *) &from, &fromlen);
+      if (bytes == sizeof(iqry_t) && ((iqry_t *) pkt)->iq_type == NETIMG_SYNQRY) {
+        setaside(&from, (iqry_t *) pkt);
+        continue;
+      }
+      if (bytes < (int) sizeof(ihdr_t) || nack->ih_vers != NETIMG_VERS
+          || nack->ih_type != NETIMG_NACK) {
+        continue;  // e.g., a member saying hello again
+      }
+      n = (bytes - sizeof(ihdr_t))/sizeof(unsigned int);
+      n = n > ntohs(nack->ih_size)/(int) sizeof(unsigned int) ?
+        ntohs(nack->ih_size)/sizeof(unsigned int) : n;
+      for (i = 0; i < n; i++) {
+        offset = ntohl(offsets[i]);
+        if (offset % datasize || offset >= imgsize || resent[offset/datasize]) {
+          continue;
+        }
+        resent[offset/datasize] = 1;
+        wirebytes += mcastseg(&mh, image, imgsize, offset, slotted);
+        repairs++;
+        if (++nacked % rwnd == 0) {
+          usleep(IMGDB_MCGAP);
+        }
+      }
+    }
+    quiet = nacked ? 0 : quiet+1;
+  }
+  delete[] resent;
+  delete[] pkt;
+
+  fprintf(stderr, "imgdb::sendmcast: %ld bytes to %d clients sent as %ld bytes, "
+          "%ld segments of them resent, %d FINs\n", imgsize, members, wirebytes, repairs, round);
+
+  return;
+}
+
+/*
+ * sendrle: serve query "iqry" with the RLE packets of the image file
+ * as they are, cut into slots, if it asks for NETIMG_RLE, for the
+ * whole image at full resolution, and the file is RLE encoded.
+ * The image is not decoded.
+ *
+ * Returns 1 if the query has been served, else 0.
+ */
+int imgdb::
+sendrle(iqry_t *iqry)
+{
+  imsg_t imsg;
+  rlecache_t *rle;
+  long size;
+
+  memset(&imsg, 0, sizeof(imsg_t));
+  if (!(iqry->iq_mode & NETIMG_RLE) || iqry->iq_format
+      || (iqry->iq_mode & (NETIMG_PROG|NETIMG_TILE|NETIMG_DCT|NETIMG_BC1))
+      || (iqry->iq_w && iqry->iq_h) || (iqry->iq_dispw && iqry->iq_disph)
+      || readrle(iqry->iq_name) != NETIMG_FOUND) {
+    return(0);
+  }
+
+  mss = (unsigned short) ntohs(iqry->iq_mss);
+  rwnd = iqry->iq_rwnd;
+  fwnd = iqry->iq_fwnd;
+  size = rleslots(mss - sizeof(ihdr_t) - NETIMG_UDPIP);
+  if (size <= 0) {
+    return(0);
+  }
+
+  rle = &curent->rle;
+  imsg.im_type = NETIMG_FOUND;
+  imsg.im_depth = rle->depth;
+  imsg.im_format = rle->format;
+  imsg.im_width = imsg.im_lvlw = rle->width;
+  imsg.im_height = imsg.im_lvlh = rle->height;
+  imsg.im_mode = NETIMG_RLE;
+  imsg.im_size = (unsigned int) size;
+  imsg.im_etag = etag(rle->slots, size, &imsg);
+  if (iqry->iq_etag && ntohl(iqry->iq_etag) == imsg.im_etag) {
+    imsg.im_type = NETIMG_NOTMOD;
+    sendimsg(&imsg);
+    return(1);
+  }
+  fprintf(stderr, "imgdb::sendrle: %ld bytes of RLE packets in %ld bytes of slots\n",
+          rle->streamsize, size);
+
+  if (!sendimsg(&imsg)) {
+    sendimg((char *) rle->slots, size, NULL, 1, NULL);
+  }
+
+  return(1);
+}
+
+/*
+ * prepare: find the image queried by "iqry" and get the payload to
+ * send ready: the pyramid level and region asked for, coded in the
+ * transfer modes and format asked for, whichever apply.  Fills in
+ * "*imsg" to describe it, but for im_etag and im_size.  On return,
+ * "*image" points to the "*size" bytes of payload, and "*incache"
+ * says whether it was cut from a payload held in the image cache.
+ * The payload is kept in imgdb::prep: a query for the same, e.g., from
+ * a burst of clients after a popular image, is given it as it is,
+ * with its etag(), parity() and compressed segments, however it was
+ * arrived at.
+ *
+ * Returns NETIMG_FOUND, or the NETIMG error code to reply with.
+ */
+char imgdb::
+prepare(iqry_t *iqry, imsg_t *imsg, unsigned char **payload, long *size, bool *incache)
+{
+  double imgsize_d;
+  unsigned char *image;
+  int l;
+  dctcache_t *dc;
+  bccache_t *bc;
+  fmtcache_t *fc;
+  long slotsize;
+  bool cached;
+
+  imsg->im_type = readimg(iqry->iq_name, 1);
+  if (imsg->im_type != NETIMG_FOUND) {
+    return(imsg->im_type);
+  }
+
+  mss = (unsigned short) ntohs(iqry->iq_mss);
+  // Lab6 and PA3:
+  rwnd = iqry->iq_rwnd;
+  fwnd = iqry->iq_fwnd;
+
+  if (prep.ent == curent && prep.since == curent->since && imgdb_samekey(iqry, &prep.key)) {
+    // asked for again, e.g., in a burst of queries for a popular
+    // image: all of it is still here, as is what was derived from it
+    *imsg = prep.imsg;
+    *payload = prep.payload;
+    *size = prep.size;
+    *incache = prep.incache;
+    return(NETIMG_FOUND);
+  }
+  prep.ent = NULL;      // the buffers it points into are about to
+  xzc.payload = NULL;   // change, and so what was derived from them
+
+  imgsize_d = marshall_imsg(imsg);
+  image = curimg->GetPixels();
+  if (iqry->iq_mode & NETIMG_TILE) {
+    buildpyr();
+    l = iqry->iq_level < curent->nlvls ? iqry->iq_level : curent->nlvls-1;
+    imsg->im_mode |= NETIMG_TILE;
+  } else if (iqry->iq_dispw && iqry->iq_disph) {
+    l = pyrlevel(ntohs(iqry->iq_dispw), ntohs(iqry->iq_disph));
+  } else {
+    l = 0;
+  }
+  if (l) {
+    image = curent->lvl[l];
+    imsg->im_level = l;
+    imsg->im_width = imsg->im_lvlw = curent->lvlw[l];
+    imsg->im_height = imsg->im_lvlh = curent->lvlh[l];
+    imgsize_d = (double) imsg->im_width*imsg->im_height*imsg->im_depth;
+  }
+  if (iqry->iq_w && iqry->iq_h) {
+    imsg->im_type = cropimg(iqry, imsg, &image);
+    imgsize_d = (double) imsg->im_width*imsg->im_height*imsg->im_depth;
+  }
+  net_assert((imgsize_d > (double) LONG_MAX), "imgdb: image too big");
+  // payload held in the cache, so worth keeping its codings too
+  cached = image == curimg->GetPixels() || (curent->nlvls && image == curent->lvl[l]);
+  if (imsg->im_type == NETIMG_FOUND && (iqry->iq_mode & NETIMG_DCT)
+      && !(iqry->iq_mode & NETIMG_TILE)) {
+    if (cached) {
+      dc = &curent->dc;
+    } else {
+      dc = &xdc;
+      xdc.payload = NULL;  // buffer reused, contents may have changed
+    }
+    slotsize = dctslots(dc, image, imsg, iqry->iq_quality);
+    if (slotsize > 0) {
+      fprintf(stderr, "imgdb::prepare: %ld bytes DCT coded at quality %d\n",
+              (long) imgsize_d, dc->quality);
+      image = dc->slots;
+      imgsize_d = (double) slotsize;
+      imsg->im_quality = dc->quality;
+      imsg->im_mode |= NETIMG_DCT;
+    }
+  }
+  if (imsg->im_type == NETIMG_FOUND && (iqry->iq_mode & NETIMG_BC1) && imsg->im_depth >= 3
+      && !(iqry->iq_mode & NETIMG_TILE) && !(imsg->im_mode & NETIMG_DCT)) {
+    bc = cached ? &curent->bc : &xbc;
+    if (!cached) {
+      xbc.payload = NULL;  // buffer reused, contents may have changed
+    }
+    image = bc1blocks(bc, image, imsg);
+    imgsize_d = (double) bc->size;
+    imsg->im_mode |= NETIMG_BC1;
+  }
+  // NETIMG_RGB565 and NETIMG_PAL8 are displayed converted, which
+  // Adam7 order and tiles don't provide for
+  if (imsg->im_type == NETIMG_FOUND && pixfmt_reducible(iqry->iq_format, imsg->im_format)
+      && !(imsg->im_mode & (NETIMG_DCT|NETIMG_BC1))
+      && (iqry->iq_format == NETIMG_GS || !(iqry->iq_mode & (NETIMG_PROG|NETIMG_TILE)))) {
+    fc = cached ? &curent->fc[iqry->iq_format] : &xfc;
+    if (!cached) {
+      xfc.payload = NULL;  // buffer reused, contents may have changed
+    }
+    image = reduce(fc, image, imsg, iqry->iq_format);
+    imgsize_d = (double) fc->size;
+  }
+  if (imsg->im_type == NETIMG_FOUND && (iqry->iq_mode & NETIMG_PROG)
+      && !(imsg->im_mode & (NETIMG_DCT|NETIMG_BC1))
+      && imsg->im_format != NETIMG_RGB565 && imsg->im_format != NETIMG_PAL8) {
+    if ((long) imgsize_d > progsize) {
+      progbuf = (unsigned char *) realloc(progbuf, (long) imgsize_d);
+      net_assert((progbuf == NULL), "imgdb::prepare: realloc");
+      progsize = (long) imgsize_d;
+    }
+    prog_reorder(progbuf, image, imsg->im_width, imsg->im_height, imsg->im_depth);
+    image = progbuf;
+    imsg->im_mode |= NETIMG_PROG;
+  }
+
+  *payload = image;
+  *size = (long) imgsize_d;
+  *incache = cached;
+  if (imsg->im_type == NETIMG_FOUND) {
+    prep.ent = curent;
+    prep.since = curent->since;
+    prep.key = *iqry;
+    prep.imsg = *imsg;
+    prep.payload = image;
+    prep.size = *size;
+    prep.incache = cached;
+    prep.tag = 0;
+    prep.pfwnd = 0;
+  }
+  return(imsg->im_type);
+}
+
+/*
+ * prepheld: whether the "size" bytes at "payload" are those last
+ * prepare()d, still held as they were.
+ */
+bool imgdb::
+prepheld(unsigned char *payload, long size)
+{
+  return(prep.ent && prep.ent->since == prep.since
+         && payload == prep.payload && size == prep.size);
+}
+
+/*
+ * parity: the FEC of the "nfec" segments of the current client's
+ * datasize at "offset" of the "size" bytes at "payload", if that is
+ * the payload last prepare()d.  Each is computed once and kept with
+ * it, for all clients sent the same payload in segments of the same
+ * size.
+ *
+ * Returns the FEC, datasize bytes, or NULL if "payload" isn't that one
+ * or "offset" doesn't start an FEC window.
+ */
+unsigned char *imgdb::
+parity(unsigned char *payload, long size, long offset, int nfec)
+{
+  long datasize, window, nwins, seg, segsize;
+  unsigned char *fec;
+
+  datasize = mss - sizeof(ihdr_t) - NETIMG_UDPIP;
+  window = nfec*datasize;
+  if (nfec < 1 || !prepheld(payload, size) || offset % window || offset >= size) {
+    return(NULL);
+  }
+  if (prep.pdatasize != datasize || prep.pfwnd != nfec) {
+    nwins = (size + window-1)/window;
+    prep.parity = (unsigned char *) realloc(prep.parity, nwins*datasize);
+    prep.pdone = (unsigned char *) realloc(prep.pdone, nwins);
+    net_assert((!prep.parity || !prep.pdone), "imgdb::parity: realloc");
+    memset(prep.pdone, 0, nwins);
+    prep.pdatasize = datasize;
+    prep.pfwnd = nfec;
+  }
+
+  fec = prep.parity + offset/window*datasize;
+  if (!prep.pdone[offset/window]) {
+    for (seg = offset; seg < size && seg < offset + window; seg += datasize) {
+      segsize = size - seg < datasize ? size - seg : datasize;
+      if (seg == offset) {
+        fec_init(fec, payload + seg, datasize, segsize);
+      } else {
+        fec_accum(fec, payload + seg, datasize, segsize);
+      }
+    }
+    prep.pdone[offset/window] = 1;
+  }
+
+  return(fec);
+}
+
 /*
  * handleqry: receives a query packet, searches
  * for the queried image, and replies to client.
@@ -572,27 +2597,86 @@ handleqry()
 {
   iqry_t iqry;
   imsg_t imsg;
-  double imgsize_d;
+  unsigned char *image;
+  long size;
+  zcache_t *zc;
+  unsigned char *unchanged;
+  bool cached, mcast;
+  long start, end;
 
+  memset(&imsg, 0, sizeof(imsg_t));
   imsg.im_type = recvqry(&iqry);
-  if (imsg.im_type) {
+  if (!imsg.im_type) {
+    recvhash(&iqry);  // they follow the query
+  }
+  mcast = !imsg.im_type && mcastqry(&iqry);
+  if (imsg.im_type == NETIMG_ACK) {
+    return;
+  } else if (imsg.im_type) {
     fprintf(stderr, "imgdb::handleqry: recvqry returns 0x%x.\n", imsg.im_type);
     sendimsg(&imsg);
-  } else {
+  } else if ((iqry.iq_mode & NETIMG_RANGE) || !sendrle(&iqry)) {
     
-    imsg.im_type = readimg(iqry.iq_name, 1);
+    imsg.im_type = prepare(&iqry, &imsg, &image, &size, &cached);
     
     if (imsg.im_type == NETIMG_FOUND) {
-      mss = (unsigned short) ntohs(iqry.iq_mss);
-      // Lab6 and PA3:
-      rwnd = iqry.iq_rwnd;
-      fwnd = iqry.iq_fwnd;
-
-      imgsize_d = marshall_imsg(&imsg);
-      net_assert((imgsize_d > (double) LONG_MAX), "imgdb: image too big");
-      if (!sendimsg(&imsg)) {  // if imsg sent and ACKed successfully
-        sendimg((char *) curimg.GetPixels(), (long)imgsize_d);
+      // NETIMG_RANGE: one stripe of the payload, see netimg.h
+      start = 0;
+      end = size;
+      if (iqry.iq_mode & NETIMG_RANGE) {
+        start = ntohl(iqry.iq_start);
+        end = ntohl(iqry.iq_end) < size ? ntohl(iqry.iq_end) : size;
+        if (start >= end || start % (mss - sizeof(ihdr_t) - NETIMG_UDPIP)) {
+          imsg.im_type = NETIMG_ESIZE;
+          sendimsg(&imsg);
+          return;
+        }
+        imsg.im_mode |= NETIMG_RANGE;
+      }
+      zc = NULL;
+      if ((iqry.iq_mode & NETIMG_Z) && !(imsg.im_mode & (NETIMG_DCT|NETIMG_BC1|NETIMG_RANGE))) {
+        if (cached) {
+          zc = &curent->zc;
+        } else {
+          zc = &xzc;  // emptied by prepare() if not for this payload
+        }
+        zprepare(zc, image, size, imsg.im_depth, NETIMG_ZROWSIZE(&imsg));
+        imsg.im_mode |= NETIMG_Z;
       }
+      // the client may have it cached already
+      imsg.im_etag = etag(image, size, &imsg);
+      if (iqry.iq_etag && ntohl(iqry.iq_etag) == imsg.im_etag) {
+        fprintf(stderr, "imgdb::handleqry: %s not modified\n", iqry.iq_name);
+        imsg.im_type = NETIMG_NOTMOD;
+      }
+      // NETIMG_DELTA needs the payload as the client's raster copy
+      unchanged = NULL;
+      if (imsg.im_type == NETIMG_FOUND && nhash
+          && !(imsg.im_mode & (NETIMG_PROG|NETIMG_DCT|NETIMG_BC1|NETIMG_RANGE))
+          && imsg.im_format != NETIMG_RGB565 && imsg.im_format != NETIMG_PAL8) {
+        unchanged = deltasegs(image, size, &imsg);
+        if (unchanged) {
+          imsg.im_mode |= NETIMG_DELTA;
+        }
+      }
+      imsg.im_size = (unsigned int) size;
+      if (imsg.im_type == NETIMG_FOUND && iqry.iq_nflows > 1 && !zc && !unchanged
+          && !(imsg.im_mode & NETIMG_RANGE) && !mcast) {
+        flowinit(&imsg, iqry.iq_nflows);
+      }
+      if (imsg.im_type != NETIMG_FOUND) {
+        sendimsg(&imsg);
+      } else if (mcast) {
+        sendmcast((char *) image, size, imsg.im_mode & NETIMG_SLOTS, &iqry, &imsg);
+      } else if (!sendimsg(&imsg)) {  // if imsg sent and ACKed successfully
+        if (nflows) {
+          sendflows((char *) image, size, imsg.im_mode & NETIMG_SLOTS);
+        } else {
+          sendimg((char *) image + start, end - start, zc, imsg.im_mode & NETIMG_SLOTS,
+                  unchanged);
+        }
+      }
+      flowclose();
     } else {
       sendimsg(&imsg);
     }
@@ -601,26 +2685,251 @@ handleqry()
   return;
 }
 
-int
-main(int argc, char *argv[])
-{ 
-  socks_init();
+#ifdef __linux__
+/*
+ * publish: put the "size" bytes of "payload" described by "imsg" in
+ * shared memory for a local client to map.  The last payload
+ * published of curent is kept, so asking for it again costs nothing.
+ *
+ * Returns the sealed memfd holding the payload, or -1 on error.
+ */
+int imgdb::
+publish(unsigned char *payload, long size, imsg_t *imsg)
+{
+  shmcache_t *shm = &curent->shm;
+  long done;
+  ssize_t bytes;
+  int fd;
+
+  if (shm->size == size && shm->etag == imsg->im_etag) {
+    return(shm->fd);
+  }
+
+  fd = memfd_create("imgdb", MFD_CLOEXEC|MFD_ALLOW_SEALING);
+  if (fd < 0) {
+    perror("imgdb::publish: memfd_create");
+    return(-1);
+  }
+  for (done = 0; done < size; done += bytes) {
+    bytes = write(fd, payload + done, size - done);
+    if (bytes <= 0) {
+      perror("imgdb::publish: write");
+      close(fd);
+      return(-1);
+    }
+  }
+  // clients may hold on to it, it mustn't change under them
+  if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK|F_SEAL_GROW|F_SEAL_WRITE|F_SEAL_SEAL) < 0) {
+    perror("imgdb::publish: F_ADD_SEALS");
+  }
+
+  if (shm->size) {
+    close(shm->fd);
+  }
+  shm->fd = fd;
+  shm->size = size;
+  shm->etag = imsg->im_etag;
+  fprintf(stderr, "imgdb::publish: %ld bytes of %s\n", size, curent->name);
+
+  return(fd);
+}
+
+/*
+ * imgdb_checkqry: check query "iqry" of "bytes" bytes received on a
+ * connection, as recvqry() does for those received over UDP.
+ *
+ * Returns the NETIMG error code to reply with, else 0.
+ */
+static char
+imgdb_checkqry(iqry_t *iqry, int bytes)
+{
+  if (bytes != sizeof(iqry_t)) {
+    return(NETIMG_ESIZE);
+  } else if (iqry->iq_vers != NETIMG_VERS) {
+    return(NETIMG_EVERS);
+  } else if (iqry->iq_type != NETIMG_SYNQRY) {
+    return(NETIMG_ETYPE);
+  } else if (strnlen(iqry->iq_name, NETIMG_MAXFNAME) >= NETIMG_MAXFNAME) {
+    return(NETIMG_ENAME);
+  }
+  return(0);
+}
+
+/*
+ * handlelocal: accepts a client on the same host at imgdb::lsd and
+ * serves its query.  Query and reply are as over UDP, but instead of
+ * being sent, the payload is published in shared memory and its
+ * memfd passed along with the imsg_t.  There is nothing to ACK.
+ */
+void imgdb::
+handlelocal()
+{
+  iqry_t iqry;
+  imsg_t imsg;
+  unsigned char *image;
+  long size;
+  bool cached;
+  int csd, bytes, fd = -1;
+  char type;
+
+  csd = accept(lsd, NULL, NULL);
+  if (csd < 0) {
+    perror("imgdb::handlelocal: accept");
+    return;
+  }
+  setsockopt(csd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(struct timeval));
+
+  memset(&imsg, 0, sizeof(imsg_t));
+  bytes = recv(csd, &iqry, sizeof(iqry_t), 0);
+  imsg.im_type = imgdb_checkqry(&iqry, bytes);
+  if (!imsg.im_type) {
+    // the payload goes whole, not cut into segments
+    iqry.iq_mode &= ~(NETIMG_Z|NETIMG_RLE|NETIMG_DELTA);
+    imsg.im_type = prepare(&iqry, &imsg, &image, &size, &cached);
+    if (imsg.im_type == NETIMG_FOUND) {
+      imsg.im_etag = etag(image, size, &imsg);
+      imsg.im_size = (unsigned int) size;
+      fd = publish(image, size, &imsg);
+      if (fd < 0) {
+        imsg.im_type = NETIMG_ERROR;
+      }
+    }
+  }
+
+  type = imsg.im_type;
+  imgdb_htonimsg(&imsg);
+  if (socks_sendfd(csd, &imsg, sizeof(imsg_t), type == NETIMG_FOUND ? fd : -1) < 0) {
+    perror("imgdb::handlelocal: sendmsg");
+  }
+  close(csd);
 
-  imgdb imgdb;
-  // parse args, see the comments for imgdb::args()
-  if (imgdb.args(argc, argv)) {
-    fprintf(stderr, "Usage: %s [ -d <prob> ]\n",
-            argv[0]); 
-    exit(1);
+  return;
+}
+
+/*
+ * handletcp: accepts a client at imgdb::tsd and serves its query.
+ * Query and reply are as over UDP, but the payload follows the
+ * imsg_t on the connection as is, leaving reliable delivery to TCP.
+ * It is published as for local clients and sent from the memfd with
+ * sendfile(), so it isn't copied through user space.  The connection
+ * is corked so that the imsg_t goes out with the first of the
+ * payload.  It is closed once all is sent, or once the client has
+ * taken none of it for NETIMG_MAXTRIES RTOs, lest it hold up the
+ * others.
+ */
+void imgdb::
+handletcp()
+{
+  iqry_t iqry;
+  imsg_t imsg;
+  unsigned char *image;
+  long size = 0;
+  bool cached;
+  int csd, bytes, fd = -1, on = 1, off = 0, stall;
+  struct pollfd pfd;
+  off_t offset;
+  ssize_t sent;
+  char type;
+
+  csd = accept(tsd, NULL, NULL);
+  if (csd < 0) {
+    perror("imgdb::handletcp: accept");
+    return;
   }
+  setsockopt(csd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(struct timeval));
+
+  memset(&imsg, 0, sizeof(imsg_t));
+  bytes = recv(csd, &iqry, sizeof(iqry_t), MSG_WAITALL);
+  imsg.im_type = imgdb_checkqry(&iqry, bytes);
+  if (!imsg.im_type) {
+    // the payload goes whole, not cut into segments
+    iqry.iq_mode &= ~(NETIMG_Z|NETIMG_RLE|NETIMG_DELTA);
+    imsg.im_type = prepare(&iqry, &imsg, &image, &size, &cached);
+    if (imsg.im_type == NETIMG_FOUND) {
+      imsg.im_etag = etag(image, size, &imsg);
+      imsg.im_size = (unsigned int) size;
+      if (iqry.iq_etag && ntohl(iqry.iq_etag) == imsg.im_etag) {
+        fprintf(stderr, "imgdb::handletcp: %s not modified\n", iqry.iq_name);
+        imsg.im_type = NETIMG_NOTMOD;
+      } else if ((fd = publish(image, size, &imsg)) < 0) {
+        imsg.im_type = NETIMG_ERROR;
+      }
+    }
+  }
+
+  type = imsg.im_type;
+  imgdb_htonimsg(&imsg);
+  setsockopt(csd, IPPROTO_TCP, TCP_CORK, &on, sizeof(int));
+  if (send(csd, &imsg, sizeof(imsg_t), 0) != sizeof(imsg_t)) {
+    perror("imgdb::handletcp: send");
+  } else if (type == NETIMG_FOUND) {
+    // a client taking none of the payload for NETIMG_MAXTRIES RTOs
+    // is given up on
+    fcntl(csd, F_SETFL, fcntl(csd, F_GETFL) | O_NONBLOCK);
+    stall = NETIMG_MAXTRIES*(timeout.tv_sec*1000 + timeout.tv_usec/1000);
+    pfd.fd = csd;
+    pfd.events = POLLOUT;
+    for (offset = 0; offset < size; ) {
+      sent = sendfile(csd, fd, &offset, size - offset);
+      if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        if (poll(&pfd, 1, stall) <= 0) {
+          fprintf(stderr, "imgdb::handletcp: client stalled, giving up\n");
+          break;
+        }
+      } else if (sent <= 0) {
+        perror("imgdb::handletcp: sendfile");
+        break;
+      }
+    }
+    fprintf(stderr, "imgdb::handletcp: %ld of %ld bytes sent\n", (long) offset, size);
+  }
+  setsockopt(csd, IPPROTO_TCP, TCP_CORK, &off, sizeof(int));
+  close(csd);
+
+  return;
+}
+
+#endif // __linux__
+
+/*
+ * serve: answer queries forever, over UDP and, if set up with args(),
+ * from local and TCP clients, one at a time.  Queries set aside by
+ * recvack() are answered before any new ones.
+ */
+void imgdb::
+serve()
+{
+  fd_set rset;
+  int maxsd;
 
   while (1) {
-    imgdb.handleqry();
+    if (!npending && (lsd >= 0 || tsd >= 0)) {
+      FD_ZERO(&rset);
+      FD_SET(sd, &rset);
+      maxsd = sd;
+      if (lsd >= 0) {
+        FD_SET(lsd, &rset);
+        maxsd = max(maxsd, lsd);
+      }
+      if (tsd >= 0) {
+        FD_SET(tsd, &rset);
+        maxsd = max(maxsd, tsd);
+      }
+      if (select(maxsd+1, &rset, NULL, NULL, NULL) < 0) {
+        continue;
+      }
+#ifdef __linux__
+      if (lsd >= 0 && FD_ISSET(lsd, &rset)) {
+        handlelocal();
+      }
+      if (tsd >= 0 && FD_ISSET(tsd, &rset)) {
+        handletcp();
+      }
+#endif // __linux__
+      if (!FD_ISSET(sd, &rset)) {
+        continue;
+      }
+    }
+    handleqry();
   }
-    
-#ifdef _WIN32
-  WSACleanup();
-#endif // _WIN32
-  
-  exit(0);
 }
@@ -23,13 +23,165 @@
 #include "ltga.h"
 #include "socks.h"
 #include "netimg.h"
+#include "uring.h"
+#include "imgsrc.h"
 
 #ifdef _WIN32
 #define IMGDB_DIRSEP "\\"
 #else
 #define IMGDB_DIRSEP "/"
 #endif
-#define IMGDB_FOLDER    "."
+#define IMGDB_FOLDER    "."    // of fsimgsrc, unless set with -f
+#define IMGDB_CACHESZ   8      // decoded images kept in memory
+#define IMGDB_MAXHASH   65536  // NETIMG_DELTA: segment hashes taken
+#define IMGDB_PENDING   256    // queries set aside while serving
+                               // another client, at most
+#define IMGDB_ZCMIN     4096   // smallest segment sent MSG_ZEROCOPY
+#define IMGDB_URSLOTS   512    // io_uring sends in flight, at most
+#define IMGDB_URBUFS    256    // io_uring buffers provided for ACKs
+#define IMGDB_URBUFSZ   512    // bytes each, room for an iqry_t and
+                               // its sender after struct
+                               // io_uring_recvmsg_out
+#define IMGDB_MCPORTS   16     // multicast: ports of the group taken
+                               // in turn, one per transfer
+#define IMGDB_MCFWND    4      // segments per FEC packet sent to it
+#define IMGDB_MCGATHER  100    // ms to wait for others asking for the
+                               // same image, once one has
+#define IMGDB_MCGAP     2000   // us to wait after each rwnd segments
+#define IMGDB_MCRTO     100    // ms between FINs, for NACKs
+#define IMGDB_MCQUIET   3      // FINs without NACKs till done,
+#define IMGDB_MCROUNDS  100    // or this many FINs in all
+#define IMGDB_URRECV    (~0ULL)    // user_data of the ACK receive,
+#define IMGDB_URTIMER   (~0ULL-1)  // of the RTO timer,
+#define IMGDB_URCANCEL  (~0ULL-2)  // and of their cancellations;
+                                   // that of a send is its slot
+
+typedef struct {               // NETIMG_DATA_Z segments of one payload
+  unsigned char *payload;      // bytes compressed, NULL if none yet
+  long size;                   // of payload
+  int datasize;                // segment size the payload is cut into
+  int depth;                   // zseg_encode() predictor parameters
+  int rowsize;
+  unsigned char *zsegs;        // segment i compressed at zsegs+i*datasize
+  int *zlen;                   // compressed sizes, 0 if not compressed
+                               // yet, -1 if not worth compressing
+} zcache_t;
+
+typedef struct {               // NETIMG_RLE: the file's own RLE packets
+  unsigned char *stream;       // as read from the file, NULL if not read
+  long streamsize;             // -1 if the file is not RLE encoded
+  unsigned short width, height;
+  unsigned char depth, format; // as in imsg_t
+  unsigned char *slots;        // stream cut into slots, see rle_slots()
+  long size;                   // of slots, -1 if it can't be cut
+  int datasize;                // slot size, 0 if not cut yet
+} rlecache_t;
+
+typedef struct {               // NETIMG_DCT slots of one payload
+  unsigned char *payload;      // raster coded, NULL if none yet
+  unsigned short width, height;
+  unsigned char depth, quality;
+  int datasize;                // slot size
+  unsigned char *slots;        // see dct_slots()
+  long size;                   // of slots, -1 if it can't be cut
+} dctcache_t;
+
+typedef struct {               // NETIMG_BC1 blocks of one payload
+  unsigned char *payload;      // raster coded, NULL if none yet
+  unsigned short width, height;
+  unsigned char depth;
+  unsigned char *blocks;       // see bc1_encode()
+  long size;                   // of blocks
+} bccache_t;
+
+typedef struct {               // one reduced format of one payload
+  unsigned char *payload;      // raster reduced, NULL if none yet
+  unsigned short width, height;
+  unsigned char *pixels;       // see pixfmt_reduce()
+  long size;                   // of pixels
+} fmtcache_t;
+
+typedef struct {               // payload published for local clients
+  int fd;                      // memfd holding it, sealed
+  long size;                   // of payload, 0 if none published
+  unsigned int etag;           // im_etag of payload
+} shmcache_t;
+
+typedef struct {               // a transfer's sender, see sendimg()
+  int sd;                      // socket sent on
+  struct sockaddr_in client;   // sent to
+  unsigned short mss;          // the client's, see imgdb
+  unsigned char rwnd;
+  unsigned char fwnd;
+  struct timeval timeout;
+  float pdrop;
+  bool flow;                   // one of several flows, see sendflows()
+} sender_t;
+
+class imgdb;
+
+typedef struct {               // one flow of a multi-flow transfer,
+                               // see sendflows()
+  imgdb *db;                   // sending it
+  sender_t snd;                // on a socket of its own
+  char *buf;                   // its copy: the segments it carries,
+  long size;                   // back to back, this many bytes,
+  int slotted;                 // slotted or not, see sendimg()
+} flow_t;
+
+typedef struct {               // query of another client, see recvack()
+  struct sockaddr_in from;
+  iqry_t iqry;
+} pendqry_t;
+
+#ifdef __linux__
+typedef struct {               // one send in flight on imgdb::ur
+  ihdr_t hdr;
+  struct iovec iov[NETIMG_NUMIOV];
+  struct msghdr mh;
+  unsigned char *copy;         // of the FEC data sent, which is reused
+  int zcflag;                  // MSG_ZEROCOPY or 0
+  bool busy;                   // until its completion is reaped
+} urslot_t;
+#endif // __linux__
+
+typedef struct {
+  char name[NETIMG_MAXFNAME];  // empty if the entry is unused
+  long version;                // imgsrc::stamp() of the image loaded
+  unsigned long used;          // imgdb::clock at last use, for LRU
+  unsigned long since;         // and when given to name, see prepmemo_t
+  LTGA *img;                   // full resolution image, NULL if
+                               // only served NETIMG_RLE so far
+  int nlvls;                   // pyramid levels computed, 0 if not yet
+  unsigned short lvlw[NETIMG_MAXLVL];
+  unsigned short lvlh[NETIMG_MAXLVL];
+  unsigned char *lvl[NETIMG_MAXLVL];  // lvl[0] is img->GetPixels()
+  zcache_t zc;                 // compressed segments of one of the levels
+  rlecache_t rle;
+  dctcache_t dc;               // DCT coded slots of one of the levels
+  bccache_t bc;                // BC1 blocks of one of the levels
+  fmtcache_t fc[NETIMG_PAL8+1];  // reduced formats of one of the
+                                 // levels, indexed by format
+  shmcache_t shm;              // last payload of the image published
+} imgent_t;
+
+typedef struct {               // last payload prepare()d, and what is
+                               // derived from it, for the next query
+                               // asking for the same, see prepare()
+  imgent_t *ent;               // cut from this cache entry, NULL if
+  unsigned long since;         // none, as held since then
+  iqry_t key;                  // for this query,
+  imsg_t imsg;                 // and described so
+  unsigned char *payload;
+  long size;
+  bool incache;                // see prepare()
+  unsigned int tag;            // its etag(), 0 if not taken yet,
+  unsigned char tagmode;       // for these modes
+  int pdatasize;               // FEC of each window of pfwnd segments
+  int pfwnd;                   // of pdatasize bytes, 0 if none yet,
+  unsigned char *parity;       // see parity(), if pdone
+  unsigned char *pdone;
+} prepmemo_t;
 
 class imgdb {
   struct sockaddr_in self;
@@ -42,34 +194,170 @@ class imgdb {
   unsigned char rwnd;  // receiver's window, in packets, each of size <= mss
   unsigned char fwnd;  // receiver's FEC window, in packets
 
-  LTGA curimg;
+  fsimgsrc fssrc;         // IMGDB_FOLDER
+  imgsrc *src;            // where images come from, fssrc by default
+  imgent_t cache[IMGDB_CACHESZ];
+  unsigned long clock;    // counts cache lookups
+  imgent_t *curent;       // cache entry of the image being served
+  LTGA *curimg;           // curent->img
+  zcache_t xzc;           // compressed segments of a payload that is
+                          // not kept in the cache, e.g., a region
+  dctcache_t xdc;         // likewise for NETIMG_DCT
+  bccache_t xbc;          // and NETIMG_BC1
+  fmtcache_t xfc;         // and reduced formats
+  prepmemo_t prep;        // last payload prepared
+  unsigned char *roibuf;  // rows of a region of interest, if any
+  long roisize;           // bytes allocated to roibuf
+  unsigned char *progbuf; // NETIMG_PROG: image in Adam7 pass order
+  long progsize;          // bytes allocated to progbuf
+  unsigned int nhash;     // NETIMG_DELTA: segment hashes of the
+  unsigned char *hashes;  // client's copy, SEGHASH_LEN bytes each,
+  unsigned char *same;    // whether each arrived, then whether its
+                          // segment is unchanged, see deltasegs()
+  pendqry_t *pending;     // IMGDB_PENDING queries set aside,
+  int npending;           // oldest first, this many
+  bool zerocopy;          // send segments MSG_ZEROCOPY, see zcreap(),
+                          // never set but on Linux
+  unsigned int zcsent;    // segments so sent on sd, ever
+  unsigned int zcdone;    // of which completed
+  unsigned int zccopied;  // of which the kernel copied after all
+  bool useuring;          // send windows and wait for ACKs on ur,
+                          // never set but on Linux
+#ifdef __linux__
+  uring_t ur;             // see urwait()
+  urslot_t *urslots;      // IMGDB_URSLOTS sends
+  int urnext;             // slot to try first
+  int urbusy;             // slots in flight
+  struct io_uring_sqe *urlink;  // last send queued, linked to the next
+  struct io_uring_buf_ring *urbr;  // IMGDB_URBUFS buffers for ACKs
+  unsigned char *urbufs;  // of IMGDB_URBUFSZ bytes each
+  struct msghdr urmh;     // of the multishot ACK receive
+  bool urrecv;            // multishot ACK receive armed
+  bool urtimer;           // RTO timer armed
+  bool uracked;           // an ACK arrived since the timer was armed
+  bool urfired;           // the timer expired without any
+  struct __kernel_timespec urts;  // RTO
+  unsigned int urack;     // largest ACK received
+  int uracks;             // ACKs received not yet taken by urwait()
+#endif // __linux__
+  flow_t flows[NETIMG_MAXFLOWS];  // of a multi-flow transfer, see
+  int nflows;             // sendflows(), this many
+  struct sockaddr_in mcgroup;  // multicast group and its first port,
+                               // sin_port 0 if none, see sendmcast()
+  unsigned int mcsent;    // multicast transfers, picks the port
 
+  char findent(char *imgname);
   char readimg(char *imgname, int verbose);
+  char readrle(char *imgname);
+  long rleslots(int datasize);
+  long dctslots(dctcache_t *dc, unsigned char *payload, imsg_t *imsg, int quality);
+  unsigned char *bc1blocks(bccache_t *bc, unsigned char *payload, imsg_t *imsg);
+  unsigned char *reduce(fmtcache_t *fc, unsigned char *payload, imsg_t *imsg, int format);
+  void clearent(imgent_t *ent);
+  void zprepare(zcache_t *zc, unsigned char *payload, long size, int depth, int rowsize);
+  int zsegment(zcache_t *zc, long offset, int segsize, unsigned char **zdata);
+  void buildpyr();
+  int pyrlevel(unsigned short dispw, unsigned short disph);
+  char cropimg(iqry_t *iqry, imsg_t *imsg, unsigned char **image);
+  char prepare(iqry_t *iqry, imsg_t *imsg, unsigned char **payload, long *size,
+               bool *incache);
+  bool prepheld(unsigned char *payload, long size);
+  unsigned char *parity(unsigned char *payload, long size, long offset, int nfec);
 
   char recvqry(iqry_t *iqry);
+  int recvack(sender_t *snd, ihdr_t *ack, int flags);
+  unsigned int recvhash(iqry_t *iqry);
+  unsigned char *deltasegs(unsigned char *payload, long size, imsg_t *imsg);
+  unsigned int etag(unsigned char *payload, long size, imsg_t *imsg);
   double marshall_imsg(imsg_t *imsg);
-  int sendpkt(char *pkt, int size, unsigned int ackseqn, int all);
+  void sendinit(sender_t *snd, int s);
+  int sendpkt(sender_t *snd, char *pkt, int size, unsigned int ackseqn, int all);
   int sendimsg(imsg_t *imsg);
+  int sendrle(iqry_t *iqry);
+#ifdef __linux__
+  int publish(unsigned char *payload, long size, imsg_t *imsg);
+  void zcreap(int wait);
+  int urinit();
+  struct io_uring_sqe *ursqe();
+  int urflush(unsigned wait);
+  void ursend(urslot_t *slot);
+  void urqueue(struct msghdr *mh, int copy, int zcflag);
+  void urreap();
+  int urwait();
+  void urdrain();
+#endif // __linux__
+  int flowinit(imsg_t *imsg, int n);
+  void sendflows(char *image, long imgsize, int slotted);
+  static void *sendflow(void *arg);
+  void flowclose();
+  void sendimg(sender_t *snd, char *image, long imgsize, zcache_t *zc, int slotted,
+               unsigned char *same);
+  int mcastqry(iqry_t *iqry);
+  int mcastgather(iqry_t *iqry, imsg_t *imsg);
+  long mcastseg(struct msghdr *mh, char *image, long imgsize, long offset, int slotted);
+  void sendmcast(char *image, long imgsize, int slotted, iqry_t *iqry, imsg_t *imsg);
+  void setaside(struct sockaddr_in *from, iqry_t *iqry);
 
 public:
   int sd;  // image socket
+  int lsd; // local clients' listening socket, -1 if none,
+  int tsd; // TCP clients' listening socket, -1 if none, both
+           // never set up but on Linux
   struct timeval timeout;
   fd_set imgdb_fd_set;
 
-  imgdb() { // default constructor
+  imgdb() : fssrc(IMGDB_FOLDER) { // default constructor
+    src = &fssrc;
     pdrop = NETIMG_PDROP;
     timeout.tv_sec = NETIMG_SLEEP;
     timeout.tv_usec = NETIMG_USLEEP;
+    roibuf = NULL;
+    roisize = 0;
+    progbuf = NULL;
+    progsize = 0;
+    nhash = 0;
+    hashes = NULL;
+    same = NULL;
+    pending = (pendqry_t *) malloc(IMGDB_PENDING*sizeof(pendqry_t));
+    npending = 0;
+    zerocopy = false;
+    zcsent = zcdone = zccopied = 0;
+    useuring = false;
+#ifdef __linux__
+    ur.fd = -1;
+    urslots = NULL;
+    urbufs = NULL;
+#endif // __linux__
+    nflows = 0;
+    memset(&mcgroup, 0, sizeof(struct sockaddr_in));
+    mcsent = 0;
+    memset(cache, 0, sizeof(cache));
+    clock = 0;
+    curent = NULL;
+    curimg = NULL;
+    memset(&xzc, 0, sizeof(zcache_t));
+    memset(&xdc, 0, sizeof(dctcache_t));
+    memset(&xbc, 0, sizeof(bccache_t));
+    memset(&xfc, 0, sizeof(fmtcache_t));
+    memset(&prep, 0, sizeof(prepmemo_t));
 
-
+    lsd = -1;
+    tsd = -1;
     sd = socks_servinit((char *) "imgdb", &self, sname); // Task 1
   }
 
   int args(int argc, char *argv[]);
+  void setsrc(imgsrc *_src);
+  void serve();
 
   // image query-reply
   void handleqry();
-  void sendimg(char *image, long imgsize);
+#ifdef __linux__
+  void handlelocal();
+  void handletcp();
+#endif // __linux__
+  void sendimg(char *image, long imgsize, zcache_t *zc, int slotted,
+               unsigned char *same);
 };  
 
 #endif /* __IMGDB_H__ */
@@ -0,0 +1,342 @@
+/*
+ * Copyright (c) 2016 University of Michigan, Ann Arbor.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms are permitted
+ * provided that the above copyright notice and this paragraph are
+ * duplicated in all such forms and that any documentation,
+ * advertising materials, and other materials related to such
+ * distribution and use acknowledge that the software was developed
+ * by the University of Michigan, Ann Arbor. The name of the University
+ * may not be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * Author: Sugih Jamin (jamin@eecs.umich.edu)
+ *
+*/
+#include <stdio.h>         // fopen(), fread(), fwrite()
+#include <stdlib.h>        // malloc(), realloc(), free()
+#include <assert.h>        // assert()
+#include <string.h>        // strcmp(), strncpy(), memset()
+#include <fcntl.h>         // open()
+#include <unistd.h>        // close()
+#include <sys/stat.h>      // stat()
+#include <sys/mman.h>      // mmap()
+#include <string>
+
+#include "imgsrc.h"
+
+#ifdef _WIN32
+#define IMGSRC_DIRSEP "\\"
+#else
+#define IMGSRC_DIRSEP "/"
+#endif
+
+/*
+ * fsimgsrc: "name" is a TGA file in "folder", its version is its
+ * modification time.
+ */
+int fsimgsrc::
+stamp(char *name, long *version)
+{
+  std::string pathname = std::string(folder)+IMGSRC_DIRSEP+name;
+  struct stat st;
+
+  if (stat(pathname.c_str(), &st)) {
+    return(-1);
+  }
+  *version = (long) st.st_mtime;
+
+  return(0);
+}
+
+LTGA *fsimgsrc::
+load(char *name)
+{
+  LTGA *img;
+
+  img = new LTGA();
+  if (!img->LoadFromFile(std::string(folder)+IMGSRC_DIRSEP+name)) {
+    delete img;
+    return(NULL);
+  }
+
+  return(img);
+}
+
+/*
+ * fsimgsrc::rle: read the packets following the header, and the image
+ * ID skipped, of an RLE encoded file, image types 10 and 11, as is.
+ */
+long fsimgsrc::
+rle(char *name, unsigned char *tgahdr, unsigned char **stream)
+{
+  std::string pathname = std::string(folder)+IMGSRC_DIRSEP+name;
+  FILE *fp;
+  long size;
+
+  fp = fopen(pathname.c_str(), "rb");
+  if (!fp) {
+    return(-1);
+  }
+  if (fread(tgahdr, 1, IMGSRC_TGAHDR, fp) != IMGSRC_TGAHDR
+      || (tgahdr[2] != 10 && tgahdr[2] != 11)
+      || fseek(fp, 0, SEEK_END) || (size = ftell(fp)) < 0
+      || (size -= IMGSRC_TGAHDR + tgahdr[0]) <= 0
+      || fseek(fp, IMGSRC_TGAHDR + tgahdr[0], SEEK_SET)) {
+    fclose(fp);
+    return(-1);
+  }
+
+  *stream = (unsigned char *) malloc(size);
+  if (!*stream || fread(*stream, 1, size, fp) != (size_t) size) {
+    free(*stream);
+    *stream = NULL;
+    fclose(fp);
+    return(-1);
+  }
+  fclose(fp);
+
+  return(size);
+}
+
+packimgsrc::
+~packimgsrc()
+{
+  if (map) {
+    munmap(map, mapsize);
+  }
+}
+
+/*
+ * packimgsrc::find: the entry of "name", mapping the pack in anew if
+ * it changed since, NULL if there is none.  Scanning stops at the
+ * first malformed entry.
+ */
+imgpack_t *packimgsrc::
+find(char *name)
+{
+  struct stat st;
+  imgpack_t *ent;
+  long off;
+  int fd;
+
+  if (stat(path, &st)) {
+    return(NULL);
+  }
+  if (!map || mtime != (long) st.st_mtime || mapsize != (long) st.st_size) {
+    if (map) {
+      munmap(map, mapsize);
+      map = NULL;
+    }
+    if ((fd = open(path, O_RDONLY)) < 0) {
+      return(NULL);
+    }
+    map = (unsigned char *) mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+      map = NULL;
+      return(NULL);
+    }
+    mapsize = (long) st.st_size;
+    mtime = (long) st.st_mtime;
+  }
+
+  for (off = 0; off + (long) sizeof(imgpack_t) <= mapsize;
+       off += sizeof(imgpack_t) + ent->ip_size) {
+    ent = (imgpack_t *) (map + off);
+    if (off + (long) sizeof(imgpack_t) + ent->ip_size > mapsize
+        || ent->ip_depth < 1 || ent->ip_depth > 4
+        || ent->ip_size != ent->ip_width*ent->ip_height*ent->ip_depth) {
+      break;
+    }
+    if (!strncmp(ent->ip_name, name, NETIMG_MAXFNAME)) {
+      return(ent);
+    }
+  }
+
+  return(NULL);
+}
+
+/*
+ * packimgsrc: the version of an image is that of the whole pack.
+ */
+int packimgsrc::
+stamp(char *name, long *version)
+{
+  if (!find(name)) {
+    return(-1);
+  }
+  *version = mtime;
+
+  return(0);
+}
+
+LTGA *packimgsrc::
+load(char *name)
+{
+  imgpack_t *ent;
+
+  ent = find(name);
+  if (!ent) {
+    return(NULL);
+  }
+
+  return(new LTGA(ent->ip_width, ent->ip_height, ent->ip_depth,
+                  (unsigned char *) (ent+1)));
+}
+
+/*
+ * packimgsrc::append: add "img" to the pack at "path" as "name",
+ * creating the pack if need be.
+ *
+ * Returns 0 on success, -1 on error.
+ */
+int packimgsrc::
+append(const char *path, const char *name, LTGA *img)
+{
+  imgpack_t ent;
+  FILE *fp;
+  int err;
+
+  memset(&ent, 0, sizeof(imgpack_t));
+  strncpy(ent.ip_name, name, NETIMG_MAXFNAME-1);
+  ent.ip_width = img->GetImageWidth();
+  ent.ip_height = img->GetImageHeight();
+  ent.ip_depth = img->GetPixelDepth()/8;
+  ent.ip_size = ent.ip_width*ent.ip_height*ent.ip_depth;
+
+  fp = fopen(path, "ab");
+  if (!fp) {
+    return(-1);
+  }
+  err = fwrite(&ent, sizeof(imgpack_t), 1, fp) != 1
+    || fwrite(img->GetPixels(), 1, ent.ip_size, fp) != ent.ip_size;
+
+  return(fclose(fp) || err ? -1 : 0);
+}
+
+memimgsrc::
+~memimgsrc()
+{
+  free(ents);
+}
+
+imgmem_t *memimgsrc::
+find(char *name)
+{
+  int i;
+
+  for (i = 0; i < nents; i++) {
+    if (!strcmp(ents[i].name, name)) {
+      return(&ents[i]);
+    }
+  }
+
+  return(NULL);
+}
+
+/*
+ * memimgsrc: the version of an image counts the add()s it was
+ * given with.
+ */
+int memimgsrc::
+stamp(char *name, long *version)
+{
+  imgmem_t *ent;
+
+  ent = find(name);
+  if (!ent) {
+    return(-1);
+  }
+  *version = ent->version;
+
+  return(0);
+}
+
+LTGA *memimgsrc::
+load(char *name)
+{
+  imgmem_t *ent;
+
+  ent = find(name);
+  if (!ent) {
+    return(NULL);
+  }
+
+  return(new LTGA(ent->width, ent->height, ent->depth, ent->pixels));
+}
+
+/*
+ * memimgsrc::add: serve "pixels", of "width" x "height" x "depth"
+ * bytes, as "name", in place of what was served so far, if anything.
+ */
+void memimgsrc::
+add(const char *name, unsigned short width, unsigned short height,
+    unsigned char depth, const unsigned char *pixels)
+{
+  imgmem_t *ent;
+
+  ent = find((char *) name);
+  if (!ent) {
+    ent = find((char *) "");
+  }
+  if (!ent) {
+    ents = (imgmem_t *) realloc(ents, (nents+1)*sizeof(imgmem_t));
+    net_assert((ents == NULL), "memimgsrc::add: realloc");
+    ent = &ents[nents++];
+  }
+  memset(ent, 0, sizeof(imgmem_t));
+  strncpy(ent->name, name, NETIMG_MAXFNAME-1);
+  ent->width = width;
+  ent->height = height;
+  ent->depth = depth;
+  ent->pixels = pixels;
+  ent->version = ++clock;
+
+  return;
+}
+
+void memimgsrc::
+remove(const char *name)
+{
+  imgmem_t *ent;
+
+  ent = find((char *) name);
+  if (ent) {
+    ent->name[0] = '\0';
+  }
+
+  return;
+}
+
+/*
+ * genimgsrc: every name may be there, load() has the last word.
+ */
+int genimgsrc::
+stamp(char *name, long *version)
+{
+  *version = 0;
+
+  return(0);
+}
+
+LTGA *genimgsrc::
+load(char *name)
+{
+  unsigned short width, height;
+  unsigned char depth, *pixels;
+  LTGA *img;
+
+  pixels = func(arg, name, &width, &height, &depth);
+  if (!pixels) {
+    return(NULL);
+  }
+  img = depth >= 1 && depth <= 4 ? new LTGA(width, height, depth, pixels) : NULL;
+  free(pixels);
+
+  return(img);
+}
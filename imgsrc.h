@@ -0,0 +1,121 @@
+/*
+ * Copyright (c) 2016 University of Michigan, Ann Arbor.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms are permitted
+ * provided that the above copyright notice and this paragraph are
+ * duplicated in all such forms and that any documentation,
+ * advertising materials, and other materials related to such
+ * distribution and use acknowledge that the software was developed
+ * by the University of Michigan, Ann Arbor. The name of the University
+ * may not be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * Author: Sugih Jamin (jamin@eecs.umich.edu)
+ *
+*/
+#ifndef __IMGSRC_H__
+#define __IMGSRC_H__
+
+#include "ltga.h"
+#include "netimg.h"
+
+#define IMGSRC_TGAHDR  18      // bytes of TGA file header
+
+// Where imgdb gets its images by name, see imgdb::setsrc().
+class imgsrc {
+public:
+  virtual ~imgsrc() {}
+  // 0 if "name" is there, with "*version" changing whenever its
+  // content does, -1 if not
+  virtual int stamp(char *name, long *version) = 0;
+  // the image decoded, the caller's to delete, NULL if it can't be
+  virtual LTGA *load(char *name) = 0;
+  // NETIMG_RLE: the TGA header and, in "*stream", malloc()ed, the RLE
+  // packets as stored, returning their size, or -1 if not RLE encoded
+  // or not held that way
+  virtual long rle(char *name, unsigned char *tgahdr, unsigned char **stream) {
+    return(-1); }
+};
+
+// TGA files in a folder, the default
+class fsimgsrc : public imgsrc {
+  const char *folder;
+public:
+  fsimgsrc(const char *_folder) { folder = _folder; }
+  int stamp(char *name, long *version);
+  LTGA *load(char *name);
+  long rle(char *name, unsigned char *tgahdr, unsigned char **stream);
+};
+
+// A pack file: images already decoded, one after the other, each an
+// imgpack_t followed by its pixels, laid out as LTGA::GetPixels()
+// returns them.  The whole file is mapped in once and reloaded when
+// it changes.  See packimgsrc::append() to make one.
+typedef struct {
+  char ip_name[NETIMG_MAXFNAME];  // NULL terminated
+  unsigned int ip_width;       // in host byte order
+  unsigned int ip_height;
+  unsigned int ip_depth;       // bytes per pixel, 1 to 4
+  unsigned int ip_size;        // bytes of pixels following
+} imgpack_t;
+
+class packimgsrc : public imgsrc {
+  const char *path;
+  unsigned char *map;          // the pack, NULL if not mapped
+  long mapsize;
+  long mtime;                  // of the pack mapped
+  imgpack_t *find(char *name);
+public:
+  packimgsrc(const char *_path) { path = _path; map = NULL; mapsize = 0; mtime = 0; }
+  ~packimgsrc();
+  int stamp(char *name, long *version);
+  LTGA *load(char *name);
+  static int append(const char *path, const char *name, LTGA *img);
+};
+
+// Images the caller holds in memory.  The pixels are not copied
+// until served, so they must stay put until replaced or removed.
+typedef struct {
+  char name[NETIMG_MAXFNAME];  // empty if the entry is unused
+  unsigned short width, height;
+  unsigned char depth;         // bytes per pixel, 1 to 4
+  const unsigned char *pixels;
+  long version;
+} imgmem_t;
+
+class memimgsrc : public imgsrc {
+  imgmem_t *ents;
+  int nents;
+  long clock;                  // counts add()s, for versions
+  imgmem_t *find(char *name);
+public:
+  memimgsrc() { ents = NULL; nents = 0; clock = 0; }
+  ~memimgsrc();
+  int stamp(char *name, long *version);
+  LTGA *load(char *name);
+  void add(const char *name, unsigned short width, unsigned short height,
+           unsigned char depth, const unsigned char *pixels);
+  void remove(const char *name);
+};
+
+// Images made up on request by "func", which fills in the size and
+// depth of image "name" and returns its pixels, malloc()ed, or NULL
+// if there is no such image.  They are made again only once evicted
+// from imgdb's cache, "version" is never changed.
+typedef unsigned char *(*imggen_t)(void *arg, char *name, unsigned short *width,
+                                   unsigned short *height, unsigned char *depth);
+
+class genimgsrc : public imgsrc {
+  imggen_t func;
+  void *arg;
+public:
+  genimgsrc(imggen_t _func, void *_arg) { func = _func; arg = _arg; }
+  int stamp(char *name, long *version);
+  LTGA *load(char *name);
+};
+
+#endif // __IMGSRC_H__
@@ -0,0 +1,859 @@
+/* 
+ * Copyright (c) 2014, 2015, 2016 University of Michigan, Ann Arbor.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms are permitted
+ * provided that the above copyright notice and this paragraph are
+ * duplicated in all such forms and that any documentation,
+ * advertising materials, and other materials related to such
+ * distribution and use acknowledge that the software was developed
+ * by the University of Michigan, Ann Arbor. The name of the University 
+ * may not be used to endorse or promote products derived from this 
+ * software without specific prior written permission.
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * Author: Sugih Jamin (jamin@eecs.umich.edu)
+ *
+*/
+#include <stdio.h>         // fprintf(), perror()
+#include <stdlib.h>        // random()
+#include <assert.h>        // assert()
+#include <limits.h>        // LONG_MAX, INT_MAX
+#include <math.h>          // ceil()
+#include <errno.h>
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>      // socklen_t
+#else
+#include <string.h>        // memset(), memcmp(), memcpy()
+#include <unistd.h>        // close()
+#include <netinet/in.h>    // struct in_addr
+#include <arpa/inet.h>     // htons()
+#include <sys/types.h>     // u_short
+#include <sys/socket.h>    // socket API
+#include <sys/uio.h>       // struct iovec
+#include <poll.h>          // poll()
+#endif
+
+#include "netimg.h"
+#include "socks.h"
+#include "fec.h"
+#include "zseg.h"
+#include "seghash.h"
+#include "ltga.h"
+
+/*
+ * libnetimg: the client side of the netimg protocol, with no display
+ * of its own.  A netimgsess is one image being fetched: connect() to
+ * the server, sendqry() and recvimsg(), give it a buffer of bufsize
+ * bytes with setbuf(), then call process() whenever fd() is readable
+ * until it returns 1.  Each range of the buffer filled in, in wire
+ * order, is handed to the sink set with setsink() as it lands,
+ * pointing into the buffer itself, nothing is copied out.  Sessions
+ * share no state, a process may run any number of them, on one
+ * thread or several.  See netimg.cpp for one that displays the image.
+ */
+
+/*
+ * setbuf: receive the image into "image", of at least bufsize bytes,
+ * as known once recvimsg() returns.  It stays the caller's.  With
+ * NETIMG_RANGE, "image" is the whole payload, of imsg.im_size bytes,
+ * and the range goes at its offset in it: call setrange() first.
+ */
+void netimgsess::
+setbuf(unsigned char *image)
+{
+  buf = image + rstart;
+
+  return;
+}
+
+/*
+ * setsink: call "func" with "arg" for every range of the buffer
+ * filled in, NULL for none.
+ */
+void netimgsess::
+setsink(netimg_sink_t func, void *arg)
+{
+  sink = func;
+  sinkarg = arg;
+
+  return;
+}
+
+/*
+ * deliver: "size" bytes at "offset" of the buffer have been filled
+ * in, tell the sink, at their offset in the whole payload.
+ */
+void netimgsess::
+deliver(long offset, long size)
+{
+  if (sink) {
+    sink(sinkarg, rstart + offset, buf + offset, size);
+  }
+
+  return;
+}
+
+/*
+ * connect: reach the server "sname" at "port", in network byte
+ * order, over the transport asked for, see netimgsess::localpath
+ * and netimgsess::tcp.  socks_init() must have been called.
+ *
+ * Returns the socket descriptor, also kept in netimgsess::sd.
+ */
+int netimgsess::
+connect(char *sname, unsigned short port)
+{
+  this->sname = sname;
+  if (localpath) {
+    sd = socks_localclntinit(localpath);
+  } else if (tcp) {
+    sd = socks_tcpclntinit(sname, port, rcvbuf());
+  } else {
+    sd = socks_clntinit(sname, port, rcvbuf());  // Lab5 Task 2
+  }
+
+  return(sd);
+}
+
+/*
+ * process: receive what has arrived on fd(), without waiting for
+ * more, at most a window's worth so that one busy session doesn't
+ * starve others sharing the thread.  Over UDP, keep calling it after
+ * the image is done, for a while, to ACK the server's FIN again
+ * should ours be lost.
+ *
+ * Returns 1 once the image is done, 0 if not yet, -1 if the
+ * connection failed.
+ */
+int netimgsess::
+process()
+{
+  struct pollfd pfd;
+  int n;
+
+  pfd.fd = sd;
+  pfd.events = POLLIN;
+  for (n = 0; n <= rwnd; n++) {
+    if (poll(&pfd, 1, 0) <= 0) {
+      break;
+    }
+    if (pfd.revents & (POLLERR|POLLNVAL) || recvimg() < 0) {
+      return(-1);
+    }
+  }
+
+  if (!done && rend && next_seqn >= rend - rstart && next_seqn < bufsize) {
+    // the rest of the range is being fetched elsewhere, see setend(),
+    // keep telling the server till its FIN comes
+    ihdr_t ack;
+    ack.ih_vers = NETIMG_VERS;
+    ack.ih_type = NETIMG_ACK;
+    ack.ih_size = htons(sizeof(ihdr_t));
+    ack.ih_seqn = htonl((unsigned int) bufsize);
+    if (send_ack(&ack) < 0) {
+      return(-1);
+    }
+  }
+
+  return(done ? 1 : 0);
+}
+
+/*
+ * setend: NETIMG_RANGE, only want the range up to payload offset
+ * "end", no less than have(), after all.  Once that much has arrived,
+ * process() ACKs the whole range so the server moves on to its FIN.
+ * The bytes it sends in the meantime are still received, into the
+ * part of the payload given up, which holds the same bytes either
+ * way.
+ */
+void netimgsess::
+setend(unsigned int end)
+{
+  if (end > have() && end < rend) {
+    rend = end;
+  }
+
+  return;
+}
+
+/*
+ * sendqry: send a query for provided imgname to
+ * connected server.  Query is of type iqry_t, defined in netimg.h.
+ * The query packet must be of version NETIMG_VERS and of type
+ * NETIMG_SYNQRY both also defined in netimg.h. In addition to the
+ * filename of the image the client is searching for, the query
+ * message also carries the receiver's window size (rwnd), maximum
+ * segment size (mss), and FEC window size (used in Lab6 and PA3).
+ * All three are global variables.  If a region of interest was
+ * specified, only that rectangle of the image is asked for.  If we
+ * have a previous copy of the image, it is loaded into netimgsess::prev
+ * and its segment hashes follow the query.  If we have the reply
+ * cached, the query is made conditional on its im_etag.
+ *
+ * On send error, return 0, else return 1
+ */
+int netimgsess::
+sendqry(char *imgname)
+{
+  int bytes;
+  iqry_t iqry;
+  unsigned int nhash = 0;
+
+  if (prevname && !localpath && !tcp && !(mode & NETIMG_TILE) && !rend) {
+    prev = new LTGA();
+    if (prev->LoadFromFile(prevname)) {
+      datasize = mss - sizeof(ihdr_t) - NETIMG_UDPIP;
+      nhash = (unsigned int) (((long) prev->GetImageWidth()*prev->GetImageHeight()
+                               *(prev->GetPixelDepth()/8) + datasize-1)/datasize);
+    } else {
+      fprintf(stderr, "netimgsess::sendqry: cannot load %s, asking for all of the image\n",
+              prevname);
+      delete prev;
+      prev = NULL;
+    }
+  }
+
+  iqry.iq_vers = NETIMG_VERS;
+  iqry.iq_type = NETIMG_SYNQRY;
+  iqry.iq_mss = htons(mss);
+  iqry.iq_rwnd = rwnd;
+  iqry.iq_fwnd = fwnd;             // used in Lab6 and PA3
+  iqry.iq_x = htons(roi[0]);
+  iqry.iq_y = htons(roi[1]);
+  iqry.iq_w = htons(roi[2]);
+  iqry.iq_h = htons(roi[3]);
+  iqry.iq_mode = nhash ? mode | NETIMG_DELTA : mode;
+  iqry.iq_dispw = htons(dispw);
+  iqry.iq_disph = htons(disph);
+  iqry.iq_level = level;
+  iqry.iq_quality = quality;
+  iqry.iq_format = format;
+  iqry.iq_nhash = htonl(nhash);
+  iqry.iq_etag = 0;
+  iqry.iq_start = htonl(rstart);
+  iqry.iq_end = htonl(rend);
+  iqry.iq_nflows = localpath || tcp || rend || (mode & NETIMG_TILE) ? 0 : nflows;
+  iqry.iq_mcast = localpath || tcp || rend || (mode & NETIMG_TILE) ? 0 : mcast;
+  if (rend) {
+    iqry.iq_mode = (iqry.iq_mode | NETIMG_RANGE) & ~(NETIMG_Z|NETIMG_RLE);
+  }
+  strcpy(iqry.iq_name, imgname); 
+  if (cachedir && !localpath && !(mode & NETIMG_TILE) && !rend) {
+    iqry.iq_etag = htonl(netimgcache_lookup(cachedir, &iqry));
+  }
+  bytes = send(sd, (char *) &iqry, sizeof(iqry_t), 0);
+  if (bytes != sizeof(iqry_t)) {
+    return(0);
+  }
+
+  return(nhash ? sendhash(nhash) : 1);
+}
+
+/*
+ * sendhash: send the "nhash" segment hashes of netimgsess::prev in
+ * NETIMG_HASH packets, as described with iqry_t.
+ *
+ * On send error, return 0, else return 1
+ */
+int netimgsess::
+sendhash(unsigned int nhash)
+{
+  ihdr_t hdr;
+  struct iovec iov[NETIMG_NUMIOV];
+  struct msghdr mh;
+  unsigned char *hashes;
+  unsigned int i, n, per;
+  unsigned char depth, format;
+  long size;
+
+  depth = (unsigned char) (prev->GetPixelDepth()/8);
+  if (((int) prev->GetImageType()) == 3 || ((int) prev->GetImageType()) == 11) {
+    format = prev->GetAlphaDepth() ? NETIMG_GSA : NETIMG_GS;
+  } else {
+    format = prev->GetAlphaDepth() ? NETIMG_RGBA : NETIMG_RGB;
+  }
+  size = (long) prev->GetImageWidth()*prev->GetImageHeight()*depth;
+
+  hashes = new unsigned char[nhash*SEGHASH_LEN];
+  seghash_image(hashes, prev->GetPixels(), size, datasize,
+                SEGHASH_SEED(prev->GetImageWidth(), prev->GetImageHeight(), depth, format));
+
+  memset(&mh, 0, sizeof(struct msghdr));
+  mh.msg_iov = iov;
+  mh.msg_iovlen = NETIMG_NUMIOV;
+  iov[0].iov_base = &hdr;
+  iov[0].iov_len = sizeof(ihdr_t);
+  hdr.ih_vers = NETIMG_VERS;
+  hdr.ih_type = NETIMG_HASH;
+
+  per = datasize/SEGHASH_LEN;
+  for (i = 0; i < nhash; i += n) {
+    n = nhash - i < per ? nhash - i : per;
+    hdr.ih_size = htons(n*SEGHASH_LEN);
+    hdr.ih_seqn = htonl(i);
+    iov[1].iov_base = hashes + i*SEGHASH_LEN;
+    iov[1].iov_len = n*SEGHASH_LEN;
+    if (sendmsg(sd, &mh, 0) < 0) {
+      delete[] hashes;
+      return(0);
+    }
+  }
+  fprintf(stderr, "netimgsess::sendhash: %u segment hashes of %s sent\n", nhash, prevname);
+
+  delete[] hashes;
+  return(1);
+}
+
+/*
+ * prefill: NETIMG_DELTA was applied, so segments sent as
+ * NETIMG_DATA_H are to be taken from our previous copy.  Start the
+ * image buffer off as that copy.
+ */
+void netimgsess::
+prefill()
+{
+  long size;
+
+  size = (long) prev->GetImageWidth()*prev->GetImageHeight()*(prev->GetPixelDepth()/8);
+  memcpy(buf, prev->GetPixels(), size < bufsize ? size : bufsize);
+
+  return;
+}
+
+/*
+ * reset: prepare to receive a new image, forgetting all receive
+ * state of the previous one.
+ */
+void netimgsess::
+reset()
+{
+  next_seqn = 0;
+  next_next_seqn = 0;
+  window_start = 0;
+  packets_count = 0;
+  go_back_n_mode = false;
+  rendered = 0;
+  done = false;
+
+  return;
+}
+
+/*
+ * reconstruct_image: rebuild the one segment lost in the FEC window
+ * starting at window_start, the one at next_seqn, from "fec_data",
+ * which is freed.
+ *
+ * Returns 0 on success, -1 if next_seqn isn't in the window, the FEC
+ * is then of no use.
+ */
+int netimgsess::
+reconstruct_image(unsigned char* fec_data){
+        unsigned int next_seqn_fec = window_start;
+        if (window_start > next_seqn) {
+          delete[] fec_data;
+          return(-1);
+        }
+         unsigned int window_end = window_start + (fwnd*datasize)>=bufsize? bufsize : window_start + (fwnd*datasize);
+
+        while(next_seqn_fec<window_end){
+          unsigned int segsize = (bufsize - next_seqn_fec < datasize) ? bufsize-next_seqn_fec : datasize;
+          if(next_seqn != next_seqn_fec){
+            fec_accum(fec_data, (buf+next_seqn_fec), datasize, segsize);
+          }
+          next_seqn_fec = next_seqn_fec + segsize;
+        }
+        unsigned int size_to_be_copy = next_seqn+datasize>bufsize? (bufsize-next_seqn) : datasize;
+        memcpy(buf+next_seqn,fec_data, size_to_be_copy);
+        deliver(next_seqn, size_to_be_copy);
+        delete[] fec_data; 
+
+        return(0);
+}
+
+
+
+/*
+ * send_ack: send "ack" to the server, unless dropped on purpose.
+ *
+ * Returns 0 if sent or dropped, -1 on error.
+ */
+int netimgsess::
+send_ack(ihdr_t* ack){
+
+  /* PA3 Task 2.3:
+   * If we're to send back an ACK, send it now.  Probabilistically
+   * drop the ACK instead of sending it back (see how this is done in
+   * imgdb.cpp).
+   */ 
+  /* PA3: YOUR CODE HERE */
+   
+    if(((float) random())/INT_MAX < pdrop) {
+        fprintf(stderr, "netimgsess::send ack: DROPPED with next expected 0x%x\n",
+                  next_seqn);
+    }else{
+
+        if (send(sd, ack, sizeof(ihdr_t), 0) < 0) {
+          perror("netimgsess::send_ack: send");
+          return(-1);
+        }
+    } 
+
+    return(0);
+}
+/*
+ * recvimsg: receive an imsg_t packet from server and store it
+ * in the global variable imsg.  The type imsg_t is defined in
+ * netimg.h. Return NETIMG_EVERS if packet is of the wrong version.
+ * Return NETIMG_ESIZE if packet received is of the wrong size.
+ * Otherwise return the content of the im_type field of the received
+ * packet. Upon return, all the integer fields of imsg MUST be in HOST
+ * BYTE ORDER. If msg_type is NETIMG_FOUND, or NETIMG_NOTMOD, compute
+ * the size of the
+ * incoming image and store the size in netimgsess::bufsize.
+ */
+char netimgsess::
+recvimsg()
+{
+  int bytes;
+  double imgsize_d;
+
+  /* receive imsg packet and check its version and type, a local
+     server passes the payload's memfd along */
+  if (localpath) {
+    bytes = socks_recvfd(sd, (char *) &imsg, sizeof(imsg_t), &shmfd);
+  } else if (tcp) {
+    bytes = recv(sd, (char *) &imsg, sizeof(imsg_t), MSG_WAITALL);
+  } else {
+    bytes = recv(sd, (char *) &imsg, sizeof(imsg_t), 0); // imsg global
+  }
+  if (bytes != sizeof(imsg_t)) {
+    return(NETIMG_ESIZE);
+  }
+  if (imsg.im_vers != NETIMG_VERS) {
+    return(NETIMG_EVERS);
+  }
+
+  if (imsg.im_type == NETIMG_FOUND || imsg.im_type == NETIMG_NOTMOD) {
+    imsg.im_height = ntohs(imsg.im_height);
+    imsg.im_width = ntohs(imsg.im_width);
+    imsg.im_lvlw = ntohs(imsg.im_lvlw);
+    imsg.im_lvlh = ntohs(imsg.im_lvlh);
+    imsg.im_size = ntohl(imsg.im_size);
+    imsg.im_etag = ntohl(imsg.im_etag);
+
+    imgsize_d = (double) (imsg.im_height*imsg.im_width*(u_short)imsg.im_depth);
+    net_assert((imgsize_d > (double) LONG_MAX), 
+               "netimgsess::recvimsg: image too big");
+    bufsize = (long) imsg.im_size;               // bytes on the wire
+    if (!(imsg.im_mode & NETIMG_RANGE)) {
+      rstart = rend = 0;                         // all of it came
+    } else if (rend) {
+      if (rend > imsg.im_size) {
+        rend = imsg.im_size;
+      }
+      bufsize = (long) (rend - rstart);
+    }
+    if (localpath || tcp) {
+      return((char) imsg.im_type);               // nothing to ACK
+    }
+    if (imsg.im_type == NETIMG_FOUND && imsg.im_group) {
+      return((char) imsg.im_type);               // not before joining
+    }                                            // it, see recvmcast()
+
+    /* PA3 Task 2.1:
+     *
+     * Send back an ACK with ih_type = NETIMG_ACK and ih_seqn =
+     * NETIMG_SYNSEQ.  Initialize any variable necessary to keep track
+     * of ACKs.
+     */
+    /* PA3: YOUR CODE HERE */
+    ihdr_t send_back_ack;
+    send_back_ack.ih_vers = NETIMG_VERS;
+    send_back_ack.ih_type = NETIMG_ACK;
+    send_back_ack.ih_size = htons(sizeof(ihdr_t));
+    send_back_ack.ih_seqn = htonl(NETIMG_SYNSEQ);
+    //socklen_t client_size = sizeof(client);
+    bytes = send(sd, &send_back_ack, sizeof(send_back_ack), 0);
+  }
+
+  return((char) imsg.im_type);
+}
+
+/*
+ * recvstream: TCP transport, receive as much of the image as has
+ * arrived straight into "buf", following what we already have.
+ * Deliver what is complete, in whole segments as over UDP, since
+ * renderers and the coded payloads work in those.
+ */
+void netimgsess::
+recvstream()
+{
+  ssize_t bytes;
+  long end;
+
+  if (done) {
+    return;
+  }
+  bytes = recv(sd, buf + next_seqn, bufsize - next_seqn, 0);
+  if (bytes <= 0) {
+    if (!bytes || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+      fprintf(stderr, "netimgsess::recvstream: connection closed at offset 0x%x\n", next_seqn);
+      done = true;
+    }
+    return;
+  }
+  next_seqn += bytes;
+
+  datasize = mss - sizeof(ihdr_t) - NETIMG_UDPIP;
+  end = next_seqn == bufsize ? bufsize : next_seqn - next_seqn % datasize;
+  if (end > rendered) {
+    deliver(rendered, end - rendered);
+    rendered = end;
+  }
+  if (next_seqn == bufsize) {
+    if (cachedir) {
+      netimgcache_store(&imsg, buf, bufsize);
+    }
+    done = true;
+  }
+
+  return;
+}
+
+/*
+ * recvimg: called whenever sd is readable, see process(). On each
+ * call, receive a chunk of the image from the network and store it
+ * in "buf" at offset from the start of the buffer as specified in
+ * the header of the packet, then hand it to the sink.
+ *
+ * Returns 0, or -1 on receive or send error, the socket is left to
+ * the caller.
+ */
+int netimgsess::
+recvimg(void)
+{
+  ihdr_t hdr;  // memory to hold packet header
+  int err = 0;
+   
+  if (tcp) {
+    recvstream();
+    return(0);
+  }
+
+  /* 
+   * Lab5 Task 2:
+   * 
+   * The image data packet from the server consists of an ihdr_t
+   * header followed by a chunk of data.  We want to put the data
+   * directly into the buffer pointed to by netimgsess::buf
+   * without any additional copying. To determine the correct
+   * offset from the start of the buffer to put the data into, we
+   * first need to retrieve the sequence number stored in the packet
+   * header.  Since we're dealing with UDP packet, however, we can't
+   * simply read the header off the network, leaving the rest of the
+   * packet to be retrieved by subsequent calls to recv(). Instead, we
+   * call recv() with flags == MSG_PEEK.  This allows us to retrieve a
+   * copy of the header without removing the packet from the receive
+   * buffer.
+   *
+   * Since our socket has been set to non-blocking mode, if there's no
+   * packet ready to be retrieved from the socket, the call to recv()
+   * will return immediately with return value -1 and the system
+   * global variable "errno" set to EAGAIN or EWOULDBLOCK (defined in
+   * errno.h).  In which case, this function should simply return to
+   * caller.
+   * 
+   * Once a copy of the header is made to the local variable "hdr",
+   * check that it has the correct version number and that it is of
+   * type NETIMG_DATA (use bitwise '&' as NETIMG_FEC is also of type
+   * NETIMG_DATA).  Return -1 if any error is encountered.
+   * Otherwise, convert the size and sequence number in the header
+   * to host byte order.
+   */
+  /* Lab5: YOUR CODE HERE */
+    ssize_t head_judge = recv(sd, &hdr, sizeof(hdr), MSG_PEEK);
+    if(head_judge <= 0){  // 0: local server done with us
+      return(0);
+    }
+
+    //need to look for hdr.type judgement 
+    if (hdr.ih_vers != NETIMG_VERS){
+          recv(sd, &hdr, sizeof(hdr), 0);  // not ours, dropped
+          return(0);
+    }
+  /* Lab5 Task 2
+   *
+   * Populate a struct msghdr with a pointer to a struct iovec
+   * array.  The iovec array should be of size NETIMG_NUMIOV.  The
+   * first entry of the iovec should be initialized to point to the
+   * header above, which should be re-used for each chunk of data
+   * received.
+   */
+  /* Lab5: YOUR CODE HERE */
+    struct iovec iov[NETIMG_NUMIOV];
+    iov[0].iov_base=&hdr;
+    iov[0].iov_len = sizeof(ihdr_t);
+    
+    struct msghdr message;
+    message.msg_name=NULL;
+    message.msg_namelen=0;
+    message.msg_iov=iov;
+    message.msg_iovlen=NETIMG_NUMIOV;
+    message.msg_control=0;
+    message.msg_controllen=0;
+
+    int h_seqn = ntohl(hdr.ih_seqn);
+    int h_size = ntohs(hdr.ih_size);
+
+    //fec_out_rang is the indicator that current seqency is out of windowstart
+    datasize = mss - sizeof(ihdr_t) - NETIMG_UDPIP;
+    int fec_out_rang  = (h_seqn - window_start)/(fwnd*datasize); 
+
+
+
+  /* PA3 Task 2.3: initialize your ACK packet */
+    ihdr_t ack_packet;
+    ack_packet.ih_vers = NETIMG_VERS;
+    ack_packet.ih_type = NETIMG_ACK;
+    ack_packet.ih_size = htons(sizeof(ack_packet));
+
+  if (hdr.ih_type == NETIMG_DATA || hdr.ih_type == NETIMG_DATA_Z
+      || hdr.ih_type == NETIMG_DATA_S || hdr.ih_type == NETIMG_DATA_H) {
+    /* 
+     * Lab5 Task 2
+     *
+     * Now that we have the offset/seqno information from the packet
+     * header, point the second entry of the iovec to the correct
+     * offset from the start of the image buffer pointed to by
+     * netimgsess::buf.  Both the offset/seqno and the size of
+     * the data to be received into the image buffer are recorded in
+     * the packet header retrieved above. Receive the segment "for
+     * real" (as opposed to "peeking" as we did above) by calling
+     * recvmsg().  We'll be overwriting the information in the "hdr"
+     * local variable, so remember to convert the size and sequence
+     * number in the header to host byte order again.
+     */
+    /* Lab5: YOUR CODE HERE */
+    iov[1].iov_base = buf +  ntohl(hdr.ih_seqn);
+    iov[1].iov_len = ntohs(hdr.ih_size);
+    if (hdr.ih_type == NETIMG_DATA_Z) {
+      // compressed segment, decoded into place below
+      if (!zbuf) {
+        zbuf = new unsigned char[datasize];
+      }
+      iov[1].iov_base = zbuf;
+      iov[1].iov_len = h_size > (int) datasize ? datasize : h_size;
+    } else if (hdr.ih_type == NETIMG_DATA_S && (h_seqn >= bufsize || h_size > (int) datasize)) {
+      iov[1].iov_len = 0;  // dropped below
+    } else if (hdr.ih_type == NETIMG_DATA_H) {
+      iov[1].iov_len = 0;  // header only
+    }
+    ssize_t count=recvmsg(sd, &message, 0);
+    if(count ==-1){
+      perror("netimgsess::recvimg: recvmsg");
+      return(-1);
+    }
+    if (hdr.ih_type == NETIMG_DATA_Z) {
+      // segments are datasize long except the last one
+      int segsize = bufsize - h_seqn < (long) datasize ? bufsize - h_seqn : datasize;
+      if (h_seqn >= bufsize ||
+          zseg_decode(buf + h_seqn, segsize, zbuf, count - sizeof(ihdr_t),
+                      imsg.im_depth, NETIMG_ZROWSIZE(&imsg)) != segsize) {
+        fprintf(stderr, "netimgsess::recvimg: bad NETIMG_DATA_Z at offset 0x%x\n", h_seqn);
+        return(0);  // treat as lost
+      }
+      h_size = segsize;
+    } else if (hdr.ih_type == NETIMG_DATA_S) {
+      // padding of the slot is not sent, but FEC covers it
+      int segsize = bufsize - h_seqn < (long) datasize ? bufsize - h_seqn : datasize;
+      if (!iov[1].iov_len || count - (int) sizeof(ihdr_t) > segsize) {
+        fprintf(stderr, "netimgsess::recvimg: bad NETIMG_DATA_S at offset 0x%x\n", h_seqn);
+        return(0);
+      }
+      memset(buf + h_seqn + (count - sizeof(ihdr_t)), 0, segsize - (count - sizeof(ihdr_t)));
+      h_size = segsize;
+    } else if (hdr.ih_type == NETIMG_DATA_H) {
+      // unchanged since our previous copy, already in place
+      if (h_seqn >= bufsize) {
+        fprintf(stderr, "netimgsess::recvimg: bad NETIMG_DATA_H at offset 0x%x\n", h_seqn);
+        return(0);
+      }
+      h_size = bufsize - h_seqn < (long) datasize ? bufsize - h_seqn : datasize;
+    }
+    deliver(h_seqn, h_size);
+            
+    
+    if(go_back_n_mode){
+      if(next_seqn == h_seqn){
+        //jump out of the go back n mode
+        //window_start = next_seqn;
+
+        next_seqn = next_seqn+h_size;
+        packets_count = 1;
+        go_back_n_mode=false;
+      }
+    }else{  
+        //first of all check if the arrived packet is out of range 
+        if(fec_out_rang>0){
+            if(!go_back_n_mode){
+              /*If we have not lost any data segment in the current FEC window, 
+              we can simply advance the FEC window to the next window 
+              and resume transmission*/
+              if(next_seqn == h_seqn){
+                //net_assert((window_start<next_seqn),"window > next_seqn");
+                if(window_start<next_seqn){
+                  window_start = window_start + (fwnd*datasize);
+                }
+                packets_count = 1;
+                next_seqn = next_seqn + h_size;
+              }else{
+                /*Otherwise, since we've lost the FEC packet, 
+                we can't patch any lost segment in the current FEC window, 
+                we must enter Go-Back-N mode and wait for the sender to 
+                retransmit the lost segment.*/
+                go_back_n_mode = true;
+                packets_count = 0;
+                window_start = next_seqn;
+              }
+            }
+        }else{
+              /*If the arriving data segment is the next expected segment (netimgsess::next_seqn), 
+              we increment netimgsess::next_seqn by the size of the arriving segment. 
+              being careful not to count late arriving out-of-order
+              packet as belonging to the current FEC window*/
+              if(next_seqn == h_seqn){
+                next_seqn = next_seqn + h_size;
+                packets_count = packets_count + 1;
+              }else if((next_seqn+h_size == h_seqn)&(next_next_seqn<h_seqn)){
+                next_next_seqn = h_seqn + h_size;
+                packets_count = packets_count + 1;
+              }else if ((next_next_seqn==h_seqn)&(next_next_seqn>next_seqn)){
+                next_next_seqn = next_next_seqn + h_size;
+                packets_count = packets_count + 1;
+              }
+          }
+      }
+      ack_packet.ih_seqn = htonl(next_seqn);
+      err = send_ack(&ack_packet);
+
+
+
+  }else if(hdr.ih_type == NETIMG_FIN) {  // NETIMG_FIN pkt
+      head_judge = recv(sd, &hdr, sizeof(hdr), 0);
+    /* PA3 Task 2.3: else it's a NETIMG_FIN packet, prepare to send
+       back an ACK with NETIMG_FINSEQ as the sequence number */
+    /* PA3 YOUR CODE HERE */ 
+      ack_packet.ih_seqn = htonl(NETIMG_FINSEQ);
+      err = send_ack(&ack_packet);
+      if (cachedir && !done && !(imsg.im_mode & (NETIMG_TILE|NETIMG_RANGE))) {
+        netimgcache_store(&imsg, buf, bufsize);
+      }
+      done = true;
+
+  }
+
+
+
+  else if(hdr.ih_type == NETIMG_FEC){
+    int packets_left = ceil(bufsize-window_start)/datasize;
+    unsigned int adjust_fwnd = packets_left>fwnd? fwnd:packets_left;
+    //recive netimg_fec message
+    unsigned char* fec_data = new unsigned char[datasize];; 
+    memset(fec_data,0,datasize);
+    iov[1].iov_base = fec_data;
+    iov[1].iov_len = datasize;
+    ssize_t fec_count = recvmsg(sd, &message, 0);
+    if(fec_count == -1){
+      perror("netimgsess::recvimg: recvmsg");
+      delete[] fec_data;
+      return(-1);
+    }
+    /*If we're not in GBN mode, double check that the FEC window of the
+    sender is the same as ours. It is possible that the sender's and 
+    receiver's FEC windows have gone out of synch. If the sender's FEC 
+    window is ahead of the receiver's (figure out a scenario when this could
+    happen and test for it), our count of received packets within the current
+    FEC window is most likely meaningless at this point. Since we don't know how
+    many segments are lost in the current FEC window, we should treat it as a
+    multiple-loss case, enter GBN mode, reset our 
+    FEC window to start at netimgsess::next_seqn and reset any 
+    other FEC-related variables.*/
+    if(!go_back_n_mode){
+     
+      // //for the case of the last fwnd window 
+      // unsigned int packet_left=0;
+      // if(window_end>=bufsize){
+      //   unsigned int last_packets_size = ((bufsize - window_start) % datasize) ? ((bufsize - window_start) / datasize + 1) :((bufsize - window_start) / datasize);
+      //   packet_left = packets_count - (fwnd - last_packets_size);
+      //   window_end = bufsize;
+      // }
+       unsigned int window_end = window_start + (fwnd*datasize)>=bufsize? bufsize : window_start + (fwnd*datasize);
+
+
+      if(h_seqn>window_start){
+        go_back_n_mode = true;
+
+        packets_count = 0;
+      }
+      else if((packets_count == adjust_fwnd -1)){
+        /*If the client has lost at most one segment within the current FEC window, 
+        you can re-use your Lab 6 code to reconstruct the lost segment, put it in its 
+        appointed place in the image buffer, and send back an ACK acknowledging the full FEC window. 
+        If only one segment has been lost in the current FEC window, it is possible that the sender's 
+        FEC window is behind that of the receiver's, i.e., the sender's FEC packet has a sequence number 
+        smaller than the sequence number that starts the receiver's current FEC window (figure out a scenario
+        when this could happen and test for it). In this case, adjust receiver's FEC window to match that of
+        the sender's. If the lost segment is still within the adjusted FEC window, you can reconstruct the 
+        lost segment as before.*/
+        if(h_seqn<window_start){
+          if((next_seqn<h_seqn+(fwnd*datasize))&(next_seqn>h_seqn)){
+            window_start = h_seqn;
+          }
+        }
+        if(h_seqn == window_start){
+          if (reconstruct_image(fec_data) < 0) {
+            go_back_n_mode = true;
+            window_start = next_seqn;
+            packets_count = 0;
+            return(0);
+          }
+          fec_data = NULL;
+          window_start = window_start + (fwnd*datasize);
+          packets_count = 0;
+                   
+
+          next_seqn = window_start;
+          ack_packet.ih_seqn = htonl(next_seqn);
+          err = send_ack(&ack_packet);
+        }
+      }else if(packets_count == fwnd){
+          window_start = window_start + (fwnd*datasize);
+          packets_count = 0;
+          next_seqn = window_start;
+
+      } else{
+
+          // If more than one segments were lost, in Lab 6 we couldn't
+          // recover the lost segments because we didn't have retransmission, 
+          // but now that we do have retransmission, we put the client in Go-Back-N mode and 
+          // wait for retransmission. Whenever we put the client in GBN mode, we reset the FEC
+          // window to start at the next expected sequence number (netimgsess::next_seqn) and reset 
+          // any other FEC-related variables. It takes about 15 lines of code to handle FEC packet,
+          // not counting code implemented in Labs 5 and 6 and Task 2 above.
+          go_back_n_mode = true;
+          window_start = next_seqn;
+          packets_count =0;
+      }
+  }
+    delete[] fec_data;  // NULL if used
+  }
+  
+
+
+
+  return(err);
+}
\ No newline at end of file
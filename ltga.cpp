@@ -28,6 +28,7 @@ THE POSSIBILITY OF SUCH DAMAGE.
 #include "ltga.h"
 #include <fstream>
 #include <stdlib.h>
+#include <string.h>
 
 //--------------------------------------------------
 // global functions
@@ -92,6 +93,19 @@ LTGA::LTGA(uint _width, uint _height) : m_height(_height), m_width(_width) {
 }
 
 
+LTGA::LTGA(uint _width, uint _height, uint _depth, const byte *_pixels)
+    : m_height(_height), m_width(_width) {
+    m_pixelDepth = _depth*8;
+    m_alphaDepth = (_depth == 2 || _depth == 4) ? 8 : 0;
+    m_type = _depth <= 2 ? itGreyscale : (_depth == 4 ? itRGBA : itRGB);
+
+    m_pixels = (byte*) malloc(m_width*m_height*_depth);
+    memcpy(m_pixels, _pixels, m_width*m_height*_depth);
+
+    m_loaded = true;
+}
+
+
 //--------------------------------------------------
 LTGA::~LTGA()
 {
@@ -272,7 +286,7 @@ void LTGA::WriteToFile(const std::string& name) {
 
   th.identsize = 0;
   th.colourmaptype = 0;
-  th.imagetype = 2;
+  th.imagetype = pltga->GetImageType() == itGreyscale ? 3 : 2;
   th.colourmapstart = 0;
   th.colourmaplength = 0;
   th.colourmapbits = 0;
@@ -50,6 +50,11 @@ public:
     // constructor from sizes, IG added this. 
     LTGA(uint _width, uint _height);
 
+    // constructs the object from a copy of the given pixels, laid out
+    // as returned by GetPixels(), _depth bytes each: 1 or 2 for
+    // greyscale without or with alpha, 3 or 4 for RGB or RGBA.
+    LTGA(uint _width, uint _height, uint _depth, const byte *_pixels);
+
     // the destructor, cleans up the memory
     virtual ~LTGA();
     // this method loads a tga file. It clears all the data
@@ -20,9 +20,6 @@
 #include <stdio.h>         // fprintf(), perror(), fflush()
 #include <stdlib.h>        // atoi()
 #include <assert.h>        // assert()
-#include <limits.h>        // LONG_MAX
-#include <math.h>          // ceil()
-#include <errno.h>
 #ifdef _WIN32
 #include <winsock2.h>
 #include <ws2tcpip.h>      // socklen_t
@@ -37,7 +34,12 @@
 #include <sys/types.h>     // u_short
 #include <sys/socket.h>    // socket API
 #include <sys/ioctl.h>     // ioctl(), FIONBIO
+#include <sys/mman.h>      // mmap()
+#include <sys/time.h>      // gettimeofday()
+#include <poll.h>          // poll()
+#include <pthread.h>       // pthread_create()
 #endif
+#define GL_GLEXT_PROTOTYPES  // glBindBuffer(), glBufferSubData()
 #ifdef __APPLE__
 #include <GLUT/glut.h>
 #else
@@ -46,10 +48,23 @@
 
 #include "netimg.h"
 #include "socks.h"
-#include "fec.h"
+#include "prog.h"
+#include "rle.h"
+#include "dct.h"
+#include "bc1.h"
+#include "pixfmt.h"
+#include "ltga.h"
+
+#ifndef GL_COMPRESSED_RGB_S3TC_DXT1_EXT
+#define GL_COMPRESSED_RGB_S3TC_DXT1_EXT  0x83F0
+#define GL_COMPRESSED_RGBA_S3TC_DXT1_EXT 0x83F1
+#endif
 
 long img_size;
 unsigned char *image;
+unsigned char *dispimg;  // what is displayed, same as image unless the
+                         // wire order differs from raster order
+unsigned char *rank;     // NETIMG_PROG: per-pixel rank, see prog_render()
 netimg netimg;
 /*
  * args: parses command line args.
@@ -59,7 +74,38 @@ netimg netimg;
  * to connect at server, in network byte order.  Both "*sname", and
  * "port" must be allocated by caller.  The variable "*imgname" points
  * to the name of the image to search for. The imgdb member variables
- * mss, rwnd, and fwnd are initialized.
+ * mss, rwnd, and fwnd are initialized.  If a region of interest
+ * "x,y,w,h" is given with -r, it is stored in netimg::roi.  The -p
+ * flag asks for progressive (coarse-to-fine) transmission.  With
+ * -g "WxH", the display window is of that size and the server is
+ * asked for the smallest image resolution covering it.  The -t flag
+ * selects tiled mode, see netimgtile.cpp.  With -z, the server may
+ * send losslessly compressed segments, with -e, the RLE packets of
+ * an RLE encoded image file as they are.  With -j "quality", 1 to
+ * 100, the image is sent lossy coded, see dct.cpp.  With -b, it is
+ * sent as BC1 texture blocks, see bc1.cpp.  With -f "gs", "565" or
+ * "pal", the server is asked to reduce the image to greyscale, 16-bit
+ * RGB565 or an 8-bit palette, see pixfmt.cpp.  With -D "prev.tga",
+ * a copy of the image received earlier, only the segments that
+ * differ from it are sent, see NETIMG_DELTA.  With -c "dir", images
+ * received are kept in that directory and not sent again while they
+ * are current, see netimgcache.cpp.  With -l "path", the server is on
+ * the same host, reached at that Unix domain socket instead of -s,
+ * and hands the image over in shared memory.  With -T, the image is
+ * received over TCP.  With -o "out.tga", nothing is displayed: the
+ * image is received as fast as it comes and written to that file.
+ * Otherwise, but for tiled mode, the image is received on a thread of
+ * its own and redrawn at most "fps" times a second, 30 unless given
+ * with -F "fps"; -F 0 receives in the GLUT idle loop instead.  With
+ * -P, rows are uploaded through a pixel buffer object, see upload().
+ * Each -R "server:port" names another server holding the same images,
+ * the image is then fetched in stripes from all of them at once, see
+ * netimgstripe.cpp.  With -K "nflows", the server is asked to split
+ * the transfer across that many flows, received on as many threads,
+ * see netimgflow.cpp, headless or with the receive thread only.
+ * With -M, the image may come over multicast, shared with other
+ * clients asking for it at the same time, see netimgmcast.cpp, again
+ * headless or with the receive thread only.
  *
  * Nothing else is modified.
  */
@@ -77,7 +123,7 @@ args(int argc, char *argv[], char **sname, unsigned short *port, char **imgname)
   rwnd = NETIMG_RCVWIN;
   mss = NETIMG_MSS;
 
-  while ((c = getopt(argc, argv, "s:q:m:w:d:")) != EOF) {
+  while ((c = getopt(argc, argv, "s:q:m:w:d:r:pg:tzej:bf:D:c:l:To:F:PR:K:M")) != EOF) {
     switch (c) {
     case 's':
       for (p = optarg+strlen(optarg)-1;  // point to last character of
@@ -120,493 +166,503 @@ args(int argc, char *argv[], char **sname, unsigned short *port, char **imgname)
                 argv[0], NETIMG_MINPROB, NETIMG_MAXPROB);
       }
       break;
+    case 'r':
+      if (sscanf(optarg, "%hu,%hu,%hu,%hu", &roi[0], &roi[1], &roi[2], &roi[3]) != 4
+          || !roi[2] || !roi[3]) {
+        return(1);
+      }
+      break;
+    case 'p':
+      mode |= NETIMG_PROG;
+      break;
+    case 'z':
+      mode |= NETIMG_Z;
+      break;
+    case 'e':
+      mode |= NETIMG_RLE;
+      break;
+    case 'b':
+      mode |= NETIMG_BC1;
+      break;
+    case 'f':
+      if (!strcmp(optarg, "gs")) {
+        format = NETIMG_GS;
+      } else if (!strcmp(optarg, "565")) {
+        format = NETIMG_RGB565;
+      } else if (!strcmp(optarg, "pal")) {
+        format = NETIMG_PAL8;
+      } else {
+        return(1);
+      }
+      break;
+    case 'D':
+      prevname = optarg;
+      break;
+    case 'c':
+      cachedir = optarg;
+      break;
+    case 'l':
+      localpath = optarg;
+      break;
+    case 'T':
+      tcp = true;
+      break;
+    case 'o':
+      outname = optarg;
+      break;
+    case 'F':
+      arg = atoi(optarg);
+      if (arg < 0 || arg > 1000) {
+        return(1);
+      }
+      fps = (unsigned short) arg;
+      break;
+    case 'P':
+      usepbo = true;
+      break;
+    case 'K':
+      arg = atoi(optarg);
+      if (arg < 1 || arg > NETIMG_MAXFLOWS) {
+        return(1);
+      }
+      nflows = (unsigned char) arg;
+      break;
+    case 'M':
+      mcast = true;
+      break;
+    case 'R':
+      for (p = optarg+strlen(optarg)-1; p != optarg && *p != NETIMG_PORTSEP; p--);
+      if (p == optarg || nrepl >= NETIMG_MAXREPL-1) {
+        return(1);
+      }
+      *p++ = '\0';
+      rnames[nrepl] = optarg;
+      rports[nrepl++] = htons((u_short) atoi(p));
+      break;
+    case 'j':
+      arg = atoi(optarg);
+      if (arg < 1 || arg > 100) {
+        return(1);
+      }
+      quality = (unsigned char) arg;
+      mode |= NETIMG_DCT;
+      break;
+    case 't':
+      mode |= NETIMG_TILE;
+      settile(0, 0, 0, NETIMG_TILESZ, NETIMG_TILESZ);
+      break;
+    case 'g':
+      if (sscanf(optarg, "%hux%hu", &dispw, &disph) != 2 || !dispw || !disph) {
+        return(1);
+      }
+      break;
     default:
       return(1);
       break;
     }
   }
 
+  if (mode & NETIMG_TILE) {
+    mode &= ~NETIMG_PROG;        // tiles are displayed once complete
+    if (tcp || outname) {
+      return(1);                 // tiles are queried over UDP only,
+    }                            // for display
+  }
+
+  if (nrepl) {
+    if ((mode & NETIMG_TILE) || tcp || localpath) {
+      return(1);                 // stripes are sent over UDP only
+    }
+    datasize = mss - sizeof(ihdr_t) - NETIMG_UDPIP;
+    setrange(0, NETIMG_STRIPESEGS*datasize);  // the first stripe
+  }
+
+  threaded = fps && !outname && !(mode & NETIMG_TILE);
+  if ((nflows > 1 || mcast) && !outname && !threaded) {
+    return(1);                   // flows and multicast are received
+  }                              // blocking, on threads
   fwnd = NETIMG_FECWIN >= rwnd ? rwnd-1 : NETIMG_FECWIN;  
                                  // used in Lab6 and PA3
   
   return (0);
 }
 
+
 /*
- * sendqry: send a query for provided imgname to
- * connected server.  Query is of type iqry_t, defined in netimg.h.
- * The query packet must be of version NETIMG_VERS and of type
- * NETIMG_SYNQRY both also defined in netimg.h. In addition to the
- * filename of the image the client is searching for, the query
- * message also carries the receiver's window size (rwnd), maximum
- * segment size (mss), and FEC window size (used in Lab6 and PA3).
- * All three are global variables.
+ * adopt: the whole "payload" is already here, either our cached copy
+ * the server says is current, or shared by a server on the same
+ * host.  Make it the image buffer, in place of the one allocated by
+ * netimglut_imginit(), and display it.  It is only read from.
  *
- * On send error, return 0, else return 1
+ * Returns 0 on success, -1 if there is no "payload".
  */
 int netimg::
-sendqry(char *imgname)
+adopt(unsigned char *payload)
 {
-  int bytes;
-  iqry_t iqry;
-
-  iqry.iq_vers = NETIMG_VERS;
-  iqry.iq_type = NETIMG_SYNQRY;
-  iqry.iq_mss = htons(mss);
-  iqry.iq_rwnd = rwnd;
-  iqry.iq_fwnd = fwnd;             // used in Lab6 and PA3
-  strcpy(iqry.iq_name, imgname); 
-  bytes = send(sd, (char *) &iqry, sizeof(iqry_t), 0);
-  if (bytes != sizeof(iqry_t)) {
-    return(0);
+  if (!payload) {
+    return(-1);
+  }
+  if (dispimg == image) {
+    dispimg = payload;
   }
+  free(image);
+  image = payload;
+  setbuf(image);
+  datasize = mss - sizeof(ihdr_t) - NETIMG_UDPIP;
+  render(0, img_size);
+  done = true;
+  upload();
 
-  return(1);
+  return(0);
 }
 
-void netimg::
-reconstruct_image(unsigned char* fec_data){
-        unsigned int next_seqn_fec = window_start;
-        fprintf(stderr, "reconstruct IMAGE at offst 0x%x \n", next_seqn);
-        net_assert((window_start>next_seqn),"wronnggg");
-         unsigned int window_end = window_start + (fwnd*datasize)>=img_size? img_size : window_start + (fwnd*datasize);
-
-        while(next_seqn_fec<window_end){
-          unsigned int segsize = (img_size - next_seqn_fec < datasize) ? img_size-next_seqn_fec : datasize;
-          if(next_seqn != next_seqn_fec){
-            fec_accum(fec_data, (image+next_seqn_fec), datasize, segsize);
-          }
-          next_seqn_fec = next_seqn_fec + segsize;
-        }
-        unsigned int size_to_be_copy = next_seqn+datasize>img_size? (img_size-next_seqn) : datasize;
-        memcpy(image+next_seqn,fec_data, size_to_be_copy);
-        delete[] fec_data; 
+/*
+ * recvimsg: as netimgsess::recvimsg(), the size of the incoming image,
+ * all of it even if only a stripe is coming, is also kept in the
+ * global variable "img_size".
+ */
+char netimg::
+recvimsg()
+{
+  char err;
+
+  err = netimgsess::recvimsg();
+  img_size = imsg.im_size;
+
+  return(err);
 }
 
+/*
+ * recvimg: as netimgsess::recvimg(), then, unless threaded, upload()
+ * whatever it rendered.
+ */
+int netimg::
+recvimg()
+{
+  int err;
 
+  err = netimgsess::recvimg();
+  if (!threaded) {
+    upload();
+  }
 
+  return(err);
+}
 
+/*
+ * render_sink: libnetimg sink of the rdpimg client, "data" is in
+ * "image", where render() expects it.
+ */
+static void
+render_sink(void *arg, long offset, unsigned char *data, long len)
+{
+  ((class netimg *) arg)->render(offset, len);
+
+  return;
+}
+
+/*
+ * render: "size" bytes at "offset" of the image as sent on the wire
+ * have been filled in.  If the wire order is not raster order, bring
+ * the display image "dispimg" up to date with the new bytes.
+ */
 void netimg::
-send_ack(ihdr_t* ack){
-
-  /* PA3 Task 2.3:
-   * If we're to send back an ACK, send it now.  Probabilistically
-   * drop the ACK instead of sending it back (see how this is done in
-   * imgdb.cpp).
-   */ 
-  /* PA3: YOUR CODE HERE */
-   
-    if(((float) random())/INT_MAX < pdrop) {
-        fprintf(stderr, "netimg::send ack: DROPPED with next expected 0x%x\n",
-                  next_seqn);
-    }else{
-
-        int bytes = send(sd, ack, sizeof(ihdr_t), 0);
-        net_assert((bytes<0), "ack sent errror");
-        fprintf(stderr, "netimg::send ack: 0x%x\n",
-                  ntohl(ack->ih_seqn));
-    } 
+render(long offset, long size)
+{
+  if (imsg.im_mode & NETIMG_PROG) {
+    prog_render(dispimg, rank, image, imsg.im_width, imsg.im_height,
+                imsg.im_depth, offset, size);
+  } else if (imsg.im_format == NETIMG_RGB565 || imsg.im_format == NETIMG_PAL8) {
+    pixfmt_render(dispimg, imsg.im_format, image, (long) imsg.im_width*imsg.im_height,
+                  offset, size);
+  } else if ((imsg.im_mode & NETIMG_BC1) && !bc1gl) {
+    bc1_render(dispimg, imsg.im_width, imsg.im_height, imsg.im_depth,
+               image, offset, size);
+  } else if (imsg.im_mode & NETIMG_SLOTS) {
+    for (long o = offset - offset % datasize; o < offset+size && o < img_size; o += datasize) {
+      if ((imsg.im_mode & NETIMG_RLE ?
+           rle_render(dispimg, (long) imsg.im_width*imsg.im_height, imsg.im_depth,
+                      image + o, datasize) :
+           dct_render(dispimg, imsg.im_width, imsg.im_height, imsg.im_depth,
+                      imsg.im_quality, image + o, datasize)) < 0) {
+        fprintf(stderr, "netimg::render: bad slot at offset 0x%lx\n", o);
+      }
+    }
+  }
+
+  if (threaded) {
+    while (!spsc_push(&rxq, offset, size)) {
+      usleep(1000);  // let the GLUT thread catch up
+    }
+  } else {
+    touch(offset, size);
+  }
+
+  return;
 }
+
 /*
- * recvimsg: receive an imsg_t packet from server and store it
- * in the global variable imsg.  The type imsg_t is defined in
- * netimg.h. Return NETIMG_EVERS if packet is of the wrong version.
- * Return NETIMG_ESIZE if packet received is of the wrong size.
- * Otherwise return the content of the im_type field of the received
- * packet. Upon return, all the integer fields of imsg MUST be in HOST
- * BYTE ORDER. If msg_type is NETIMG_FOUND, compute the size of the
- * incoming image and store the size in the global variable
- * "img_size".
+ * touch: "size" bytes at "offset" of the image as sent on the wire
+ * have been render()ed.  Mark the rows of the display image they
+ * landed in, netimg::dirtylo to netimg::dirtyhi, for upload().  A
+ * NETIMG_PAL8 palette precedes the indices, all rows are re-rendered
+ * when it lands, see pixfmt_render().
  */
-char netimg::
-recvimsg()
+void netimg::
+touch(long offset, long size)
 {
-  int bytes;
-  double imgsize_d;
+  long lo, hi, rowsize;
 
-  /* receive imsg packet and check its version and type */
-  bytes = recv(sd, (char *) &imsg, sizeof(imsg_t), 0); // imsg global
-  if (bytes != sizeof(imsg_t)) {
-    return(NETIMG_ESIZE);
+  if (size <= 0) {
+    return;
+  }
+  if (imsg.im_format == NETIMG_PAL8) {
+    offset -= PIXFMT_PALSZ;  // pixel offset, negative if in the palette
+  }
+  if (offset < 0 || (imsg.im_mode & (NETIMG_PROG|NETIMG_SLOTS))) {
+    // spread over, or not known to stay within, any rows
+    lo = 0;
+    hi = imsg.im_height-1;
+  } else if (imsg.im_mode & NETIMG_BC1) {
+    rowsize = (long) (imsg.im_width+3)/4*BC1_BLKSZ;  // a row of blocks
+    lo = offset/rowsize*4;
+    hi = (offset+size-1)/rowsize*4 + 3;
+  } else {
+    rowsize = (long) imsg.im_width*imsg.im_depth;    // as sent
+    lo = offset/rowsize;
+    hi = (offset+size-1)/rowsize;
   }
-  if (imsg.im_vers != NETIMG_VERS) {
-    return(NETIMG_EVERS);
+  if (hi >= imsg.im_height) {
+    hi = imsg.im_height-1;
   }
 
-  if (imsg.im_type == NETIMG_FOUND) {
-    imsg.im_height = ntohs(imsg.im_height);
-    imsg.im_width = ntohs(imsg.im_width);
-
-    imgsize_d = (double) (imsg.im_height*imsg.im_width*(u_short)imsg.im_depth);
-    net_assert((imgsize_d > (double) LONG_MAX), 
-               "netimg::recvimsg: image too big");
-    img_size = (long) imgsize_d;                 // global
-
-    /* PA3 Task 2.1:
-     *
-     * Send back an ACK with ih_type = NETIMG_ACK and ih_seqn =
-     * NETIMG_SYNSEQ.  Initialize any variable necessary to keep track
-     * of ACKs.
-     */
-    /* PA3: YOUR CODE HERE */
-    ihdr_t send_back_ack;
-    send_back_ack.ih_vers = NETIMG_VERS;
-    send_back_ack.ih_type = NETIMG_ACK;
-    send_back_ack.ih_size = htons(sizeof(ihdr_t));
-    send_back_ack.ih_seqn = htonl(NETIMG_SYNSEQ);
-    //socklen_t client_size = sizeof(client);
-    bytes = send(sd, &send_back_ack, sizeof(send_back_ack), 0);
+  if (dirtyhi < 0 || lo < dirtylo) {
+    dirtylo = lo;
+  }
+  if (hi > dirtyhi) {
+    dirtyhi = hi;
   }
 
-  return((char) imsg.im_type);
+  return;
 }
 
-/* Callback function for GLUT.
- *
- * recvimg: called by GLUT when idle. On each call, receive a
- * chunk of the image from the network and store it in global variable
- * "image" at offset from the start of the buffer as specified in the
- * header of the packet.
- *
- * Terminate process on receive error.
+
+
+/*
+ * upload: give the updated image to OpenGL for texturing, tiles are
+ * handed to OpenGL by netimgtile once complete.  Headless, there is
+ * no OpenGL.  The whole image goes the first time, after that only
+ * the rows touch()ed since, if any, NETIMG_BC1 blocks in whole block
+ * rows.  With netimg::usepbo, raster rows are staged in a pixel
+ * buffer object, from which OpenGL copies them into the texture on
+ * its own time.
  */
 void netimg::
-recvimg(void)
+upload()
 {
-  ihdr_t hdr;  // memory to hold packet header
   unsigned short format;
-   
-  /* 
-   * Lab5 Task 2:
-   * 
-   * The image data packet from the server consists of an ihdr_t
-   * header followed by a chunk of data.  We want to put the data
-   * directly into the buffer pointed to by the global variable
-   * "image" without any additional copying. To determine the correct
-   * offset from the start of the buffer to put the data into, we
-   * first need to retrieve the sequence number stored in the packet
-   * header.  Since we're dealing with UDP packet, however, we can't
-   * simply read the header off the network, leaving the rest of the
-   * packet to be retrieved by subsequent calls to recv(). Instead, we
-   * call recv() with flags == MSG_PEEK.  This allows us to retrieve a
-   * copy of the header without removing the packet from the receive
-   * buffer.
-   *
-   * Since our socket has been set to non-blocking mode, if there's no
-   * packet ready to be retrieved from the socket, the call to recv()
-   * will return immediately with return value -1 and the system
-   * global variable "errno" set to EAGAIN or EWOULDBLOCK (defined in
-   * errno.h).  In which case, this function should simply return to
-   * caller.
-   * 
-   * Once a copy of the header is made to the local variable "hdr",
-   * check that it has the correct version number and that it is of
-   * type NETIMG_DATA (use bitwise '&' as NETIMG_FEC is also of type
-   * NETIMG_DATA).  Terminate process if any error is encountered.
-   * Otherwise, convert the size and sequence number in the header
-   * to host byte order.
-   */
-  /* Lab5: YOUR CODE HERE */
-    ssize_t head_judge = recv(sd, &hdr, sizeof(hdr), MSG_PEEK);
-    if(head_judge == -1){
-      //fprintf(stderr, "recv not recive anythign\n");
-      return;
-    }
+  unsigned char *rows;
+  long rowsize, lo;
 
-    //need to look for hdr.type judgement 
-    if (hdr.ih_vers != NETIMG_VERS){
-          fprintf(stderr, "wrong  version");
-          return;
+  if ((imsg.im_mode & NETIMG_TILE) || outname || dirtyhi < 0) {
+    return;
+  }
+  if ((imsg.im_mode & NETIMG_BC1) && bc1gl) {
+    format = imsg.im_depth == 4 ?
+      GL_COMPRESSED_RGBA_S3TC_DXT1_EXT : GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+    if (!texinit) {
+      glCompressedTexImage2D(GL_TEXTURE_2D, 0, format, (GLsizei) imsg.im_width,
+                             (GLsizei) imsg.im_height, 0, (GLsizei) img_size, image);
+      texinit = true;
+    } else {
+      // sub-images of blocks start on a block row, and end on one or
+      // at the bottom edge
+      lo = dirtylo - dirtylo % 4;
+      rowsize = (long) (imsg.im_width+3)/4*BC1_BLKSZ;
+      glCompressedTexSubImage2D(GL_TEXTURE_2D, 0, 0, (GLint) lo, (GLsizei) imsg.im_width,
+                                (GLsizei) (dirtyhi-lo+1), format,
+                                (GLsizei) ((dirtyhi/4 - lo/4 + 1)*rowsize),
+                                image + lo/4*rowsize);
     }
-  /* Lab5 Task 2
-   *
-   * Populate a struct msghdr with a pointer to a struct iovec
-   * array.  The iovec array should be of size NETIMG_NUMIOV.  The
-   * first entry of the iovec should be initialized to point to the
-   * header above, which should be re-used for each chunk of data
-   * received.
-   */
-  /* Lab5: YOUR CODE HERE */
-    struct iovec iov[NETIMG_NUMIOV];
-    iov[0].iov_base=&hdr;
-    iov[0].iov_len = sizeof(ihdr_t);
-    
-    struct msghdr message;
-    message.msg_name=NULL;
-    message.msg_namelen=0;
-    message.msg_iov=iov;
-    message.msg_iovlen=NETIMG_NUMIOV;
-    message.msg_control=0;
-    message.msg_controllen=0;
-
-    int h_seqn = ntohl(hdr.ih_seqn);
-    int h_size = ntohs(hdr.ih_size);
-
-    //fec_out_rang is the indicator that current seqency is out of windowstart
-    datasize = mss - sizeof(ihdr_t) - NETIMG_UDPIP;
-    fprintf(stderr, "fwnd is %d\n", fwnd);
-    int fec_out_rang  = (h_seqn - window_start)/(fwnd*datasize); 
-
-
-
-  /* PA3 Task 2.3: initialize your ACK packet */
-    ihdr_t ack_packet;
-    ack_packet.ih_vers = NETIMG_VERS;
-    ack_packet.ih_type = NETIMG_ACK;
-    ack_packet.ih_size = htons(sizeof(ack_packet));
-
-  if (hdr.ih_type == NETIMG_DATA) {
-    /* 
-     * Lab5 Task 2
-     *
-     * Now that we have the offset/seqno information from the packet
-     * header, point the second entry of the iovec to the correct
-     * offset from the start of the image buffer pointed to by the
-     * global variable "image".  Both the offset/seqno and the size of
-     * the data to be received into the image buffer are recorded in
-     * the packet header retrieved above. Receive the segment "for
-     * real" (as opposed to "peeking" as we did above) by calling
-     * recvmsg().  We'll be overwriting the information in the "hdr"
-     * local variable, so remember to convert the size and sequence
-     * number in the header to host byte order again.
-     */
-    /* Lab5: YOUR CODE HERE */
-    iov[1].iov_base = image +  ntohl(hdr.ih_seqn);
-    iov[1].iov_len = ntohs(hdr.ih_size);
-    ssize_t count=recvmsg(sd, &message, 0);
-    if(count ==-1){
-      fprintf(stderr, "cao xxx can not recive anything");
-      close(sd);
-      return;
+    dirtyhi = -1;
+    glutPostRedisplay();
+    return;
+  }
+  format = netimglut_glformat(imsg.im_format);
+  if (!texinit) {
+    glTexImage2D(GL_TEXTURE_2D, 0, (GLint) format, (GLsizei) imsg.im_width,
+                 (GLsizei) imsg.im_height, 0, (GLenum) format, GL_UNSIGNED_BYTE,
+                 dispimg);
+    texinit = true;
+    if (usepbo && !(pbod = netimglut_newpbo((long) imsg.im_height*imsg.im_width
+                                            *NETIMG_DISPDEPTH(&imsg)))) {
+      usepbo = false;  // not supported, straight from dispimg then
     }
-            
-    
-    if(go_back_n_mode){
-      if(next_seqn == h_seqn){
-        //jump out of the go back n mode
-        //window_start = next_seqn;
-
-        next_seqn = next_seqn+h_size;
-        packets_count = 1;
-        go_back_n_mode=false;
-        fprintf(stderr, "jumped out of goback n at next_seqn 0x%x with size %d\n",next_seqn,h_size);        
-      }
-    }else{  
-        //first of all check if the arrived packet is out of range 
-        if(fec_out_rang>0){
-            if(!go_back_n_mode){
-              /*If we have not lost any data segment in the current FEC window, 
-              we can simply advance the FEC window to the next window 
-              and resume transmission*/
-              if(next_seqn == h_seqn){
-                //net_assert((window_start<next_seqn),"window > next_seqn");
-                if(window_start<next_seqn){
-                  window_start = window_start + (fwnd*datasize);
-                }
-                packets_count = 1;
-                next_seqn = next_seqn + h_size;
-                fprintf(stderr, "do not recive a fec but could move on next_seqn 0x%x bytes%d \n", next_seqn, h_size);
-              }else{
-                /*Otherwise, since we've lost the FEC packet, 
-                we can't patch any lost segment in the current FEC window, 
-                we must enter Go-Back-N mode and wait for the sender to 
-                retransmit the lost segment.*/
-                go_back_n_mode = true;
-                packets_count = 0;
-                window_start = next_seqn;
-                
-                fprintf(stderr, "do not recive a fec jump to go back n mode\n");
-              }
-            }
-        }else{
-              /*If the arriving data segment is the next expected segment (netimg::next_seqn), 
-              we increment netimg::next_seqn by the size of the arriving segment. 
-              being careful not to count late arriving out-of-order
-              packet as belonging to the current FEC window*/
-              if(next_seqn == h_seqn){
-                next_seqn = next_seqn + h_size;
-                fprintf(stderr, "move on next_seqn 0x%x bytes%d \n", next_seqn, h_size);
-                packets_count = packets_count + 1;
-              }else if((next_seqn+h_size == h_seqn)&(next_next_seqn<h_seqn)){
-                fprintf(stderr, "next_next seq matched on 0x%x bytes%d \n", next_next_seqn, h_size);
-                next_next_seqn = h_seqn + h_size;
-                packets_count = packets_count + 1;
-              }else if ((next_next_seqn==h_seqn)&(next_next_seqn>next_seqn)){
-                net_assert((next_next_seqn<next_seqn),"booom");
-                next_next_seqn = next_next_seqn + h_size;
-                fprintf(stderr, "next_next seq moved on  0x%x bytes%d \n", next_next_seqn, h_size);
-                packets_count = packets_count + 1;
-              }
-                
-                  // fprintf(stderr, "recived next_seqn 0x%x bytes%d \n", next_seqn, h_size);
-                  // packets_count = packets_count + 1;
-              if(h_seqn<window_start){
-                fprintf(stderr, "HI!!!!!!!!!!!!!!!!!!!!!!!HSEQU < WINDOW START\n");
-              }
-          }
-      }
-      ack_packet.ih_seqn = htonl(next_seqn);
-      fprintf(stderr, "netimg::recvimg: received offset 0x%x, %d bytes, waiting for 0x%x\n", 
-            h_seqn, h_size, next_seqn);
-
-      send_ack(&ack_packet);
-
+  } else {
+    rowsize = (long) imsg.im_width*NETIMG_DISPDEPTH(&imsg);
+    rows = dispimg + dirtylo*rowsize;
+    if (pbod) {
+      glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbod);
+      glBufferSubData(GL_PIXEL_UNPACK_BUFFER, dirtylo*rowsize,
+                      (dirtyhi-dirtylo+1)*rowsize, rows);
+      rows = (unsigned char *) NULL + dirtylo*rowsize;  // offset into it
+    }
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, (GLint) dirtylo, (GLsizei) imsg.im_width,
+                    (GLsizei) (dirtyhi-dirtylo+1), (GLenum) format, GL_UNSIGNED_BYTE,
+                    rows);
+    if (pbod) {
+      glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    }
+  }
+  dirtyhi = -1;
 
+  /* redisplay */
+  glutPostRedisplay();
 
-  }else if(hdr.ih_type == NETIMG_FIN) {  // NETIMG_FIN pkt
-      head_judge = recv(sd, &hdr, sizeof(hdr), 0);
-    /* PA3 Task 2.3: else it's a NETIMG_FIN packet, prepare to send
-       back an ACK with NETIMG_FINSEQ as the sequence number */
-    /* PA3 YOUR CODE HERE */ 
-      ack_packet.ih_seqn = htonl(NETIMG_FINSEQ);
-      send_ack(&ack_packet);
+  return;
+}
 
+void
+recvimg_glut()
+{
+  if (netimg.striped) {
+    netimgstripe_wait(0);
+    netimg.upload();
+    return;
   }
+  netimg.recvimg();
 
+  return;
+}
 
+/*
+ * recvimg_thread: receive the image on a thread of its own, as fast
+ * as it comes, while the GLUT thread redraws it, see redraw_glut().
+ * render() tells it what changed.  Over UDP, stay on after the image
+ * is done, to ACK the server's FIN again should ours be lost.
+ */
+void *
+recvimg_thread(void *arg)
+{
+  struct pollfd pfd;
 
-  else if(hdr.ih_type == NETIMG_FEC){
-    int packets_left = ceil(img_size-window_start)/datasize;
-    unsigned int adjust_fwnd = packets_left>fwnd? fwnd:packets_left;
-    fprintf(stderr, "!!!!!!!!!!!!  recieve FEC packet at offset 0x%x the packets_count is %d and adjust_fwnd is %d\n", h_seqn, packets_count, adjust_fwnd);
-    //recive netimg_fec message
-    unsigned char* fec_data = new unsigned char[datasize];; 
-    memset(fec_data,0,datasize);
-    iov[1].iov_base = fec_data;
-    iov[1].iov_len = datasize;
-    ssize_t fec_count = recvmsg(sd, &message, 0);
-    if(fec_count == -1){
-      fprintf(stderr, "can not recive fec_count");
-      close(sd);
-      return;
+  if (netimg.imsg.im_nflows > 1) {
+    if (netimg.recvflows()) {
+      fprintf(stderr, "netimg: flow failed, image incomplete\n");
     }
-    /*If we're not in GBN mode, double check that the FEC window of the
-    sender is the same as ours. It is possible that the sender's and 
-    receiver's FEC windows have gone out of synch. If the sender's FEC 
-    window is ahead of the receiver's (figure out a scenario when this could
-    happen and test for it), our count of received packets within the current
-    FEC window is most likely meaningless at this point. Since we don't know how
-    many segments are lost in the current FEC window, we should treat it as a
-    multiple-loss case, enter GBN mode, reset our 
-    FEC window to start at netimg::next_seqn and reset any 
-    other FEC-related variables.*/
-    if(!go_back_n_mode){
-     
-      // //for the case of the last fwnd window 
-      // unsigned int packet_left=0;
-      // if(window_end>=img_size){
-      //   unsigned int last_packets_size = ((img_size - window_start) % datasize) ? ((img_size - window_start) / datasize + 1) :((img_size - window_start) / datasize);
-      //   packet_left = packets_count - (fwnd - last_packets_size);
-      //   window_end = img_size;
-      // }
-       unsigned int window_end = window_start + (fwnd*datasize)>=img_size? img_size : window_start + (fwnd*datasize);
-
-
-      if(h_seqn>window_start){
-        fprintf(stderr, "OUTSYNECHEED fec go to go back n\n");
-        go_back_n_mode = true;
-
-        packets_count = 0;
-      }
-      else if((packets_count == adjust_fwnd -1)){
-        /*If the client has lost at most one segment within the current FEC window, 
-        you can re-use your Lab 6 code to reconstruct the lost segment, put it in its 
-        appointed place in the image buffer, and send back an ACK acknowledging the full FEC window. 
-        If only one segment has been lost in the current FEC window, it is possible that the sender's 
-        FEC window is behind that of the receiver's, i.e., the sender's FEC packet has a sequence number 
-        smaller than the sequence number that starts the receiver's current FEC window (figure out a scenario
-        when this could happen and test for it). In this case, adjust receiver's FEC window to match that of
-        the sender's. If the lost segment is still within the adjusted FEC window, you can reconstruct the 
-        lost segment as before.*/
-        if(h_seqn<window_start){
-          if((next_seqn<h_seqn+(fwnd*datasize))&(next_seqn>h_seqn)){
-            fprintf(stderr, "adjust window start before reconsturect previous 0x%x now0x%x\n", window_start, h_seqn);
-            window_start = h_seqn;
-            reconstruct_image(fec_data);
-            window_start = window_start + (fwnd*datasize);
-           
-
-            next_seqn = window_start;
-            ack_packet.ih_seqn = htonl(next_seqn);
-            packets_count = 0;
-            send_ack(&ack_packet);
-          }else{
-            fprintf(stderr, "does not do anything\n");
-          }
-        }else if(h_seqn == window_start){
-          
-          fprintf(stderr, "reconstruct withuot adjust window\n");
-          reconstruct_image(fec_data);
-          window_start = window_start + (fwnd*datasize);
-          packets_count = 0;
-                   
-
-          next_seqn = window_start;
-          ack_packet.ih_seqn = htonl(next_seqn);
-          send_ack(&ack_packet);
-        }
-      }else if(packets_count == fwnd){
-          fprintf(stderr, "recive all packets ");
-          window_start = window_start + (fwnd*datasize);
-          packets_count = 0;
-          next_seqn = window_start;
-
-      } else{
-
-          // If more than one segments were lost, in Lab 6 we couldn't
-          // recover the lost segments because we didn't have retransmission, 
-          // but now that we do have retransmission, we put the client in Go-Back-N mode and 
-          // wait for retransmission. Whenever we put the client in GBN mode, we reset the FEC
-          // window to start at the next expected sequence number (netimg::next_seqn) and reset 
-          // any other FEC-related variables. It takes about 15 lines of code to handle FEC packet,
-          // not counting code implemented in Labs 5 and 6 and Task 2 above.
-          if(packets_count>adjust_fwnd){
-                  fprintf(stderr, "fuck packets_count >>> fwnd which is %d and adjust_fwnd is%d\n", packets_count,adjust_fwnd);
-                }
-          go_back_n_mode = true;
-          window_start = next_seqn;
-          packets_count =0;
-
-          fprintf(stderr, "enter go back n mode at 0x%x\n", next_seqn);
-      }
+    return(NULL);
   }
+  if (netimg.imsg.im_group) {
+    if (netimg.recvmcast()) {
+      fprintf(stderr, "netimg: multicast failed, image incomplete\n");
+    }
+    return(NULL);
+  }
+  pfd.fd = netimg.sd;
+  pfd.events = POLLIN;
+  while (!netimg.done || !netimg.tcp) {
+    if (netimg.striped) {
+      if (netimgstripe_wait(-1) < 0) {
+        fprintf(stderr, "netimg: no server left to send the rest\n");
+        break;
+      }
+    } else if (poll(&pfd, 1, -1) > 0 && netimg.recvimg() < 0) {
+      fprintf(stderr, "netimg: receive failed, image incomplete\n");
+      break;
+    }
   }
-  
 
+  return(NULL);
+}
 
+/*
+ * redraw_glut: threaded, GLUT idle callback.  Take what the receive
+ * thread has rendered since last time and, if anything, upload the
+ * rows it touched, no more than netimg::fps times a second.  Sleep
+ * till the next frame otherwise.
+ */
+void
+redraw_glut()
+{
+  static struct timeval last;
+  struct timeval now;
+  long offset, size, wait;
 
-  /* give the updated image to OpenGL for texturing */
-  switch(imsg.im_format) {
-  case NETIMG_RGBA:
-    format = GL_RGBA;
-    break;
-  case NETIMG_RGB:
-    format = GL_RGB;
-    break;
-  case NETIMG_GSA:
-    format = GL_LUMINANCE_ALPHA;
-    break;
-  default:
-    format = GL_LUMINANCE;
-    break;
+  while (spsc_pop(&netimg.rxq, &offset, &size)) {
+    netimg.touch(offset, size);
   }
-  
-  glTexImage2D(GL_TEXTURE_2D, 0, (GLint) format, (GLsizei) imsg.im_width,
-               (GLsizei) imsg.im_height, 0, (GLenum) format, GL_UNSIGNED_BYTE,
-               image);
-
-  /* redisplay */
-  glutPostRedisplay();
+  gettimeofday(&now, NULL);
+  wait = 1000000/netimg.fps
+    - ((now.tv_sec - last.tv_sec)*1000000 + (now.tv_usec - last.tv_usec));
+  if (netimg.dirtyhi < 0 || wait > 0) {
+    usleep(wait > 0 ? wait : 1000000/netimg.fps);
+    return;
+  }
+  netimg.upload();
+  last = now;
 
   return;
 }
 
-void
-recvimg_glut()
+/*
+ * recvimg_headless: in place of the GLUT idle loop, receive until the
+ * image is done, blocking in poll() between packets instead of
+ * spinning, then write it, as displayed, to netimg::outname.  Report
+ * the time taken since "start" and the goodput, image bytes over that
+ * time.
+ *
+ * Returns 0 on success, 1 if the server went quiet first or the
+ * receive failed.
+ */
+int
+recvimg_headless(struct timeval *start)
 {
-  netimg.recvimg();
+  struct pollfd pfd;
+  struct timeval end;
+  double secs;
+  int depth;
+
+  if (netimg.imsg.im_nflows > 1 && netimg.recvflows()) {
+    fprintf(stderr, "netimg: flow failed, %s not written\n", netimg.outname);
+    return(1);
+  }
+  if (netimg.imsg.im_group && netimg.recvmcast()) {
+    fprintf(stderr, "netimg: multicast failed, %s not written\n", netimg.outname);
+    return(1);
+  }
+  pfd.fd = netimg.sd;
+  pfd.events = POLLIN;
+  while (!netimg.done) {
+    if (netimg.striped) {
+      if (netimgstripe_wait(-1) < 0) {
+        fprintf(stderr, "netimg: no server left to send the rest, %s not written\n",
+                netimg.outname);
+        return(1);
+      }
+      continue;
+    }
+    // the server gives up after NETIMG_MAXTRIES RTOs
+    if (poll(&pfd, 1, (NETIMG_MAXTRIES+1)*(NETIMG_SLEEP*1000 + NETIMG_USLEEP/1000)) <= 0) {
+      fprintf(stderr, "netimg: server went quiet, %s not written\n", netimg.outname);
+      return(1);
+    }
+    if (netimg.recvimg() < 0) {
+      fprintf(stderr, "netimg: receive failed, %s not written\n", netimg.outname);
+      return(1);
+    }
+  }
+  gettimeofday(&end, NULL);
+  secs = (end.tv_sec - start->tv_sec) + (end.tv_usec - start->tv_usec)/1000000.0;
 
-  return;
+  depth = NETIMG_DISPDEPTH(&netimg.imsg);
+  LTGA out(netimg.imsg.im_width, netimg.imsg.im_height, depth, dispimg);
+  out.WriteToFile(netimg.outname);
+
+  fprintf(stderr, "netimg: %ld bytes received in %.3f s, goodput %.2f Mbps, %dx%d image written to %s\n",
+          img_size, secs, secs > 0.0 ? img_size*8/secs/1000000.0 : 0.0,
+          netimg.imsg.im_width, netimg.imsg.im_height, netimg.outname);
+
+  return(0);
 }
 
 int
@@ -616,10 +672,12 @@ main(int argc, char *argv[])
   char *sname, *imgname;
   u_short port;
   int nonblock=1;
+  struct timeval start;
+  pthread_t rxthread;
 
   // parse args, see the comments for netimg::args()
   if (netimg.args(argc, argv, &sname, &port, &imgname)) {
-    fprintf(stderr, "Usage: %s -s <server>%c<port> -q <image>.tga [ -w <rwnd [1, 255]> -m <mss (>40)> -d <prob> ]\n", argv[0], NETIMG_PORTSEP); 
+    fprintf(stderr, "Usage: %s -s <server>%c<port> -q <image>.tga [ -w <rwnd [1, 255]> -m <mss (>40)> -d <prob> -r <x,y,w,h> -p -g <w>x<h> -t -z -e -j <quality> -b -f gs|565|pal -D <prev>.tga -c <cachedir> -l <path> -T -o <out>.tga -F <fps> -P -R <server>%c<port> -K <nflows> -M ]\n", argv[0], NETIMG_PORTSEP, NETIMG_PORTSEP); 
     exit(1);
   }
 
@@ -627,18 +685,86 @@ main(int argc, char *argv[])
 
   socks_init();
 
-  netimg.sd = socks_clntinit(sname, port, netimg.rcvbuf());  // Lab5 Task 2
+  netimg.connect(sname, port);
+  netimg.setsink(render_sink, &netimg);
 
+  gettimeofday(&start, NULL);
   if (netimg.sendqry(imgname)) {
     err = netimg.recvimsg();
 
-    if (err == NETIMG_FOUND) { // if image received ok
-      netimglut_init(&argc, argv, recvimg_glut);
-      netimglut_imginit(netimg.imsg.im_format);
+    if (err == NETIMG_FOUND && (netimg.imsg.im_mode & NETIMG_TILE)) {
+      netimglut_init(&argc, argv, netimgtile_idle,
+                     netimg.dispw ? netimg.dispw : NETIMG_WIDTH,
+                     netimg.disph ? netimg.disph : NETIMG_HEIGHT);
+      netimgtile_init(imgname);
+
+      /* set socket non blocking */
+      ioctl(netimg.sd, FIONBIO, &nonblock);
+
+      glutMainLoop();
+    } else if (err == NETIMG_FOUND || err == NETIMG_NOTMOD) { // if image received ok
+      if (netimg.outname) {
+        image = (unsigned char *) calloc(img_size, 1);
+        net_assert((!image), "netimg: malloc");
+      } else {
+        netimglut_init(&argc, argv, netimg.threaded ? redraw_glut : recvimg_glut,
+                       netimg.dispw ? netimg.dispw : NETIMG_WIDTH,
+                       netimg.disph ? netimg.disph : NETIMG_HEIGHT);
+        netimglut_imginit(netimg.imsg.im_format);
+        netimg.bc1gl = (netimg.imsg.im_mode & NETIMG_BC1) && netimglut_s3tc();
+      }
+      netimg.setbuf(image);
+      if (netimg.imsg.im_mode & NETIMG_DELTA) {
+        netimg.prefill();
+      }
+      dispimg = image;
+      if (netimg.imsg.im_mode & NETIMG_PROG) {
+        dispimg = (unsigned char *) malloc(img_size);
+        rank = (unsigned char *) calloc(netimg.imsg.im_width*netimg.imsg.im_height, 1);
+        net_assert((!dispimg || !rank), "netimg: malloc");
+        memcpy(dispimg, image, img_size);
+      } else if ((netimg.imsg.im_mode & (NETIMG_SLOTS|NETIMG_BC1))
+                 || NETIMG_DISPDEPTH(&netimg.imsg) != netimg.imsg.im_depth) {
+        // image holds what is received, dispimg the pixels
+        int depth = NETIMG_DISPDEPTH(&netimg.imsg);
+        long rastersize = (long) netimg.imsg.im_width*netimg.imsg.im_height*depth;
+        dispimg = (unsigned char *) calloc(rastersize, 1);
+        net_assert((!dispimg), "netimg: malloc");
+        for (long i = 0; i < rastersize; i += depth) {
+          dispimg[i] = (unsigned char) 0xff;
+        }
+        memset(image, 0, img_size);
+      }
+      if (err == NETIMG_NOTMOD && netimg.adopt(netimgcache_map(&netimg.imsg))) {
+        fprintf(stderr, "%s: cached %s gone, query again.\n", argv[0], imgname);
+        exit(1);
+      }
+      if (netimg.localpath) {
+        void *shm = mmap(NULL, img_size, PROT_READ, MAP_SHARED, netimg.shmfd, 0);
+        if (netimg.shmfd < 0 || shm == MAP_FAILED || netimg.adopt((unsigned char *) shm)) {
+          fprintf(stderr, "%s: cannot map %s.\n", argv[0], imgname);
+          exit(1);
+        }
+        close(netimg.shmfd);
+      }
       
       /* set socket non blocking */
       ioctl(netimg.sd, FIONBIO, &nonblock);
 
+      if (netimg.nrepl) {
+        netimgstripe_init(imgname, sname, port);
+      }
+      if (netimg.outname) {
+        err = recvimg_headless(&start);
+        socks_close(netimg.sd);
+        return(err);
+      }
+      if (netimg.threaded && !netimg.done
+          && pthread_create(&rxthread, NULL, recvimg_thread, NULL)) {
+        fprintf(stderr, "%s: no receive thread, receiving in the GLUT loop.\n", argv[0]);
+        netimg.threaded = false;
+        glutIdleFunc(recvimg_glut);
+      }
       glutMainLoop(); /* start the GLUT main loop */
     } else if (err == NETIMG_NFOUND) {
       fprintf(stderr, "%s: %s image not found.\n", argv[0], imgname);
@@ -646,6 +772,8 @@ main(int argc, char *argv[])
       fprintf(stderr, "%s: wrong version number.\n", argv[0]);
     } else if (err == NETIMG_EBUSY) {
       fprintf(stderr, "%s: image server busy.\n", argv[0]);
+    } else if (err == NETIMG_EROI) {
+      fprintf(stderr, "%s: region of interest outside %s.\n", argv[0], imgname);
     } else if (err == NETIMG_ESIZE) {
       fprintf(stderr, "%s: wrong size.\n", argv[0]);
     } else {
@@ -20,6 +20,8 @@
 #ifndef __NETIMG_H__
 #define __NETIMG_H__
 
+#include "spsc.h"
+
 #ifdef _WIN32
 #define usleep(usec) Sleep(usec/1000)
 #define ioctl(sockdesc, request, onoff) ioctlsocket(sockdesc, request, onoff)
@@ -35,6 +37,8 @@
 #define NETIMG_RGB    0x3
 #define NETIMG_GSA    0x2
 #define NETIMG_GS     0x1
+#define NETIMG_RGB565 0x5      // reduced formats, sent on request,
+#define NETIMG_PAL8   0x6      // displayed as NETIMG_RGB, see pixfmt.cpp
 
 #define NETIMG_MAXFNAME  256   // including terminating NULL
 #define NETIMG_PORTSEP   ':'
@@ -62,14 +66,18 @@
                                // prevent unnecessary retransmissions
 #define NETIMG_USLEEP 500000   // 500 ms
 
-#define NETIMG_VERS    0x11
+#define NETIMG_VERS    0x12    // of the iqry_t and imsg_t layouts below
 
 // imsg_t::img_type from client:
 #define NETIMG_SYNQRY  0x10
 #define NETIMG_ACK     0x11    // PA3
+#define NETIMG_HASH    0x12    // NETIMG_DELTA: segment hashes, see iqry_t
+#define NETIMG_NACK    0x13    // multicast: segments missed, see imsg_t
 
 // imsg_t::img_type from server:
 #define NETIMG_FOUND   0x02
+#define NETIMG_NOTMOD  0x03    // as NETIMG_FOUND, but iq_etag is current,
+                               // so nothing follows
 #define NETIMG_NFOUND  0x04
 #define NETIMG_ERROR   0x08
 #define NETIMG_ESIZE   0x09
@@ -77,11 +85,51 @@
 #define NETIMG_ETYPE   0x0b
 #define NETIMG_ENAME   0x0c
 #define NETIMG_EBUSY   0x0d
+#define NETIMG_EROI    0x0e    // region of interest outside image
 
 #define NETIMG_DATA    0x20
+#define NETIMG_DATA_Z  0x30    // NETIMG_DATA compressed with zseg_encode()
+#define NETIMG_DATA_S  0x28    // NETIMG_DATA carrying only the used part
+                               // of a slot, see islot_t
+#define NETIMG_DATA_H  0x24    // NETIMG_DATA the client already has,
+                               // header only, see NETIMG_DELTA
 #define NETIMG_FEC     0x60    // Lab6 & PA3
 #define NETIMG_FIN     0xa0    // PA3
 
+// iqry_t::iq_mode and imsg_t::im_mode transfer modes, requested by
+// the client and echoed back for those the server applied:
+#define NETIMG_PROG    0x01    // Adam7 progressive, coarse-to-fine order
+#define NETIMG_TILE    0x02    // iq_level picks the pyramid level, for
+                               // tiles given as region of interest
+#define NETIMG_Z       0x04    // segments may be sent as NETIMG_DATA_Z
+#define NETIMG_RLE     0x08    // slots of the file's own TGA RLE packets
+#define NETIMG_DCT     0x10    // slots of lossy DCT coded blocks, at
+                               // iq_quality
+#define NETIMG_SLOTS   (NETIMG_RLE|NETIMG_DCT)  // modes sending islot_t
+#define NETIMG_BC1     0x20    // BC1 (DXT1) texture blocks, RGB(A) only
+#define NETIMG_DELTA   0x40    // raster segments whose hash matches one
+                               // sent by the client go as NETIMG_DATA_H
+#define NETIMG_RANGE   0x80    // only iq_start to iq_end of the payload,
+                               // as one of several stripes, see below
+
+// bytes per pixel of the image as displayed
+#define NETIMG_DISPDEPTH(im) \
+  (((im)->im_format == NETIMG_RGB565 || (im)->im_format == NETIMG_PAL8) ? 3 : (im)->im_depth)
+
+// zseg_encode() bytes per row: raster payloads predict from the row
+// above, others only from the left
+#define NETIMG_ZROWSIZE(im) \
+  (((im)->im_mode & NETIMG_PROG) ? 0 : (im)->im_width*(im)->im_depth)
+
+#define NETIMG_MAXLVL    16    // pyramid levels, level 0 is full resolution
+#define NETIMG_TILESZ   256    // tiled mode: tile width and height, pixels
+#define NETIMG_TILECACHE 64    // tiled mode: tiles kept by the client
+#define NETIMG_FPS       30    // redraws per second, at most, while
+                               // receiving on a thread of its own
+#define NETIMG_MAXREPL    8    // striped mode: servers fetched from at once
+#define NETIMG_STRIPESEGS 32   // striped mode: datasize segments per stripe
+#define NETIMG_MAXFLOWS   8    // flows one transfer may be split across
+
 // special seqno's for PA3:
 #define NETIMG_MAXSEQ  2147483647 // 2^31-1
 #define NETIMG_SYNSEQ  4294967295 // 2^32-1
@@ -94,57 +142,264 @@ typedef struct {                  // NETIMG_SYNQRY
   unsigned char iq_rwnd;          // receiver's window size
   unsigned char iq_fwnd;          // receiver's FEC window size
                                   // used in Lab6 and PA3
+  unsigned short iq_x;            // region of interest: top-left
+  unsigned short iq_y;            // pixel, width and height, in
+  unsigned short iq_w;            // the image's row order; iq_w or
+  unsigned short iq_h;            // iq_h == 0 asks for whole image
   char iq_name[NETIMG_MAXFNAME];  // must be NULL terminated
+  unsigned char iq_mode;          // NETIMG_PROG, etc.
+  unsigned short iq_dispw;        // client's display size, the server
+  unsigned short iq_disph;        // may send a smaller pyramid level
+                                  // covering it, 0 for full resolution
+  unsigned char iq_level;         // NETIMG_TILE: pyramid level wanted
+  unsigned char iq_quality;       // NETIMG_DCT: 1 to 100, 0 for default
+  unsigned char iq_format;        // NETIMG_GS, NETIMG_RGB565 or
+                                  // NETIMG_PAL8 to reduce the image
+                                  // to, 0 to send it as it is
+  unsigned int iq_nhash;          // NETIMG_DELTA: number of segment
+                                  // hashes of the client's copy that
+                                  // follow the query, see below
+  unsigned int iq_etag;           // im_etag of the reply the client
+                                  // has cached, 0 if none
+  unsigned int iq_start;          // NETIMG_RANGE: payload bytes wanted,
+  unsigned int iq_end;            // iq_start a multiple of datasize
+  unsigned char iq_nflows;        // flows to split the transfer across,
+                                  // see below, 0 or 1 for just this one
+  unsigned char iq_mcast;         // 1 if the payload may come over
+                                  // multicast, see imsg_t::im_group
 } iqry_t;
 
+// With NETIMG_DELTA, the client follows its query with the
+// seghash() of every datasize segment of the copy of the image it
+// already has, SEGHASH_LEN bytes each, seeded with
+// SEGHASH_SEED(width, height, depth, format) of that copy.  They go in
+// NETIMG_HASH packets: an ihdr_t whose ih_seqn is the index of the
+// first hash carried and ih_size the bytes of hashes following it, at
+// most datasize.  Hashes that don't arrive count as mismatches.
+
 typedef struct {               
   unsigned char im_vers;
   unsigned char im_type;       // NETIMG_FOUND or NETIMG_NFOUND
   unsigned char im_depth;      // in bytes, not in bits as
                                // returned by LTGA.GetPixelDepth()
-  unsigned char im_format;
+  unsigned char im_format;     // as sent, may be reduced, see iq_format
   unsigned short im_width;
   unsigned short im_height;
+  unsigned char im_mode;       // transfer modes applied, see iq_mode
+  unsigned char im_level;      // pyramid level sent, 0 is full resolution
+  unsigned short im_lvlw;      // size of that whole level, of which
+  unsigned short im_lvlh;      // width x height may be a region
+  unsigned char im_quality;    // NETIMG_DCT: quality coded at
+  unsigned int im_size;        // bytes to be sent, width x height x
+                               // depth unless in slots, see islot_t
+  unsigned int im_etag;        // tag of the content to be sent, never 0,
+                               // changes whenever the content does
+  unsigned char im_nflows;     // flows the payload is split across, 0
+                               // or 1 if sent the usual way, and their
+  unsigned short im_fports[NETIMG_MAXFLOWS];  // server ports, in network
+                               // byte order
+  unsigned int im_group;       // multicast group the payload is sent
+  unsigned short im_gport;     // to, and its port, both in network
+                               // byte order, im_group 0 if unicast
+  unsigned char im_gfwnd;      // segments per FEC packet sent to it
 } imsg_t;
 
+// With im_nflows > 1, segment i of the payload, of datasize bytes, goes
+// on flow i % im_nflows, not to the port the query went to.  The
+// client opens a socket per flow, connected to its port in
+// im_fports, and sends a NETIMG_ACK of NETIMG_SYNSEQ on it, to which
+// the server starts sending.  Each flow is a transfer of its own, of
+// the segments it carries back to back, see netimg_flowsize(), with
+// its own window, FEC and FIN.  Both ends service each flow on a
+// thread of its own.  Not applied with NETIMG_Z, NETIMG_DELTA or
+// NETIMG_RANGE, nor over the local or TCP transports.
+
+// With im_group set, the payload is sent once, to the multicast group
+// im_group at port im_gport, for every client asking for the same
+// payload at about the same time.  The client joins the group before
+// sending its NETIMG_ACK of NETIMG_SYNSEQ.  Segments go as
+// NETIMG_DATA or NETIMG_DATA_S, each im_gfwnd of them followed by a
+// NETIMG_FEC whose ih_seqn is that of the first it covers, and are
+// not ACKed.  The server then sends a NETIMG_FIN to the group every
+// so often, to which each client still missing segments replies
+// with a NETIMG_NACK to the server's port: an ihdr_t whose ih_size
+// is the bytes of segment offsets following it, 4 bytes each in
+// network byte order, at most datasize.  The server sends those
+// segments to the group again.  Asked for with iq_mcast, only over
+// UDP, and not applied with NETIMG_TILE, NETIMG_DELTA or
+// NETIMG_RANGE, nor with NETIMG_Z or NETIMG_RLE, which are dropped.
+
+/*
+ * netimg_flowsize: bytes of a payload of "size" bytes carried by flow
+ * "f" of "nflows", in segments of "datasize" bytes.
+ */
+static inline long
+netimg_flowsize(long size, int datasize, int nflows, int f)
+{
+  long nsegs = (size + datasize-1)/datasize;
+  long flowsize = (nsegs - f + nflows-1)/nflows*datasize;
+
+  if (nsegs && (nsegs-1) % nflows == f) {
+    flowsize -= nsegs*datasize - size;  // the last, short, segment
+  }
+  return(flowsize);
+}
+
+// Payloads that don't map bytes to pixels one to one, e.g.,
+// NETIMG_RLE, are cut into slots of the client's datasize.  Each slot
+// starts with an islot_t saying where its content goes, followed by
+// is_size bytes of content and zero padding up to datasize.  The
+// padding is not sent: slots go out as NETIMG_DATA_S, with ih_size
+// covering the islot_t and content only.  Sequence numbers, ACKs and
+// FEC all work on the padded slots.
+typedef struct {
+  unsigned int is_unit;        // first pixel (NETIMG_RLE) or coding
+                               // unit (NETIMG_DCT) in the slot
+  unsigned int is_size;        // content bytes following the islot_t
+} islot_t;
+
 typedef struct {
   unsigned char ih_vers;
-  unsigned char ih_type;       // NETIMG_DATA
+  unsigned char ih_type;       // NETIMG_DATA, NETIMG_DATA_Z,
+                               // NETIMG_DATA_S, NETIMG_DATA_H
                                // Lab6: NETIMG_FEC,
                                // PA3: NETIMG_ACK, NETIMG_FIN
   unsigned short ih_size;      // actual data size, in bytes,
-                               // not including header
+                               // not including header, compressed
+                               // size for NETIMG_DATA_Z
   unsigned int ih_seqn;
 } ihdr_t;
 
-class netimg {
+class LTGA;
+
+// libnetimg sink: "len" bytes of the image at "offset", as sent on
+// the wire, have been filled in at "data", see netimgsess::setsink()
+typedef void (*netimg_sink_t)(void *arg, long offset, unsigned char *data, long len);
+
+class netimgsess {       // libnetimg: one image being fetched
+protected:
   unsigned short mss;       // receiver's maximum segment size, in bytes
   unsigned char rwnd;       // receiver's window, in packets, of size <= mss
   unsigned char fwnd;       // Lab6: receiver's FEC window < rwnd, in packets
   float pdrop;              // PA3 Task 2.3: probabilistically drop an ACK
+  unsigned short roi[4];    // region of interest: x, y, w, h, w == 0 if none
+  unsigned char mode;       // transfer modes to ask for, see iqry_t::iq_mode
+  unsigned char level;      // NETIMG_TILE: pyramid level to ask for
+  unsigned char quality;    // NETIMG_DCT: quality to ask for
+  unsigned char format;     // reduced format to ask for, 0 if none
+  char *prevname;           // NETIMG_DELTA: file of the copy we have
+  LTGA *prev;               // that copy, NULL if none
+  char *cachedir;           // on-disk cache, NULL if not kept
 
   unsigned int next_seqn;   // Lab6 and PA3: next expected sequence number
 
+  netimg_sink_t sink;       // told of every range filled in, NULL if none
+  void *sinkarg;
+  char *sname;              // server, as given to connect()
+  unsigned char nflows;     // flows to ask for, see setflows()
+  bool mcast;               // multicast may be used, see setmcast()
+
 public:
   int sd;                   // socket descriptor
   imsg_t imsg;
+  unsigned char *buf;       // the image as sent on the wire, the caller's
+  long bufsize;             // its size, known once recvimsg() returns,
+                            // that of the range asked for if any
+  unsigned short dispw;     // display window size, also the resolution
+  unsigned short disph;     // cap asked for, if set with -g
+  bool done;                // NETIMG_FIN received
+  unsigned int rstart;      // NETIMG_RANGE: payload bytes asked for,
+  unsigned int rend;        // rend 0 for all of it, see setrange()
+  char *localpath;          // server's Unix domain socket, NULL if
+                            // reached over UDP
+  int shmfd;                // local transport: memfd holding the payload
+  bool tcp;                 // TCP transport, the payload follows imsg
+  unsigned int rendered;    // TCP transport: bytes delivered to the sink
+  unsigned char *zbuf;      // NETIMG_DATA_Z payload before decoding
   unsigned int window_start;
   unsigned int datasize;
   int packets_count;
   bool go_back_n_mode;
   unsigned int next_next_seqn;
-  netimg() {next_seqn = 0; window_start = 0; packets_count = 0; go_back_n_mode=false;}   // default constructor
-  int args(int argc, char *argv[], char **sname, unsigned short *port, char **imgname);
+  netimgsess() {mss = NETIMG_MSS; rwnd = NETIMG_RCVWIN; fwnd = NETIMG_FECWIN; pdrop = 0.0; next_seqn = 0; roi[0] = roi[1] = roi[2] = roi[3] = 0; mode = 0; level = 0; quality = 0; format = 0; prevname = NULL; prev = NULL; cachedir = NULL; sink = NULL; sinkarg = NULL; rstart = rend = 0; sname = NULL; nflows = 0; mcast = false; buf = NULL; bufsize = 0; localpath = NULL; shmfd = -1; tcp = false; rendered = 0; dispw = disph = 0; done = false; zbuf = NULL; window_start = 0; packets_count = 0; go_back_n_mode=false;}   // default constructor
+  virtual ~netimgsess() {}
+  int connect(char *sname, unsigned short port);
+  int fd() { return(sd); }
   int rcvbuf() { return(rwnd*mss); }
+  void setbuf(unsigned char *image);
+  void setsink(netimg_sink_t func, void *arg);
+  int process();
   int sendqry(char *imgname);
+  int sendhash(unsigned int nhash);
+  void prefill();
+  void settile(unsigned char lvl, unsigned short x, unsigned short y,
+               unsigned short w, unsigned short h) {  // NETIMG_TILE
+    level = lvl; roi[0] = x; roi[1] = y; roi[2] = w; roi[3] = h; }
+  void setrange(unsigned int start, unsigned int end) {  // NETIMG_RANGE
+    rstart = start; rend = end; }
+  void setend(unsigned int end);
+  unsigned int have() { return(rstart + next_seqn); }  // payload offset
+  void setflows(unsigned char n) { nflows = n; }       // see im_nflows
+  int recvflows();
+  void setmcast(bool on) { mcast = on; }             // see im_group
+  int recvmcast();
+  void reset();
+  virtual char recvimsg();
+  virtual int recvimg();
+  void recvstream();
+  int reconstruct_image(unsigned char* fec_data);
+  void deliver(long offset, long size);
+  int send_ack(ihdr_t* ack);
+
+};
+
+class netimg : public netimgsess {  // the rdpimg client, displays it
+public:
+  char *outname;            // headless: file the image is written to,
+                            // NULL to display it
+  unsigned short fps;       // redraws per second, at most, 0 to
+                            // receive in the GLUT idle loop instead
+  bool threaded;            // received on a thread of its own, see
+                            // recvimg_thread()
+  spsc_t rxq;               // threaded: ranges render()ed since the
+                            // GLUT thread last looked, see redraw_glut()
+  long dirtylo;             // rows of the display image changed since
+  long dirtyhi;             // the last upload(), none if dirtyhi < 0
+  bool texinit;             // whole image given to OpenGL once
+  bool usepbo;              // upload() through a pixel buffer object,
+  unsigned int pbod;        // this one, 0 if none
+  bool bc1gl;               // NETIMG_BC1: OpenGL takes the blocks as
+                            // they are, else they are decoded here
+  int nrepl;                // striped mode: other servers holding the
+  char *rnames[NETIMG_MAXREPL];          // same images, with their
+  unsigned short rports[NETIMG_MAXREPL]; // ports, see netimgstripe.cpp
+  bool striped;             // receiving through netimgstripe_wait()
+  netimg() {outname = NULL; fps = NETIMG_FPS; threaded = false; spsc_init(&rxq); dirtylo = 0; dirtyhi = -1; texinit = false; usepbo = false; pbod = 0; bc1gl = false; nrepl = 0; striped = false;}   // default constructor
+  int args(int argc, char *argv[], char **sname, unsigned short *port, char **imgname);
   char recvimsg();
-  void recvimg();
-  void reconstruct_image(unsigned char* fec_data);
-  void send_ack(ihdr_t* ack);
+  int recvimg();
+  void upload();
+  int adopt(unsigned char *payload);
+  void render(long offset, long size);
+  void touch(long offset, long size);
 
 };
 
-extern void netimglut_init(int *argc, char *argv[], void (*idlefunc)());
+extern void netimglut_init(int *argc, char *argv[], void (*idlefunc)(), int w, int h);
 extern void netimglut_imginit(unsigned short format);
+extern unsigned int netimglut_newtex();
+extern unsigned short netimglut_glformat(unsigned char format);
+extern int netimglut_s3tc();
+extern unsigned int netimglut_newpbo(long size);
+
+extern unsigned int netimgcache_lookup(char *dir, iqry_t *iqry);
+extern unsigned char *netimgcache_map(imsg_t *imsg);
+extern void netimgcache_store(imsg_t *imsg, unsigned char *image, long size);
+
+extern void netimgtile_init(char *imgname);
+extern void netimgtile_idle();
+
+extern void netimgstripe_init(char *imgname, char *sname, unsigned short port);
+extern int netimgstripe_wait(int timeout);
 
 #endif /* __NETIMG_H__ */
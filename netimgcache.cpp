@@ -0,0 +1,163 @@
+/*
+ * Copyright (c) 2016 University of Michigan, Ann Arbor.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms are permitted
+ * provided that the above copyright notice and this paragraph are
+ * duplicated in all such forms and that any documentation,
+ * advertising materials, and other materials related to such
+ * distribution and use acknowledge that the software was developed
+ * by the University of Michigan, Ann Arbor. The name of the University
+ * may not be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * Author: Sugih Jamin (jamin@eecs.umich.edu)
+ *
+*/
+#include <stdio.h>         // fprintf(), snprintf(), rename()
+#include <string.h>        // memset(), memcpy(), memcmp()
+#include <unistd.h>        // close(), write(), getpid()
+#include <fcntl.h>         // open()
+#include <sys/stat.h>      // fstat(), mkdir()
+#include <sys/mman.h>      // mmap()
+
+#include "netimg.h"
+#include "seghash.h"
+
+/*
+ * On-disk cache of received images, one file per query: a
+ * NETIMGCACHE_MAGIC tag and the imsg_t of the reply, in host byte
+ * order, followed by the im_size bytes received.  Files are named
+ * after a hash of the query, less the fields that don't change the
+ * reply.  The im_etag of a cached reply goes out as the query's
+ * iq_etag.  If the server still has the same content, it answers
+ * NETIMG_NOTMOD without sending it and the file, already mapped,
+ * becomes the image buffer.
+ */
+
+#define NETIMGCACHE_MAGIC "NIC1"
+#define NETIMGCACHE_HDR   (4 + sizeof(imsg_t))
+
+static char cachepath[NETIMG_MAXFNAME + 24];
+static unsigned char *cachemap;   // cached file, NULL if none
+static long cachesize;            // of cachemap
+
+/*
+ * netimgcache_lookup: look up the reply to "iqry", as about to be
+ * sent, in directory "dir", and keep it mapped if found.
+ *
+ * Returns the cached reply's im_etag, or 0 if there is none.
+ */
+unsigned int
+netimgcache_lookup(char *dir, iqry_t *iqry)
+{
+  iqry_t key;
+  unsigned char hash[SEGHASH_LEN];
+  struct stat st;
+  imsg_t imsg;
+  int fd;
+
+  if (strlen(dir) >= NETIMG_MAXFNAME) {
+    return(0);
+  }
+  memcpy(&key, iqry, sizeof(iqry_t));
+  key.iq_rwnd = key.iq_fwnd = 0;
+  key.iq_mode &= ~NETIMG_DELTA;
+  key.iq_nhash = key.iq_etag = 0;
+  seghash(hash, (unsigned char *) &key, sizeof(iqry_t), 0);
+  snprintf(cachepath, sizeof(cachepath), "%s/%02x%02x%02x%02x%02x%02x%02x%02x.nic", dir,
+           hash[0], hash[1], hash[2], hash[3], hash[4], hash[5], hash[6], hash[7]);
+
+  mkdir(dir, 0755);   // for netimgcache_store(), may already exist
+  fd = open(cachepath, O_RDONLY);
+  if (fd < 0) {
+    return(0);
+  }
+  if (fstat(fd, &st) < 0 || st.st_size < (off_t) NETIMGCACHE_HDR) {
+    close(fd);
+    return(0);
+  }
+  // private: the image buffer may be written to, the file is not
+  cachemap = (unsigned char *) mmap(NULL, st.st_size, PROT_READ|PROT_WRITE,
+                                    MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (cachemap == MAP_FAILED) {
+    cachemap = NULL;
+    return(0);
+  }
+  cachesize = st.st_size;
+
+  memcpy(&imsg, cachemap+4, sizeof(imsg_t));
+  if (memcmp(cachemap, NETIMGCACHE_MAGIC, 4) || imsg.im_type != NETIMG_FOUND
+      || (long) (NETIMGCACHE_HDR + imsg.im_size) != cachesize) {
+    munmap(cachemap, cachesize);
+    cachemap = NULL;
+    return(0);
+  }
+
+  return(imsg.im_etag);
+}
+
+/*
+ * netimgcache_map: the server said NETIMG_NOTMOD to the query last
+ * looked up.  Returns the cached bytes received, of the size given
+ * in "imsg", or NULL if they don't match "imsg".
+ */
+unsigned char *
+netimgcache_map(imsg_t *imsg)
+{
+  imsg_t cached;
+
+  if (!cachemap) {
+    return(NULL);
+  }
+  memcpy(&cached, cachemap+4, sizeof(imsg_t));
+  if (cached.im_etag != imsg->im_etag || cached.im_size != imsg->im_size) {
+    return(NULL);
+  }
+  fprintf(stderr, "netimgcache_map: %u bytes from %s\n", imsg->im_size, cachepath);
+
+  return(cachemap + NETIMGCACHE_HDR);
+}
+
+/*
+ * netimgcache_store: keep reply "imsg" and the "size" bytes received
+ * at "image" as the answer to the query last looked up, unless the
+ * server didn't tag it.  Written to a temporary file first, so that
+ * a cache file is either whole or missing.
+ */
+void
+netimgcache_store(imsg_t *imsg, unsigned char *image, long size)
+{
+  char tmppath[sizeof(cachepath) + 16];
+  imsg_t cached;
+  int fd;
+  bool ok;
+
+  if (!cachepath[0] || !imsg->im_etag) {
+    return;
+  }
+  snprintf(tmppath, sizeof(tmppath), "%s.%d", cachepath, (int) getpid());
+  fd = open(tmppath, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+  if (fd < 0) {
+    perror("netimgcache_store: open");
+    return;
+  }
+  memcpy(&cached, imsg, sizeof(imsg_t));
+  cached.im_type = NETIMG_FOUND;
+  ok = write(fd, NETIMGCACHE_MAGIC, 4) == 4
+    && write(fd, &cached, sizeof(imsg_t)) == sizeof(imsg_t)
+    && write(fd, image, size) == size;
+  close(fd);
+  if (!ok || rename(tmppath, cachepath) < 0) {
+    perror("netimgcache_store");
+    unlink(tmppath);
+    return;
+  }
+  fprintf(stderr, "netimgcache_store: %ld bytes to %s\n", size, cachepath);
+
+  return;
+}
@@ -0,0 +1,224 @@
+/*
+ * Copyright (c) 2016 University of Michigan, Ann Arbor.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms are permitted
+ * provided that the above copyright notice and this paragraph are
+ * duplicated in all such forms and that any documentation,
+ * advertising materials, and other materials related to such
+ * distribution and use acknowledge that the software was developed
+ * by the University of Michigan, Ann Arbor. The name of the University
+ * may not be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * Author: Sugih Jamin (jamin@eecs.umich.edu)
+ *
+*/
+#include <stdio.h>         // fprintf()
+#include <stdlib.h>        // malloc(), free()
+#include <assert.h>        // assert()
+#include <string.h>        // memcpy()
+#ifdef _WIN32
+#include <winsock2.h>
+#else
+#include <unistd.h>
+#include <arpa/inet.h>     // htonl()
+#include <sys/types.h>     // u_short
+#include <sys/socket.h>    // send()
+#include <sys/ioctl.h>     // ioctl(), FIONBIO
+#include <poll.h>          // poll()
+#include <pthread.h>       // pthread_create()
+#endif
+
+#include "netimg.h"
+#include "socks.h"
+
+/*
+ * Multi-flow transfers, see imsg_t::im_nflows.  Each flow is a
+ * session of its own, a copy of the one that queried, receiving on a
+ * thread of its own.  A flow receives the segments it carries back
+ * to back into a buffer of its own, the one its FEC works on, and
+ * copies each as it lands to its place in the payload.  The sink is
+ * then called from one flow at a time.
+ */
+
+#define FLOW_RTO   (NETIMG_SLEEP*1000 + NETIMG_USLEEP/1000)  // ms
+#define FLOW_QUIET ((NETIMG_MAXTRIES+1)*FLOW_RTO)  // the server gave up
+
+typedef struct flowset flowset_t;
+
+typedef struct {
+  netimgsess *sess;        // the flow's own
+  flowset_t *set;
+  int f;                   // which of them
+  int err;                 // 0, or -1 if it failed
+  bool started;            // its thread
+  pthread_t thread;
+} flow_t;
+
+struct flowset {
+  netimgsess *parent;      // the session that queried
+  int nflows;
+  pthread_mutex_t lock;    // held around the parent's sink
+  flow_t flows[NETIMG_MAXFLOWS];
+};
+
+/*
+ * flow_sink: "len" bytes at "offset" of flow "arg" have arrived, at
+ * "data".  Copy them to their place in the payload and tell the
+ * parent's sink.
+ */
+static void
+flow_sink(void *arg, long offset, unsigned char *data, long len)
+{
+  flow_t *fl = (flow_t *) arg;
+  netimgsess *parent = fl->set->parent;
+  long datasize = parent->datasize;
+  long n, at;
+
+  while (len > 0) {
+    n = datasize - offset % datasize;
+    n = n > len ? len : n;
+    at = (offset/datasize*fl->set->nflows + fl->f)*datasize + offset % datasize;
+    memcpy(parent->buf + at, data, n);
+    pthread_mutex_lock(&fl->set->lock);
+    parent->deliver(at, n);
+    pthread_mutex_unlock(&fl->set->lock);
+    offset += n;
+    data += n;
+    len -= n;
+  }
+
+  return;
+}
+
+/*
+ * flow_hello: tell the server where flow "fl" is, so it starts
+ * sending on it.
+ */
+static void
+flow_hello(flow_t *fl)
+{
+  ihdr_t hello;
+
+  hello.ih_vers = NETIMG_VERS;
+  hello.ih_type = NETIMG_ACK;
+  hello.ih_size = htons(sizeof(ihdr_t));
+  hello.ih_seqn = htonl(NETIMG_SYNSEQ);
+  send(fl->sess->sd, (char *) &hello, sizeof(ihdr_t), 0);
+
+  return;
+}
+
+/*
+ * flow_recv: thread receiving flow "arg" till done, saying hello
+ * again every RTO till the server starts sending.
+ */
+static void *
+flow_recv(void *arg)
+{
+  flow_t *fl = (flow_t *) arg;
+  struct pollfd pfd;
+  int quiet = 0;
+  bool heard = false;
+
+  pfd.fd = fl->sess->sd;
+  pfd.events = POLLIN;
+  flow_hello(fl);
+  while (!fl->sess->done) {
+    if (poll(&pfd, 1, FLOW_RTO) <= 0) {
+      if ((quiet += FLOW_RTO) >= FLOW_QUIET) {
+        fprintf(stderr, "netimgsess::recvflows: flow %d went quiet\n", fl->f);
+        fl->err = -1;
+        break;
+      }
+      if (!heard) {
+        flow_hello(fl);
+      }
+      continue;
+    }
+    heard = true;
+    quiet = 0;
+    if (fl->sess->process() < 0) {
+      fl->err = -1;
+      break;
+    }
+  }
+
+  return(NULL);
+}
+
+/*
+ * recvflows: imsg says the payload comes over im_nflows flows.  Open
+ * them and receive them all, each on a thread of its own, into
+ * "buf", blocking till all are done.
+ *
+ * Returns 0 once the image is done, -1 if any flow failed.
+ */
+int netimgsess::
+recvflows()
+{
+  flowset_t set;
+  flow_t *fl;
+  unsigned char *flowbuf;
+  long offset;
+  int f, err = 0, nonblock = 1;
+
+  datasize = mss - sizeof(ihdr_t) - NETIMG_UDPIP;
+  set.parent = this;
+  set.nflows = imsg.im_nflows;
+  pthread_mutex_init(&set.lock, NULL);
+  flowbuf = (unsigned char *) malloc(bufsize);
+  net_assert((!flowbuf), "netimgsess::recvflows: malloc");
+
+  for (offset = f = 0; f < set.nflows; f++) {
+    fl = &set.flows[f];
+    fl->set = &set;
+    fl->f = f;
+    fl->err = 0;
+    fl->sess = new netimgsess(*this);  // same settings
+    fl->sess->reset();
+    fl->sess->zbuf = NULL;
+    fl->sess->cachedir = NULL;  // it holds only part of the payload
+    fl->sess->setsink(flow_sink, fl);
+    fl->sess->setbuf(flowbuf + offset);
+    fl->sess->bufsize = netimg_flowsize(bufsize, datasize, set.nflows, f);
+    offset += fl->sess->bufsize;
+    fl->sess->connect(sname, imsg.im_fports[f]);
+    ioctl(fl->sess->sd, FIONBIO, &nonblock);
+  }
+
+  for (f = 0; f < set.nflows; f++) {
+    fl = &set.flows[f];
+    fl->started = !pthread_create(&fl->thread, NULL, flow_recv, fl);
+    if (!fl->started) {
+      fprintf(stderr, "netimgsess::recvflows: no thread for flow %d\n", f);
+      fl->err = -1;
+    }
+  }
+  for (f = 0; f < set.nflows; f++) {
+    fl = &set.flows[f];
+    if (fl->started) {
+      pthread_join(fl->thread, NULL);
+    }
+    err |= fl->err;
+    socks_close(fl->sess->sd);
+    delete fl->sess;
+  }
+
+  free(flowbuf);
+  pthread_mutex_destroy(&set.lock);
+  if (err) {
+    return(-1);
+  }
+  if (cachedir) {
+    netimgcache_store(&imsg, buf, bufsize);
+  }
+  next_seqn = bufsize;
+  done = true;
+
+  return(0);
+}
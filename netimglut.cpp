@@ -25,6 +25,7 @@
 #else
 #include <unistd.h>
 #endif
+#define GL_GLEXT_PROTOTYPES  // glBindBuffer(), glBufferSubData()
 #ifdef __APPLE__
 #include <GLUT/glut.h>
 #else
@@ -104,36 +105,90 @@ netimglut_kbd(unsigned char key, int x, int y)
   return;
 }
 
+/*
+ * netimglut_glformat: the OpenGL pixel format of a NETIMG_* format.
+ */
+unsigned short
+netimglut_glformat(unsigned char format)
+{
+  switch(format) {
+  case NETIMG_RGBA:
+    return(GL_RGBA);
+  case NETIMG_RGB:
+  case NETIMG_RGB565:        // converted on arrival
+  case NETIMG_PAL8:
+    return(GL_RGB);
+  case NETIMG_GSA:
+    return(GL_LUMINANCE_ALPHA);
+  default:
+    return(GL_LUMINANCE);
+  }
+}
+
+/*
+ * netimglut_s3tc: whether OpenGL takes BC1 (S3TC DXT1) coded
+ * textures as they are.
+ */
+int
+netimglut_s3tc()
+{
+  return(glutExtensionSupported("GL_EXT_texture_compression_s3tc"));
+}
+
+/*
+ * netimglut_newpbo: create a pixel buffer object of "size" bytes for
+ * texture uploads to be staged in, kept for as long as the image is.
+ *
+ * Returns it, or 0 if pixel buffer objects are not supported.
+ */
+unsigned int
+netimglut_newpbo(long size)
+{
+  GLuint pbod;
+
+  if (!glutExtensionSupported("GL_ARB_pixel_buffer_object")) {
+    return(0);
+  }
+  glGenBuffers(1, &pbod);
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbod);
+  glBufferData(GL_PIXEL_UNPACK_BUFFER, size, NULL, GL_STREAM_DRAW);
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+  return(pbod);
+}
+
+/*
+ * netimglut_newtex: create a texture object, bind it and return it.
+ */
+unsigned int
+netimglut_newtex()
+{
+  GLuint tod;
+
+  glGenTextures(1, &tod);
+  glBindTexture(GL_TEXTURE_2D, tod);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR); 
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR); 
+  glTexEnvf(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_REPLACE); 
+
+  return(tod);
+}
+
 void
 netimglut_imginit(unsigned short stride)
 {
-  int i, tod;
+  int i;
 
   glMatrixMode(GL_MODELVIEW);
   glLoadIdentity();
 
   glPolygonMode(GL_FRONT, GL_FILL);
 
-  glGenTextures(1, (GLuint*) &tod);
-  glBindTexture(GL_TEXTURE_2D, tod);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR); 
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR); 
-  glTexEnvf(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_REPLACE); 
+  netimglut_newtex();
   glEnable(GL_TEXTURE_2D);
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 1);  // rows are not padded
 
-/* 
-#if PBO
-  int pbod;
-
-  glGenBuffers(1, (GLuint*) &pbod); 
-  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbod);
-  glBufferData(GL_PIXEL_UNPACK_BUFFER, img_size, NULL, GL_DYNAMIC_DRAW);  
-#else
-*/
   image = (char *)calloc(img_size, sizeof(unsigned char));
-/*
-#endif
-*/
 
   /* paint the image texture background red if color, white
      otherwise to better visualize lost segments */
@@ -145,15 +200,15 @@ netimglut_imginit(unsigned short stride)
 }
 
 void
-netimglut_init(int *argc, char *argv[], void (*idlefunc)())
+netimglut_init(int *argc, char *argv[], void (*idlefunc)(), int w, int h)
 {
 
-  width  = NETIMG_WIDTH;    /* initial window width and height, */
-  height = NETIMG_HEIGHT;   /* within which we draw. */
+  width  = w;               /* initial window width and height, */
+  height = h;               /* within which we draw. */
 
   glutInit(argc, argv);
   glutInitDisplayMode(GLUT_SINGLE | GLUT_RGBA);
-  glutInitWindowSize((int) NETIMG_WIDTH, (int) NETIMG_HEIGHT);
+  glutInitWindowSize(w, h);
   wd = glutCreateWindow("Netimg Display" /* title */ );   // wd global
   glutDisplayFunc(netimglut_display);
   glutReshapeFunc(netimglut_reshape);
@@ -0,0 +1,294 @@
+/*
+ * Copyright (c) 2016 University of Michigan, Ann Arbor.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms are permitted
+ * provided that the above copyright notice and this paragraph are
+ * duplicated in all such forms and that any documentation,
+ * advertising materials, and other materials related to such
+ * distribution and use acknowledge that the software was developed
+ * by the University of Michigan, Ann Arbor. The name of the University
+ * may not be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * Author: Sugih Jamin (jamin@eecs.umich.edu)
+ *
+*/
+#include <stdio.h>         // fprintf()
+#include <stdlib.h>        // malloc(), calloc(), free(), random()
+#include <assert.h>        // assert()
+#include <limits.h>        // INT_MAX
+#include <string.h>        // memcpy(), memset()
+#ifdef _WIN32
+#include <winsock2.h>
+#else
+#include <unistd.h>
+#include <netinet/in.h>    // struct sockaddr_in
+#include <arpa/inet.h>     // htonl()
+#include <sys/types.h>     // u_short
+#include <sys/socket.h>    // send(), recv(), getsockname()
+#include <poll.h>          // poll()
+#endif
+
+#include "netimg.h"
+#include "socks.h"
+#include "fec.h"
+
+/*
+ * Multicast transfers, see imsg_t::im_group.  Segments arrive in any
+ * order, once, from a server that doesn't hear from us but for our
+ * NACKs.  Which have arrived is kept per segment.  The FEC of a
+ * window is kept until the window is complete, it rebuilds the one
+ * segment of it missing, whenever that is the case.  The rest are
+ * NACKed whenever the server sends its FIN.
+ */
+
+#define MCAST_RTO   (NETIMG_SLEEP*1000 + NETIMG_USLEEP/1000)  // ms
+#define MCAST_QUIET ((NETIMG_MAXTRIES+1)*MCAST_RTO)  // the server gave up
+
+typedef struct {
+  netimgsess *sess;
+  long datasize;
+  long nsegs;              // of the payload
+  long got;                // of which arrived or rebuilt
+  unsigned char *have;     // whether each has
+  int gfwnd;               // segments per FEC window
+  unsigned char **fec;     // FEC of each window, NULL till it arrives
+} mcast_t;
+
+/*
+ * mcast_segsize: bytes of segment "seg" of the payload received in
+ * "mc", all but the last are datasize.
+ */
+static long
+mcast_segsize(mcast_t *mc, long seg)
+{
+  long left = mc->sess->bufsize - seg*mc->datasize;
+
+  return(left < mc->datasize ? left : mc->datasize);
+}
+
+/*
+ * mcast_have: segment "seg" of "mc" is in place, tell the sink.
+ */
+static void
+mcast_have(mcast_t *mc, long seg)
+{
+  mc->have[seg] = 1;
+  mc->got++;
+  mc->sess->deliver(seg*mc->datasize, mcast_segsize(mc, seg));
+
+  return;
+}
+
+/*
+ * mcast_repair: if FEC window "w" of "mc" has its FEC and misses
+ * exactly one segment, rebuild it.  A complete window's FEC is no
+ * longer needed.
+ */
+static void
+mcast_repair(mcast_t *mc, long w)
+{
+  long seg, first, last, lost = -1;
+  int missing = 0;
+
+  if (!mc->fec[w]) {
+    return;
+  }
+  first = w*mc->gfwnd;
+  last = first + mc->gfwnd < mc->nsegs ? first + mc->gfwnd : mc->nsegs;
+  for (seg = first; seg < last; seg++) {
+    if (!mc->have[seg]) {
+      missing++;
+      lost = seg;
+    }
+  }
+  if (missing == 1) {
+    for (seg = first; seg < last; seg++) {
+      if (seg != lost) {
+        fec_accum(mc->fec[w], mc->sess->buf + seg*mc->datasize, mc->datasize,
+                  mcast_segsize(mc, seg));
+      }
+    }
+    memcpy(mc->sess->buf + lost*mc->datasize, mc->fec[w], mcast_segsize(mc, lost));
+    mcast_have(mc, lost);
+    missing = 0;
+  }
+  if (!missing) {
+    free(mc->fec[w]);
+    mc->fec[w] = NULL;
+  }
+
+  return;
+}
+
+/*
+ * mcast_hello: tell the server we have joined the group.
+ */
+static void
+mcast_hello(int sd)
+{
+  ihdr_t hello;
+
+  hello.ih_vers = NETIMG_VERS;
+  hello.ih_type = NETIMG_ACK;
+  hello.ih_size = htons(sizeof(ihdr_t));
+  hello.ih_seqn = htonl(NETIMG_SYNSEQ);
+  send(sd, (char *) &hello, sizeof(ihdr_t), 0);
+
+  return;
+}
+
+/*
+ * mcast_nack: the server's FIN came, NACK every segment of "mc" still
+ * missing, in as many NETIMG_NACK as it takes, each dropped with
+ * probability "pdrop" as ACKs are.  "pkt" has room for an ihdr_t and
+ * datasize bytes.
+ */
+static void
+mcast_nack(mcast_t *mc, unsigned char *pkt, float pdrop)
+{
+  ihdr_t *hdr = (ihdr_t *) pkt;
+  unsigned int *offsets = (unsigned int *) (pkt + sizeof(ihdr_t));
+  long seg, per = mc->datasize/sizeof(unsigned int);
+  int n = 0;
+
+  hdr->ih_vers = NETIMG_VERS;
+  hdr->ih_type = NETIMG_NACK;
+  hdr->ih_seqn = 0;
+  for (seg = 0; seg < mc->nsegs; seg++) {
+    if (!mc->have[seg]) {
+      offsets[n++] = htonl((unsigned int) (seg*mc->datasize));
+    }
+    if (n == per || (n && seg == mc->nsegs-1)) {
+      hdr->ih_size = htons(n*sizeof(unsigned int));
+      if (((float) random())/INT_MAX < pdrop) {
+        fprintf(stderr, "netimgsess::recvmcast: NACK of %d segments DROPPED\n", n);
+      } else {
+        send(mc->sess->sd, (char *) pkt, sizeof(ihdr_t) + n*sizeof(unsigned int), 0);
+      }
+      n = 0;
+    }
+  }
+
+  return;
+}
+
+/*
+ * recvmcast: imsg says the payload is sent to a multicast group.
+ * Join it on the interface we reach the server through, say hello
+ * till the first packet comes, and receive it all into "buf",
+ * blocking till done.
+ *
+ * Returns 0 once the image is done, -1 if we couldn't join the group
+ * or the server went quiet first.
+ */
+int netimgsess::
+recvmcast()
+{
+  mcast_t mc;
+  struct sockaddr_in group, local;
+  socklen_t len = sizeof(struct sockaddr_in);
+  struct pollfd pfd;
+  unsigned char *pkt;
+  ihdr_t *hdr;
+  long seg, nwins, w;
+  unsigned int seqn;
+  int msd, bytes, size, quiet = 0, err = 0;
+  bool heard = false;
+
+  memset((char *) &group, 0, sizeof(struct sockaddr_in));
+  group.sin_family = AF_INET;
+  group.sin_addr.s_addr = imsg.im_group;
+  group.sin_port = imsg.im_gport;
+  getsockname(sd, (struct sockaddr *) &local, &len);
+  msd = socks_mcastclntinit(&group, &local.sin_addr, rcvbuf());
+  if (msd < 0) {
+    perror("netimgsess::recvmcast: cannot join group");
+    return(-1);
+  }
+
+  datasize = mss - sizeof(ihdr_t) - NETIMG_UDPIP;
+  mc.sess = this;
+  mc.datasize = datasize;
+  mc.nsegs = (bufsize + datasize-1)/datasize;
+  mc.got = 0;
+  mc.gfwnd = imsg.im_gfwnd ? imsg.im_gfwnd : 1;
+  nwins = (mc.nsegs + mc.gfwnd-1)/mc.gfwnd;
+  mc.have = (unsigned char *) calloc(mc.nsegs ? mc.nsegs : 1, 1);
+  mc.fec = (unsigned char **) calloc(nwins ? nwins : 1, sizeof(unsigned char *));
+  pkt = (unsigned char *) malloc(sizeof(ihdr_t) + datasize);
+  net_assert((!mc.have || !mc.fec || !pkt), "netimgsess::recvmcast: malloc");
+  hdr = (ihdr_t *) pkt;
+
+  pfd.fd = msd;
+  pfd.events = POLLIN;
+  mcast_hello(sd);
+  while (mc.got < mc.nsegs) {
+    if (poll(&pfd, 1, MCAST_RTO) <= 0) {
+      if ((quiet += MCAST_RTO) >= MCAST_QUIET) {
+        fprintf(stderr, "netimgsess::recvmcast: server went quiet, %ld of %ld segments\n",
+                mc.got, mc.nsegs);
+        err = -1;
+        break;
+      }
+      if (!heard) {
+        mcast_hello(sd);
+      }
+      continue;
+    }
+    bytes = recv(msd, (char *) pkt, sizeof(ihdr_t) + datasize, 0);
+    if (bytes < (int) sizeof(ihdr_t) || hdr->ih_vers != NETIMG_VERS) {
+      continue;
+    }
+    size = bytes - sizeof(ihdr_t);
+    heard = true;
+    quiet = 0;
+    seqn = ntohl(hdr->ih_seqn);
+    seg = seqn/datasize;
+    if (hdr->ih_type == NETIMG_FIN) {
+      mcast_nack(&mc, pkt, pdrop);
+    } else if (seqn % datasize || seg >= mc.nsegs) {
+      continue;  // not of this payload
+    } else if (hdr->ih_type == NETIMG_FEC) {
+      w = seg/mc.gfwnd;
+      if (seg % mc.gfwnd || mc.fec[w] || size != (int) datasize) {
+        continue;
+      }
+      mc.fec[w] = (unsigned char *) malloc(datasize);
+      net_assert((!mc.fec[w]), "netimgsess::recvmcast: malloc");
+      memcpy(mc.fec[w], pkt + sizeof(ihdr_t), datasize);
+      mcast_repair(&mc, w);
+    } else if (hdr->ih_type == NETIMG_DATA || hdr->ih_type == NETIMG_DATA_S) {
+      if (mc.have[seg] || size > mcast_segsize(&mc, seg)) {
+        continue;
+      }
+      // padding of a slot is not sent, but FEC covers it
+      memcpy(buf + seqn, pkt + sizeof(ihdr_t), size);
+      memset(buf + seqn + size, 0, mcast_segsize(&mc, seg) - size);
+      mcast_have(&mc, seg);
+      mcast_repair(&mc, seg/mc.gfwnd);
+    }
+  }
+
+  close(msd);  // leaves the group
+  for (w = 0; w < nwins; w++) {
+    free(mc.fec[w]);
+  }
+  free(mc.fec);
+  free(mc.have);
+  free(pkt);
+  if (err) {
+    return(-1);
+  }
+  if (cachedir) {
+    netimgcache_store(&imsg, buf, bufsize);
+  }
+  next_seqn = bufsize;
+  done = true;
+
+  return(0);
+}
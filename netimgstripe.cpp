@@ -0,0 +1,452 @@
+/*
+ * Copyright (c) 2016 University of Michigan, Ann Arbor.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms are permitted
+ * provided that the above copyright notice and this paragraph are
+ * duplicated in all such forms and that any documentation,
+ * advertising materials, and other materials related to such
+ * distribution and use acknowledge that the software was developed
+ * by the University of Michigan, Ann Arbor. The name of the University
+ * may not be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * Author: Sugih Jamin (jamin@eecs.umich.edu)
+ *
+*/
+#include <stdio.h>         // fprintf()
+#include <stdlib.h>        // malloc(), free()
+#include <string.h>        // memset()
+#ifdef _WIN32
+#include <winsock2.h>
+#else
+#include <unistd.h>
+#include <sys/time.h>      // gettimeofday()
+#include <sys/types.h>     // u_short
+#include <sys/socket.h>    // recv()
+#include <sys/ioctl.h>     // ioctl(), FIONBIO
+#include <arpa/inet.h>     // htonl()
+#include <poll.h>          // poll()
+#endif
+
+#include "netimg.h"
+#include "socks.h"
+
+/*
+ * Striped mode: the image is fetched from several servers holding
+ * the same images at once, each sending disjoint ranges of the
+ * payload, see NETIMG_RANGE.  The payload is cut into stripes of
+ * NETIMG_STRIPESEGS segments, handed out in order to whichever server
+ * is free, one at a time each, since a server sends to one client at
+ * a time.  Faster servers thus end up sending more stripes.  Once
+ * none are left, a free server takes over the tail of the stripe
+ * with the most left to go, in proportion to how fast the two have
+ * been sending.  A server gone quiet, or not sending the same image,
+ * is given up on and its stripe handed out again.
+ *
+ * Each server has a session of its own, a copy of netimg's, receiving
+ * straight into "image" and render()ing through the same sink.  The
+ * query netimg sent itself is for the first stripe: its session is
+ * taken over as the first server's.
+ */
+
+#define STRIPE_IDLE     0    // no stripe outstanding
+#define STRIPE_WAITIMSG 1    // stripe asked for, waiting for its imsg_t
+#define STRIPE_RECV     2    // receiving the stripe
+
+#define STRIPE_MINSPLIT 4    // segments, tails no shorter are not split
+#define STRIPE_QUIET    ((NETIMG_MAXTRIES+1)*(NETIMG_SLEEP*1000 + NETIMG_USLEEP/1000))
+                             // ms, the server has given up on us
+
+typedef struct {
+  char *sname;             // server
+  unsigned short port;     // in network byte order
+  netimgsess *sess;        // NULL if given up on
+  int state;
+  struct timeval heard;    // last packet from it, or query to it
+  struct timeval began;    // current stripe's imsg_t
+  double rate;             // bytes per second of its last stripe,
+                           // 0 if none yet
+  long sent;               // bytes of stripes completed
+  int nstripes;
+} repl_t;
+
+typedef struct {           // stripes not handed out yet
+  unsigned int start;
+  unsigned int end;
+} todo_t;
+
+extern unsigned char *image;
+extern netimg netimg;
+
+static char *stripeimg;              // name of the image
+static repl_t repls[NETIMG_MAXREPL];
+static int nrepls;
+static todo_t todo[NETIMG_MAXREPL+1];
+static int ntodo;
+
+static double
+stripe_secs(struct timeval *from, struct timeval *to)
+{
+  return((to->tv_sec - from->tv_sec) + (to->tv_usec - from->tv_usec)/1000000.0);
+}
+
+/*
+ * stripe_left: bytes of the stripe of "r" still to come.
+ */
+static unsigned int
+stripe_left(repl_t *r)
+{
+  return(r->sess->have() < r->sess->rend ? r->sess->rend - r->sess->have() : 0);
+}
+
+/*
+ * stripe_put: hand "start" to "end" of the payload out again.
+ */
+static void
+stripe_put(unsigned int start, unsigned int end)
+{
+  if (start < end) {
+    todo[ntodo].start = start;
+    todo[ntodo].end = end;
+    ntodo++;
+  }
+
+  return;
+}
+
+/*
+ * stripe_query: ask the server of "r" for "start" to "end" of the
+ * payload.  Returns 0 on success, -1 on send error.
+ */
+static int
+stripe_query(repl_t *r, unsigned int start, unsigned int end)
+{
+  r->sess->reset();
+  r->sess->setrange(start, end);
+  r->sess->setbuf(image);
+  if (!r->sess->sendqry(stripeimg)) {
+    return(-1);
+  }
+  gettimeofday(&r->heard, NULL);
+  r->state = STRIPE_WAITIMSG;
+
+  return(0);
+}
+
+/*
+ * stripe_fail: give up on the server of "r", what it had left of its
+ * stripe is handed out again.
+ */
+static void
+stripe_fail(repl_t *r, const char *why)
+{
+  fprintf(stderr, "netimgstripe: %s, giving up on %s:%d\n", why, r->sname, ntohs(r->port));
+  if (r->state != STRIPE_IDLE) {
+    stripe_put(r->state == STRIPE_RECV ? r->sess->have() : r->sess->rstart,
+               r->sess->rend);
+  }
+  socks_close(r->sess->sd);
+  delete r->sess;
+  r->sess = NULL;
+  r->state = STRIPE_IDLE;
+
+  return;
+}
+
+/*
+ * stripe_stale: a packet arrived on "r" outside any stripe, most
+ * likely the server's FIN again, our ACK of it having been lost.
+ * ACK such, drop anything else.
+ */
+static void
+stripe_stale(repl_t *r)
+{
+  ihdr_t hdr;
+
+  if (recv(r->sess->sd, &hdr, sizeof(ihdr_t), 0) == sizeof(ihdr_t)
+      && hdr.ih_type == NETIMG_FIN) {
+    hdr.ih_type = NETIMG_ACK;
+    hdr.ih_size = htons(sizeof(ihdr_t));
+    hdr.ih_seqn = htonl(NETIMG_FINSEQ);
+    r->sess->send_ack(&hdr);
+  }
+
+  return;
+}
+
+/*
+ * stripe_imsg: the imsg_t of the stripe asked of "r" has arrived.  It
+ * must be of the same image as the first server's.
+ */
+static void
+stripe_imsg(repl_t *r)
+{
+  imsg_t peek;
+  char err;
+
+  if (recv(r->sess->sd, &peek, sizeof(imsg_t), MSG_PEEK) != sizeof(imsg_t)) {
+    stripe_stale(r);
+    return;
+  }
+  err = r->sess->recvimsg();
+  if (err != NETIMG_FOUND) {
+    stripe_fail(r, "image not found");
+  } else if (!(r->sess->imsg.im_mode & NETIMG_RANGE)) {
+    stripe_fail(r, "stripes not supported");
+  } else if (r->sess->imsg.im_etag != netimg.imsg.im_etag
+             || r->sess->imsg.im_size != netimg.imsg.im_size) {
+    stripe_fail(r, "image differs");
+  } else {
+    gettimeofday(&r->began, NULL);
+    r->state = STRIPE_RECV;
+  }
+
+  return;
+}
+
+/*
+ * stripe_done: "r" has completed its stripe.
+ */
+static void
+stripe_done(repl_t *r)
+{
+  struct timeval now;
+  double secs;
+  long size;
+
+  gettimeofday(&now, NULL);
+  size = r->sess->rend - r->sess->rstart;
+  secs = stripe_secs(&r->began, &now);
+  r->rate = secs > 0.0 ? size/secs : 0.0;
+  r->sent += size;
+  r->nstripes++;
+  r->state = STRIPE_IDLE;
+
+  return;
+}
+
+/*
+ * stripe_split: no stripes left to hand out, let the free "r" take
+ * over the tail of the one with the most left to go, if worth it.
+ */
+static void
+stripe_split(repl_t *r)
+{
+  repl_t *slow = NULL;
+  struct timeval now;
+  unsigned int left, share, mid, end;
+  double rate, secs;
+  int i;
+
+  for (i = 0; i < nrepls; i++) {
+    if (repls[i].sess && repls[i].state == STRIPE_RECV
+        && (!slow || stripe_left(&repls[i]) > stripe_left(slow))) {
+      slow = &repls[i];
+    }
+  }
+  if (!slow) {
+    return;
+  }
+  left = stripe_left(slow);
+  if (left < STRIPE_MINSPLIT*netimg.datasize) {
+    return;
+  }
+
+  // share the tail by how fast each has been sending
+  gettimeofday(&now, NULL);
+  secs = stripe_secs(&slow->began, &now);
+  rate = secs > 0.0 ? (slow->sess->have() - slow->sess->rstart)/secs : 0.0;
+  if (r->rate > 0.0 && rate > 0.0) {
+    share = (unsigned int) (left*(r->rate/(r->rate + rate)));
+  } else {
+    share = left/2;
+  }
+  end = slow->sess->rend;
+  mid = end - share;
+  mid -= mid % netimg.datasize;
+  if (mid <= slow->sess->have() || mid >= end) {
+    return;
+  }
+
+  fprintf(stderr, "netimgstripe: %s:%d takes over 0x%x to 0x%x from %s:%d\n",
+          r->sname, ntohs(r->port), mid, end, slow->sname, ntohs(slow->port));
+  slow->sess->setend(mid);
+  if (stripe_query(r, mid, end)) {
+    stripe_put(mid, end);  // back to the slow one, once it's done
+  }
+
+  return;
+}
+
+/*
+ * stripe_assign: hand the next stripe, or a tail of one, to every
+ * free server.
+ */
+static void
+stripe_assign()
+{
+  unsigned int start, end, size;
+  repl_t *r;
+  int i;
+
+  size = NETIMG_STRIPESEGS*netimg.datasize;
+  for (i = 0; i < nrepls; i++) {
+    r = &repls[i];
+    if (!r->sess || r->state != STRIPE_IDLE) {
+      continue;
+    }
+    if (!ntodo) {
+      stripe_split(r);
+      continue;
+    }
+    start = todo[0].start;
+    end = todo[0].end - start > size ? start + size : todo[0].end;
+    todo[0].start = end;
+    if (todo[0].start == todo[0].end) {
+      todo[0] = todo[--ntodo];
+    }
+    if (stripe_query(r, start, end)) {
+      stripe_put(start, end);
+      stripe_fail(r, "cannot send query");
+    }
+  }
+
+  return;
+}
+
+/*
+ * netimgstripe_init: netimg has received the imsg_t of the first
+ * stripe of "imgname" from "sname" at "port", in network byte order,
+ * and its buffer is set.  If the server sent only that stripe, take
+ * over its session and connect to the other servers, given with -R,
+ * to fetch the rest of the payload from all of them.
+ */
+void
+netimgstripe_init(char *imgname, char *sname, unsigned short port)
+{
+  int i, nonblock = 1;
+  repl_t *r;
+
+  if (!(netimg.imsg.im_mode & NETIMG_RANGE)) {
+    return;  // the server sent all of it
+  }
+  stripeimg = imgname;
+
+  r = &repls[0];
+  r->sname = sname;
+  r->port = port;
+  r->sess = new netimgsess(netimg);
+  r->state = STRIPE_RECV;
+  gettimeofday(&r->began, NULL);
+  r->heard = r->began;
+  ioctl(r->sess->sd, FIONBIO, &nonblock);
+
+  for (i = 0; i < netimg.nrepl; i++) {
+    r = &repls[i+1];
+    r->sname = netimg.rnames[i];
+    r->port = netimg.rports[i];
+    r->sess = new netimgsess(netimg);  // same settings
+    r->sess->zbuf = NULL;
+    r->sess->connect(r->sname, r->port);
+    ioctl(r->sess->sd, FIONBIO, &nonblock);
+    r->state = STRIPE_IDLE;
+  }
+  nrepls = netimg.nrepl + 1;
+
+  ntodo = 0;
+  stripe_put(netimg.rend, netimg.imsg.im_size);
+  netimg.striped = true;
+  stripe_assign();
+
+  return;
+}
+
+/*
+ * netimgstripe_wait: wait up to "timeout" ms, -1 for no limit, for
+ * packets from any of the servers and receive them.  Keep handing
+ * out stripes, giving up on servers gone quiet, till the image is
+ * done, when netimg::done is set.  Keep calling it after that, for a
+ * while, to ACK the servers' FINs again should ours be lost.
+ *
+ * Returns 1 once the image is done, 0 if not yet, -1 if all servers
+ * have been given up on first.
+ */
+int
+netimgstripe_wait(int timeout)
+{
+  struct pollfd pfds[NETIMG_MAXREPL];
+  int map[NETIMG_MAXREPL];
+  struct timeval now;
+  repl_t *r;
+  int i, n, busy;
+
+  for (n = i = 0; i < nrepls; i++) {
+    if (repls[i].sess) {
+      pfds[n].fd = repls[i].sess->sd;
+      pfds[n].events = POLLIN;
+      map[n++] = i;
+    }
+  }
+  if (!n) {
+    return(netimg.done ? 1 : -1);
+  }
+  if (!netimg.done && (timeout < 0 || timeout > STRIPE_QUIET)) {
+    timeout = STRIPE_QUIET;  // to notice servers gone quiet
+  }
+
+  if (poll(pfds, n, timeout) > 0) {
+    gettimeofday(&now, NULL);
+    for (i = 0; i < n; i++) {
+      r = &repls[map[i]];
+      if (!pfds[i].revents) {
+        continue;
+      }
+      r->heard = now;
+      if ((pfds[i].revents & (POLLERR|POLLNVAL)) && r->state != STRIPE_RECV) {
+        stripe_fail(r, "connection failed");
+      } else if (r->state == STRIPE_IDLE) {
+        stripe_stale(r);
+      } else if (r->state == STRIPE_WAITIMSG) {
+        stripe_imsg(r);
+      } else if ((busy = r->sess->process()) < 0) {
+        stripe_fail(r, "connection failed");
+      } else if (busy) {
+        stripe_done(r);
+      }
+    }
+  }
+
+  if (netimg.done) {
+    return(1);
+  }
+  gettimeofday(&now, NULL);
+  for (i = 0; i < nrepls; i++) {
+    r = &repls[i];
+    if (r->sess && r->state != STRIPE_IDLE
+        && stripe_secs(&r->heard, &now)*1000 > STRIPE_QUIET) {
+      stripe_fail(r, "server went quiet");
+    }
+  }
+  stripe_assign();
+
+  for (busy = i = 0; i < nrepls; i++) {
+    busy += repls[i].sess && repls[i].state != STRIPE_IDLE;
+  }
+  if (busy) {
+    return(0);
+  }
+  if (ntodo) {
+    return(-1);  // none left to hand them to
+  }
+
+  for (i = 0; i < nrepls; i++) {
+    fprintf(stderr, "netimgstripe: %s:%d sent %ld bytes in %d stripes\n",
+            repls[i].sname, ntohs(repls[i].port), repls[i].sent, repls[i].nstripes);
+  }
+  netimg.done = true;
+  return(1);
+}
@@ -0,0 +1,491 @@
+/*
+ * Copyright (c) 2016 University of Michigan, Ann Arbor.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms are permitted
+ * provided that the above copyright notice and this paragraph are
+ * duplicated in all such forms and that any documentation,
+ * advertising materials, and other materials related to such
+ * distribution and use acknowledge that the software was developed
+ * by the University of Michigan, Ann Arbor. The name of the University
+ * may not be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * Author: Sugih Jamin (jamin@eecs.umich.edu)
+ *
+*/
+#include <stdio.h>         // fprintf(), perror(), fflush()
+#include <stdlib.h>        // malloc(), free()
+#include <assert.h>        // assert()
+#include <string.h>        // memset()
+#ifdef _WIN32
+#include <winsock2.h>
+#else
+#include <unistd.h>
+#include <sys/time.h>      // gettimeofday()
+#include <sys/socket.h>    // recv()
+#endif
+#ifdef __APPLE__
+#include <GLUT/glut.h>
+#else
+#include <GL/glut.h>
+#endif
+
+#include "netimg.h"
+#include "pyr.h"
+
+/*
+ * Tiled mode: the image is shown one pyramid level at a time, at one
+ * screen pixel per level pixel.  Only the NETIMG_TILESZ x
+ * NETIMG_TILESZ tiles of the current level that intersect the window
+ * are asked for, one query per tile, and each completed tile is kept
+ * as its own texture in an LRU cache of NETIMG_TILECACHE tiles.  The
+ * coarsest level that fits in the window is fetched first and drawn
+ * stretched underneath as an overview until the tiles arrive.
+ *
+ * Keys: '+' zooms in, '-' zooms out, arrow keys pan, 'q' quits.
+ */
+
+#define TILE_IDLE     0    // no query outstanding
+#define TILE_WAITIMSG 1    // query sent, waiting for its imsg_t
+#define TILE_RECV     2    // receiving the tile's pixels
+
+// ms without a packet of the tile before it is given up and asked
+// for again, the server gives up after NETIMG_MAXTRIES RTOs
+#define TILE_QUIET ((NETIMG_MAXTRIES+1)*(NETIMG_SLEEP*1000 + NETIMG_USLEEP/1000))
+
+typedef struct {
+  int level;               // pyramid level, -1 if entry unused
+  int x, y, w, h;          // region of the level held, in pixels
+  unsigned char *pixels;   // while being received
+  GLuint tod;              // texture, once complete
+  unsigned long used;      // tileclock at last use, for LRU
+  int ready;
+} tile_t;
+
+extern long img_size;
+extern unsigned char *image;
+extern unsigned char *dispimg;
+extern netimg netimg;
+extern GLdouble width, height;   // window size, see netimglut.cpp
+extern int wd;
+
+static char *tileimg;            // name of the image
+static tile_t tiles[NETIMG_TILECACHE];
+static unsigned long tileclock;
+static int nlvls;
+static int lvlw[NETIMG_MAXLVL], lvlh[NETIMG_MAXLVL];
+static int curlvl, ovlvl;        // level shown, overview level
+static int cx, cy;               // window origin in curlvl pixels
+static int state;
+static int qx, qy, qlvl;         // the outstanding query
+static tile_t *fetching;
+static struct timeval qrytime;
+static struct timeval rcvtime;   // last packet of the tile received
+
+static tile_t *
+tile_find(int level, int x, int y)
+{
+  int i;
+
+  for (i = 0; i < NETIMG_TILECACHE; i++) {
+    if (tiles[i].level == level && tiles[i].x == x && tiles[i].y == y) {
+      return(&tiles[i]);
+    }
+  }
+  return(NULL);
+}
+
+/*
+ * tile_alloc: find an unused tile entry or evict the least recently
+ * used complete one.
+ */
+static tile_t *
+tile_alloc()
+{
+  int i;
+  tile_t *victim = NULL;
+
+  for (i = 0; i < NETIMG_TILECACHE; i++) {
+    if (tiles[i].level < 0) {
+      return(&tiles[i]);
+    }
+    if (&tiles[i] != fetching && (!victim || tiles[i].used < victim->used)) {
+      victim = &tiles[i];
+    }
+  }
+
+  if (victim->ready) {
+    glDeleteTextures(1, &victim->tod);
+  }
+  free(victim->pixels);
+  memset(victim, 0, sizeof(tile_t));
+  victim->level = -1;
+
+  return(victim);
+}
+
+/*
+ * tile_begin: the imsg_t of a tile query has arrived.  Allocate the
+ * tile and point the receive buffer at its pixels.
+ */
+static void
+tile_begin()
+{
+  fetching = tile_alloc();
+  fetching->level = netimg.imsg.im_level;
+  fetching->x = qx;
+  fetching->y = qy;
+  fetching->w = netimg.imsg.im_width;
+  fetching->h = netimg.imsg.im_height;
+  fetching->pixels = (unsigned char *) malloc(img_size);
+  net_assert((fetching->pixels == NULL), "netimgtile: malloc");
+  fetching->used = ++tileclock;
+
+  image = dispimg = fetching->pixels;
+  netimg.reset();
+  netimg.setbuf(image);
+  gettimeofday(&rcvtime, NULL);
+  state = TILE_RECV;
+
+  return;
+}
+
+/*
+ * tile_abort: the server went quiet on the tile being received, drop
+ * it, tile_next() asks for it again.
+ */
+static void
+tile_abort()
+{
+  fprintf(stderr, "netimgtile: level %d tile (%d, %d) timed out.\n", qlvl, qx, qy);
+  free(fetching->pixels);
+  memset(fetching, 0, sizeof(tile_t));
+  fetching->level = -1;
+  fetching = NULL;
+  image = dispimg = NULL;
+  state = TILE_IDLE;
+
+  return;
+}
+
+/*
+ * tile_end: the tile is complete, hand it to OpenGL.
+ */
+static void
+tile_end()
+{
+  GLenum format = netimglut_glformat(netimg.imsg.im_format);
+
+  fetching->tod = netimglut_newtex();
+  glTexImage2D(GL_TEXTURE_2D, 0, (GLint) format, fetching->w, fetching->h, 0,
+               format, GL_UNSIGNED_BYTE, fetching->pixels);
+  free(fetching->pixels);
+  fetching->pixels = NULL;
+  fetching->ready = 1;
+  fetching = NULL;
+  image = dispimg = NULL;
+  state = TILE_IDLE;
+
+  glutPostRedisplay();
+  return;
+}
+
+/*
+ * tile_query: ask for the region at (x, y), of at most w x h pixels,
+ * of the given level.
+ */
+static void
+tile_query(int level, int x, int y, int w, int h)
+{
+  qlvl = level;
+  qx = x;
+  qy = y;
+  netimg.settile(level, x, y, w, h);
+  if (netimg.sendqry(tileimg)) {
+    gettimeofday(&qrytime, NULL);
+    state = TILE_WAITIMSG;
+  }
+
+  return;
+}
+
+/*
+ * tile_clampview: keep the window over the current level, centering
+ * the level in the window if it is smaller than the window.
+ */
+static void
+tile_clampview()
+{
+  if (lvlw[curlvl] <= (int) width) {
+    cx = (lvlw[curlvl] - (int) width)/2;
+  } else if (cx < 0) {
+    cx = 0;
+  } else if (cx > lvlw[curlvl] - (int) width) {
+    cx = lvlw[curlvl] - (int) width;
+  }
+
+  if (lvlh[curlvl] <= (int) height) {
+    cy = (lvlh[curlvl] - (int) height)/2;
+  } else if (cy < 0) {
+    cy = 0;
+  } else if (cy > lvlh[curlvl] - (int) height) {
+    cy = lvlh[curlvl] - (int) height;
+  }
+
+  return;
+}
+
+/*
+ * tile_next: issue a query for the overview if it's missing, else
+ * for the first visible tile of the current level that is missing.
+ */
+static void
+tile_next()
+{
+  int tx, ty, tx0, tx1, ty0, ty1;
+
+  if (!tile_find(ovlvl, 0, 0)) {
+    tile_query(ovlvl, 0, 0, lvlw[ovlvl], lvlh[ovlvl]);
+    return;
+  }
+
+  tx0 = (cx > 0 ? cx : 0)/NETIMG_TILESZ;
+  ty0 = (cy > 0 ? cy : 0)/NETIMG_TILESZ;
+  tx1 = ((cx + (int) width < lvlw[curlvl] ? cx + (int) width : lvlw[curlvl]) - 1)/NETIMG_TILESZ;
+  ty1 = ((cy + (int) height < lvlh[curlvl] ? cy + (int) height : lvlh[curlvl]) - 1)/NETIMG_TILESZ;
+
+  for (ty = ty0; ty <= ty1; ty++) {
+    for (tx = tx0; tx <= tx1; tx++) {
+      if (!tile_find(curlvl, tx*NETIMG_TILESZ, ty*NETIMG_TILESZ)) {
+        tile_query(curlvl, tx*NETIMG_TILESZ, ty*NETIMG_TILESZ,
+                   NETIMG_TILESZ, NETIMG_TILESZ);
+        return;
+      }
+    }
+  }
+
+  return;
+}
+
+/*
+ * tile_draw: draw a complete tile at the scale of the current level.
+ */
+static void
+tile_draw(tile_t *tp)
+{
+  double sx, sy, x0, y0, x1, y1;
+
+  sx = (double) lvlw[curlvl]/lvlw[tp->level];
+  sy = (double) lvlh[curlvl]/lvlh[tp->level];
+  x0 = tp->x*sx - cx;
+  x1 = (tp->x + tp->w)*sx - cx;
+  y0 = height - (tp->y*sy - cy);        // window y grows upwards
+  y1 = height - ((tp->y + tp->h)*sy - cy);
+  if (x1 < 0 || x0 > width || y0 < 0 || y1 > height) {
+    return;
+  }
+
+  tp->used = ++tileclock;
+  glBindTexture(GL_TEXTURE_2D, tp->tod);
+  glBegin(GL_QUADS);
+    glTexCoord2f(0.0,1.0); glVertex3f(x0, y1, 0.0);
+    glTexCoord2f(0.0,0.0); glVertex3f(x0, y0, 0.0);
+    glTexCoord2f(1.0,0.0); glVertex3f(x1, y0, 0.0);
+    glTexCoord2f(1.0,1.0); glVertex3f(x1, y1, 0.0);
+  glEnd();
+
+  return;
+}
+
+static void
+tile_display(void)
+{
+  int i;
+  tile_t *tp;
+
+  glClear(GL_COLOR_BUFFER_BIT);
+
+  tile_clampview();
+  tp = tile_find(ovlvl, 0, 0);
+  if (tp && tp->ready) {
+    tile_draw(tp);
+  }
+  for (i = 0; i < NETIMG_TILECACHE; i++) {
+    if (tiles[i].level == curlvl && tiles[i].ready && &tiles[i] != tp) {
+      tile_draw(&tiles[i]);
+    }
+  }
+
+  glFlush();
+}
+
+static void
+tile_zoom(int level)
+{
+  if (level < 0 || level >= nlvls) {
+    return;
+  }
+  cx = (int) (((double) cx + width/2)*lvlw[level]/lvlw[curlvl] - width/2);
+  cy = (int) (((double) cy + height/2)*lvlh[level]/lvlh[curlvl] - height/2);
+  curlvl = level;
+  tile_clampview();
+  glutPostRedisplay();
+
+  return;
+}
+
+static void
+tile_kbd(unsigned char key, int x, int y)
+{
+  switch((char)key) {
+  case '+':
+  case '=':
+    tile_zoom(curlvl-1);
+    break;
+  case '-':
+    tile_zoom(curlvl+1);
+    break;
+  case 'q':
+  case 27:
+    glutDestroyWindow(wd);
+    exit(0);
+    break;
+  default:
+    break;
+  }
+
+  return;
+}
+
+static void
+tile_special(int key, int x, int y)
+{
+  switch(key) {
+  case GLUT_KEY_LEFT:
+    cx -= NETIMG_TILESZ/2;
+    break;
+  case GLUT_KEY_RIGHT:
+    cx += NETIMG_TILESZ/2;
+    break;
+  case GLUT_KEY_UP:
+    cy -= NETIMG_TILESZ/2;
+    break;
+  case GLUT_KEY_DOWN:
+    cy += NETIMG_TILESZ/2;
+    break;
+  default:
+    return;
+  }
+  tile_clampview();
+  glutPostRedisplay();
+
+  return;
+}
+
+/*
+ * netimgtile_idle: GLUT idle callback in tiled mode.  Drives one tile
+ * query at a time: waits for its imsg_t, re-sending the query on
+ * timeout, receives the tile, giving it up should the server go
+ * quiet, then picks the next tile needed.
+ */
+void
+netimgtile_idle()
+{
+  imsg_t peek;
+  struct timeval now;
+  int bytes;
+  char err;
+
+  switch (state) {
+  case TILE_RECV:
+    gettimeofday(&now, NULL);
+    if (recv(netimg.sd, (char *) &peek, sizeof(ihdr_t), MSG_PEEK) > 0) {
+      rcvtime = now;
+      netimg.recvimg();
+      if (netimg.done) {
+        tile_end();
+      }
+    } else if ((now.tv_sec - rcvtime.tv_sec)*1000
+               + (now.tv_usec - rcvtime.tv_usec)/1000 > TILE_QUIET) {
+      tile_abort();
+    }
+    break;
+
+  case TILE_WAITIMSG:
+    bytes = recv(netimg.sd, (char *) &peek, sizeof(imsg_t), MSG_PEEK);
+    if (bytes == sizeof(imsg_t)) {
+      err = netimg.recvimsg();
+      if (err == NETIMG_FOUND) {
+        tile_begin();
+      } else {
+        fprintf(stderr, "netimgtile: level %d tile (%d, %d) error %d.\n",
+                qlvl, qx, qy, err);
+        state = TILE_IDLE;
+      }
+    } else if (bytes > 0) {
+      recv(netimg.sd, (char *) &peek, sizeof(imsg_t), 0);  // stale packet
+    } else {
+      gettimeofday(&now, NULL);
+      if (now.tv_sec - qrytime.tv_sec > NETIMG_SLEEP) {
+        state = TILE_IDLE;     // query or imsg_t lost, ask again
+      }
+    }
+    break;
+
+  default:
+    tile_next();
+    break;
+  }
+
+  return;
+}
+
+/*
+ * netimgtile_init: called once the imsg_t answering the first tile
+ * query has been received.  Derives the size of every pyramid level
+ * from the full resolution size reported, sets up the GLUT callbacks
+ * of tiled mode and starts receiving the first tile.
+ */
+void
+netimgtile_init(char *imgname)
+{
+  int i;
+
+  tileimg = imgname;
+  for (i = 0; i < NETIMG_TILECACHE; i++) {
+    tiles[i].level = -1;
+  }
+
+  lvlw[0] = netimg.imsg.im_lvlw;
+  lvlh[0] = netimg.imsg.im_lvlh;
+  for (nlvls = 1; nlvls < NETIMG_MAXLVL && (lvlw[nlvls-1] > 1 || lvlh[nlvls-1] > 1); nlvls++) {
+    lvlw[nlvls] = PYR_HALF(lvlw[nlvls-1]);
+    lvlh[nlvls] = PYR_HALF(lvlh[nlvls-1]);
+  }
+  for (ovlvl = 0; ovlvl < nlvls-1; ovlvl++) {
+    if (lvlw[ovlvl] <= (int) width && lvlh[ovlvl] <= (int) height) {
+      break;
+    }
+  }
+  curlvl = ovlvl;
+  tile_clampview();
+
+  glMatrixMode(GL_MODELVIEW);
+  glLoadIdentity();
+  glPolygonMode(GL_FRONT, GL_FILL);
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+  glEnable(GL_TEXTURE_2D);
+
+  glutDisplayFunc(tile_display);
+  glutKeyboardFunc(tile_kbd);
+  glutSpecialFunc(tile_special);
+
+  qlvl = qx = qy = 0;        // args() asked for tile (0, 0) of level 0
+  tile_begin();
+
+  return;
+}
@@ -0,0 +1,304 @@
+/*
+ * Copyright (c) 2016 University of Michigan, Ann Arbor.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms are permitted
+ * provided that the above copyright notice and this paragraph are
+ * duplicated in all such forms and that any documentation,
+ * advertising materials, and other materials related to such
+ * distribution and use acknowledge that the software was developed
+ * by the University of Michigan, Ann Arbor. The name of the University
+ * may not be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * Author: Sugih Jamin (jamin@eecs.umich.edu)
+ *
+*/
+#include <stdlib.h>
+#include <string.h>
+
+#include "netimg.h"
+#include "pixfmt.h"
+
+/*
+ * Reduced pixel formats the server can convert an image to:
+ * NETIMG_GS, 8-bit luma; NETIMG_RGB565, 16 bits per pixel in network
+ * byte order; NETIMG_PAL8, a PIXFMT_NCOLORS entry RGB palette
+ * followed by an 8-bit index per pixel.  The per-pixel loops work on
+ * a fixed pixel stride with no data-dependent branches so that the
+ * compiler can vectorize them.
+ */
+
+#define PIXFMT_CELLS 32768               // 5-5-5 bit colour cells
+#define PIXFMT_CELL(p) ((((p)[0] >> 3) << 10) | (((p)[1] >> 3) << 5) | ((p)[2] >> 3))
+
+/*
+ * pixfmt_reducible(): whether "format" is smaller than "srcformat"
+ * and can be made from it.
+ */
+int
+pixfmt_reducible(int format, int srcformat)
+{
+  switch (format) {
+  case NETIMG_GS:
+    return(srcformat != NETIMG_GS);
+  case NETIMG_RGB565:
+  case NETIMG_PAL8:
+    return(srcformat == NETIMG_RGB || srcformat == NETIMG_RGBA);
+  default:
+    return(0);
+  }
+}
+
+/*
+ * pixfmt_depth(): bytes per pixel of "format".
+ */
+int
+pixfmt_depth(int format)
+{
+  return(format == NETIMG_RGB565 ? 2 : 1);
+}
+
+/*
+ * pixfmt_size(): bytes taken by "npixels" pixels in "format".
+ */
+long
+pixfmt_size(int format, long npixels)
+{
+  return((format == NETIMG_PAL8 ? PIXFMT_PALSZ : 0) + npixels*pixfmt_depth(format));
+}
+
+static void
+pixfmt_grey(unsigned char *dst, unsigned char *src, long npixels, int depth)
+{
+  long i;
+
+  if (depth == 2) {          // drop alpha
+    for (i = 0; i < npixels; i++) {
+      dst[i] = src[2*i];
+    }
+  } else if (depth == 3) {   // BT.601 luma, 8-bit fixed point
+    for (i = 0; i < npixels; i++) {
+      dst[i] = (unsigned char) ((77*src[3*i] + 150*src[3*i+1] + 29*src[3*i+2] + 128) >> 8);
+    }
+  } else {
+    for (i = 0; i < npixels; i++) {
+      dst[i] = (unsigned char) ((77*src[4*i] + 150*src[4*i+1] + 29*src[4*i+2] + 128) >> 8);
+    }
+  }
+}
+
+static void
+pixfmt_565(unsigned char *dst, unsigned char *src, long npixels, int depth)
+{
+  unsigned short v;
+  long i;
+
+  for (i = 0; i < npixels; i++) {
+    v = (unsigned short) (((src[depth*i] >> 3) << 11) | ((src[depth*i+1] >> 2) << 5)
+                          | (src[depth*i+2] >> 3));
+    dst[2*i] = (unsigned char) (v >> 8);
+    dst[2*i+1] = (unsigned char) v;
+  }
+}
+
+typedef struct {
+  int lo[3], hi[3];          // cells covered, inclusive, per channel
+  long count;                // pixels in the box
+} pixfmt_box_t;
+
+static long
+pixfmt_boxscan(pixfmt_box_t *box, long *hist, int shrink)
+{
+  int lo[3] = { 31, 31, 31 }, hi[3] = { 0, 0, 0 };
+  int c[3], j;
+  long count = 0;
+
+  for (c[0] = box->lo[0]; c[0] <= box->hi[0]; c[0]++) {
+    for (c[1] = box->lo[1]; c[1] <= box->hi[1]; c[1]++) {
+      for (c[2] = box->lo[2]; c[2] <= box->hi[2]; c[2]++) {
+        long n = hist[(c[0] << 10) | (c[1] << 5) | c[2]];
+        if (n) {
+          count += n;
+          for (j = 0; j < 3; j++) {
+            lo[j] = c[j] < lo[j] ? c[j] : lo[j];
+            hi[j] = c[j] > hi[j] ? c[j] : hi[j];
+          }
+        }
+      }
+    }
+  }
+  if (shrink && count) {
+    memcpy(box->lo, lo, sizeof(lo));
+    memcpy(box->hi, hi, sizeof(hi));
+  }
+  box->count = count;
+
+  return(count);
+}
+
+/*
+ * pixfmt_pal8(): median cut.  Colours are binned into 5-5-5 bit
+ * cells, and the box of cells holding the most pixels is repeatedly
+ * split at the median of its longest side until there are
+ * PIXFMT_NCOLORS boxes.  Each box's colour is the mean of its pixels,
+ * and every pixel takes the index of the box its cell is in.
+ */
+static void
+pixfmt_pal8(unsigned char *dst, unsigned char *src, long npixels, int depth)
+{
+  long *hist, (*sum)[3];
+  unsigned char *lut, *pal, *p;
+  pixfmt_box_t box[PIXFMT_NCOLORS], *b, *nb;
+  long i, n, half, acc, rgb[3];
+  int nboxes, a, j, c, cut, c0, c1, c2;
+
+  hist = (long *) calloc(PIXFMT_CELLS, sizeof(long));
+  sum = (long (*)[3]) calloc(PIXFMT_CELLS, sizeof(long [3]));
+  lut = (unsigned char *) calloc(PIXFMT_CELLS, 1);
+  pal = dst;
+  memset(pal, 0, PIXFMT_PALSZ);
+
+  for (i = 0; i < npixels; i++) {
+    p = src + i*depth;
+    n = PIXFMT_CELL(p);
+    hist[n]++;
+    for (j = 0; j < 3; j++) {
+      sum[n][j] += p[j];
+    }
+  }
+
+  for (j = 0; j < 3; j++) {
+    box[0].lo[j] = 0;
+    box[0].hi[j] = 31;
+  }
+  pixfmt_boxscan(&box[0], hist, 1);
+  for (nboxes = 1; nboxes < PIXFMT_NCOLORS; nboxes++) {
+    b = NULL;
+    for (i = 0; i < nboxes; i++) {
+      if ((box[i].lo[0] < box[i].hi[0] || box[i].lo[1] < box[i].hi[1]
+           || box[i].lo[2] < box[i].hi[2]) && (!b || box[i].count > b->count)) {
+        b = &box[i];
+      }
+    }
+    if (!b) {
+      break;                 // every box is down to a single cell
+    }
+
+    for (a = 0, j = 1; j < 3; j++) {
+      if (b->hi[j] - b->lo[j] > b->hi[a] - b->lo[a]) {
+        a = j;
+      }
+    }
+    half = b->count/2;
+    nb = &box[nboxes];
+    for (cut = b->lo[a], acc = 0; cut < b->hi[a]-1; cut++) {
+      *nb = *b;
+      nb->lo[a] = nb->hi[a] = cut;
+      acc += pixfmt_boxscan(nb, hist, 0);
+      if (acc >= half) {
+        break;
+      }
+    }
+    *nb = *b;
+    nb->lo[a] = cut+1;
+    b->hi[a] = cut;
+    pixfmt_boxscan(b, hist, 1);
+    pixfmt_boxscan(nb, hist, 1);
+  }
+
+  for (i = 0; i < nboxes; i++) {
+    b = &box[i];
+    rgb[0] = rgb[1] = rgb[2] = n = 0;
+    for (c0 = b->lo[0]; c0 <= b->hi[0]; c0++) {
+      for (c1 = b->lo[1]; c1 <= b->hi[1]; c1++) {
+        for (c2 = b->lo[2]; c2 <= b->hi[2]; c2++) {
+          c = (c0 << 10) | (c1 << 5) | c2;
+          lut[c] = (unsigned char) i;
+          n += hist[c];
+          for (j = 0; j < 3; j++) {
+            rgb[j] += sum[c][j];
+          }
+        }
+      }
+    }
+    for (j = 0; j < 3 && n; j++) {
+      pal[3*i+j] = (unsigned char) ((rgb[j] + n/2)/n);
+    }
+  }
+
+  dst += PIXFMT_PALSZ;
+  for (i = 0; i < npixels; i++) {
+    dst[i] = lut[PIXFMT_CELL(src + i*depth)];
+  }
+
+  free(hist);
+  free(sum);
+  free(lut);
+}
+
+/*
+ * pixfmt_reduce(): convert the "npixels" pixels of "depth" bytes at
+ * "image" to "format", into the pixfmt_size() bytes at "dst".
+ */
+void
+pixfmt_reduce(unsigned char *dst, int format, unsigned char *image,
+              long npixels, int depth)
+{
+  switch (format) {
+  case NETIMG_GS:
+    pixfmt_grey(dst, image, npixels, depth);
+    break;
+  case NETIMG_RGB565:
+    pixfmt_565(dst, image, npixels, depth);
+    break;
+  case NETIMG_PAL8:
+    pixfmt_pal8(dst, image, npixels, depth);
+    break;
+  default:
+    break;
+  }
+
+  return;
+}
+
+/*
+ * pixfmt_render(): expand the pixels of "data", "npixels" pixels in
+ * NETIMG_RGB565 or NETIMG_PAL8, covered by the "size" bytes at
+ * "offset" to RGB in "rgb".  The palette landing redoes all pixels.
+ */
+void
+pixfmt_render(unsigned char *rgb, int format, unsigned char *data,
+              long npixels, long offset, long size)
+{
+  long i, first, last;
+  unsigned short v;
+  unsigned char *pal, *c;
+
+  if (format == NETIMG_RGB565) {
+    first = offset/2;
+    last = (offset+size+1)/2;
+    for (i = first; i < last && i < npixels; i++) {
+      v = (unsigned short) ((data[2*i] << 8) | data[2*i+1]);
+      rgb[3*i] = (unsigned char) (((v >> 11) << 3) | (v >> 13));
+      rgb[3*i+1] = (unsigned char) ((((v >> 5) & 63) << 2) | ((v >> 9) & 3));
+      rgb[3*i+2] = (unsigned char) (((v & 31) << 3) | ((v >> 2) & 7));
+    }
+  } else if (format == NETIMG_PAL8) {
+    pal = data;
+    first = offset < PIXFMT_PALSZ ? 0 : offset - PIXFMT_PALSZ;
+    last = offset < PIXFMT_PALSZ ? npixels : offset + size - PIXFMT_PALSZ;
+    data += PIXFMT_PALSZ;
+    for (i = first; i < last && i < npixels; i++) {
+      c = pal + 3*data[i];
+      rgb[3*i] = c[0];
+      rgb[3*i+1] = c[1];
+      rgb[3*i+2] = c[2];
+    }
+  }
+
+  return;
+}
@@ -0,0 +1,34 @@
+/*
+ * Copyright (c) 2016 University of Michigan, Ann Arbor.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms are permitted
+ * provided that the above copyright notice and this paragraph are
+ * duplicated in all such forms and that any documentation,
+ * advertising materials, and other materials related to such
+ * distribution and use acknowledge that the software was developed
+ * by the University of Michigan, Ann Arbor. The name of the University
+ * may not be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * Author: Sugih Jamin (jamin@eecs.umich.edu)
+ *
+*/
+#ifndef __PIXFMT_H__
+#define __PIXFMT_H__
+
+#define PIXFMT_NCOLORS 256                  // NETIMG_PAL8 palette entries
+#define PIXFMT_PALSZ   (PIXFMT_NCOLORS*3)   // palette bytes, RGB
+
+extern int pixfmt_reducible(int format, int srcformat);
+extern int pixfmt_depth(int format);
+extern long pixfmt_size(int format, long npixels);
+extern void pixfmt_reduce(unsigned char *dst, int format, unsigned char *image,
+                          long npixels, int depth);
+extern void pixfmt_render(unsigned char *rgb, int format, unsigned char *data,
+                          long npixels, long offset, long size);
+
+#endif // __PIXFMT_H__
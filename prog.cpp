@@ -0,0 +1,134 @@
+/* 
+ * Copyright (c) 2016 University of Michigan, Ann Arbor.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms are permitted
+ * provided that the above copyright notice and this paragraph are
+ * duplicated in all such forms and that any documentation,
+ * advertising materials, and other materials related to such
+ * distribution and use acknowledge that the software was developed
+ * by the University of Michigan, Ann Arbor. The name of the University 
+ * may not be used to endorse or promote products derived from this 
+ * software without specific prior written permission.
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * Author: Sugih Jamin (jamin@eecs.umich.edu)
+ *
+*/
+#include <stdio.h>
+#include <string.h>
+
+#include "prog.h"
+
+/*
+ * Adam7 interlacing: pass p carries the pixels at
+ * (xstart + i*xstep, ystart + j*ystep).  Until finer passes arrive,
+ * each such pixel stands in for the bw x bh block to its lower right.
+ */
+static const struct {
+  int xstart, ystart, xstep, ystep, bw, bh;
+} adam7[PROG_NPASS] = {
+  { 0, 0, 8, 8, 8, 8 },
+  { 4, 0, 8, 8, 4, 8 },
+  { 0, 4, 4, 8, 4, 4 },
+  { 2, 0, 4, 4, 2, 4 },
+  { 0, 2, 2, 4, 2, 2 },
+  { 1, 0, 2, 2, 1, 2 },
+  { 0, 1, 1, 2, 1, 1 },
+};
+
+static int
+prog_cols(int p, int width)
+{
+  return(width > adam7[p].xstart ?
+         (width - adam7[p].xstart + adam7[p].xstep - 1)/adam7[p].xstep : 0);
+}
+
+static int
+prog_rows(int p, int height)
+{
+  return(height > adam7[p].ystart ?
+         (height - adam7[p].ystart + adam7[p].ystep - 1)/adam7[p].ystep : 0);
+}
+
+/*
+ * prog_reorder(): copy the raster-order "image" into "progimg" in
+ * Adam7 pass order, so that sending "progimg" from offset 0 delivers
+ * a coarse 1/64 sample of the whole image first, followed by
+ * successively finer refinement passes.  Both buffers are
+ * width*height*depth bytes.
+*/
+void
+prog_reorder(unsigned char *progimg, unsigned char *image, int width, int height, int depth)
+{
+  int p, i, j, cols, rows;
+  unsigned char *pp = progimg;
+
+  for (p = 0; p < PROG_NPASS; p++) {
+    cols = prog_cols(p, width);
+    rows = prog_rows(p, height);
+    for (j = 0; j < rows; j++) {
+      for (i = 0; i < cols; i++) {
+        memcpy(pp, image + ((long) (adam7[p].ystart + j*adam7[p].ystep)*width
+                            + adam7[p].xstart + i*adam7[p].xstep)*depth, depth);
+        pp += depth;
+      }
+    }
+  }
+
+  return;
+}
+
+/*
+ * prog_render(): the "size" bytes at "offset" into the Adam7-ordered
+ * "progimg" have arrived.  Copy every pixel they touch back to its
+ * place in the raster-order "image" and replicate it over its block
+ * so that the partially received image can be displayed upsampled.
+ *
+ * "rank" holds one byte per pixel, initialized to 0 by the caller.
+ * It records the pass that last painted a pixel, PROG_EXACT once the
+ * pixel's own data has arrived, so that a late or retransmitted
+ * coarse pass never paints over finer data already displayed.
+*/
+void
+prog_render(unsigned char *image, unsigned char *rank, unsigned char *progimg,
+            int width, int height, int depth, long offset, long size)
+{
+  int p, x, y, bx, by, cols, rows;
+  long n, first, last, passpix, pix;
+  unsigned char *src;
+
+  if (size <= 0) {
+    return;
+  }
+  first = offset/depth;               // first and last pixel touched
+  last = (offset + size - 1)/depth;
+
+  for (p = 0, pix = 0; p < PROG_NPASS && pix <= last; p++, pix += passpix) {
+    cols = prog_cols(p, width);
+    rows = prog_rows(p, height);
+    passpix = (long) cols*rows;
+    if (pix + passpix <= first) {
+      continue;
+    }
+
+    for (n = (first > pix ? first : pix) - pix; n < passpix && pix+n <= last; n++) {
+      x = adam7[p].xstart + (int) (n % cols)*adam7[p].xstep;
+      y = adam7[p].ystart + (int) (n / cols)*adam7[p].ystep;
+      src = progimg + (pix+n)*depth;
+
+      for (by = y; by < y + adam7[p].bh && by < height; by++) {
+        for (bx = x; bx < x + adam7[p].bw && bx < width; bx++) {
+          if ((bx == x && by == y) || rank[(long) by*width+bx] <= p+1) {
+            memcpy(image + ((long) by*width+bx)*depth, src, depth);
+            rank[(long) by*width+bx] = (bx == x && by == y) ? PROG_EXACT : p+1;
+          }
+        }
+      }
+    }
+  }
+
+  return;
+}
@@ -0,0 +1,30 @@
+/* 
+ * Copyright (c) 2016 University of Michigan, Ann Arbor.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms are permitted
+ * provided that the above copyright notice and this paragraph are
+ * duplicated in all such forms and that any documentation,
+ * advertising materials, and other materials related to such
+ * distribution and use acknowledge that the software was developed
+ * by the University of Michigan, Ann Arbor. The name of the University 
+ * may not be used to endorse or promote products derived from this 
+ * software without specific prior written permission.
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * Author: Sugih Jamin (jamin@eecs.umich.edu)
+ *
+*/
+#ifndef __PROG_H__
+#define __PROG_H__
+
+#define PROG_NPASS 7     // Adam7 interlacing passes
+#define PROG_EXACT 8     // prog_render() rank of a pixel holding its own data
+
+extern void prog_reorder(unsigned char *progimg, unsigned char *image, int width, int height, int depth);
+extern void prog_render(unsigned char *image, unsigned char *rank, unsigned char *progimg,
+                        int width, int height, int depth, long offset, long size);
+
+#endif // __PROG_H__
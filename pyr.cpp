@@ -0,0 +1,73 @@
+/* 
+ * Copyright (c) 2016 University of Michigan, Ann Arbor.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms are permitted
+ * provided that the above copyright notice and this paragraph are
+ * duplicated in all such forms and that any documentation,
+ * advertising materials, and other materials related to such
+ * distribution and use acknowledge that the software was developed
+ * by the University of Michigan, Ann Arbor. The name of the University 
+ * may not be used to endorse or promote products derived from this 
+ * software without specific prior written permission.
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * Author: Sugih Jamin (jamin@eecs.umich.edu)
+ *
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pyr.h"
+
+/*
+ * pyr_halve(): 2x2 box-filter the width x height "src" image, of
+ * "depth" bytes per pixel, into "dst" of PYR_HALF(width) x
+ * PYR_HALF(height) pixels.  A trailing odd row or column is dropped,
+ * a dimension of 1 is kept as is by averaging the pixel with itself.
+ *
+ * Each pair of source rows is first summed into a row of 16-bit
+ * accumulators and then folded horizontally.  Both inner loops run
+ * over contiguous bytes with no data-dependent branches so that the
+ * compiler can vectorize them.
+*/
+void
+pyr_halve(unsigned char *dst, unsigned char *src, int width, int height, int depth)
+{
+  int i, c, x, y, w2, h2, rowsize;
+  unsigned char *r0, *r1, *d;
+  unsigned short *acc;
+
+  w2 = PYR_HALF(width);
+  h2 = PYR_HALF(height);
+  rowsize = width*depth;
+  acc = (unsigned short *) malloc(rowsize*sizeof(unsigned short));
+
+  for (y = 0; y < h2; y++) {
+    r0 = src + (long) (height > 1 ? 2*y : y)*rowsize;
+    r1 = src + (long) (height > 1 ? 2*y+1 : y)*rowsize;
+    for (i = 0; i < rowsize; i++) {
+      acc[i] = (unsigned short) r0[i] + r1[i];
+    }
+
+    d = dst + (long) y*w2*depth;
+    if (width > 1) {
+      for (x = 0; x < w2; x++) {
+        for (c = 0; c < depth; c++) {
+          d[x*depth+c] = (unsigned char)
+            ((acc[2*x*depth+c] + acc[(2*x+1)*depth+c] + 2) >> 2);
+        }
+      }
+    } else {
+      for (c = 0; c < depth; c++) {
+        d[c] = (unsigned char) ((acc[c] + 1) >> 1);
+      }
+    }
+  }
+
+  free(acc);
+  return;
+}
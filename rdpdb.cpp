@@ -0,0 +1,57 @@
+/*
+ * Copyright (c) 2014, 2015, 2016 University of Michigan, Ann Arbor.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms are permitted
+ * provided that the above copyright notice and this paragraph are
+ * duplicated in all such forms and that any documentation,
+ * advertising materials, and other materials related to such
+ * distribution and use acknowledge that the software was developed
+ * by the University of Michigan, Ann Arbor. The name of the University 
+ * may not be used to endorse or promote products derived from this 
+ * software without specific prior written permission.
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * Author: Sugih Jamin (jamin@eecs.umich.edu)
+ *
+*/
+#include <stdio.h>         // fprintf()
+#include <stdlib.h>        // exit()
+#ifdef _WIN32
+#include <winsock2.h>
+#else
+#include <string.h>        // memset()
+#include <netinet/in.h>    // struct sockaddr_in
+#include <sys/socket.h>    // struct msghdr
+#include <sys/uio.h>       // struct iovec
+#endif
+
+#include "imgdb.h"
+
+/*
+ * rdpdb: the image server, imgdb serving TGA files from the current
+ * directory, or as set up with its args().
+ */
+int
+main(int argc, char *argv[])
+{ 
+  socks_init();
+
+  imgdb imgdb;
+  // parse args, see the comments for imgdb::args()
+  if (imgdb.args(argc, argv)) {
+    fprintf(stderr, "Usage: %s [ -d <prob> -u <path> -t -z -U -f <folder> -k <pack> -M <group>%c<port> ]\n",
+            argv[0], NETIMG_PORTSEP); 
+    exit(1);
+  }
+
+  imgdb.serve();
+    
+#ifdef _WIN32
+  WSACleanup();
+#endif // _WIN32
+  
+  exit(0);
+}
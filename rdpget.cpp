@@ -0,0 +1,471 @@
+/*
+ * Copyright (c) 2016 University of Michigan, Ann Arbor.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms are permitted
+ * provided that the above copyright notice and this paragraph are
+ * duplicated in all such forms and that any documentation,
+ * advertising materials, and other materials related to such
+ * distribution and use acknowledge that the software was developed
+ * by the University of Michigan, Ann Arbor. The name of the University
+ * may not be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * Author: Sugih Jamin (jamin@eecs.umich.edu)
+ *
+*/
+#include <stdio.h>         // fprintf(), fgets(), snprintf()
+#include <stdlib.h>        // atoi(), malloc(), free()
+#include <assert.h>        // assert()
+#include <string.h>        // strlen(), strpbrk(), strrchr()
+#include <unistd.h>        // getopt()
+#include <glob.h>          // glob()
+#include <netinet/in.h>    // struct in_addr
+#include <arpa/inet.h>     // htons()
+#include <sys/types.h>     // u_short
+#include <sys/socket.h>    // socket API
+#include <sys/ioctl.h>     // ioctl(), FIONBIO
+#include <sys/stat.h>      // mkdir()
+#include <sys/time.h>      // gettimeofday()
+#include <sys/epoll.h>     // epoll_create1(), epoll_wait()
+
+#include "netimg.h"
+#include "socks.h"
+#include "ltga.h"
+
+/*
+ * rdpget: fetch many images from one server, several at a time, and
+ * write them to disk, without displaying anything.  Each image is a
+ * libnetimg session of its own, on a socket of its own, all of them
+ * driven from one epoll loop.  At most "-n" sessions are in flight,
+ * the next image is queried as soon as one finishes.  The server
+ * answers queries one at a time, so sessions mostly wait their turn,
+ * but no process is started and no window opened per image.
+ */
+
+#define RDPGET_CONC      8     // sessions in flight, unless set with -n
+#define RDPGET_MAXCONC 256
+#define RDPGET_RTO    (NETIMG_SLEEP*1000 + NETIMG_USLEEP/1000)  // ms
+#define RDPGET_IDLE   ((NETIMG_MAXTRIES+1)*RDPGET_RTO)
+                               // ms without anything arriving on any
+                               // session before those in flight are
+                               // given up, see recvimg_headless()
+#define RDPGET_LINGER (2*RDPGET_RTO)
+                               // ms a finished UDP session stays open,
+                               // so a FIN resent after an RTO, should
+                               // our ACK be lost, is ACKed again
+
+#define RDPGET_QRY  0          // getsess::state: waiting for the imsg_t
+#define RDPGET_RECV 1          // receiving the image
+#define RDPGET_DONE 2          // written, ACKing the FIN, see linger()
+
+class getsess : public netimgsess {
+public:
+  char *name;               // image asked for
+  int state;                // RDPGET_QRY, RDPGET_RECV or RDPGET_DONE
+  long until;               // RDPGET_DONE: closed at this time, in ms
+  getsess *next;            // RDPGET_DONE: on the lingering list
+  getsess(char *_name, unsigned short _mss, unsigned char _rwnd,
+          unsigned char _mode, unsigned char _format, bool _tcp) {
+    name = _name; state = RDPGET_QRY; mss = _mss; rwnd = _rwnd;
+    fwnd = NETIMG_FECWIN >= rwnd ? rwnd-1 : NETIMG_FECWIN;
+    mode = _mode; format = _format; tcp = _tcp; }
+};
+
+static char *sname;         // server
+static u_short port;        // its port, in network byte order
+static unsigned short mss = NETIMG_MSS;
+static unsigned char rwnd = NETIMG_RCVWIN;
+static unsigned char mode;  // NETIMG_Z or 0
+static unsigned char format;  // NETIMG_GS or 0
+static bool tcp;
+static int conc = RDPGET_CONC;
+static char *outdir = (char *) ".";
+
+static getsess *lingering;  // finished UDP sessions, see linger()
+
+static char **names;        // images to fetch
+static int nnames;
+static int nalloc;          // entries allocated to names
+
+/*
+ * addname: fetch image "name" too.  A name with wildcards is a glob(3)
+ * pattern, expanded against the current directory, e.g., a copy of
+ * the server's, matching nothing, it is taken as is.
+ */
+static void
+addname(char *name)
+{
+  glob_t g;
+  size_t i;
+
+  if (strpbrk(name, "*?[") && !glob(name, 0, NULL, &g)) {
+    for (i = 0; i < g.gl_pathc; i++) {
+      addname(strdup(g.gl_pathv[i]));
+    }
+    globfree(&g);
+    return;
+  }
+  if (nnames == nalloc) {
+    nalloc = nalloc ? 2*nalloc : 64;
+    names = (char **) realloc(names, nalloc*sizeof(char *));
+    net_assert((names == NULL), "rdpget: realloc");
+  }
+  names[nnames++] = name;
+
+  return;
+}
+
+/*
+ * args: parses command line args.
+ *
+ * Returns 0 on success or 1 on failure.  The images to fetch are
+ * given as arguments following the flags, or with -L "list", a file
+ * of names, one per line, "-" for stdin, or both.  They are written
+ * to the directory given with -o, the current one by default, each
+ * under its own name, at most -n "conc" of them received at once.
+ * The -w, -m, -z and -T flags are as for rdpimg, -f only takes "gs".
+ */
+static int
+args(int argc, char *argv[])
+{
+  char c, *p, line[NETIMG_MAXFNAME+2];
+  extern char *optarg;
+  extern int optind;
+  FILE *fp;
+  int arg;
+
+  while ((c = getopt(argc, argv, "s:n:o:L:w:m:zTf:")) != EOF) {
+    switch (c) {
+    case 's':
+      for (p = optarg+strlen(optarg)-1;
+           p != optarg && *p != NETIMG_PORTSEP;
+           p--);
+      net_assert((p == optarg), "rdpget::args: server address malformed");
+      *p++ = '\0';
+      port = htons((u_short) atoi(p));
+      sname = optarg;
+      break;
+    case 'n':
+      conc = atoi(optarg);
+      if (conc < 1 || conc > RDPGET_MAXCONC) {
+        return(1);
+      }
+      break;
+    case 'o':
+      outdir = optarg;
+      break;
+    case 'L':
+      fp = strcmp(optarg, "-") ? fopen(optarg, "r") : stdin;
+      if (!fp) {
+        perror(optarg);
+        return(1);
+      }
+      while (fgets(line, sizeof(line), fp)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] && strlen(line) < NETIMG_MAXFNAME) {
+          addname(strdup(line));
+        }
+      }
+      if (fp != stdin) {
+        fclose(fp);
+      }
+      break;
+    case 'w':
+      arg = atoi(optarg);
+      if (arg < 1 || arg > NETIMG_MAXWIN) {
+        return(1);
+      }
+      rwnd = (unsigned char) arg;
+      break;
+    case 'm':
+      arg = atoi(optarg);
+      if (arg < NETIMG_MINSS) {
+        return(1);
+      }
+      mss = (unsigned short) arg;
+      break;
+    case 'z':
+      mode |= NETIMG_Z;
+      break;
+    case 'T':
+      tcp = true;
+      break;
+    case 'f':
+      if (strcmp(optarg, "gs")) {
+        return(1);
+      }
+      format = NETIMG_GS;
+      break;
+    default:
+      return(1);
+      break;
+    }
+  }
+
+  for (; optind < argc; optind++) {
+    if (strlen(argv[optind]) < NETIMG_MAXFNAME) {
+      addname(argv[optind]);
+    }
+  }
+
+  return(!sname || !nnames);
+}
+
+/*
+ * start: query image "name", with its session added to epoll
+ * instance "ed".
+ *
+ * Returns the session, or NULL if the query couldn't be sent.
+ */
+static getsess *
+start(int ed, char *name)
+{
+  struct epoll_event ev;
+  getsess *sess;
+
+  sess = new getsess(name, mss, rwnd, mode, format, tcp);
+  sess->connect(sname, port);
+  if (!sess->sendqry(name)) {
+    socks_close(sess->fd());
+    delete sess;
+    return(NULL);
+  }
+  ev.events = EPOLLIN;
+  ev.data.ptr = sess;
+  epoll_ctl(ed, EPOLL_CTL_ADD, sess->fd(), &ev);
+
+  return(sess);
+}
+
+/*
+ * rdpget_ms: Returns the time now, in ms.
+ */
+static long
+rdpget_ms()
+{
+  struct timeval now;
+
+  gettimeofday(&now, NULL);
+
+  return(now.tv_sec*1000L + now.tv_usec/1000);
+}
+
+/*
+ * close_sess: remove session "sess" from epoll instance "ed", close
+ * its socket and free it.
+ */
+static void
+close_sess(int ed, getsess *sess)
+{
+  epoll_ctl(ed, EPOLL_CTL_DEL, sess->fd(), NULL);
+  socks_close(sess->fd());
+  free(sess->buf);
+  delete sess;
+
+  return;
+}
+
+/*
+ * linger: close the finished sessions kept open by finish() whose
+ * time is up.
+ */
+static void
+linger(int ed)
+{
+  getsess **pp, *sess;
+  long now = rdpget_ms();
+
+  for (pp = &lingering; (sess = *pp); ) {
+    if (now >= sess->until) {
+      *pp = sess->next;
+      close_sess(ed, sess);
+    } else {
+      pp = &sess->next;
+    }
+  }
+
+  return;
+}
+
+/*
+ * finish: done with session "sess", write its image if received
+ * whole.  Over UDP, the session is then kept open on the lingering
+ * list for RDPGET_LINGER ms, to ACK the server's FIN again should
+ * ours be lost, lest the server hold up the sessions queued behind
+ * it resending it, see netimgsess::process().
+ *
+ * Returns 0 if it was, 1 if not.
+ */
+static int
+finish(int ed, getsess *sess, const char *err)
+{
+  char path[2*NETIMG_MAXFNAME];
+  const char *base;
+
+  if (!err) {
+    base = strrchr(sess->name, '/');
+    snprintf(path, sizeof(path), "%s/%s", outdir, base ? base+1 : sess->name);
+    LTGA out(sess->imsg.im_width, sess->imsg.im_height, sess->imsg.im_depth, sess->buf);
+    out.WriteToFile(path);
+    fprintf(stderr, "rdpget: %s: %ld bytes, %dx%d, written to %s\n", sess->name,
+            sess->bufsize, sess->imsg.im_width, sess->imsg.im_height, path);
+  } else {
+    fprintf(stderr, "rdpget: %s: %s\n", sess->name, err);
+  }
+  if (!err && !sess->tcp) {
+    sess->state = RDPGET_DONE;
+    sess->until = rdpget_ms() + RDPGET_LINGER;
+    sess->next = lingering;
+    lingering = sess;
+  } else {
+    close_sess(ed, sess);
+  }
+
+  return(err ? 1 : 0);
+}
+
+/*
+ * ready: session "sess" is readable.  Take its imsg_t, or as much of
+ * its image as has arrived.
+ *
+ * Returns 1 once the session is finished with, successfully or not,
+ * in "*err", 0 otherwise.
+ */
+static int
+ready(getsess *sess, const char **err)
+{
+  int nonblock = 1;
+  char type;
+
+  *err = NULL;
+  if (sess->state == RDPGET_DONE) {
+    sess->process();  // ACKs the FIN again
+    return(0);
+  }
+  if (sess->state == RDPGET_QRY) {
+    type = sess->recvimsg();
+    if (type != NETIMG_FOUND) {
+      *err = type == NETIMG_NFOUND ? "image not found" :
+        type == NETIMG_EBUSY ? "image server busy" : "query failed";
+      return(1);
+    }
+    if (sess->imsg.im_format != NETIMG_RGB && sess->imsg.im_format != NETIMG_RGBA
+        && sess->imsg.im_format != NETIMG_GS && sess->imsg.im_format != NETIMG_GSA) {
+      *err = "format not supported";
+      return(1);
+    }
+    sess->setbuf((unsigned char *) calloc(sess->bufsize, 1));
+    net_assert((!sess->buf), "rdpget: malloc");
+    ioctl(sess->fd(), FIONBIO, &nonblock);
+    sess->state = RDPGET_RECV;
+  }
+
+  switch (sess->process()) {
+  case 1:
+    return(1);
+  case -1:
+    *err = "connection failed";
+    return(1);
+  }
+
+  return(0);
+}
+
+int
+main(int argc, char *argv[])
+{
+  struct epoll_event evs[RDPGET_MAXCONC];
+  struct timeval start_tv, end;
+  getsess *sess, *inflight[RDPGET_MAXCONC];
+  const char *err;
+  int ed, next, active, failed, nev, idle, i;
+  long bytes;
+  double secs;
+
+  if (args(argc, argv)) {
+    fprintf(stderr, "Usage: %s -s <server>%c<port> [ -n <conc> -o <outdir> -L <list> -w <rwnd [1, 255]> -m <mss (>40)> -z -T -f gs ] <image>.tga ...\n",
+            argv[0], NETIMG_PORTSEP);
+    exit(1);
+  }
+
+  socks_init();
+  mkdir(outdir, 0755);  // may already exist
+  ed = epoll_create1(0);
+  net_assert((ed < 0), "rdpget: epoll_create1");
+
+  gettimeofday(&start_tv, NULL);
+  next = active = failed = 0;
+  bytes = 0;
+  idle = 0;
+  memset(inflight, 0, sizeof(inflight));
+  while (next < nnames || active) {
+    // keep "conc" sessions in flight
+    for (i = 0; i < conc && next < nnames; i++) {
+      if (!inflight[i]) {
+        if (!(inflight[i] = start(ed, names[next]))) {
+          fprintf(stderr, "rdpget: %s: query not sent\n", names[next]);
+          failed++;
+        } else {
+          active++;
+        }
+        next++;
+      }
+    }
+
+    linger(ed);
+    nev = epoll_wait(ed, evs, conc, NETIMG_SLEEP*1000);
+    if (nev <= 0) {
+      if ((idle += NETIMG_SLEEP*1000) < RDPGET_IDLE) {
+        continue;
+      }
+      for (i = 0; i < conc; i++) {   // server went quiet
+        if (inflight[i]) {
+          failed += finish(ed, inflight[i], "server went quiet");
+          inflight[i] = NULL;
+          active--;
+        }
+      }
+      idle = 0;
+      continue;
+    }
+    idle = 0;
+    for (i = 0; i < nev; i++) {
+      sess = (getsess *) evs[i].data.ptr;
+      if (!ready(sess, &err)) {
+        continue;
+      }
+      if (!err) {
+        bytes += sess->bufsize;
+      }
+      for (int j = 0; j < conc; j++) {
+        if (inflight[j] == sess) {
+          inflight[j] = NULL;
+        }
+      }
+      failed += finish(ed, sess, err);
+      active--;
+    }
+  }
+  gettimeofday(&end, NULL);
+
+  // the last sessions linger too, the server may still be sending
+  // them their FIN
+  while (lingering) {
+    nev = epoll_wait(ed, evs, RDPGET_MAXCONC, NETIMG_SLEEP*1000);
+    for (i = 0; i < nev; i++) {
+      ready((getsess *) evs[i].data.ptr, &err);
+    }
+    linger(ed);
+  }
+  close(ed);
+
+  secs = (end.tv_sec - start_tv.tv_sec) + (end.tv_usec - start_tv.tv_usec)/1000000.0;
+  fprintf(stderr, "rdpget: %d of %d images, %ld bytes, in %.3f s, goodput %.2f Mbps\n",
+          nnames - failed, nnames, bytes, secs, secs > 0.0 ? bytes*8/secs/1000000.0 : 0.0);
+
+  return(failed ? 1 : 0);
+}
@@ -0,0 +1,151 @@
+/*
+ * Copyright (c) 2016 University of Michigan, Ann Arbor.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms are permitted
+ * provided that the above copyright notice and this paragraph are
+ * duplicated in all such forms and that any documentation,
+ * advertising materials, and other materials related to such
+ * distribution and use acknowledge that the software was developed
+ * by the University of Michigan, Ann Arbor. The name of the University
+ * may not be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * Author: Sugih Jamin (jamin@eecs.umich.edu)
+ *
+*/
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>     // htonl(), ntohl()
+
+#include "netimg.h"
+#include "rle.h"
+
+/*
+ * TGA run-length encoding: each packet starts with a header byte
+ * whose low 7 bits give its pixel count less one.  With the top bit
+ * set, it is a run packet, followed by a single pixel repeated that
+ * many times, otherwise it is a raw packet, followed by that many
+ * pixels.  Pixels are stored BGR(A).
+ */
+static long
+rle_pktsize(unsigned char *pkt, int depth)
+{
+  return(1 + (*pkt & 0x80 ? 1 : (*pkt & 0x7f) + 1)*depth);
+}
+
+/*
+ * rle_slots(): cut the "streamsize" bytes of TGA RLE packets at
+ * "stream", encoding "npixels" pixels of "depth" bytes each, into
+ * slots of "datasize" bytes as described with islot_t.  Packets are
+ * not decoded nor split: each slot carries as many whole packets as
+ * fit.  "*slots" is realloc()'ed to hold the result, zero padded.
+ *
+ * Returns the number of bytes of slots, or -1 if a packet doesn't
+ * fit in a slot or the stream is malformed.
+ */
+long
+rle_slots(unsigned char **slots, unsigned char *stream, long streamsize,
+          long npixels, int depth, int datasize)
+{
+  long pos, pkt, pixel, size, alloced;
+  islot_t slot;
+  int used;
+
+  if (datasize < (int) sizeof(islot_t) + 1 + RLE_MAXRUN*depth) {
+    return(-1);
+  }
+
+  alloced = size = 0;
+  pos = pixel = 0;
+  while (pixel < npixels && pos < streamsize) {
+    if (size + datasize > alloced) {
+      alloced = alloced ? 2*alloced : 16L*datasize;
+      *slots = (unsigned char *) realloc(*slots, alloced);
+      if (!*slots) {
+        return(-1);
+      }
+    }
+    memset(*slots + size, 0, datasize);
+    slot.is_unit = htonl((unsigned int) pixel);
+    used = sizeof(islot_t);
+
+    while (pixel < npixels && pos < streamsize) {
+      pkt = rle_pktsize(stream + pos, depth);
+      if (pos + pkt > streamsize) {
+        return(-1);
+      }
+      if (used + pkt > datasize) {
+        break;
+      }
+      memcpy(*slots + size + used, stream + pos, pkt);
+      used += pkt;
+      pos += pkt;
+      pixel += (stream[pos-pkt] & 0x7f) + 1;
+    }
+    slot.is_size = htonl(used - sizeof(islot_t));
+    memcpy(*slots + size, &slot, sizeof(islot_t));
+    size += datasize;
+  }
+
+  return(size);
+}
+
+/*
+ * rle_render(): decode the TGA RLE packets of the slot at "slot", of
+ * "datasize" bytes, into the raster "image" of "npixels" pixels of
+ * "depth" bytes each, swapping BGR(A) to RGB(A) as LTGA does.
+ * Pixels beyond "npixels" are dropped.
+ *
+ * Returns the number of pixels decoded, 0 for a slot that hasn't
+ * arrived, or -1 if the slot is malformed.
+ */
+long
+rle_render(unsigned char *image, long npixels, int depth,
+           unsigned char *slot, int datasize)
+{
+  islot_t is;
+  unsigned char *pkt, *end, *px, *dst;
+  long pixel, first, size;
+  int i, j, n;
+
+  memcpy(&is, slot, sizeof(islot_t));
+  first = pixel = ntohl(is.is_unit);
+  size = ntohl(is.is_size);
+  if (size > datasize - (long) sizeof(islot_t)) {
+    return(-1);
+  }
+
+  pkt = slot + sizeof(islot_t);
+  end = pkt + size;
+  while (pkt < end && pixel < npixels) {
+    n = (*pkt & 0x7f) + 1;
+    if (pkt + rle_pktsize(pkt, depth) > end) {
+      return(-1);
+    }
+    if (pixel + n > npixels) {
+      n = (int) (npixels - pixel);
+    }
+    px = pkt + 1;
+    dst = image + pixel*depth;
+    for (i = 0; i < n; i++, dst += depth) {
+      for (j = 0; j < depth; j++) {
+        dst[j] = px[j];
+      }
+      if (depth >= 3) {
+        dst[0] = px[2];
+        dst[2] = px[0];
+      }
+      if (!(*pkt & 0x80)) {
+        px += depth;
+      }
+    }
+    pixel += n;
+    pkt += rle_pktsize(pkt, depth);
+  }
+
+  return(pixel - first);
+}
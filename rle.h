@@ -0,0 +1,30 @@
+/*
+ * Copyright (c) 2016 University of Michigan, Ann Arbor.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms are permitted
+ * provided that the above copyright notice and this paragraph are
+ * duplicated in all such forms and that any documentation,
+ * advertising materials, and other materials related to such
+ * distribution and use acknowledge that the software was developed
+ * by the University of Michigan, Ann Arbor. The name of the University
+ * may not be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * Author: Sugih Jamin (jamin@eecs.umich.edu)
+ *
+*/
+#ifndef __RLE_H__
+#define __RLE_H__
+
+#define RLE_MAXRUN 128   // pixels per TGA RLE packet
+
+extern long rle_slots(unsigned char **slots, unsigned char *stream, long streamsize,
+                      long npixels, int depth, int datasize);
+extern long rle_render(unsigned char *image, long npixels, int depth,
+                       unsigned char *slot, int datasize);
+
+#endif // __RLE_H__
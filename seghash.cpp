@@ -0,0 +1,126 @@
+/*
+ * Copyright (c) 2016 University of Michigan, Ann Arbor.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms are permitted
+ * provided that the above copyright notice and this paragraph are
+ * duplicated in all such forms and that any documentation,
+ * advertising materials, and other materials related to such
+ * distribution and use acknowledge that the software was developed
+ * by the University of Michigan, Ann Arbor. The name of the University
+ * may not be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * Author: Sugih Jamin (jamin@eecs.umich.edu)
+ *
+*/
+#include "seghash.h"
+
+/*
+ * 128-bit MurmurHash3 (x64 variant), which digests 16 bytes per
+ * round in two independent 64-bit lanes.  Bytes are read little
+ * endian so that hashes agree across hosts.
+ */
+
+typedef unsigned long long u64;
+
+static inline u64
+seghash_rotl(u64 x, int r)
+{
+  return((x << r) | (x >> (64 - r)));
+}
+
+static inline u64
+seghash_fmix(u64 k)
+{
+  k ^= k >> 33;
+  k *= 0xff51afd7ed558ccdULL;
+  k ^= k >> 33;
+  k *= 0xc4ceb9fe1a85ec53ULL;
+  k ^= k >> 33;
+  return(k);
+}
+
+static inline u64
+seghash_load(unsigned char *p, int n)
+{
+  u64 v = 0;
+
+  while (n--) {
+    v = (v << 8) | p[n];
+  }
+  return(v);
+}
+
+/*
+ * seghash(): hash the "len" bytes at "data" with "seed" into the
+ * SEGHASH_LEN bytes at "hash".
+ */
+void
+seghash(unsigned char *hash, unsigned char *data, long len, unsigned int seed)
+{
+  const u64 c1 = 0x87c37b91114253d5ULL, c2 = 0x4cf5ad432745937fULL;
+  u64 h1 = seed, h2 = seed, k1, k2;
+  long i, rest;
+  int j;
+
+  for (i = 0; i + 16 <= len; i += 16) {
+    k1 = seghash_load(data+i, 8);
+    k2 = seghash_load(data+i+8, 8);
+
+    k1 *= c1; k1 = seghash_rotl(k1, 31); k1 *= c2; h1 ^= k1;
+    h1 = seghash_rotl(h1, 27); h1 += h2; h1 = h1*5 + 0x52dce729;
+    k2 *= c2; k2 = seghash_rotl(k2, 33); k2 *= c1; h2 ^= k2;
+    h2 = seghash_rotl(h2, 31); h2 += h1; h2 = h2*5 + 0x38495ab5;
+  }
+
+  rest = len - i;
+  if (rest > 8) {
+    k2 = seghash_load(data+i+8, (int) rest-8);
+    k2 *= c2; k2 = seghash_rotl(k2, 33); k2 *= c1; h2 ^= k2;
+  }
+  if (rest > 0) {
+    k1 = seghash_load(data+i, rest > 8 ? 8 : (int) rest);
+    k1 *= c1; k1 = seghash_rotl(k1, 31); k1 *= c2; h1 ^= k1;
+  }
+
+  h1 ^= (u64) len;
+  h2 ^= (u64) len;
+  h1 += h2;
+  h2 += h1;
+  h1 = seghash_fmix(h1);
+  h2 = seghash_fmix(h2);
+  h1 += h2;
+  h2 += h1;
+
+  for (j = 0; j < 8; j++) {
+    hash[j] = (unsigned char) (h1 >> (8*j));
+    hash[8+j] = (unsigned char) (h2 >> (8*j));
+  }
+
+  return;
+}
+
+/*
+ * seghash_image(): hash each segment of "datasize" bytes of the
+ * "size" bytes at "image", the last one possibly shorter, into
+ * consecutive hashes at "hashes".
+ *
+ * Returns the number of segments.
+ */
+long
+seghash_image(unsigned char *hashes, unsigned char *image, long size,
+              int datasize, unsigned int seed)
+{
+  long i, offset;
+
+  for (i = 0, offset = 0; offset < size; i++, offset += datasize) {
+    seghash(hashes + i*SEGHASH_LEN, image + offset,
+            size - offset < datasize ? size - offset : datasize, seed);
+  }
+
+  return(i);
+}
@@ -0,0 +1,33 @@
+/*
+ * Copyright (c) 2016 University of Michigan, Ann Arbor.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms are permitted
+ * provided that the above copyright notice and this paragraph are
+ * duplicated in all such forms and that any documentation,
+ * advertising materials, and other materials related to such
+ * distribution and use acknowledge that the software was developed
+ * by the University of Michigan, Ann Arbor. The name of the University
+ * may not be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * Author: Sugih Jamin (jamin@eecs.umich.edu)
+ *
+*/
+#ifndef __SEGHASH_H__
+#define __SEGHASH_H__
+
+#define SEGHASH_LEN 16   // bytes per hash
+
+// seed binding hashes to the shape of the image they were taken of
+#define SEGHASH_SEED(width, height, depth, format) \
+  ((((unsigned int) (width)) << 16 ^ (unsigned int) (height)) * 31 + ((depth) << 8 | (format)))
+
+extern void seghash(unsigned char *hash, unsigned char *data, long len, unsigned int seed);
+extern long seghash_image(unsigned char *hashes, unsigned char *image, long size,
+                          int datasize, unsigned int seed);
+
+#endif // __SEGHASH_H__
@@ -31,6 +31,7 @@
 #include <arpa/inet.h>     // htons(), inet_ntoa()
 #include <sys/types.h>     // u_short
 #include <sys/socket.h>    // socket API, setsockopt(), getsockname()
+#include <sys/un.h>        // struct sockaddr_un
 #endif
 
 #include "netimg.h"
@@ -119,6 +120,96 @@ socks_servinit(char *progname, struct sockaddr_in *self, char *sname)
   return sd;
 }
 
+/*
+ * socks_dgraminit: sets up a UDP socket bound to an ephemeral port,
+ * on all interfaces, for one more flow of a transfer, see
+ * imsg_t::im_nflows.  The port is stored in "*port", in network byte
+ * order.
+ *
+ * Returns the bound socket id, or -1 on error.
+ */
+int
+socks_dgraminit(u_short *port)
+{
+  struct sockaddr_in self;
+  socklen_t len = sizeof(struct sockaddr_in);
+  int sd;
+
+  sd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (sd < 0) {
+    return(-1);
+  }
+  memset((char *) &self, 0, sizeof(struct sockaddr_in));
+  self.sin_family = AF_INET;
+  self.sin_addr.s_addr = INADDR_ANY;
+  self.sin_port = 0;
+  if (bind(sd, (struct sockaddr *) &self, sizeof(struct sockaddr_in))
+      || getsockname(sd, (struct sockaddr *) &self, &len)) {
+    close(sd);
+    return(-1);
+  }
+  *port = self.sin_port;
+
+  return(sd);
+}
+
+/*
+ * socks_mcastservinit: lets UDP socket "sd" send to multicast groups,
+ * out of the interface of address "ifaddr", looped back to members
+ * on this host too.
+ *
+ * Returns 0 on success, -1 on error.
+ */
+int
+socks_mcastservinit(int sd, struct in_addr *ifaddr)
+{
+  unsigned char loop = 1;
+
+  if (setsockopt(sd, IPPROTO_IP, IP_MULTICAST_IF, (char *) ifaddr, sizeof(struct in_addr))
+      || setsockopt(sd, IPPROTO_IP, IP_MULTICAST_LOOP, (char *) &loop, sizeof(loop))) {
+    return(-1);
+  }
+
+  return(0);
+}
+
+/*
+ * socks_mcastclntinit: sets up a UDP socket receiving what is sent to
+ * multicast "group", at its port, joined on the interface of address
+ * "ifaddr".  Other sockets on this host may join the same group at
+ * the same port.  The receive buffer is set to at least "rcvbuf"
+ * bytes.  Closing the socket leaves the group.
+ *
+ * Returns the socket id, or -1 on error.
+ */
+int
+socks_mcastclntinit(struct sockaddr_in *group, struct in_addr *ifaddr, int rcvbuf)
+{
+  struct sockaddr_in self;
+  struct ip_mreq mreq;
+  int sd, on = 1;
+
+  sd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (sd < 0) {
+    return(-1);
+  }
+  memset((char *) &self, 0, sizeof(struct sockaddr_in));
+  self.sin_family = AF_INET;
+  self.sin_addr.s_addr = INADDR_ANY;
+  self.sin_port = group->sin_port;
+  mreq.imr_multiaddr = group->sin_addr;
+  mreq.imr_interface = *ifaddr;
+  setsockopt(sd, SOL_SOCKET, SO_RCVBUF, (char *) &rcvbuf, sizeof(int));
+  if (setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, (char *) &on, sizeof(int))
+      || bind(sd, (struct sockaddr *) &self, sizeof(struct sockaddr_in))
+      || setsockopt(sd, IPPROTO_IP, IP_ADD_MEMBERSHIP, (char *) &mreq, sizeof(mreq))) {
+    close(sd);
+    return(-1);
+  }
+
+  return(sd);
+}
+
 /*
  * socks_clntinit: creates a new socket to connect to the provided
  * server.  The server's name and port number are provided.  The port
@@ -173,6 +264,79 @@ socks_clntinit(char *sname, u_short port, int rcvbuf)
   return(sd);
 }
 
+/*
+ * socks_tcpservinit: sets up a TCP server socket listening at the
+ * same port number as the UDP one described by "self", as set up
+ * by socks_servinit(), or at an ephemeral one if that is taken.
+ *
+ * Terminates process on error.
+ * Returns the listening socket id.
+ */
+int
+socks_tcpservinit(char *progname, struct sockaddr_in *self, char *sname)
+{
+  int sd, err, on = 1;
+  struct sockaddr_in tcp;
+  socklen_t len;
+
+  sd = socket(AF_INET, SOCK_STREAM, 0);
+  net_assert((sd < 0), "socks_tcpservinit: socket");
+  setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, (char *) &on, sizeof(int));
+
+  memset((char *) &tcp, 0, sizeof(struct sockaddr_in));
+  tcp.sin_family = AF_INET;
+  tcp.sin_addr.s_addr = INADDR_ANY;
+  tcp.sin_port = self->sin_port;
+  if (bind(sd, (struct sockaddr *) &tcp, sizeof(struct sockaddr_in))) {
+    tcp.sin_port = 0;
+    err = bind(sd, (struct sockaddr *) &tcp, sizeof(struct sockaddr_in));
+    net_assert(err, "socks_tcpservinit: bind");
+  }
+  err = listen(sd, SOMAXCONN);
+  net_assert(err, "socks_tcpservinit: listen");
+
+  len = sizeof(struct sockaddr_in);
+  err = getsockname(sd, (struct sockaddr *) &tcp, &len);
+  net_assert(err, "socks_tcpservinit: getsockname");
+  fprintf(stderr, "%s TCP address is %s:%d\n", progname, sname, ntohs(tcp.sin_port));
+
+  return(sd);
+}
+
+/*
+ * socks_tcpclntinit: as socks_clntinit(), but connects a TCP socket.
+ *
+ * On success, return the newly created socket descriptor.
+ * On error, terminates process.
+ */
+int
+socks_tcpclntinit(char *sname, u_short port, int rcvbuf)
+{
+  int sd, err;
+  struct sockaddr_in server;
+  struct hostent *sp;
+
+  sd = socket(AF_INET, SOCK_STREAM, 0);
+  net_assert((sd < 0), "socks_tcpclntinit: socket");
+
+  memset((char *) &server, 0, sizeof(struct sockaddr_in));
+  server.sin_family = AF_INET;
+  server.sin_port = port;
+  sp = gethostbyname(sname);
+  net_assert((sp == 0), "socks_tcpclntinit: gethostbyname");
+  memcpy(&server.sin_addr, sp->h_addr, sp->h_length);
+
+  // before connect(), for the window scale to cover it
+  if (setsockopt(sd, SOL_SOCKET, SO_RCVBUF, (char *) &rcvbuf, sizeof(int)) < 0) {
+    perror("socks_tcpclntinit: setsockopt SO_RCVBUF");
+  }
+
+  err = connect(sd, (struct sockaddr *) &server, sizeof(struct sockaddr_in));
+  net_assert(err, "socks_tcpclntinit: connect");
+
+  return(sd);
+}
+
 void
 socks_close(int td)
 {
@@ -183,3 +347,143 @@ socks_close(int td)
 #endif // _WIN32
   return;
 }
+
+#ifndef _WIN32
+/*
+ * socks_localservinit: sets up a Unix domain server socket for
+ * clients on the same host, listening at "path", which is replaced
+ * if it exists.  Sockets are SOCK_SEQPACKET, so message boundaries
+ * are kept as with UDP.
+ *
+ * Terminates process on error.
+ * Returns the listening socket id.
+ */
+int
+socks_localservinit(char *progname, char *path)
+{
+  int sd, err;
+  struct sockaddr_un self;
+
+  net_assert((strlen(path) >= sizeof(self.sun_path)),
+             "socks_localservinit: path too long");
+  sd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+  net_assert((sd < 0), "socks_localservinit: socket");
+
+  memset((char *) &self, 0, sizeof(struct sockaddr_un));
+  self.sun_family = AF_UNIX;
+  strcpy(self.sun_path, path);
+  unlink(path);
+  err = bind(sd, (struct sockaddr *) &self, sizeof(struct sockaddr_un));
+  net_assert(err, "socks_localservinit: bind");
+  err = listen(sd, SOMAXCONN);
+  net_assert(err, "socks_localservinit: listen");
+
+  fprintf(stderr, "%s local address is %s\n", progname, path);
+
+  return(sd);
+}
+
+/*
+ * socks_localclntinit: connects to the Unix domain server socket at
+ * "path".
+ *
+ * On success, return the newly created socket descriptor.
+ * On error, terminates process.
+ */
+int
+socks_localclntinit(char *path)
+{
+  int sd, err;
+  struct sockaddr_un server;
+
+  net_assert((strlen(path) >= sizeof(server.sun_path)),
+             "socks_localclntinit: path too long");
+  sd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+  net_assert((sd < 0), "socks_localclntinit: socket");
+
+  memset((char *) &server, 0, sizeof(struct sockaddr_un));
+  server.sun_family = AF_UNIX;
+  strcpy(server.sun_path, path);
+  err = connect(sd, (struct sockaddr *) &server, sizeof(struct sockaddr_un));
+  net_assert(err, "socks_localclntinit: connect");
+
+  return(sd);
+}
+
+/*
+ * socks_sendfd: send the "len" bytes at "buf" on Unix domain socket
+ * "sd", passing file descriptor "fd" along with them, unless it is
+ * negative.
+ *
+ * Returns the return value of sendmsg().
+ */
+int
+socks_sendfd(int sd, void *buf, int len, int fd)
+{
+  struct msghdr mh;
+  struct iovec iov;
+  union {                      // aligned for struct cmsghdr
+    struct cmsghdr cm;
+    char buf[CMSG_SPACE(sizeof(int))];
+  } ctl;
+  struct cmsghdr *cmsg;
+
+  memset(&mh, 0, sizeof(struct msghdr));
+  iov.iov_base = buf;
+  iov.iov_len = len;
+  mh.msg_iov = &iov;
+  mh.msg_iovlen = 1;
+  if (fd >= 0) {
+    memset(&ctl, 0, sizeof(ctl));
+    mh.msg_control = ctl.buf;
+    mh.msg_controllen = sizeof(ctl.buf);
+    cmsg = CMSG_FIRSTHDR(&mh);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+  }
+
+  return(sendmsg(sd, &mh, 0));
+}
+
+/*
+ * socks_recvfd: receive up to "len" bytes into "buf" from Unix domain
+ * socket "sd", and the file descriptor passed along with them, if
+ * any, into "*fd", else -1.
+ *
+ * Returns the return value of recvmsg().
+ */
+int
+socks_recvfd(int sd, void *buf, int len, int *fd)
+{
+  struct msghdr mh;
+  struct iovec iov;
+  union {
+    struct cmsghdr cm;
+    char buf[CMSG_SPACE(sizeof(int))];
+  } ctl;
+  struct cmsghdr *cmsg;
+  int bytes;
+
+  memset(&mh, 0, sizeof(struct msghdr));
+  iov.iov_base = buf;
+  iov.iov_len = len;
+  mh.msg_iov = &iov;
+  mh.msg_iovlen = 1;
+  mh.msg_control = ctl.buf;
+  mh.msg_controllen = sizeof(ctl.buf);
+
+  *fd = -1;
+  bytes = recvmsg(sd, &mh, 0);
+  if (bytes >= 0) {
+    for (cmsg = CMSG_FIRSTHDR(&mh); cmsg; cmsg = CMSG_NXTHDR(&mh, cmsg)) {
+      if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+        memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+      }
+    }
+  }
+
+  return(bytes);
+}
+#endif // _WIN32
@@ -24,7 +24,18 @@
 
 extern void socks_init();
 extern int socks_servinit(char *progname, struct sockaddr_in *self, char *sname);
+extern int socks_dgraminit(u_short *port);
+extern int socks_mcastservinit(int sd, struct in_addr *ifaddr);
+extern int socks_mcastclntinit(struct sockaddr_in *group, struct in_addr *ifaddr, int rcvbuf);
 extern int socks_clntinit(char *sname, u_short port, int rcvbuf);
+extern int socks_tcpservinit(char *progname, struct sockaddr_in *self, char *sname);
+extern int socks_tcpclntinit(char *sname, u_short port, int rcvbuf);
 extern void socks_close(int td);
+#ifndef _WIN32
+extern int socks_localservinit(char *progname, char *path);
+extern int socks_localclntinit(char *path);
+extern int socks_sendfd(int sd, void *buf, int len, int fd);
+extern int socks_recvfd(int sd, void *buf, int len, int *fd);
+#endif
 
 #endif /* __SOCKS_H__ */
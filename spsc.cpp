@@ -0,0 +1,79 @@
+/*
+ * Copyright (c) 2016 University of Michigan, Ann Arbor.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms are permitted
+ * provided that the above copyright notice and this paragraph are
+ * duplicated in all such forms and that any documentation,
+ * advertising materials, and other materials related to such
+ * distribution and use acknowledge that the software was developed
+ * by the University of Michigan, Ann Arbor. The name of the University
+ * may not be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * Author: Sugih Jamin (jamin@eecs.umich.edu)
+ *
+*/
+#include <stdio.h>
+
+#include "spsc.h"
+
+/*
+ * A ring of byte ranges passed from one thread to another without
+ * locks.  Only the producer moves the tail and only the consumer the
+ * head: a release store of either publishes the entries before it,
+ * the acquire load on the other side sees them.
+ */
+
+void
+spsc_init(spsc_t *q)
+{
+  q->head = q->tail = 0;
+
+  return;
+}
+
+/*
+ * spsc_push: producer only.  Queue the range of "size" bytes at
+ * "offset".
+ *
+ * Returns 1 on success, 0 if the queue is full.
+ */
+int
+spsc_push(spsc_t *q, long offset, long size)
+{
+  unsigned tail = q->tail;
+
+  if (tail - __atomic_load_n(&q->head, __ATOMIC_ACQUIRE) >= SPSC_SIZE) {
+    return(0);
+  }
+  q->ring[tail & (SPSC_SIZE-1)].offset = offset;
+  q->ring[tail & (SPSC_SIZE-1)].size = size;
+  __atomic_store_n(&q->tail, tail+1, __ATOMIC_RELEASE);
+
+  return(1);
+}
+
+/*
+ * spsc_pop: consumer only.  Take the oldest range queued into
+ * "*offset" and "*size".
+ *
+ * Returns 1 on success, 0 if the queue is empty.
+ */
+int
+spsc_pop(spsc_t *q, long *offset, long *size)
+{
+  unsigned head = q->head;
+
+  if (head == __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE)) {
+    return(0);
+  }
+  *offset = q->ring[head & (SPSC_SIZE-1)].offset;
+  *size = q->ring[head & (SPSC_SIZE-1)].size;
+  __atomic_store_n(&q->head, head+1, __ATOMIC_RELEASE);
+
+  return(1);
+}
@@ -0,0 +1,43 @@
+/*
+ * Copyright (c) 2016 University of Michigan, Ann Arbor.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms are permitted
+ * provided that the above copyright notice and this paragraph are
+ * duplicated in all such forms and that any documentation,
+ * advertising materials, and other materials related to such
+ * distribution and use acknowledge that the software was developed
+ * by the University of Michigan, Ann Arbor. The name of the University
+ * may not be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * Author: Sugih Jamin (jamin@eecs.umich.edu)
+ *
+*/
+#ifndef __SPSC_H__
+#define __SPSC_H__
+
+#define SPSC_SIZE    1024      // entries, a power of 2
+#define SPSC_LINE      64      // cache line size, bytes
+
+typedef struct {               // byte range of an image
+  long offset;
+  long size;
+} spsc_range_t;
+
+typedef struct {               // lock-free, one producer, one consumer
+  spsc_range_t ring[SPSC_SIZE];
+  // each index is written by one side only, kept apart so the two
+  // don't keep taking the cache line from each other
+  unsigned head __attribute__((aligned(SPSC_LINE)));  // consumer's
+  unsigned tail __attribute__((aligned(SPSC_LINE)));  // producer's
+} spsc_t;
+
+extern void spsc_init(spsc_t *q);
+extern int spsc_push(spsc_t *q, long offset, long size);
+extern int spsc_pop(spsc_t *q, long *offset, long *size);
+
+#endif // __SPSC_H__
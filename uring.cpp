@@ -0,0 +1,256 @@
+/*
+ * Copyright (c) 2016 University of Michigan, Ann Arbor.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms are permitted
+ * provided that the above copyright notice and this paragraph are
+ * duplicated in all such forms and that any documentation,
+ * advertising materials, and other materials related to such
+ * distribution and use acknowledge that the software was developed
+ * by the University of Michigan, Ann Arbor. The name of the University
+ * may not be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * Author: Sugih Jamin (jamin@eecs.umich.edu)
+ *
+*/
+#ifdef __linux__
+
+#include <stdio.h>
+#include <string.h>        // memset()
+#include <errno.h>
+#include <unistd.h>        // syscall(), close()
+#include <sys/syscall.h>   // __NR_io_uring_*
+#include <sys/mman.h>      // mmap()
+
+#include "uring.h"
+
+/*
+ * The least of io_uring needed to drive a socket, on the raw system
+ * calls: one submission queue and one completion queue, shared with
+ * the kernel through mmap(), and rings of provided buffers for
+ * multishot receives.  Only one thread may use a uring_t.
+ */
+
+#define uring_load(p)     __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define uring_store(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+/*
+ * uring_init: set up "ur" with room for "entries" submissions,
+ * rounded up to a power of 2 by the kernel.
+ *
+ * Returns 0 on success, else -errno, with "ur" unusable.
+ */
+int
+uring_init(uring_t *ur, unsigned entries)
+{
+  struct io_uring_params p;
+  char *sq, *cq;
+
+  memset(ur, 0, sizeof(uring_t));
+  memset(&p, 0, sizeof(p));
+  ur->fd = (int) syscall(__NR_io_uring_setup, entries, &p);
+  if (ur->fd < 0) {
+    return(-errno);
+  }
+
+  ur->sqringsz = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+  ur->cqringsz = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (ur->cqringsz > ur->sqringsz) {
+      ur->sqringsz = ur->cqringsz;
+    }
+    ur->cqringsz = 0;
+  }
+  ur->sqring = mmap(NULL, ur->sqringsz, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+                    ur->fd, IORING_OFF_SQ_RING);
+  if (ur->sqring == MAP_FAILED) {
+    goto fail;
+  }
+  if (ur->cqringsz) {
+    ur->cqring = mmap(NULL, ur->cqringsz, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+                      ur->fd, IORING_OFF_CQ_RING);
+    if (ur->cqring == MAP_FAILED) {
+      munmap(ur->sqring, ur->sqringsz);
+      goto fail;
+    }
+  } else {
+    ur->cqring = ur->sqring;
+  }
+  ur->sqesz = p.sq_entries*sizeof(struct io_uring_sqe);
+  ur->sqes = (struct io_uring_sqe *) mmap(NULL, ur->sqesz, PROT_READ|PROT_WRITE,
+                                          MAP_SHARED|MAP_POPULATE, ur->fd, IORING_OFF_SQES);
+  if (ur->sqes == MAP_FAILED) {
+    munmap(ur->sqring, ur->sqringsz);
+    if (ur->cqringsz) {
+      munmap(ur->cqring, ur->cqringsz);
+    }
+    goto fail;
+  }
+
+  sq = (char *) ur->sqring;
+  ur->sqhead = (unsigned *) (sq + p.sq_off.head);
+  ur->sqtail = (unsigned *) (sq + p.sq_off.tail);
+  ur->sqmask = (unsigned *) (sq + p.sq_off.ring_mask);
+  ur->sqarray = (unsigned *) (sq + p.sq_off.array);
+  ur->sqentries = p.sq_entries;
+  ur->sqlocal = *ur->sqtail;
+  cq = (char *) ur->cqring;
+  ur->cqhead = (unsigned *) (cq + p.cq_off.head);
+  ur->cqtail = (unsigned *) (cq + p.cq_off.tail);
+  ur->cqmask = (unsigned *) (cq + p.cq_off.ring_mask);
+  ur->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+  return(0);
+
+ fail:
+  entries = errno;
+  close(ur->fd);
+  ur->fd = -1;
+  return(-(int) entries);
+}
+
+void
+uring_exit(uring_t *ur)
+{
+  if (ur->fd < 0) {
+    return;
+  }
+  munmap(ur->sqes, ur->sqesz);
+  munmap(ur->sqring, ur->sqringsz);
+  if (ur->cqringsz) {
+    munmap(ur->cqring, ur->cqringsz);
+  }
+  close(ur->fd);
+  ur->fd = -1;
+
+  return;
+}
+
+/*
+ * uring_sqe: hand out the next submission queue entry, zeroed, to be
+ * filled in and submitted with the next uring_enter().
+ *
+ * Returns NULL if the queue is full, in which case uring_enter()
+ * makes room.
+ */
+struct io_uring_sqe *
+uring_sqe(uring_t *ur)
+{
+  struct io_uring_sqe *sqe;
+  unsigned idx;
+
+  if (ur->sqlocal - uring_load(ur->sqhead) >= ur->sqentries) {
+    return(NULL);
+  }
+  idx = ur->sqlocal & *ur->sqmask;
+  sqe = &ur->sqes[idx];
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+  ur->sqarray[idx] = idx;
+  ur->sqlocal++;
+
+  return(sqe);
+}
+
+/*
+ * uring_enter: submit all entries handed out since the last call and,
+ * in the same system call, wait until at least "wait" completions are
+ * ready to be taken with uring_cqe().
+ *
+ * Returns the number of entries submitted, or -errno.
+ */
+int
+uring_enter(uring_t *ur, unsigned wait)
+{
+  unsigned tosubmit;
+  int ret;
+
+  uring_store(ur->sqtail, ur->sqlocal);
+  tosubmit = ur->sqlocal - uring_load(ur->sqhead);
+  do {
+    ret = (int) syscall(__NR_io_uring_enter, ur->fd, tosubmit, wait,
+                        wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+  } while (ret < 0 && errno == EINTR);
+
+  return(ret < 0 ? -errno : ret);
+}
+
+/*
+ * uring_cqe: Returns the oldest completion not yet seen, or NULL if
+ * there is none.  Mark it seen with uring_cqseen() once done with it.
+ */
+struct io_uring_cqe *
+uring_cqe(uring_t *ur)
+{
+  unsigned head = *ur->cqhead;
+
+  if (head == uring_load(ur->cqtail)) {
+    return(NULL);
+  }
+  return(&ur->cqes[head & *ur->cqmask]);
+}
+
+void
+uring_cqseen(uring_t *ur)
+{
+  uring_store(ur->cqhead, *ur->cqhead + 1);
+
+  return;
+}
+
+/*
+ * uring_bufring: set up and register with "ur" a ring of "entries",
+ * a power of 2, provided buffers, as buffer group "bgid".  Buffers
+ * are added with uring_bufadd().
+ *
+ * Returns the ring, or NULL on error.
+ */
+struct io_uring_buf_ring *
+uring_bufring(uring_t *ur, unsigned short bgid, unsigned entries)
+{
+  struct io_uring_buf_reg reg;
+  struct io_uring_buf_ring *br;
+  size_t size = entries*sizeof(struct io_uring_buf);
+
+  br = (struct io_uring_buf_ring *) mmap(NULL, size, PROT_READ|PROT_WRITE,
+                                         MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if (br == MAP_FAILED) {
+    return(NULL);
+  }
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (unsigned long) br;
+  reg.ring_entries = entries;
+  reg.bgid = bgid;
+  if (syscall(__NR_io_uring_register, ur->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+    munmap(br, size);
+    return(NULL);
+  }
+
+  return(br);
+}
+
+/*
+ * uring_bufadd: give buffer "bid" of "len" bytes at "addr" to the
+ * kernel through provided buffer ring "br" of "entries".
+ */
+void
+uring_bufadd(struct io_uring_buf_ring *br, unsigned entries,
+             void *addr, unsigned len, unsigned short bid)
+{
+  struct io_uring_buf *buf;
+  unsigned short tail = br->tail;
+
+  // not br->bufs: in C++, its empty struct wrapper moves it 8 bytes on
+  buf = (struct io_uring_buf *) br + (tail & (entries-1));
+  buf->addr = (unsigned long) addr;
+  buf->len = len;
+  buf->bid = bid;
+  uring_store(&br->tail, (unsigned short) (tail+1));
+
+  return;
+}
+
+#endif // __linux__
@@ -0,0 +1,53 @@
+/*
+ * Copyright (c) 2016 University of Michigan, Ann Arbor.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms are permitted
+ * provided that the above copyright notice and this paragraph are
+ * duplicated in all such forms and that any documentation,
+ * advertising materials, and other materials related to such
+ * distribution and use acknowledge that the software was developed
+ * by the University of Michigan, Ann Arbor. The name of the University
+ * may not be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * Author: Sugih Jamin (jamin@eecs.umich.edu)
+ *
+*/
+#ifndef __URING_H__
+#define __URING_H__
+
+#ifdef __linux__  // io_uring is Linux's alone
+
+#include <linux/io_uring.h>
+
+typedef struct {               // an io_uring, set up by uring_init()
+  int fd;
+  unsigned *sqhead, *sqtail, *sqmask, *sqarray;
+  struct io_uring_sqe *sqes;
+  unsigned sqentries;
+  unsigned sqlocal;            // tail of SQEs handed out, not yet
+                               // made visible to the kernel
+  unsigned *cqhead, *cqtail, *cqmask;
+  struct io_uring_cqe *cqes;
+  void *sqring, *cqring;       // mappings, for uring_exit()
+  size_t sqringsz, cqringsz, sqesz;
+} uring_t;
+
+extern int uring_init(uring_t *ur, unsigned entries);
+extern void uring_exit(uring_t *ur);
+extern struct io_uring_sqe *uring_sqe(uring_t *ur);
+extern int uring_enter(uring_t *ur, unsigned wait);
+extern struct io_uring_cqe *uring_cqe(uring_t *ur);
+extern void uring_cqseen(uring_t *ur);
+extern struct io_uring_buf_ring *uring_bufring(uring_t *ur, unsigned short bgid,
+                                               unsigned entries);
+extern void uring_bufadd(struct io_uring_buf_ring *br, unsigned entries,
+                         void *addr, unsigned len, unsigned short bid);
+
+#endif // __linux__
+
+#endif // __URING_H__
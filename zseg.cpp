@@ -0,0 +1,185 @@
+/*
+ * Copyright (c) 2016 University of Michigan, Ann Arbor.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms are permitted
+ * provided that the above copyright notice and this paragraph are
+ * duplicated in all such forms and that any documentation,
+ * advertising materials, and other materials related to such
+ * distribution and use acknowledge that the software was developed
+ * by the University of Michigan, Ann Arbor. The name of the University
+ * may not be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * Author: Sugih Jamin (jamin@eecs.umich.edu)
+ *
+*/
+#include <stdio.h>
+#include <string.h>
+
+#include "zseg.h"
+
+/*
+ * Lossless coding of one segment of image data, independent of all
+ * other segments.  Each byte is predicted from its neighbours of the
+ * same channel within the segment, using the median edge detector of
+ * LOCO-I on the left, upper and upper-left bytes ("depth" and
+ * "rowsize" bytes back).  With "rowsize" 0, or on the segment's first
+ * row, only the left neighbour is used.  Prediction residuals are
+ * zig-zag mapped and Rice coded, with the Rice parameter chosen per
+ * block of ZSEG_BLOCK residuals and stored in 3 bits ahead of it.
+ */
+
+#define ZSEG_BLOCK  32    // residuals per Rice parameter
+#define ZSEG_ESC    15    // unary prefix length escaping to 8 raw bits
+
+static inline unsigned char
+zseg_predict(unsigned char *seg, int i, int depth, int rowsize)
+{
+  int a, b, c;
+
+  if (!rowsize || i < rowsize) {
+    return(i >= depth ? seg[i-depth] : 0);
+  }
+  b = seg[i-rowsize];
+  a = i >= depth ? seg[i-depth] : b;
+  c = i >= rowsize+depth ? seg[i-rowsize-depth] : b;
+
+  if (c >= (a > b ? a : b)) {
+    return(a < b ? a : b);
+  } else if (c <= (a < b ? a : b)) {
+    return(a > b ? a : b);
+  }
+  return((unsigned char) (a + b - c));
+}
+
+/*
+ * zseg_encode(): compress the "segsize" bytes at "imgseg" into
+ * "zdata", which must hold at least "segsize" bytes.
+ *
+ * Returns the compressed size, or 0 if compressing doesn't save
+ * anything, in which case the segment should be sent as is.
+*/
+int
+zseg_encode(unsigned char *zdata, unsigned char *imgseg, int segsize,
+            int depth, int rowsize)
+{
+  unsigned char zz[ZSEG_BLOCK];
+  unsigned long long acc = 0;   // bits not yet written out
+  int nbits = 0, out = 0;
+  int i, j, n, k, bestk, cost, best;
+  unsigned q, v;
+
+  for (i = 0; i < segsize; i += ZSEG_BLOCK) {
+    n = segsize - i < ZSEG_BLOCK ? segsize - i : ZSEG_BLOCK;
+    for (j = 0; j < n; j++) {
+      signed char r = (signed char) (imgseg[i+j] - zseg_predict(imgseg, i+j, depth, rowsize));
+      zz[j] = (unsigned char) (r >= 0 ? 2*r : -2*r-1);
+    }
+
+    bestk = 0;
+    best = -1;
+    for (k = 0; k < 8; k++) {
+      for (cost = 0, j = 0; j < n; j++) {
+        q = zz[j] >> k;
+        cost += q < ZSEG_ESC ? q+1+k : ZSEG_ESC+8;
+      }
+      if (best < 0 || cost < best) {
+        best = cost;
+        bestk = k;
+      }
+    }
+
+    acc = (acc << 3) | bestk;
+    nbits += 3;
+    for (j = 0; j < n; j++) {
+      v = zz[j];
+      q = v >> bestk;
+      if (q < ZSEG_ESC) {
+        acc = (acc << (q+1)) | (((1ULL << q) - 1) << 1);
+        acc = (acc << bestk) | (v & ((1U << bestk) - 1));
+        nbits += q+1+bestk;
+      } else {
+        acc = (acc << ZSEG_ESC) | ((1U << ZSEG_ESC) - 1);
+        acc = (acc << 8) | v;
+        nbits += ZSEG_ESC+8;
+      }
+      while (nbits >= 8) {
+        if (out >= segsize) {
+          return(0);
+        }
+        nbits -= 8;
+        zdata[out++] = (unsigned char) (acc >> nbits);
+      }
+    }
+  }
+
+  if (nbits) {
+    if (out >= segsize) {
+      return(0);
+    }
+    zdata[out++] = (unsigned char) (acc << (8-nbits));
+  }
+
+  return(out < segsize ? out : 0);
+}
+
+/*
+ * zseg_decode(): decompress the "zsize" bytes at "zdata", produced
+ * by zseg_encode() with the same "depth" and "rowsize", into the
+ * "segsize" bytes at "imgseg".
+ *
+ * Returns "segsize", or -1 if "zdata" is malformed.
+*/
+int
+zseg_decode(unsigned char *imgseg, int segsize, unsigned char *zdata,
+            int zsize, int depth, int rowsize)
+{
+  unsigned long long acc = 0;
+  int nbits = 0, in = 0;
+  int i, j, n, k;
+  unsigned q, v;
+
+#define ZSEG_NEED(bits) \
+  while (nbits < (bits)) { \
+    if (in >= zsize) return(-1); \
+    acc = (acc << 8) | zdata[in++]; \
+    nbits += 8; \
+  }
+#define ZSEG_GET(bits) ((unsigned) (acc >> (nbits -= (bits))) & ((1U << (bits)) - 1))
+
+  for (i = 0; i < segsize; i += ZSEG_BLOCK) {
+    n = segsize - i < ZSEG_BLOCK ? segsize - i : ZSEG_BLOCK;
+    ZSEG_NEED(3);
+    k = ZSEG_GET(3);
+
+    for (j = 0; j < n; j++) {
+      for (q = 0; q < ZSEG_ESC; q++) {
+        ZSEG_NEED(1);
+        if (!ZSEG_GET(1)) {
+          break;
+        }
+      }
+      if (q < ZSEG_ESC) {
+        ZSEG_NEED(k);
+        v = (q << k) | (k ? ZSEG_GET(k) : 0);
+      } else {
+        ZSEG_NEED(8);
+        v = ZSEG_GET(8);
+      }
+      if (v > 255) {
+        return(-1);
+      }
+      imgseg[i+j] = (unsigned char) (zseg_predict(imgseg, i+j, depth, rowsize)
+                                     + (v & 1 ? -(int) (v >> 1) - 1 : (int) (v >> 1)));
+    }
+  }
+
+#undef ZSEG_NEED
+#undef ZSEG_GET
+
+  return(segsize);
+}